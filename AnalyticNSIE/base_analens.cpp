@@ -120,24 +120,40 @@ void LensHaloBaseNSIE::force_halo(
     
     
   // add substructure
-  if(substruct_implanted)
+  if(substruct_implanted && sub_N > 0)
   {
-    for(j=0;j<sub_N;++j)
-    {
-      
-      subs[j].force_halo(alpha_tmp,&kappa_tmp,gamma_tmp,&phi_tmp,xcm);
+    KappaType sub_gamma[3] = {0,0,0};
+    
+    if(sub_N > sub_tree_Nmin){
+      // distant substructures are grouped by the tree, the ones the ray is inside of are done exactly
+      getSubTree()->force2D_recur(xcm,alpha_tmp,&kappa_tmp,sub_gamma,&phi_tmp);
       
-      alpha[0] += alpha_tmp[0];
-      alpha[1] += alpha_tmp[1];
+      // the tree has the sign of LensPlaneTree::force
+      alpha_tmp[0] *= -1.;
+      alpha_tmp[1] *= -1.;
+    }else{
+      PosType x_sub[2];
+      kappa_tmp = 0.0;
       
+      // force_halo() adds to its arguments so they are summed in place
+      for(j=0;j<sub_N;++j)
       {
-        *kappa += kappa_tmp;
-        gamma[0] += gamma_tmp[0];
-        gamma[1] += gamma_tmp[1];
-        *phi += phi_tmp;
+        x_sub[0] = xcm[0] - sub_x[j][0];
+        x_sub[1] = xcm[1] - sub_x[j][1];
+        subs[j].force_halo(alpha_tmp,&kappa_tmp,sub_gamma,&phi_tmp,x_sub);
       }
     }
     
+    alpha[0] += alpha_tmp[0];
+    alpha[1] += alpha_tmp[1];
+    
+    {
+      *kappa += kappa_tmp;
+      gamma[0] += sub_gamma[0];
+      gamma[1] += sub_gamma[1];
+      *phi += phi_tmp;
+    }
+    
     gamma_tmp[0] = gamma_tmp[1] = 0.0;
     alpha_tmp[0] = alpha_tmp[1] = 0.0;
     phi_tmp = 0.0;
@@ -233,6 +249,34 @@ void LensHaloBaseNSIE::reNormSubstructure(PosType kappa_sub){
 	  return ;
 }
 
+/** \brief Returns the tree of the substructures, building it if they have changed since the last call.
+ *
+ *  The tree is built by the first ray that needs it and is then shared by all threads.
+ */
+TreeQuad *LensHaloBaseNSIE::getSubTree(){
+  if(sub_tree_built) return sub_tree;
+  
+  std::lock_guard<std::mutex> lock(sub_tree_mutex);
+  if(sub_tree_built) return sub_tree;
+  
+  sub_tree_halos.resize(sub_N);
+  for(int j=0;j<sub_N;++j) sub_tree_halos[j] = &subs[j];
+  
+  // the positions are in sub_x[] relative to the host, not in the halos
+  delete sub_tree;
+  sub_tree = new TreeQuad(sub_tree_halos.data(),sub_N,0,5,sub_theta_force,false,0,2,sub_x);
+  sub_tree_built = true;
+  
+  return sub_tree;
+}
+
+void LensHaloBaseNSIE::clearSubTree(){
+  std::lock_guard<std::mutex> lock(sub_tree_mutex);
+  delete sub_tree;
+  sub_tree = NULL;
+  sub_tree_built = false;
+}
+
 /// Sets parameters within BaseLens that depend on the source redshift - Dl,Sigma_crit,etc.
 void LensHaloAnaNSIE::setCosmology(const COSMOLOGY& cosmo)
 {
@@ -282,6 +326,8 @@ LensHaloBaseNSIE::LensHaloBaseNSIE(InputParams& params) : LensHalo(){
   Sigma_crit = 0;
 
   substruct_implanted = false;
+  sub_tree = NULL;
+  sub_tree_built = false;
 
 }
 LensHaloBaseNSIE::LensHaloBaseNSIE() : LensHalo(){
@@ -302,6 +348,8 @@ LensHaloBaseNSIE::LensHaloBaseNSIE() : LensHalo(){
   Sigma_crit = 0;
   
   substruct_implanted = false;
+  sub_tree = NULL;
+  sub_tree_built = false;
 }
 
 void LensHaloBaseNSIE::PrintLens(bool show_substruct,bool show_stars){
@@ -426,6 +474,7 @@ LensHaloBaseNSIE::~LensHaloBaseNSIE(){
 		// std::cout << "deleting modes" << endl;
 		delete[] perturb_modes;
 	}
+	clearSubTree();
 	if(sub_N > 0 && substruct_implanted){
 		// std::cout << "deleting subs" << endl;
 		Utilities::free_PosTypeMatrix(sub_x,sub_N,2);
@@ -231,7 +231,8 @@ void LensHaloAnaNSIE::RandomizeSubstructure2(PosType rangeInRei,long *seed){
 	//std::cout << "Rm/re = %e\n",Rm/Einstein_ro);
 	//for(i=0;i<12;++i) std::cout << "%f %f\n",poidev(ndensity*pi*Rm*Rm,seed),ndensity*pi*Rm*Rm);
 
-	unsigned int Nsub=(int)(poidev(ndensity*pi*Rm*Rm,seed));
+	Utilities::RandomNumbers_Philox ran(seed);
+	unsigned int Nsub=(int)(ran.poisson(ndensity*pi*Rm*Rm));
 	Nsub = (NsubMax > Nsub) ? Nsub : NsubMax ;
 
 	//std::cout << "scale = %e\n",scale);
@@ -239,15 +240,17 @@ void LensHaloAnaNSIE::RandomizeSubstructure2(PosType rangeInRei,long *seed){
 	for(i=0,k=0; i < Nsub;++i){
 		//for(i=0;i<NSubstruct;++i){
 
-		r=Rm*sqrt(ran2(seed));
+		// each substructure draws from its own substream so it does not depend on the others
+		Utilities::RandomNumbers_Philox sub_ran = ran.substream(i);
+		r=Rm*sqrt(sub_ran());
 
 		do{
 			if(sub_alpha == -1.0){
 				float ratio = sub_Mmax/sub_Mmin;
-				subs[k].set_mass(sub_Mmin*scale*pow(ratio,ran2(seed)));
+				subs[k].set_mass(sub_Mmin*scale*pow(ratio,sub_ran()));
 			}else{
 				subs[k].set_mass(sub_Mmin*scale
-						*pow(ran2(seed)*(pow(sub_Mmax/sub_Mmin,sub_alpha+1)-1)+1.0
+						*pow(sub_ran()*(pow(sub_Mmax/sub_Mmin,sub_alpha+1)-1)+1.0
 								,1.0/(sub_alpha+1)));
 			}
 		}while(subs[k].get_mass() < sub_Mmin);  // not sure why this is necessary
@@ -267,7 +270,7 @@ void LensHaloAnaNSIE::RandomizeSubstructure2(PosType rangeInRei,long *seed){
 		//std::cout << "RcutSubstruct[%i] = %e\n",k,RcutSubstruct[k]);
 		//std::cout << "%e %e %e Rm=%e\n",r/rmax,r,rmax,Rm);
 		if( r < rmax){
-			theta=2*pi*ran2(seed);
+			theta=2*pi*sub_ran();
 			sub_x[k][0]=r*cos(theta);
 			sub_x[k][1]=r*sin(theta);
 			assert(k<NsubMax);
@@ -281,6 +284,7 @@ void LensHaloAnaNSIE::RandomizeSubstructure2(PosType rangeInRei,long *seed){
 	}
 
 	sub_N = k;
+	clearSubTree();
 
 /*
 	if(sub_N > 2){
@@ -361,7 +365,8 @@ void LensHaloAnaNSIE::RandomizeSubstructure3(PosType rangeInRei,long *seed){
 	//std::cout << "Rm/re = %e\n",Rm/Einstein_ro);
 	//for(i=0;i<12;++i) std::cout << "%f %f\n",poidev(ndensity*pi*Rm*Rm,seed),ndensity*pi*Rm*Rm);
 
-	unsigned int Nsub=(int)(poidev(sub_Ndensity*pi*Rm*Rm,seed));
+	Utilities::RandomNumbers_Philox ran(seed);
+	unsigned int Nsub=(int)(ran.poisson(sub_Ndensity*pi*Rm*Rm));
 
 	assert(Nsub < NsubMax);
 
@@ -370,15 +375,17 @@ void LensHaloAnaNSIE::RandomizeSubstructure3(PosType rangeInRei,long *seed){
 	for(i=0,k=0; i < Nsub;++i){
 		//for(i=0;i<NSubstruct;++i){
 
-		r=Rm*sqrt(ran2(seed));
+		// each substructure draws from its own substream so it does not depend on the others
+		Utilities::RandomNumbers_Philox sub_ran = ran.substream(i);
+		r=Rm*sqrt(sub_ran());
 
 		do{
 			if(sub_alpha == -1.0){
 				float ratio = sub_Mmax/sub_Mmin;
-				subs[k].set_mass(sub_Mmin*pow(ratio,ran2(seed)));
+				subs[k].set_mass(sub_Mmin*pow(ratio,sub_ran()));
 			}else{
 				subs[k].set_mass(sub_Mmin
-						*pow(ran2(seed)*(pow(sub_Mmax/sub_Mmin,sub_alpha+1)-1)+1.0
+						*pow(sub_ran()*(pow(sub_Mmax/sub_Mmin,sub_alpha+1)-1)+1.0
 								,1.0/(sub_alpha+1)));
 			}
 		}while(subs[k].get_mass() < sub_Mmin);  // not sure why this is necessary
@@ -393,7 +400,7 @@ void LensHaloAnaNSIE::RandomizeSubstructure3(PosType rangeInRei,long *seed){
 		//std::cout << "RcutSubstruct[%i] = %e\n",k,RcutSubstruct[k]);
 		//std::cout << "%e %e %e Rm=%e\n",r/rmax,r,rmax,Rm);
 		if( r < rmax){
-			theta=2*pi*ran2(seed);
+			theta=2*pi*sub_ran();
 			sub_x[k][0]=r*cos(theta);
 			sub_x[k][1]=r*sin(theta);
 			assert(k<NsubMax);
@@ -407,6 +414,7 @@ void LensHaloAnaNSIE::RandomizeSubstructure3(PosType rangeInRei,long *seed){
 	}
 
 	sub_N = k;
+	clearSubTree();
 
 	//std::cout << "sub_N = %li Nsub = %li ndensity =%e\n",sub_N,Nsub,sub_Ndensity);
 /*
@@ -67,6 +67,19 @@ void LensHalo::implant_stars(
 	//params.get("main_sub_mass_max",sub_Mmax)
 	NstarsPerImage = stars_N/star_Nregions;
 	star_masses=stellar_mass_function(type, stars_N, seed, main_stars_min_mass, main_stars_max_mass, bend_mstar,lo_mass_slope,hi_mass_slope);
+
+	// star n of region j takes the numbers 2n and 2n+1 of the stream so they can be drawn in parallel
+	const Utilities::RandomNumbers_Philox ran(seed);
+	const size_t Ndraw = (size_t)NstarsPerImage*Nregions;
+	std::vector<PosType> star_r(Ndraw),star_theta(Ndraw);
+	Utilities::ThreadPool::get().parallel_for(Ndraw,4096,[&](size_t first,size_t last){
+		Utilities::RandomNumbers_Philox my_ran = ran;
+		my_ran.seek(2*first);
+		for(size_t n=first;n<last;++n){
+			star_r[n] = sqrt(my_ran());
+			star_theta[n] = 2*pi*my_ran();
+		}
+	});
 	if (type==One){
 		for(j=0;j<Nregions;++j){
 			mean_mstar[j]=1.0;
@@ -124,8 +137,8 @@ void LensHalo::implant_stars(
     
 		for(i=0;i<NstarsPerImage;++i,++m){
 			//m=j*NstarsPerImage+i;
-			r = star_region[j]*sqrt(ran2(seed));
-			theta=2*pi*ran2(seed);
+			r = star_region[j]*star_r[(size_t)(j*NstarsPerImage)+i];
+			theta=star_theta[(size_t)(j*NstarsPerImage)+i];
 			stars_xp[m][0] = star_xdisk[j][0] + r*cos(theta);
 			stars_xp[m][1] = star_xdisk[j][1] + r*sin(theta);
 			stars_xp[m][2] = 0.0;
@@ -265,6 +278,18 @@ float* LensHalo::stellar_mass_function(IMFtype type, unsigned long Nstars, long
 	PosType powerp1,powerp2,powerp3,powerlp1,bendmass1,bendmass2,shiftmax,shiftmin,n0,n1,n2,n3,rndnr,tmp0,tmp1,tmp2;
 	float *stellar_masses = new float[Nstars];
 
+	// star i takes number i of the stream so they can be drawn in parallel
+	std::vector<PosType> uniform;
+	if(type != One && type != Mono){
+		const Utilities::RandomNumbers_Philox ran(seed);
+		uniform.resize(Nstars);
+		Utilities::ThreadPool::get().parallel_for(Nstars,4096,[&](size_t first,size_t last){
+			Utilities::RandomNumbers_Philox my_ran = ran;
+			my_ran.seek(first);
+			for(size_t k=first;k<last;++k) uniform[k] = my_ran();
+		});
+	}
+
 	if(type==One){
 		for(i = 0; i < Nstars; i++){
 				stellar_masses[i]=1.0;
@@ -290,7 +315,7 @@ float* LensHalo::stellar_mass_function(IMFtype type, unsigned long Nstars, long
     	n0 = (pow(maxmass,powerp1)) /powerp1;
     	n1 =  n0 - (pow(minmass,powerp1)) / powerp1;
     	for(i = 0; i < Nstars; i++){
-    		stellar_masses[i] = pow( (-powerp1*(n1*ran2(seed)-n0)),(1.0/powerp1) );
+    		stellar_masses[i] = pow( (-powerp1*(n1*uniform[i]-n0)),(1.0/powerp1) );
     	}
 	}
 
@@ -304,7 +329,7 @@ float* LensHalo::stellar_mass_function(IMFtype type, unsigned long Nstars, long
        	n0 = (pow(maxmass,powerp1)) /powerp1;
        	n1 =  n0 - (pow(minmass,powerp1)) / powerp1;
        	for(i = 0; i < Nstars; i++){
-       		stellar_masses[i] = pow( (-powerp1*(n1*ran2(seed)-n0)),(1.0/powerp1) );
+       		stellar_masses[i] = pow( (-powerp1*(n1*uniform[i]-n0)),(1.0/powerp1) );
        	}
    	}
 
@@ -323,7 +348,7 @@ float* LensHalo::stellar_mass_function(IMFtype type, unsigned long Nstars, long
 		n2=tmp1/powerp1*(pow(maxmass,powerp1)-1.0);
 		n0=n1+n2;
 		for(i = 0; i < Nstars; i++){
-			rndnr=ran2(seed);
+			rndnr=uniform[i];
 			if(rndnr<(n1/n0)){
 				stellar_masses[i]=pow(10.0,(log10(chab_param[1])-sqrt(2.*chab_param[2]*chab_param[2])*erfinv((n0*rndnr)/tmp2+erff((log10(chab_param[1])-log10(minmass))/(sqrt(2.*chab_param[2]*chab_param[2])) ) )));
 			}
@@ -352,7 +377,7 @@ float* LensHalo::stellar_mass_function(IMFtype type, unsigned long Nstars, long
     		n2=( pow(shiftmax,powerp1) )/powerp1-(1./powerp1);
     		n0=n1+n2;
     		for(i = 0; i < Nstars; i++){
-    			rndnr=ran2(seed);
+    			rndnr=uniform[i];
     			if(rndnr<(n1/n0)){
     				stellar_masses[i]=(pow( ((n0*rndnr)*(powerlp1)+ pow(shiftmin,powerlp1)),(1.0/powerlp1)))*bendmass;
     				//cout << stellar_masses[i] << endl;
@@ -385,7 +410,7 @@ float* LensHalo::stellar_mass_function(IMFtype type, unsigned long Nstars, long
 			n0=n1+n2+n3;
 
 			for(i = 0; i < Nstars; i++){
-				rndnr=ran2(seed);
+				rndnr=uniform[i];
 				if(rndnr<(n1/n0)){
 					stellar_masses[i]=(pow( ((n0*rndnr)*(powerp1)+ pow(minmass,powerp1)),(1.0/powerp1)));
 
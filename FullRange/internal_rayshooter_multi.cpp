@@ -35,6 +35,7 @@
 
 
 void *compute_rays_parallel(void *_p);
+void *compute_rays_plane_major(void *_p);
 
 /**
  * \brief A data structure for temporarily distribute the data amongst threads.
@@ -48,11 +49,28 @@ struct TmpParams{
   bool flag_switch_deflection_off;
   bool flag_switch_lensing_off;
   PosType charge;
-  LensPlane** lensing_planes;
-  PosType* plane_redshifts;
-  PosType* Dl;
-  PosType* dDl;
+  LensPlane* const* lensing_planes;
+  const PosType* plane_redshifts;
+  const PosType* Dl;
+  const PosType* dDl;
   bool verbose;
+  /// all the rays go through each plane together with LensPlane::force_grid()
+  bool whole_grid;
+  
+  /* extra source planes, see Lens::rayshooterMultiSource() */
+  int Nsources;
+  /// index of the plane that each source plane replaces, in ascending order
+  const int *source_plane;
+  /// distance to each source plane and from the plane in front of it, comoving
+  const PosType *source_Dl;
+  const PosType *source_dDl;
+  /// results for each source plane, indexed like i_points
+  RayState * const *source_rays;
+  
+  /* rays saved after the planes in front of the main halos, see StaticPlaneCache */
+  int Nstatic;
+  /// where each ray is saved, indexed like i_points, NULL if it is not to be saved
+  StaticPlaneCache::State * const *static_states;
 };
 
 
@@ -60,12 +78,51 @@ struct TmpParams{
 
 /** \brief This function calculates the deflection, shear, convergence, rotation
  and time-delay of rays in parallel.
+ 
+ The Lens is not changed so rayshooterInternal() can be called from several threads at once, for
+ example to fill many grids in parallel from one Lens.
  */
 void Lens::rayshooterInternal(
                                 unsigned long Npoints   /// number of points to be shot
                               , Point *i_points         /// point on the image plane
                               , bool RSIVerbose         /// verbose option
-){
+) const {
+  rayshooterInternal_(Npoints,i_points,RSIVerbose,NULL);
+}
+
+/** \brief Same as rayshooterInternal() but the rays are kept in cache after they have gone through
+ the planes in front of the first main plane.
+ 
+ When the same rays are shot again, after the main halos have been replaced with replaceMainHalo()
+ for example, they start from the first main plane.  The results are the same as without the cache.  The
+ planes behind the main halos still have to be gone through since the rays' positions on them
+ depend on the main halos.  The speedup is roughly the total number of planes over the number of
+ planes from the first main plane back.
+ 
+ The rays are always shot one by one with this as with the default setting (see setPlaneMajorShooting()
+ and setFMMShooting()).  A cache must not be used by more than one thread at a time.
+ */
+void Lens::rayshooterInternal(
+                              unsigned long Npoints   /// number of points to be shot
+                              , Point *i_points       /// point on the image plane
+                              , StaticPlaneCache &cache  /// saved rays, these are added to it until it holds StaticPlaneCache::getMaxRays()
+) const {
+  rayshooterInternal_(Npoints,i_points,false,&cache);
+}
+
+int Lens::NStaticPlanes() const{
+  for(size_t j = 0; j < lensing_planes.size(); ++j){
+    if(std::find(main_planes.begin(),main_planes.end(),lensing_planes[j]) != main_planes.end()) return j;
+  }
+  return lensing_planes.size();
+}
+
+void Lens::rayshooterInternal_(
+                                unsigned long Npoints
+                              , Point *i_points
+                              , bool RSIVerbose
+                              , StaticPlaneCache *cache
+) const {
   
   // To force the computation of convergence, shear... -----
   // -------------------------------------------------------
@@ -98,83 +155,245 @@ void Lens::rayshooterInternal(
   
   
   int NLastPlane;
-  PosType tmpDs,tmpdDs,tmpZs;
   
   // If there are no points to shoot, then we quit.
   if(Npoints == 0) return;
   
+  // For refining the grid and shoot new rays.
+  TmpParams params;
+  
+  params.i_points = i_points;
+  params.tid = 0;
+  params.flag_switch_deflection_off = flag_switch_deflection_off;
+  params.flag_switch_lensing_off = flag_switch_lensing_off;
+  params.charge = charge;
+  params.lensing_planes = &lensing_planes[0];
+  params.plane_redshifts = &plane_redshifts[0];
+  params.Dl = &Dl[0];
+  params.dDl = &dDl[0];
+  params.verbose = RSIVerbose;
+  params.whole_grid = false;
+  params.Nsources = 0;
+  params.Nstatic = 0;
+  params.static_states = NULL;
+  
   // If a lower redshift source (compared to the farthest lens plane) is being used
+  // the source plane is put into copies of the distances so that the Lens is not changed.
+  std::vector<PosType> Dl_source,dDl_source,redshifts_source;
   if(toggle_source_plane)
   {
     NLastPlane = index_of_new_sourceplane;
     
     assert(NLastPlane <= lensing_planes.size());
-    tmpDs = Dl[index_of_new_sourceplane];
-    tmpdDs = dDl[index_of_new_sourceplane];
-    tmpZs = plane_redshifts[index_of_new_sourceplane];
+    Dl_source.assign(Dl.begin(),Dl.begin() + NLastPlane + 1);
+    dDl_source.assign(dDl.begin(),dDl.begin() + NLastPlane + 1);
+    redshifts_source.assign(plane_redshifts.begin(),plane_redshifts.begin() + NLastPlane + 1);
     
-    Dl[index_of_new_sourceplane] = Ds_implant;
-    dDl[index_of_new_sourceplane] = dDs_implant;
-    plane_redshifts[index_of_new_sourceplane] = zs_implant;
+    Dl_source[NLastPlane] = Ds_implant;
+    dDl_source[NLastPlane] = dDs_implant;
+    redshifts_source[NLastPlane] = zs_implant;
+    
+    params.plane_redshifts = &redshifts_source[0];
+    params.Dl = &Dl_source[0];
+    params.dDl = &dDl_source[0];
   }
   else{ NLastPlane = lensing_planes.size(); }
   
+  params.NPlanes = NLastPlane;
   
-  // For refining the grid and shoot new rays.
-  int nthreads, rc;
-  nthreads = Utilities::GetNThreads();
-  
-  int chunk_size;
-  do{
-    chunk_size = (int)Npoints/nthreads;
-    if(chunk_size == 0) nthreads /= 2;
-  }while(chunk_size == 0);
+  std::vector<StaticPlaneCache::State *> states;
+  if(cache != NULL && !flag_switch_lensing_off){
+    int Nstatic = std::min<int>(NStaticPlanes(),NLastPlane);
+    
+    // the saved rays are only good if the planes in front of the main halos are the same
+    bool valid = (cache->lens == this && cache->field_version == field_planes_version
+                  && cache->Nstatic == Nstatic && cache->charge == charge
+                  && cache->deflection_off == flag_switch_deflection_off);
+    for(int j = 0; valid && j < Nstatic; ++j){
+      valid = (cache->planes[j] == lensing_planes[j] && cache->redshifts[j] == params.plane_redshifts[j]);
+    }
+    for(int j = 0; valid && j <= Nstatic; ++j){
+      valid = (cache->Dl[j] == params.Dl[j] && cache->dDl[j] == params.dDl[j]);
+    }
+    
+    if(!valid){
+      cache->clear();
+      cache->lens = this;
+      cache->field_version = field_planes_version;
+      cache->Nstatic = Nstatic;
+      cache->charge = charge;
+      cache->deflection_off = flag_switch_deflection_off;
+      cache->planes.assign(lensing_planes.begin(),lensing_planes.begin() + Nstatic);
+      cache->redshifts.assign(params.plane_redshifts,params.plane_redshifts + Nstatic);
+      cache->Dl.assign(params.Dl,params.Dl + Nstatic + 1);
+      cache->dDl.assign(params.dDl,params.dDl + Nstatic + 1);
+    }
+    
+    if(Nstatic > 0){
+      states.assign(Npoints,NULL);
+      for(unsigned long i = 0; i < Npoints; ++i){
+        if(i_points[i].in_image == MAYBE) continue;
+        
+        StaticPlaneCache::Key key = {{i_points[i].x[0],i_points[i].x[1]}};
+        auto it = cache->rays.find(key);
+        if(it == cache->rays.end()){
+          ++(cache->Nmisses);
+          // when the cache is full new rays are shot without it
+          if(cache->rays.size() >= cache->max_rays) continue;
+          it = cache->rays.emplace(key,StaticPlaneCache::State()).first;
+          it->second.ready = false;
+        }else if(it->second.ready){
+          ++(cache->Nhits);
+        }else{
+          // the same ray twice in this call, it is shot without the cache
+          continue;
+        }
+        states[i] = &(it->second);
+      }
+      
+      params.Nstatic = Nstatic;
+      params.static_states = states.data();
+    }
+  }
   
-  pthread_t threads[nthreads];
-  TmpParams *thread_params = new TmpParams[nthreads];
+  // The rays are handed out in small batches so that the threads that get the
+  // expensive rays (near halo centers) are helped out by the others.
+  Utilities::ThreadPool &pool = Utilities::ThreadPool::get();
+  size_t batch_size = Npoints/(8*pool.size());
   
-  // This is for multi-threading :
-  for(int i=0; i<nthreads;i++)
-  {
-    thread_params[i].i_points = i_points;
-    thread_params[i].size = chunk_size;
-    if(i == nthreads-1)
-      thread_params[i].size = (int)Npoints - (nthreads-1)*chunk_size;
-    thread_params[i].start = i*chunk_size;
-    thread_params[i].tid = i;
-    thread_params[i].flag_switch_deflection_off = flag_switch_deflection_off;
-    thread_params[i].flag_switch_lensing_off = flag_switch_lensing_off;
-    thread_params[i].charge = charge;
-    thread_params[i].lensing_planes = &lensing_planes[0];
-    thread_params[i].plane_redshifts = &plane_redshifts[0];
-    thread_params[i].Dl = &Dl[0];
-    thread_params[i].dDl = &dDl[0];
-    thread_params[i].NPlanes = NLastPlane;
-    thread_params[i].verbose = RSIVerbose;
-    rc = pthread_create(&threads[i], NULL, compute_rays_parallel, (void*) &thread_params[i]);
-    assert(rc==0);
+  if(params.static_states != NULL){
+    if(batch_size > 64) batch_size = 64;
+    
+    pool.parallel_for(Npoints,batch_size,[&params](size_t start,size_t end){
+      TmpParams p = params;
+      p.start = start;
+      p.size = end - start;
+      compute_rays_parallel((void*) &p);
+    });
+  }else if(flag_fmm && !flag_switch_lensing_off && !RSIVerbose){
+    // the planes do the threading
+    params.start = 0;
+    params.size = Npoints;
+    params.whole_grid = true;
+    compute_rays_plane_major((void*) &params);
+  }else if(flag_plane_major && !flag_switch_lensing_off && !RSIVerbose){
+    // larger batches so that each plane is used for many rays before moving on
+    if(batch_size > 1024) batch_size = 1024;
+    
+    pool.parallel_for(Npoints,batch_size,[&params](size_t start,size_t end){
+      TmpParams p = params;
+      p.start = start;
+      p.size = end - start;
+      compute_rays_plane_major((void*) &p);
+    });
+  }else{
+    if(batch_size > 64) batch_size = 64;
+    
+    pool.parallel_for(Npoints,batch_size,[&params](size_t start,size_t end){
+      TmpParams p = params;
+      p.start = start;
+      p.size = end - start;
+      compute_rays_parallel((void*) &p);
+    });
   }
   
-  for(int i = 0; i < nthreads; i++)
-  {
-    rc = pthread_join(threads[i], NULL);
-    assert(rc==0);
+}
+
+
+
+/** \brief Shoots rays to several source redshifts in one pass through the planes.
+ *
+ * rays[s][i] is set to the state of the ray i_points[i] when it reaches the source plane at redshift
+ * zsources[s].  This is what rayshooterInternal() would put into i_points[i] and its image after
+ * ResetSourcePlane(zsources[s],nearest), but the rays only go through each plane once so it costs about
+ * the same as shooting to the highest source redshift.  The i_points are not changed and a source plane
+ * set with ResetSourcePlane() is ignored.
+ *
+ * The rays are shot plane by plane as with setPlaneMajorShooting(), or all together if setFMMShooting() is on.
+ */
+void Lens::rayshooterMultiSource(
+                                 unsigned long Npoints   /// number of points to be shot
+                                 ,Point *i_points        /// points on the image plane
+                                 ,const std::vector<PosType> &zsources  /// source redshifts in ascending order
+                                 ,std::vector<std::vector<RayState> > &rays  /// output, rays[source][point]
+                                 ,bool nearest           /// see ResetSourcePlane()
+){
+  size_t Nsources = zsources.size();
+  size_t s;
+  
+  for(s = 0; s < Nsources; ++s){
+    if(zsources[s] <= 0) throw std::invalid_argument("Lens::rayshooterMultiSource: source redshifts must be positive");
+    if(s > 0 && zsources[s] < zsources[s-1]) throw std::invalid_argument("Lens::rayshooterMultiSource: source redshifts must be in ascending order");
   }
   
-  delete[] thread_params;
+  rays.resize(Nsources);
+  for(s = 0; s < Nsources; ++s) rays[s].assign(Npoints,RayState());
   
-  if(toggle_source_plane)
-  {
-    // The initial values for the plane are reset here
-    Dl[index_of_new_sourceplane] = tmpDs;
-    dDl[index_of_new_sourceplane] = tmpdDs;
-    plane_redshifts[index_of_new_sourceplane] = tmpZs;
+  if(Npoints == 0 || Nsources == 0) return;
+  
+  std::vector<int> source_plane(Nsources);
+  std::vector<PosType> source_Dl(Nsources),source_dDl(Nsources),source_z(Nsources);
+  std::vector<RayState *> source_rays(Nsources);
+  
+  for(s = 0; s < Nsources; ++s){
+    source_plane[s] = FindSourcePlane(zsources[s],nearest,source_z[s],source_Dl[s],source_dDl[s]);
+    source_rays[s] = &rays[s][0];
+    assert(s == 0 || source_plane[s] >= source_plane[s-1]);
+  }
+  
+  if(flag_switch_lensing_off){
+    for(s = 0; s < Nsources; ++s){
+      for(unsigned long i = 0; i < Npoints; ++i){
+        rays[s][i].x[0] = i_points[i].x[0];
+        rays[s][i].x[1] = i_points[i].x[1];
+        rays[s][i].invmag = 1;
+      }
+    }
+    return;
   }
   
+  TmpParams params;
+  
+  params.i_points = i_points;
+  params.tid = 0;
+  params.flag_switch_deflection_off = flag_switch_deflection_off;
+  params.flag_switch_lensing_off = false;
+  params.charge = charge;
+  params.lensing_planes = lensing_planes.data();
+  params.plane_redshifts = &plane_redshifts[0];
+  params.Dl = &Dl[0];
+  params.dDl = &dDl[0];
+  params.verbose = false;
+  params.whole_grid = false;
+  params.NPlanes = source_plane.back();
+  params.Nsources = Nsources;
+  params.source_plane = &source_plane[0];
+  params.source_Dl = &source_Dl[0];
+  params.source_dDl = &source_dDl[0];
+  params.source_rays = &source_rays[0];
+  params.Nstatic = 0;
+  params.static_states = NULL;
+  
+  if(flag_fmm){
+    params.start = 0;
+    params.size = Npoints;
+    params.whole_grid = true;
+    compute_rays_plane_major((void*) &params);
+  }else{
+    Utilities::ThreadPool &pool = Utilities::ThreadPool::get();
+    size_t batch_size = Npoints/(8*pool.size());
+    if(batch_size > 1024) batch_size = 1024;
+    
+    pool.parallel_for(Npoints,batch_size,[&params](size_t start,size_t end){
+      TmpParams p = params;
+      p.start = start;
+      p.size = end - start;
+      compute_rays_plane_major((void*) &p);
+    });
+  }
 }
 
 
-
 // NEW VERSION OF RAYSHOOTER USING ONLY PLANE i TO COMPUTE THE RAY POSITIONS AND LENSING QUANTITIES ON PLANE i+1.
 
 void *compute_rays_parallel(void *_p)
@@ -257,10 +476,28 @@ void *compute_rays_parallel(void *_p)
     // =================================
     if(verbose) std::cout << "RSI initial : X X | X | " << p->i_points[i].image->x[0] << " " << p->i_points[i].image->x[1] << " | " << p->i_points[i].kappa << " " << p->i_points[i].gamma[0] << " " << p->i_points[i].gamma[1] << " " << p->i_points[i].gamma[2] << " X | " << p->i_points[i].dt << std::endl ;
     
+    // start from the first main plane if the ray has been through the static planes before
+    StaticPlaneCache::State *state = (p->static_states == NULL) ? NULL : p->static_states[i];
+    int jstart = 0;
+    if(state != NULL && state->ready){
+      p->i_points[i].image->x[0] = state->x[0];
+      p->i_points[i].image->x[1] = state->x[1];
+      SumPrevAlphas[0] = state->SumPrevAlphas[0];
+      SumPrevAlphas[1] = state->SumPrevAlphas[1];
+      for(int k = 0; k < 4; ++k) SumPrevAGs[k] = state->SumPrevAGs[k];
+      p->i_points[i].kappa = state->A[0];
+      p->i_points[i].gamma[0] = state->A[1];
+      p->i_points[i].gamma[1] = state->A[2];
+      p->i_points[i].gamma[2] = state->A[3];
+      p->i_points[i].dt = state->dt;
+      
+      jstart = p->Nstatic;
+      state = NULL;
+    }
     
     // Begining of the loop through the planes :
     // Each iteration leaves i_point[i].image on plane (j+1)
-    for(j = 0; j < p->NPlanes ; ++j)
+    for(j = jstart; j < p->NPlanes ; ++j)
     {
       
       // convert to physical coordinates on the plane j, just for force calculation
@@ -370,6 +607,20 @@ void *compute_rays_parallel(void *_p)
       // ==============================
       if(verbose) std::cout << "RSI plane " << j << " : " << p->i_points[i].image->x[0] << " " << p->i_points[i].image->x[1] << " | " << p->Dl[j] << " | " << p->i_points[i].kappa << " " << p->i_points[i].gamma[0] << " " << p->i_points[i].gamma[1] << " " << p->i_points[i].gamma[2] << " X | " << p->i_points[i].dt << std::endl ;
       
+      // save the ray when it gets to the first main plane
+      if(state != NULL && j+1 == p->Nstatic){
+        state->x[0] = p->i_points[i].image->x[0];
+        state->x[1] = p->i_points[i].image->x[1];
+        state->SumPrevAlphas[0] = SumPrevAlphas[0];
+        state->SumPrevAlphas[1] = SumPrevAlphas[1];
+        for(int k = 0; k < 4; ++k) state->SumPrevAGs[k] = SumPrevAGs[k];
+        state->A[0] = p->i_points[i].kappa;
+        state->A[1] = p->i_points[i].gamma[0];
+        state->A[2] = p->i_points[i].gamma[1];
+        state->A[3] = p->i_points[i].gamma[2];
+        state->dt = p->i_points[i].dt;
+        state->ready = true;
+      }
       
     } // End of the loop going through the planes
     
@@ -425,6 +676,234 @@ void *compute_rays_parallel(void *_p)
 
 
 
+/** \brief Same calculation as compute_rays_parallel() but the batch of rays is pushed through
+ * each plane before moving on to the next one.
+ *
+ * The ray state is kept in structure-of-arrays buffers and the force on each plane is calculated
+ * with LensPlane::force_batch() so that the plane's tree stays in cache for the whole batch.
+ * The arithmetic for each ray is done in the same order as in compute_rays_parallel() so the results
+ * are identical.  Verbose output and flag_switch_lensing_off are not supported here.
+ *
+ * If p->whole_grid is set LensPlane::force_grid() is used instead and the loops over the rays are
+ * done in parallel.  This is meant to be called once for all the rays.
+ *
+ * If p->Nsources > 0 the state of the rays is recorded in p->source_rays as they reach each of the source
+ * planes instead of being put into p->i_points at the end.
+ */
+void *compute_rays_plane_major(void *_p)
+{
+  TmpParams *p = (TmpParams *) _p;
+  int start      = p->start;
+  int end        = start + p->size;
+  
+  int i, j;
+  
+  // In case e.g. a temporary point is outside of the grid.
+  std::vector<int> index;
+  index.reserve(p->size);
+  for(i = start; i < end; i++) if(p->i_points[i].in_image != MAYBE) index.push_back(i);
+  
+  size_t N = index.size();
+  if(N == 0) return 0;
+  
+  // calls f(kstart,kend) on the whole range of rays, in parallel pieces if p->whole_grid
+  auto for_rays = [p,N](const std::function<void(size_t,size_t)> &f){
+    if(p->whole_grid) Utilities::ThreadPool::get().parallel_for(N,4096,f);
+    else f(0,N);
+  };
+  
+  // state of the rays
+  std::vector<PosType> x[2] = {std::vector<PosType>(N),std::vector<PosType>(N)};
+  std::vector<PosType> Theta[2] = {std::vector<PosType>(N),std::vector<PosType>(N)};
+  std::vector<PosType> SumPrevAlphas[2] = {std::vector<PosType>(N,0.),std::vector<PosType>(N,0.)};
+  std::vector<PosType> SumPrevAGs[4] = {std::vector<PosType>(N,0.),std::vector<PosType>(N,0.)
+    ,std::vector<PosType>(N,0.),std::vector<PosType>(N,0.)};
+  std::vector<KappaType> A[4] = {std::vector<KappaType>(N,1),std::vector<KappaType>(N,0)
+    ,std::vector<KappaType>(N,0),std::vector<KappaType>(N,0)};  // 1-kappa, gamma[0..2]
+  std::vector<double> dt(N);
+  
+  PlaneForceBatch batch(N);
+  
+  // sources in front of the first plane are not lensed
+  int s_last = 0;
+  while(s_last < p->Nsources && p->source_plane[s_last] == 0){
+    for(size_t k = 0; k < N; ++k){
+      RayState &ray = p->source_rays[s_last][index[k]];
+      ray.x[0] = p->i_points[index[k]].x[0];
+      ray.x[1] = p->i_points[index[k]].x[1];
+      ray.kappa = ray.gamma[0] = ray.gamma[1] = ray.gamma[2] = 0;
+      ray.invmag = 1;
+      ray.dt = 0;
+    }
+    ++s_last;
+  }
+  
+  for_rays([&](size_t kstart,size_t kend){
+    for(size_t k = kstart; k < kend; ++k){
+      int i = index[k];
+      
+      // find position on first lens plane in comoving units
+      x[0][k] = p->i_points[i].x[0] * p->Dl[0];
+      x[1][k] = p->i_points[i].x[1] * p->Dl[0];
+      
+      Theta[0][k] = p->i_points[i].x[0];
+      Theta[1][k] = p->i_points[i].x[1];
+      
+      dt[k] = 0.5*( x[0][k]*x[0][k] + x[1][k]*x[1][k] )/ p->dDl[0] ;
+    }
+  });
+  
+  for(j = 0; j < p->NPlanes ; ++j)
+  {
+    // convert to physical coordinates on the plane j, just for force calculation
+    for_rays([&](size_t kstart,size_t kend){
+      for(size_t k = kstart; k < kend; ++k){
+        batch.x[0][k] = x[0][k]/(1+p->plane_redshifts[j]);
+        batch.x[1][k] = x[1][k]/(1+p->plane_redshifts[j]);
+        assert(batch.x[0][k] == batch.x[0][k] && batch.x[1][k] == batch.x[1][k]);
+      }
+    });
+    
+    if(p->whole_grid) p->lensing_planes[j]->force_grid(batch);
+    else p->lensing_planes[j]->force_batch(batch);
+    
+    PosType fac = 1/(1+p->plane_redshifts[j]);
+    PosType aa = p->Dl[j] / p->Dl[j+1];
+    PosType bb = p->dDl[j+1] / p->Dl[j+1];
+    PosType cc = p->charge * p->Dl[j];
+    
+    // source planes that replace plane j+1
+    int s_first = s_last;
+    while(s_last < p->Nsources && p->source_plane[s_last] == j+1) ++s_last;
+    
+    for_rays([&](size_t kstart,size_t kend){
+      PosType alpha[2];
+      KappaType kappa,gamma[3];
+      PosType xminus[2],xplus[2];
+      PosType kappa_plus,gamma_plus[3];
+      KappaType kappa_source;
+      int s;
+      
+      for(size_t k = kstart; k < kend; ++k){
+        
+        kappa = batch.kappa[k];
+        gamma[0] = batch.gamma[0][k];
+        gamma[1] = batch.gamma[1][k];
+        gamma[2] = batch.gamma[2][k];
+        
+        assert(kappa == kappa && !std::isinf(kappa));
+        
+        kappa *= fac;
+        gamma[0] *= fac;
+        gamma[1] *= fac;
+        gamma[2] *= fac;
+        
+        if(p->flag_switch_deflection_off){ alpha[0] = alpha[1] = 0.0; }
+        else{
+          alpha[0] = batch.alpha[0][k];
+          alpha[1] = batch.alpha[1][k];
+        }
+        
+        // Eq. (18) of GLAMER II
+        SumPrevAlphas[0][k] += p->charge * alpha[0] ;
+        SumPrevAlphas[1][k] += p->charge * alpha[1] ;
+        
+        // Eq. (22) of GLAMER II
+        SumPrevAGs[0][k] += cc*(kappa*A[0][k] + gamma[0]*A[1][k] + gamma[1]*A[2][k]) ;
+        SumPrevAGs[1][k] += cc*(gamma[0]*A[0][k] + kappa*A[1][k] - gamma[1]*A[3][k]) ;
+        SumPrevAGs[2][k] += cc*(gamma[1]*A[0][k] + kappa*A[2][k] + gamma[0]*A[3][k]) ;
+        SumPrevAGs[3][k] += cc*(kappa*A[3][k] - gamma[1]*A[1][k] + gamma[0]*A[2][k]) ;
+        
+        // the source planes that are between this plane and the next
+        for(s = s_first; s < s_last; ++s){
+          RayState &ray = p->source_rays[s][index[k]];
+          PosType Ds = p->source_Dl[s],dDs = p->source_dDl[s];
+          
+          xplus[0] = x[0][k] + dDs * (Theta[0][k] - SumPrevAlphas[0][k]);
+          xplus[1] = x[1][k] + dDs * (Theta[1][k] - SumPrevAlphas[1][k]);
+          
+          // same as for the next plane but with the distances of the source plane
+          kappa_source = p->Dl[j]/Ds*A[0][k] + dDs/Ds*(1-SumPrevAGs[0][k]);
+          ray.kappa = 1 - kappa_source;
+          ray.gamma[0] = p->Dl[j]/Ds*A[1][k] - dDs/Ds*SumPrevAGs[1][k];
+          ray.gamma[1] = p->Dl[j]/Ds*A[2][k] - dDs/Ds*SumPrevAGs[2][k];
+          ray.gamma[2] = p->Dl[j]/Ds*A[3][k] - dDs/Ds*SumPrevAGs[3][k];
+          
+          ray.invmag = (1-ray.kappa)*(1-ray.kappa) - ray.gamma[0]*ray.gamma[0]
+          - ray.gamma[1]*ray.gamma[1] + ray.gamma[2]*ray.gamma[2];
+          
+          ray.dt = dt[k] + ( 0.5*( (xplus[0] - x[0][k])*(xplus[0] - x[0][k]) + (xplus[1] - x[1][k])*(xplus[1] - x[1][k]) )/dDs - (1 + p->plane_redshifts[j]) * batch.phi[k] * p->charge );
+          ray.dt -= 0.5*( xplus[0]*xplus[0] + xplus[1]*xplus[1] ) / Ds;
+          ray.dt *= MpcToSeconds * SecondToYears ;
+          
+          ray.x[0] = xplus[0] / Ds;
+          ray.x[1] = xplus[1] / Ds;
+        }
+        
+        xplus[0] = x[0][k] + p->dDl[j+1] * (Theta[0][k] - SumPrevAlphas[0][k]);
+        xplus[1] = x[1][k] + p->dDl[j+1] * (Theta[1][k] - SumPrevAlphas[1][k]);
+        
+        xminus[0] = x[0][k];
+        xminus[1] = x[1][k];
+        
+        x[0][k] = xplus[0];
+        x[1][k] = xplus[1];
+        
+        kappa_plus = aa*A[0][k] + bb*(1-SumPrevAGs[0][k]) ;
+        gamma_plus[0] = aa*A[1][k] - bb*SumPrevAGs[1][k] ;
+        gamma_plus[1] = aa*A[2][k] - bb*SumPrevAGs[2][k] ;
+        gamma_plus[2] = aa*A[3][k] - bb*SumPrevAGs[3][k] ;
+        
+        assert(kappa_plus==kappa_plus && gamma_plus[0]==gamma_plus[0] && gamma_plus[1]==gamma_plus[1] && gamma_plus[2]==gamma_plus[2]);
+        
+        A[0][k] = kappa_plus;
+        A[1][k] = gamma_plus[0];
+        A[2][k] = gamma_plus[1];
+        A[3][k] = gamma_plus[2];
+        
+        // Geometric time delay with added potential
+        dt[k] += 0.5*( (xplus[0] - xminus[0])*(xplus[0] - xminus[0]) + (xplus[1] - xminus[1])*(xplus[1] - xminus[1]) )/p->dDl[j+1] - (1 + p->plane_redshifts[j]) * batch.phi[k] * p->charge ; /// in Mpc
+      }
+    });
+  }
+  
+  if(p->Nsources > 0) return 0;
+  
+  for_rays([&](size_t kstart,size_t kend){
+    for(size_t k = kstart; k < kend; ++k){
+      Point &point = p->i_points[index[k]];
+      
+      // Subtracting off a term that makes the unperturbed ray to have zero time delay
+      point.dt = dt[k] - 0.5*( x[0][k]*x[0][k] + x[1][k]*x[1][k] ) / p->Dl[p->NPlanes];
+      
+      // Convert units back to angles.
+      point.image->x[0] = x[0][k] / p->Dl[p->NPlanes];
+      point.image->x[1] = x[1][k] / p->Dl[p->NPlanes];
+      
+      point.kappa = 1 - A[0][k];
+      point.gamma[0] = A[1][k];
+      point.gamma[1] = A[2][k];
+      point.gamma[2] = A[3][k];
+      
+      point.invmag = (1-point.kappa)*(1-point.kappa)
+      - point.gamma[0]*point.gamma[0]
+      - point.gamma[1]*point.gamma[1]
+      + point.gamma[2]*point.gamma[2];
+      
+      point.dt *= MpcToSeconds * SecondToYears ;
+      
+      point.image->invmag = point.invmag;
+      point.image->kappa = point.kappa;
+      point.image->gamma[0] = point.gamma[0];
+      point.image->gamma[1] = point.gamma[1];
+      point.image->gamma[2] = point.gamma[2];
+      point.image->dt = point.dt;
+    }
+  });
+  
+  return 0;
+}
+
 // FORMER VERSION OF RAYSHOOTER USING PLANES i AND i-1 TO COMPUTE THE RAY POSITIONS AND LENSING QUANTITIES ON PLANE i+1.
 /*
 void *compute_rays_parallel(void *_p)
@@ -0,0 +1,381 @@
+/*
+ * convolution.cpp
+ *
+ *  Convolution of PixelMaps with separable and general kernels.  Small kernels are
+ *  applied directly, large ones through FFTs when ENABLE_FFTW is set.
+ */
+
+#include "slsimlib.h"
+
+#ifdef ENABLE_FFTW
+#include "fftw3.h"
+#endif
+
+#include <map>
+#include <mutex>
+#include <functional>
+#include <limits>
+
+/// smallest n >= n0 with no prime factors larger than 7
+size_t Utilities::FFTSize(size_t n0){
+  for(size_t n = n0 ; ; ++n){
+    size_t m = n;
+    while(m % 2 == 0) m /= 2;
+    while(m % 3 == 0) m /= 3;
+    while(m % 5 == 0) m /= 5;
+    while(m % 7 == 0) m /= 7;
+    if(m == 1) return n;
+  }
+}
+
+#ifdef ENABLE_FFTW
+std::mutex &Utilities::FFTWPlannerMutex(){
+  static std::mutex mutex;
+  return mutex;
+}
+#endif
+
+namespace{
+
+  /// number of rows given to a thread at a time
+  size_t row_batch(size_t Nrows){
+    size_t batch = Nrows/(4*Utilities::ThreadPool::get().size());
+    return (batch > 0) ? batch : 1;
+  }
+
+  /** out[i] += k*in[i - shift] for the i where both are in [0,N)
+   */
+  inline void add_shifted(double *out,const double *in,long N,long shift,double k){
+    long i1 = (shift > 0) ? shift : 0;
+    long i2 = (shift < 0) ? N + shift : N;
+    for(long i = i1 ; i < i2 ; ++i) out[i] += k*in[i - shift];
+  }
+
+  /// direct convolution of the rows of in with kernel k centered on k.size()/2
+  void convolve_rows(const double *in,double *out,long Nx,long Ny,const std::valarray<double> &k){
+    long c = k.size()/2;
+    Utilities::ThreadPool::get().parallel_for(Ny,row_batch(Ny),[&](size_t start,size_t end){
+      for(size_t j = start ; j < end ; ++j){
+        double *out_row = out + j*Nx;
+        for(long i = 0 ; i < Nx ; ++i) out_row[i] = 0;
+        for(long a = 0 ; a < (long)k.size() ; ++a)
+          if(k[a] != 0) add_shifted(out_row,in + j*Nx,Nx,a - c,k[a]);
+      }
+    });
+  }
+
+  /// direct convolution of the columns of in with kernel k centered on k.size()/2
+  void convolve_columns(const double *in,double *out,long Nx,long Ny,const std::valarray<double> &k){
+    long c = k.size()/2;
+    Utilities::ThreadPool::get().parallel_for(Ny,row_batch(Ny),[&](size_t start,size_t end){
+      for(long j = start ; j < (long)end ; ++j){
+        double *out_row = out + j*Nx;
+        for(long i = 0 ; i < Nx ; ++i) out_row[i] = 0;
+        for(long b = 0 ; b < (long)k.size() ; ++b){
+          long jj = j - (b - c);
+          if(jj < 0 || jj >= Ny || k[b] == 0) continue;
+          add_shifted(out_row,in + jj*Nx,Nx,0,k[b]);
+        }
+      }
+    });
+  }
+
+  /// direct convolution with a Nkx x Nky kernel centered on (Nkx/2,Nky/2)
+  void convolve_direct(const double *in,double *out,long Nx,long Ny
+                       ,const std::valarray<double> &k,long Nkx,long Nky){
+    long cx = Nkx/2,cy = Nky/2;
+    Utilities::ThreadPool::get().parallel_for(Ny,row_batch(Ny),[&](size_t start,size_t end){
+      for(long j = start ; j < (long)end ; ++j){
+        double *out_row = out + j*Nx;
+        for(long i = 0 ; i < Nx ; ++i) out_row[i] = 0;
+        for(long b = 0 ; b < Nky ; ++b){
+          long jj = j - (b - cy);
+          if(jj < 0 || jj >= Ny) continue;
+          for(long a = 0 ; a < Nkx ; ++a)
+            if(k[a + Nkx*b] != 0) add_shifted(out_row,in + jj*Nx,Nx,a - cx,k[a + Nkx*b]);
+        }
+      }
+    });
+  }
+
+  /** \brief rough number of operations per map pixel for a convolution through FFTs
+   *
+   * There are three transforms of the padded size, counted at ~3 Nlog2(N) each
+   * to make up for them being less efficient than the direct sums.
+   */
+  double fft_cost(size_t Nx,size_t Ny,size_t Nkx,size_t Nky){
+#ifdef ENABLE_FFTW
+    double Npad = (double)Utilities::FFTSize(Nx + Nkx - 1)*Utilities::FFTSize(Ny + Nky - 1);
+    return 9*Npad*log2(Npad)/Nx/Ny;
+#else
+    return std::numeric_limits<double>::max();
+#endif
+  }
+
+#ifdef ENABLE_FFTW
+
+  /// FFTW plans for one padded size, made once and shared by all the convolutions of that size
+  struct ConvolutionPlans{
+    size_t Px,Py,Hx;
+    /// transforms of one row
+    fftw_plan row_forward,row_backward;
+    /// transforms of column_block neighbouring columns
+    fftw_plan block_forward,block_backward;
+    /// transforms of one column
+    fftw_plan column_forward,column_backward;
+  };
+
+  const size_t column_block = 16;
+
+  std::map<std::pair<size_t,size_t>,ConvolutionPlans> plan_cache;
+
+  /** \brief The plans are made for unaligned arrays so that they can be executed on any rows or
+   * columns with the new-array interface, which is thread safe.  Planning is not, hence the mutex.
+   */
+  const ConvolutionPlans &convolution_plans(size_t Px,size_t Py){
+    std::lock_guard<std::mutex> lock(Utilities::FFTWPlannerMutex());
+
+    auto it = plan_cache.find(std::make_pair(Px,Py));
+    if(it != plan_cache.end()) return it->second;
+
+    ConvolutionPlans &p = plan_cache[std::make_pair(Px,Py)];
+    p.Px = Px;
+    p.Py = Py;
+    p.Hx = Px/2 + 1;
+
+    int nx = Px,ny = Py,Hx = p.Hx;
+    unsigned flags = FFTW_ESTIMATE | FFTW_UNALIGNED;
+    double *r = (double *)fftw_malloc(sizeof(double)*Px);
+    fftw_complex *c = (fftw_complex *)fftw_malloc(sizeof(fftw_complex)*p.Hx*Py);
+
+    p.row_forward = fftw_plan_many_dft_r2c(1,&nx,1,r,NULL,1,nx,c,NULL,1,Hx,flags);
+    p.row_backward = fftw_plan_many_dft_c2r(1,&nx,1,c,NULL,1,Hx,r,NULL,1,nx,flags);
+    p.block_forward = fftw_plan_many_dft(1,&ny,column_block,c,NULL,Hx,1,c,NULL,Hx,1,FFTW_FORWARD,flags);
+    p.block_backward = fftw_plan_many_dft(1,&ny,column_block,c,NULL,Hx,1,c,NULL,Hx,1,FFTW_BACKWARD,flags);
+    p.column_forward = fftw_plan_many_dft(1,&ny,1,c,NULL,Hx,1,c,NULL,Hx,1,FFTW_FORWARD,flags);
+    p.column_backward = fftw_plan_many_dft(1,&ny,1,c,NULL,Hx,1,c,NULL,Hx,1,FFTW_BACKWARD,flags);
+
+    fftw_free(r);
+    fftw_free(c);
+
+    return p;
+  }
+
+  /// in place transform of all the columns of a Hx x Py complex array
+  void transform_columns(const ConvolutionPlans &p,fftw_complex *c,bool forward){
+    size_t Nblocks = p.Hx/column_block;
+    fftw_plan block = forward ? p.block_forward : p.block_backward;
+    fftw_plan column = forward ? p.column_forward : p.column_backward;
+
+    Utilities::ThreadPool::get().parallel_for(Nblocks,1,[&](size_t start,size_t end){
+      for(size_t b = start ; b < end ; ++b)
+        fftw_execute_dft(block,c + b*column_block,c + b*column_block);
+    });
+    for(size_t k = Nblocks*column_block ; k < p.Hx ; ++k) fftw_execute_dft(column,c + k,c + k);
+  }
+
+  /** \brief Transform of a Px x Py real array into the Hx x Py complex array out.
+   *
+   * fill_row(j,row) sets row j of the array in row, which is zeroed before, and returns false
+   * if the whole row is zero.
+   */
+  void transform_forward(const ConvolutionPlans &p,fftw_complex *out
+                         ,const std::function<bool(size_t,double *)> &fill_row){
+    Utilities::ThreadPool::get().parallel_for(p.Py,row_batch(p.Py),[&](size_t start,size_t end){
+      std::vector<double> row(p.Px);
+      for(size_t j = start ; j < end ; ++j){
+        std::fill(row.begin(),row.end(),0.0);
+        if(fill_row(j,row.data())){
+          fftw_execute_dft_r2c(p.row_forward,row.data(),out + j*p.Hx);
+        }else{
+          for(size_t i = 0 ; i < p.Hx ; ++i) out[i + j*p.Hx][0] = out[i + j*p.Hx][1] = 0;
+        }
+      }
+    });
+    transform_columns(p,out,true);
+  }
+
+  /// transform of the kernel function k(a,b) on Nkx x Nky pixels, the center (Nkx/2,Nky/2) goes to (0,0) and the rest wraps around
+  void transform_kernel(const ConvolutionPlans &p,fftw_complex *fkernel
+                        ,size_t Nkx,size_t Nky,const std::function<double(size_t,size_t)> &k){
+    long cx = Nkx/2,cy = Nky/2;
+    transform_forward(p,fkernel,[&](size_t j,double *row){
+      long b = (long)j + cy;
+      if(b >= (long)p.Py) b -= p.Py;
+      if(b >= (long)Nky) return false;
+      for(long a = 0 ; a < (long)Nkx ; ++a) row[(a - cx + p.Px) % p.Px] = k(a,b);
+      return true;
+    });
+  }
+
+  /** \brief Convolution of the map with a transformed kernel, fmap is the workspace for the transform of the map.
+   * The product of the transforms is multiplied by norm.
+   */
+  void convolve_transformed(const ConvolutionPlans &p,std::valarray<double> &map,size_t Nx,size_t Ny
+                            ,fftw_complex *fmap,const fftw_complex *fkernel,double norm){
+    size_t Nc = p.Hx*p.Py;
+
+    transform_forward(p,fmap,[&](size_t j,double *row){
+      if(j >= Ny) return false;
+      for(size_t i = 0 ; i < Nx ; ++i) row[i] = map[i + Nx*j];
+      return true;
+    });
+
+    Utilities::ThreadPool::get().parallel_for(Nc,p.Hx*row_batch(p.Py),[&](size_t start,size_t end){
+      double re;
+      for(size_t i = start ; i < end ; ++i){
+        re = (fmap[i][0]*fkernel[i][0] - fmap[i][1]*fkernel[i][1])*norm;
+        fmap[i][1] = (fmap[i][0]*fkernel[i][1] + fmap[i][1]*fkernel[i][0])*norm;
+        fmap[i][0] = re;
+      }
+    });
+
+    transform_columns(p,fmap,false);
+
+    Utilities::ThreadPool::get().parallel_for(Ny,row_batch(Ny),[&](size_t start,size_t end){
+      std::vector<double> row(p.Px);
+      for(size_t j = start ; j < end ; ++j){
+        fftw_execute_dft_c2r(p.row_backward,fmap + j*p.Hx,row.data());
+        for(size_t i = 0 ; i < Nx ; ++i) map[i + Nx*j] = row[i];
+      }
+    });
+  }
+
+  /** \brief Convolution through FFTs with the kernel function k(a,b) on Nkx x Nky pixels
+   * centered on (Nkx/2,Nky/2).  The map is zero padded so there is no wrapping around.
+   */
+  void convolve_fft(std::valarray<double> &map,size_t Nx,size_t Ny
+                    ,size_t Nkx,size_t Nky,const std::function<double(size_t,size_t)> &k){
+    const ConvolutionPlans &p = convolution_plans(Utilities::FFTSize(Nx + Nkx - 1),Utilities::FFTSize(Ny + Nky - 1));
+    size_t Nc = p.Hx*p.Py;
+    fftw_complex *fmap = (fftw_complex *)fftw_malloc(sizeof(fftw_complex)*Nc);
+    fftw_complex *fkernel = (fftw_complex *)fftw_malloc(sizeof(fftw_complex)*Nc);
+
+    transform_kernel(p,fkernel,Nkx,Nky,k);
+    convolve_transformed(p,map,Nx,Ny,fmap,fkernel,1.0/p.Px/p.Py);
+
+    fftw_free(fkernel);
+    fftw_free(fmap);
+  }
+
+#endif
+}
+
+/** \brief Convolves the map with a kernel of Nkx x Nky pixels.
+ *
+ * The kernel is centered on pixel (Nkx/2,Nky/2) and indexed like a PixelMap, kernel[i + Nkx*j].
+ * Outside the map the image is taken to be zero.  The convolution is done through FFTs when
+ * ENABLE_FFTW is set and that is estimated to be faster, otherwise it is done directly.
+ */
+void PixelMap::convolve(const std::valarray<double> &kernel,std::size_t Nkx,std::size_t Nky){
+  if(kernel.size() != Nkx*Nky) throw std::invalid_argument("PixelMap::convolve: kernel size does not match Nkx*Nky");
+  if(map.size() == 0 || kernel.size() == 0) return;
+
+#ifdef ENABLE_FFTW
+  if(fft_cost(Nx,Ny,Nkx,Nky) < (double)Nkx*Nky){
+    convolve_fft(map,Nx,Ny,Nkx,Nky,[&](size_t a,size_t b){return kernel[a + Nkx*b];});
+    return;
+  }
+#endif
+
+  std::valarray<double> out(map.size());
+  convolve_direct(&map[0],&out[0],Nx,Ny,kernel,Nkx,Nky);
+  std::swap(map,out);
+}
+
+/** \brief Convolves the map with the separable kernel kx[i]*ky[j].
+ *
+ * The kernel is centered on (kx.size()/2,ky.size()/2).  This is done with two one dimensional
+ * passes unless a convolution through FFTs is estimated to be faster.
+ */
+void PixelMap::convolve_separable(const std::valarray<double> &kx,const std::valarray<double> &ky){
+  if(map.size() == 0 || kx.size() == 0 || ky.size() == 0) return;
+
+#ifdef ENABLE_FFTW
+  if(fft_cost(Nx,Ny,kx.size(),ky.size()) < (double)(kx.size() + ky.size())){
+    convolve_fft(map,Nx,Ny,kx.size(),ky.size(),[&](size_t a,size_t b){return kx[a]*ky[b];});
+    return;
+  }
+#endif
+
+  std::valarray<double> tmp(map.size());
+  convolve_rows(&map[0],&tmp[0],Nx,Ny,kx);
+  convolve_columns(&tmp[0],&map[0],Nx,Ny,ky);
+}
+
+#ifdef ENABLE_FFTW
+
+/// the map must have the size the kernel was made for
+void PixelMap::convolve(const Utilities::FFTKernel &kernel){
+  if(Nx != kernel.getNx() || Ny != kernel.getNy())
+    throw std::invalid_argument("PixelMap::convolve: the kernel was transformed for maps of another size");
+  if(map.size() == 0) return;
+
+  kernel.apply(map);
+}
+
+Utilities::FFTKernel::FFTKernel(const std::valarray<double> &kernel,std::size_t Nkx,std::size_t Nky
+                                ,std::size_t my_Nx,std::size_t my_Ny,double oversample,double norm)
+:Nx(my_Nx),Ny(my_Ny),fkernel(NULL)
+{
+  if(kernel.size() != Nkx*Nky) throw std::invalid_argument("FFTKernel: kernel size does not match Nkx*Nky");
+  if(oversample < 1) throw std::invalid_argument("FFTKernel: oversampling must be >= 1");
+
+  const ConvolutionPlans &p = convolution_plans(FFTSize(Nx + Nkx - 1),FFTSize(Ny + Nky - 1));
+  Px = p.Px;
+  Py = p.Py;
+  fkernel = (fftw_complex *)fftw_malloc(sizeof(fftw_complex)*p.Hx*p.Py);
+
+  std::function<double(size_t,size_t)> k = [&](size_t a,size_t b){return kernel[a + Nkx*b];};
+
+  if(oversample == 1){
+    transform_kernel(p,fkernel,Nkx,Nky,k);
+  }else{
+    const ConvolutionPlans &pb = convolution_plans(static_cast<size_t>(Px*oversample),static_cast<size_t>(Py*oversample));
+    if(pb.Px < Nkx || pb.Py < Nky) throw std::invalid_argument("FFTKernel: kernel is larger than the oversampled map");
+    fftw_complex *fbig = (fftw_complex *)fftw_malloc(sizeof(fftw_complex)*pb.Hx*pb.Py);
+    transform_kernel(pb,fbig,Nkx,Nky,k);
+
+    // keep the frequencies of the padded map, negative ones from the end of the fine grid
+    for(size_t ky = 0 ; ky < Py ; ++ky){
+      size_t kb = (ky > Py/2) ? pb.Py - (Py - ky) : ky;
+      for(size_t kx = 0 ; kx < p.Hx ; ++kx){
+        fkernel[kx + p.Hx*ky][0] = fbig[kx + pb.Hx*kb][0];
+        fkernel[kx + p.Hx*ky][1] = fbig[kx + pb.Hx*kb][1];
+      }
+    }
+    fftw_free(fbig);
+  }
+
+  norm /= (double)Px*Py;
+  for(size_t i = 0 ; i < p.Hx*p.Py ; ++i){
+    fkernel[i][0] *= norm;
+    fkernel[i][1] *= norm;
+  }
+}
+
+Utilities::FFTKernel::~FFTKernel(){
+  fftw_free(fkernel);
+  for(fftw_complex *w : workspaces) fftw_free(w);
+}
+
+void Utilities::FFTKernel::apply(std::valarray<double> &map) const{
+  const ConvolutionPlans &p = convolution_plans(Px,Py);
+
+  fftw_complex *fmap = NULL;
+  {
+    std::lock_guard<std::mutex> hold(mutex);
+    if(workspaces.size() > 0){
+      fmap = workspaces.back();
+      workspaces.pop_back();
+    }
+  }
+  if(fmap == NULL) fmap = (fftw_complex *)fftw_malloc(sizeof(fftw_complex)*p.Hx*p.Py);
+
+  convolve_transformed(p,map,Nx,Ny,fmap,fkernel,1.0);
+
+  std::lock_guard<std::mutex> hold(mutex);
+  workspaces.push_back(fmap);
+}
+
+#endif
@@ -19,6 +19,15 @@
 #include <fstream>
 #include <limits>
 
+#ifdef ENABLE_FFTW
+struct Observation::PSFCache{
+  std::mutex mutex;
+  std::map<std::pair<size_t,size_t>,std::unique_ptr<Utilities::FFTKernel> > kernels;
+};
+#else
+struct Observation::PSFCache{};
+#endif
+
 
 /** * \brief Creates an observation setup that mimics a known instrument
  *
@@ -231,6 +240,7 @@ Observation::Observation(float diameter, float transmission, float exp_time, int
 	int N_psf = side_psf*side_psf;
 	map_psf.resize(N_psf);
 	h0->read(map_psf);
+	psf_cache = std::make_shared<PSFCache>();
 
 #else
 		std::cout << "Please enable the preprocessor flag ENABLE_FITS !" << std::endl;
@@ -261,6 +271,7 @@ void Observation::setPSF(std::string psf_file, float os)
 	int N_psf = side_psf*side_psf;
 	map_psf.resize(N_psf);
 	h0->read(map_psf);
+	psf_cache = std::make_shared<PSFCache>();
     
 #else
     std::cout << "Please enable the preprocessor flag ENABLE_FITS !" << std::endl;
@@ -297,6 +308,45 @@ PixelMap Observation::Convert (PixelMap &map, bool psf, bool noise, long *seed,
 	return outmap;
 }
 
+/**  \brief Converts a set of input maps to realistic images
+ *
+ * Gives the same result as calling Convert() on each map in turn, including the noise
+ * which is drawn from seed in the order of the maps.  The psf convolutions, which are
+ * most of the work, are done in parallel.  Maps of the same size share FFTW plans
+ * and the transformed psf.
+ */
+std::vector<PixelMap> Observation::Convert (std::vector<PixelMap> &maps, bool psf, bool noise, long *seed, unitType unit)
+{
+	if (telescope == true)
+	{
+		for(auto &map : maps)
+		{
+			if (fabs(map.getResolution()-pix_size) > pix_size*1.0e-5)
+			{
+				std::cout << "The resolution of the input map is different from the one of the simulated instrument in Observation::Convert!" << std::endl;
+				throw std::runtime_error("The resolution of the input map is different from the one of the simulated instrument!");
+			}
+		}
+	}
+
+	std::vector<PixelMap> outmaps(maps.size());
+	Utilities::ThreadPool::get().parallel_for(maps.size(),1,[&](size_t start,size_t end){
+		for(size_t i = start ; i < end ; ++i)
+		{
+			outmaps[i] = PhotonToCounts(maps[i]);
+			if (psf == true) outmaps[i] = ApplyPSF(outmaps[i]);
+		}
+	});
+
+	double counts_to_flux = pow(10,-0.4*mag_zeropoint);
+	for(auto &outmap : outmaps)
+	{
+		if (noise == true) outmap = AddNoise(outmap,seed);
+		if (unit == flux) outmap.Renormalize(counts_to_flux);
+	}
+	return outmaps;
+}
+
 /// Converts an observed image to the units of the lensing simulation
 PixelMap Observation::Convert_back (PixelMap &map)
 {
@@ -309,14 +359,13 @@ PixelMap Observation::Convert_back (PixelMap &map)
 
 /** * \brief Smooths the image with a PSF map.
 *
+* The transform of the psf is made the first time a map of a given shape comes through and
+* reused after that, see Utilities::FFTKernel.  The psf is transformed on a grid oversample
+* times finer covering the same area so that its low frequencies line up with those of the
+* padded map.
 */
 PixelMap Observation::ApplyPSF(PixelMap &pmap)
 {
-  if(pmap.getNx() != pmap.getNy()){
-    std::cout << "Observation::AddNoise() Doesn't work on nonsquare maps" << std::endl;
-    throw std::runtime_error("nonsquare");
-  }
-  
 	if (map_psf.size() == 0)
 	{
 		if (seeing > 0.)
@@ -335,104 +384,22 @@ PixelMap Observation::ApplyPSF(PixelMap &pmap)
 #ifdef ENABLE_FITS
 #ifdef ENABLE_FFTW
     
-    PixelMap outmap(pmap);
-    
-    // calculates normalisation of psf
-    int N_psf = map_psf.size();
-    int side_psf = sqrt(N_psf);
-    double map_norm = 0.;
-    for (int i = 0; i < N_psf; i++)
-    {
-      map_norm += map_psf[i];
-    }
-    fftw_plan p_psf;
-    
-    // creates plane for fft of map, sets properly input and output data, then performs fft
-    fftw_plan p;
-    long Npix = outmap.getNx();
-    long Npix_zeropad = Npix + side_psf;
-        
-    // rows and columns between first_p and last_p are copied in the zero-padded version
-    long first_p = side_psf/2;
-    long last_p = first_p + (Npix-1);
-    //std::complex<double>* out=new std::complex<double> [Npix_zeropad*(Npix_zeropad/2+1)];
-    //std::unique_ptr<std::complex<double> > out(new std::complex<double> [Npix_zeropad*(Npix_zeropad/2+1)]);
-    std::vector<std::complex<double> > out(Npix_zeropad*(Npix_zeropad/2+1));
-    
-    // add zero-padding
-    //double* in_zeropad = new double[Npix_zeropad*Npix_zeropad];
-    std::vector<double> in_zeropad(Npix_zeropad*Npix_zeropad);
-    for (int i = 0; i < Npix_zeropad*Npix_zeropad; i++)
-    {
-      long ix = i/Npix_zeropad;
-      long iy = i%Npix_zeropad;
-      if (ix >= first_p && ix <= last_p && iy >= first_p && iy <= last_p)
-        in_zeropad[i] = outmap[(ix-side_psf/2)*Npix+(iy-side_psf/2)];
-      else
-        in_zeropad[i] = 0.;
-    }
-    
-    p = fftw_plan_dft_r2c_2d(Npix_zeropad,Npix_zeropad,in_zeropad.data()
-                             , reinterpret_cast<fftw_complex*>(out.data()), FFTW_ESTIMATE);
-    fftw_execute(p);
-    
-    // creates plane for perform backward fft after convolution, sets output data 
-    fftw_plan p2;
-    //double* out2 = new double[Npix_zeropad*Npix_zeropad];
-    std::vector<double> out2(Npix_zeropad*Npix_zeropad);
-    p2 = fftw_plan_dft_c2r_2d(Npix_zeropad,Npix_zeropad,reinterpret_cast<fftw_complex*>(out.data()), out2.data(), FFTW_ESTIMATE);
-    
-    
-    // arrange psf data for fft, creates plane, then performs fft
-    // psf data are moved into the four corners of psf_big_zeropad
-    long psf_big_zeropad_Npixels = static_cast<int>((Npix+side_psf)*oversample);
-    //double* psf_big_zeropad = new double[psf_big_zeropad_Npixels*psf_big_zeropad_Npixels];
-    std::vector<double> psf_big_zeropad(psf_big_zeropad_Npixels*psf_big_zeropad_Npixels);
-    //std::complex<double>* out_psf=new std::complex<double> [psf_big_zeropad_Npixels*(psf_big_zeropad_Npixels/2+1)];
-    std::vector<std::complex<double> > out_psf(psf_big_zeropad_Npixels*(psf_big_zeropad_Npixels/2+1));
-    
-    p_psf = fftw_plan_dft_r2c_2d(psf_big_zeropad_Npixels,psf_big_zeropad_Npixels,psf_big_zeropad.data(), reinterpret_cast<fftw_complex*>(out_psf.data()), FFTW_ESTIMATE);
-    long ix, iy;
-    for (int i = 0; i < psf_big_zeropad_Npixels*psf_big_zeropad_Npixels; i++)
-    {
-      ix = i/psf_big_zeropad_Npixels;
-      iy = i%psf_big_zeropad_Npixels;
-      if(ix<side_psf/2 && iy<side_psf/2)
-        psf_big_zeropad[i] = map_psf[(ix+side_psf/2)*side_psf+(iy+side_psf/2)]/map_norm;
-      else if(ix<side_psf/2 && iy>=psf_big_zeropad_Npixels-side_psf/2)
-        psf_big_zeropad[i] = map_psf[(ix+side_psf/2)*side_psf+(iy-(psf_big_zeropad_Npixels-side_psf/2))]/map_norm;
-      else if(ix>=psf_big_zeropad_Npixels-side_psf/2 && iy<side_psf/2)
-        psf_big_zeropad[i] = map_psf[(ix-(psf_big_zeropad_Npixels-side_psf/2))*side_psf+(iy+side_psf/2)]/map_norm;
-      else if(ix>=psf_big_zeropad_Npixels-side_psf/2 && iy>=psf_big_zeropad_Npixels-side_psf/2)
-        psf_big_zeropad[i] = map_psf[(ix-(psf_big_zeropad_Npixels-side_psf/2))*side_psf+(iy-(psf_big_zeropad_Npixels-side_psf/2))]/map_norm;
-      else
-        psf_big_zeropad[i] = 0.;
-    }
-    fftw_execute(p_psf);
-    
-    // performs convolution in Fourier space , and transforms back to real space
-    for (unsigned long i = 0; i < Npix_zeropad*(Npix_zeropad/2+1); i++)
+    size_t Nx = pmap.getNx(),Ny = pmap.getNy();
+    Utilities::FFTKernel *kernel;
     {
-      ix = i/(Npix_zeropad/2+1);
-      iy = i%(Npix_zeropad/2+1);
-      if (ix>Npix_zeropad/2)
-        out[i] *= out_psf[(psf_big_zeropad_Npixels-(Npix_zeropad-ix))*(psf_big_zeropad_Npixels/2+1)+iy];
-      else
-        out[i] *= out_psf[ix*(psf_big_zeropad_Npixels/2+1)+iy];
-    }
-    fftw_execute(p2);
-    
-    // translates array of data in (normalised) counts map
-    for (unsigned long i = 0; i < Npix_zeropad*Npix_zeropad; i++)
-    {
-      ix = i/Npix_zeropad;
-      iy = i%Npix_zeropad;
-      if (ix >= first_p && ix <= last_p && iy >= first_p && iy <= last_p)
+      std::lock_guard<std::mutex> hold(psf_cache->mutex);
+      std::unique_ptr<Utilities::FFTKernel> &entry = psf_cache->kernels[std::make_pair(Nx,Ny)];
+      if(!entry)
       {
-        int ii = (ix-side_psf/2)*Npix+(iy-side_psf/2);
-        outmap.AssignValue(ii,out2[i]/double(Npix_zeropad*Npix_zeropad));
+        long side_psf = sqrt(map_psf.size());
+        entry.reset(new Utilities::FFTKernel(map_psf,side_psf,side_psf,Nx,Ny,oversample,1./map_psf.sum()));
       }
+      kernel = entry.get();
     }
+    
+    PixelMap outmap(pmap);
+    outmap.convolve(*kernel);
+    
     return outmap;
 #else
 		std::cout << "Please enable the preprocessor flag ENABLE_FFTW !" << std::endl;
@@ -471,11 +438,6 @@ float Observation::getBackgroundNoise(float resolution, unitType unit)
 /// Applies realistic noise (read-out + Poisson) on an image
 PixelMap Observation::AddNoise(PixelMap &pmap,long *seed)
 {
-  if(pmap.getNx() != pmap.getNy()){
-    std::cout << "Observation::AddNoise() Doesn't work on nonsquare maps" << std::endl;
-    throw std::runtime_error("nonsquare");
-  }
-  
 	PixelMap outmap(pmap);
 	double Q = pow(10,0.4*(mag_zeropoint+48.6));
 	double res_in_arcsec = outmap.getResolution()*180.*60.*60/pi;
@@ -324,7 +324,8 @@ void PixelMap::swap(PixelMap &map1,PixelMap &map2)
 {
 
   std::swap(map1.map,map2.map);
-  std::swap(map1.Nx,map2.Ny);
+  std::swap(map1.Nx,map2.Nx);
+  std::swap(map1.Ny,map2.Ny);
   std::swap(map1.resolution,map2.resolution);
   std::swap(map1.rangeX,map2.rangeX);
   std::swap(map1.rangeY,map2.rangeY);
@@ -896,61 +897,23 @@ void PixelMap::printFITS(std::string filename,std::vector<std::tuple<std::string
  * \brief Smoothes a map with a Gaussian kernel of width sigma (in arcseconds)
  */
 void PixelMap::smooth(PosType sigma){
-  PosType sum=0,**mask;
-  int ix,iy;
   int Nmask,Nmask_half;
-  int j_cen, k_cen;
+  PosType sum=0;
   
   sigma /= 3600.*180/pi;
   Nmask=2*(int)(3*sigma/resolution + 1);
-  std::cout << Nmask << std::endl;
   if(Nmask < 4 ) std::cout << "WARNING: pixels are large compare to psf Nmask=" << Nmask << std::endl;
   
+  // the Gaussian is separable so it is applied as two one dimensional passes
   Nmask_half = int(Nmask/2);
-  mask = new PosType*[Nmask];
-  for (int j = 0; j <Nmask; j++)
-    mask[j] = new PosType[Nmask];
-  
-  for(int j=0;j<Nmask;j++)
-  {
-    for(int k=0;k<Nmask;k++)
-    {
-      j_cen = j - Nmask_half;
-      k_cen = k - Nmask_half;
-      mask[j][k]= exp(-(pow(j_cen*resolution,2) + pow(k_cen*resolution,2))/2/pow(sigma,2) );
-      sum+=mask[j][k];
-    }
+  std::valarray<PosType> mask(Nmask);
+  for(int j=0;j<Nmask;j++){
+    mask[j] = exp(-pow((j - Nmask_half)*resolution,2)/2/pow(sigma,2) );
+    sum += mask[j];
   }
-  for(int j=0;j<Nmask;j++)
-  {
-    for(int k=0;k<Nmask;k++)
-    {
-      mask[j][k]/=sum;
-    }
-  }
-  
-  std::valarray<PosType> map_out(0.0, map.size());
-  
-  for(long i=0;i<map.size();i++){
-    for(int j=0;j<Nmask;j++){
-      ix=i%Nx + j-Nmask_half;
-      if( (ix>-1) && (ix<Nx) ){
-        for(int k=0;k<Nmask;k++){
-          iy=i/Nx + k-Nmask_half;
-          if( (iy>-1) && (iy<Ny) ){
-            map_out[ix+Nx*iy] += mask[j][k]*map[i];
-          }
-        }
-      }
-    }
-  }
-  
-  using std::swap;
-  swap(map, map_out);
+  mask /= sum;
   
-  for (int j = 0; j <Nmask; j++)
-    delete[] mask[j];
-  delete[] mask;
+  convolve_separable(mask,mask);
 }
 
 /**
@@ -13,6 +13,8 @@ namespace
 		{"outputfile", "output", ""},
 		{"deflection_off", "0", "switches deflection off (but not kappa and gamma, ie. Born approximation)"},
 		{"lensing_off", "0", "switches all lensing off"},
+		{"plane_major_shooting", "0", "shoots rays in batches one plane at a time, same results but faster with many planes"},
+		{"fmm_shooting", "0", "shoots all the rays one plane at a time with a dual tree method on the field planes, faster for large grids, needs field_expansion_order >= 3"},
 		{"read_redshift_planes", "0", "reads in the redshifts of the lensing planes from a file"},
 		{"redshift_planes_file", "Z.txt", "an asci file with redshifts of the planes, excluding the source redshift"},
 		{"z_lens", "0.42", "lens redshift"},
@@ -36,6 +38,8 @@ namespace
     {"pixelmaps_input_file","surfacedensity.fits","Density map(s) to be read in as main lens.  This can be a single map (*.fits) or a file with a list of fits files."},
     {"pixelmap_padding_factor","4","The factor by which the map is zero padded when doing FFTS."},
     {"pixelmap_zeromean","true","By default the mean surface density is subtracted from the map. Set to false to turn this off"},
+    {"pixelmaps_fft_float","false","Do the FFTs of the density maps in single precision.  Needs the library compiled with ENABLE_FFTWF."},
+    {"pixelmaps_fft_memory","0","Limit in MB on the memory used by the FFTs of each density map.  Single precision and then less zero padding are used to stay under it.  0 for no limit."},
     // MultiDarkMap lenses
     //{"PixelizedDensityMap_input_file", "PixelizedMapFiles.txt", "list of MOKA FITS files for MultiDark-like simulations"},
     
@@ -57,10 +61,14 @@ namespace
 		{"field_fov", "1.0e4", "random light cone field of view in square arcseconds"},
 		{"field_buffer", "1.0", "in physical Mpc"},
 		{"field_min_mass", "1.0e9", "min mass of the halos in the light cone in solar masses"},
+		{"field_theta_force", "0.1", "opening angle of the trees used for the field halos"},
+		{"field_expansion_order", "2", "order of the multipole expansion in the field halo trees, 2 is quadrupole"},
+		{"field_snapshot_file", "", "Optional: the field is read from this file if it exists and was made with the same parameters and seed, otherwise it is generated and written to it"},
 		
 		// Field halos from an input file
 		{"field_input_simulation_path", "halos.txt", "if set, the light cone is read from an input file or files in this directory"},
     {"field_input_simulation_format", "MillenniumObs", "if set, format of halo input data: MillenniumObs, MultiDarkHalos,  this is subject to changes"},
+    {"field_input_simulation_cache", "true", "Optional: if true the input halo catalog is cached in a binary file next to it, filename + \".bin\", that is read instead while the catalog is unchanged, default true"},
     {"field_input_simulation_center_RA", "0.0","Optional: right ascension in degrees for the center of the simulation, 0 if not included"},
     {"field_input_simulation_center_DEC","0.0","Optional: declination in degrees the center of the simulation, 0 if not included"},
     {"field_input_simulation_radius","0.0","Optional: set radius (in degrees) of simulated field radians, infinite (size of input lightcone) if not included"},
@@ -7,6 +7,9 @@
 
 #include "MOKAlens.h"
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <functional>
 
 #ifdef ENABLE_FITS
 #include <CCfits/CCfits>
@@ -432,6 +435,7 @@ void LensHaloMassMap::readMap(){
  */
 void LensHaloMassMap::writeImage(std::string filename){
 #ifdef ENABLE_FITS
+  restoreMaps();
   long naxis=2;
   long naxes[2]={map->nx,map->ny};
   
@@ -598,254 +602,275 @@ int fof(double l,std:: vector<double> xci, std:: vector<double> yci, std:: vecto
    */
 }
 
-/**
- * \brief pre-process sourface mass density map computing deflection angles and shear in FFT,
- *  generalized to work with rectangular maps
- */
-
-void LensHaloMassMap::PreProcessFFTWMap(){
 #ifdef ENABLE_FFTW
-  // initialize the quantities
-  //int npix_filter = 0;   // filter the map if you want on a given number of pixels: CHECK IT NOT IMPLEMENTED YET
-  
-  // size of the new map in x and y directions, factor by which each size is increased
-  int Nnx=int(zerosize*map->nx);
-  int Nny=int(zerosize*map->ny);
-  double Nboxlx = map->boxlMpc*zerosize;
-  double Nboxly = map->boxlMpc*zerosize/map->nx*map->ny;
-  
-  std:: valarray<float> Nmap;
-  try{
-    Nmap.resize( Nnx*Nny );
-  }catch(std::exception &e){
-    std::cerr << "exception thrown in LensHaloMassMap::PreProcessFFTWMap(): " << e.what() << std::endl;
-  }
-  // assume locate in a rectangular map and build up the new one
-  for( int j=0; j<Nny; j++ ){
-    for( int i=0; i<Nnx; i++ ){
-      Nmap[i+Nnx*j]=0;
-      if(i>=int(Nnx/2-map->nx/2) && i<int(Nnx/2+map->nx/2) && j>=int(Nny/2-map->ny/2) && j<int(Nny/2+map->ny/2)){
-        int ii = i-int(Nnx/2-map->nx/2);
-        int jj = j-int(Nny/2-map->ny/2);
-        
-        if(ii>=map->nx || jj>=map->ny){
-          std::cout << " 1 error mapping " << ii << "  " << jj << std::endl;
-          exit(1);
-        }
-        if(ii<0 || jj<0){
-          std::cout << " 2 error mapping " << ii << "  " << jj << std::endl;
-          exit(1);
-        }
-        Nmap[i+Nnx*j]=map->convergence[ii+map->nx*jj];
-      }
+namespace{
+
+  /// the FFTW interface for each precision
+  template<typename T> struct FFTWPrecision;
+
+  template<> struct FFTWPrecision<double>{
+    typedef fftw_complex complex;
+    typedef fftw_plan plan;
+    static plan r2c(int n,double *in,complex *out,unsigned flags){
+      return fftw_plan_many_dft_r2c(1,&n,1,in,NULL,1,2*(n/2+1),out,NULL,1,n/2+1,flags);
     }
-  }
-  
-  double *dNmap=new double[Nnx*Nny];
-  double *input=new double[Nnx*Nny];
-  fftw_complex *fNmap=new fftw_complex[Nny*(Nnx/2+1)];
-  fftw_complex *output=new fftw_complex[Nny*(Nnx/2+1)];
-  for(int k=0;k<Nnx*Nny;k++) dNmap[k] = double(Nmap[k]);
-  fftw_plan p;
-  p=fftw_plan_dft_r2c_2d(Nny,Nnx,input,output,FFTW_ESTIMATE);
-  
-  for(int i=0;i<Nnx*Nny;i++) input[i] = dNmap[i];
-  fftw_execute( p );
-  for(int i=0; i<Nny*(Nnx/2+1);i++){
-    fNmap[i][0] = output[i][0];
-    fNmap[i][1] = output[i][1];
-  }
-  delete[] input;
-  delete[] output;
-  delete[] dNmap;
-  fftw_destroy_plan(p);
-  
-  // fourier space
-  // std:: cout << " allocating fourier space maps " << std:: endl;
-  
-  
-  fftw_complex *fphi   = new fftw_complex[Nny*(Nnx/2+1)];
-  // build modes for each pixel in the fourier space
-  for( int i=0; i<Nnx/2+1; i++ ){
-    double kx=double(i);
-    kx=kx*2.*M_PI/Nboxlx;
-    for( int j=0; j<Nny; j++ ){
-      double ky=(j<Nny/2)?double(j):double(j-Nny);
-      ky=ky*2.*M_PI/Nboxly;
-      double k2 = kx*kx+ky*ky;
-      //smooth if you want to IMPLEMENT
-      // if(npix_filter>0){
-      // fNmap[j+(Nnpixels/2+1)*i][0] = fNmap[j+(Nnpixels/2+1)*i][0]*exp(-k2/sigmag/sigmag/2.);
-      // fNmap[j+(Nnpixels/2+1)*i][1] = fNmap[j+(Nnpixels/2+1)*i][1]*exp(-k2/sigmag/sigmag/2.);
-      // }
-      
-      // fphi
-      fphi[i+(Nnx/2+1)*j][0]= -2.*fNmap[i+(Nnx/2+1)*j][0]/k2;
-      fphi[i+(Nnx/2+1)*j][1]= -2.*fNmap[i+(Nnx/2+1)*j][1]/k2;
-      // null for k2 = 0 no divergence
-      if(k2 == 0){
-        fphi[i+(Nnx/2+1)*j][0] = 0.;
-        fphi[i+(Nnx/2+1)*j][1] = 0.;
-      }
+    static plan c2r(int n,complex *in,double *out,unsigned flags){
+      return fftw_plan_many_dft_c2r(1,&n,1,in,NULL,1,n/2+1,out,NULL,1,2*(n/2+1),flags);
     }
-  }
-  
-  delete[] fNmap;
-  
-  
-  fftw_complex *fft= new fftw_complex[Nny*(Nnx/2+1)];
-  double *realsp = new double[Nnx*Nny];
-  //fftw_plan pp = fftw_plan_dft_c2r_2d(Nny,Nnx,fft,realsp,FFTW_ESTIMATE);
-  fftw_plan pp = fftw_plan_dft_c2r_2d(Nny,Nnx,fft,realsp,FFTW_MEASURE);
-  
-  // alpha1
-  {
-    
-    // build modes for each pixel in the fourier space
-    for( int i=0; i<Nnx/2+1; i++ ){
-      double kx=double(i);
-      kx=kx*2.*M_PI/Nboxlx;
-      for( int j=0; j<Nny; j++ ){
-        double ky=(j<Nny/2)?double(j):double(j-Nny);
-        ky=ky*2.*M_PI/Nboxly;
-        
-        fft[i+(Nnx/2+1)*j][0] = -kx*fphi[i+(Nnx/2+1)*j][1];
-        fft[i+(Nnx/2+1)*j][1] =  kx*fphi[i+(Nnx/2+1)*j][0];
-      }
+    static plan columns(int n,int howmany,int stride,complex *c,int sign,unsigned flags){
+      return fftw_plan_many_dft(1,&n,howmany,c,NULL,stride,1,c,NULL,stride,1,sign,flags);
     }
-    
-    //pp=fftw_plan_dft_c2r_2d(Nny,Nnx,fft,realsp,FFTW_ESTIMATE);
-    fftw_execute( pp );
-    //fftw_destroy_plan(pp);
-    
-    map->alpha1.resize(map->nx*map->ny);
-    
-    for( int j=Nny/2-map->ny/2; j<Nny/2+map->ny/2; j++ ){
-      for( int i=Nnx/2-map->nx/2; i<Nnx/2+map->nx/2; i++ ){
-        int ii = i-int(Nnx/2-map->nx/2);
-        int jj = j-int(Nny/2-map->ny/2);
-        
-        map->alpha1[ii+map->nx*jj] = -1*float(realsp[i+Nnx*j]/Nnx/Nny);
-      }
+    static void execute_r2c(plan p,double *in,complex *out){fftw_execute_dft_r2c(p,in,out);}
+    static void execute_c2r(plan p,complex *in,double *out){fftw_execute_dft_c2r(p,in,out);}
+    static void execute_dft(plan p,complex *in,complex *out){fftw_execute_dft(p,in,out);}
+    static void *malloc(size_t n){return fftw_malloc(n);}
+    static void free(void *p){fftw_free(p);}
+  };
+
+#ifdef ENABLE_FFTWF
+  template<> struct FFTWPrecision<float>{
+    typedef fftwf_complex complex;
+    typedef fftwf_plan plan;
+    static plan r2c(int n,float *in,complex *out,unsigned flags){
+      return fftwf_plan_many_dft_r2c(1,&n,1,in,NULL,1,2*(n/2+1),out,NULL,1,n/2+1,flags);
     }
-  }
-  
-  // alpha2
-  {
-    
-    // build modes for each pixel in the fourier space
-    for( int i=0; i<Nnx/2+1; i++ ){
-      double kx=double(i);
-      kx=kx*2.*M_PI/Nboxlx;
-      for( int j=0; j<Nny; j++ ){
-        double ky=(j<Nny/2)?double(j):double(j-Nny);
-        ky=ky*2.*M_PI/Nboxly;
-        
-        // alpha
-        fft[i+(Nnx/2+1)*j][0] = -ky*fphi[i+(Nnx/2+1)*j][1];
-        fft[i+(Nnx/2+1)*j][1] =  ky*fphi[i+(Nnx/2+1)*j][0];
-        
-      }
+    static plan c2r(int n,complex *in,float *out,unsigned flags){
+      return fftwf_plan_many_dft_c2r(1,&n,1,in,NULL,1,n/2+1,out,NULL,1,2*(n/2+1),flags);
     }
-    
-    //pp=fftw_plan_dft_c2r_2d(Nny,Nnx,fft,realsp,FFTW_ESTIMATE);
-    fftw_execute( pp );
-    //fftw_destroy_plan(pp);
-    
-    map->alpha2.resize(map->nx*map->ny);
-    
-    for( int j=Nny/2-map->ny/2; j<Nny/2+map->ny/2; j++ ){
-      for( int i=Nnx/2-map->nx/2; i<Nnx/2+map->nx/2; i++ ){
-        int ii = i-int(Nnx/2-map->nx/2);
-        int jj = j-int(Nny/2-map->ny/2);
-        
-        map->alpha2[ii+map->nx*jj] = -1*float(realsp[i+Nnx*j]/Nnx/Nny);
-      }
+    static plan columns(int n,int howmany,int stride,complex *c,int sign,unsigned flags){
+      return fftwf_plan_many_dft(1,&n,howmany,c,NULL,stride,1,c,NULL,stride,1,sign,flags);
     }
+    static void execute_r2c(plan p,float *in,complex *out){fftwf_execute_dft_r2c(p,in,out);}
+    static void execute_c2r(plan p,complex *in,float *out){fftwf_execute_dft_c2r(p,in,out);}
+    static void execute_dft(plan p,complex *in,complex *out){fftwf_execute_dft(p,in,out);}
+    static void *malloc(size_t n){return fftwf_malloc(n);}
+    static void free(void *p){fftwf_free(p);}
+  };
+#endif
+
+  const int mass_map_column_block = 16;
+
+  /** \brief In place plans for one padded map size.
+   *
+   * They are made once with FFTW_MEASURE and reused for every map of that size.  They are
+   * planned for unaligned arrays so that they can be run on any row or block of columns
+   * through the new-array interface from several threads.
+   */
+  template<typename T>
+  struct MassMapPlans{
+    typename FFTWPrecision<T>::plan row_forward,row_backward;
+    typename FFTWPrecision<T>::plan block_forward,block_backward;
+    typename FFTWPrecision<T>::plan column_forward,column_backward;
+  };
+
+  template<typename T>
+  const MassMapPlans<T> &mass_map_plans(int Nnx,int Nny){
+    typedef FFTWPrecision<T> F;
+    static std::map<std::pair<int,int>,MassMapPlans<T> > cache;
+
+    std::lock_guard<std::mutex> lock(Utilities::FFTWPlannerMutex());
+    auto it = cache.find(std::make_pair(Nnx,Nny));
+    if(it != cache.end()) return it->second;
+
+    MassMapPlans<T> &p = cache[std::make_pair(Nnx,Nny)];
+    int H = Nnx/2 + 1;
+    unsigned flags = FFTW_MEASURE | FFTW_UNALIGNED;
+    typename F::complex *c = (typename F::complex *)F::malloc(sizeof(typename F::complex)*H*Nny);
+
+    p.row_forward = F::r2c(Nnx,(T *)c,c,flags);
+    p.row_backward = F::c2r(Nnx,c,(T *)c,flags);
+    p.block_forward = F::columns(Nny,mass_map_column_block,H,c,FFTW_FORWARD,flags);
+    p.block_backward = F::columns(Nny,mass_map_column_block,H,c,FFTW_BACKWARD,flags);
+    p.column_forward = F::columns(Nny,1,H,c,FFTW_FORWARD,flags);
+    p.column_backward = F::columns(Nny,1,H,c,FFTW_BACKWARD,flags);
+
+    F::free(c);
+    return p;
   }
-  // gamma1
-  {
-    
-    // build modes for each pixel in the fourier space
-    for( int i=0; i<Nnx/2+1; i++ ){
-      double kx=double(i);
-      kx=kx*2.*M_PI/Nboxlx;
-      for( int j=0; j<Nny; j++ ){
-        double ky=(j<Nny/2)?double(j):double(j-Nny);
-        ky=ky*2.*M_PI/Nboxly;
-        
-        // gamma
-        fft[i+(Nnx/2+1)*j][0] = 0.5*(kx*kx-ky*ky)*fphi[i+(Nnx/2+1)*j][0];
-        fft[i+(Nnx/2+1)*j][1] = 0.5*(kx*kx-ky*ky)*fphi[i+(Nnx/2+1)*j][1];
-        
+
+  /// in place transform of all the columns of a H x Nny complex array
+  template<typename T>
+  void mass_map_columns(const MassMapPlans<T> &p,typename FFTWPrecision<T>::complex *c,int H,bool forward){
+    typedef FFTWPrecision<T> F;
+    size_t Nblocks = H/mass_map_column_block;
+    typename F::plan block = forward ? p.block_forward : p.block_backward;
+    typename F::plan column = forward ? p.column_forward : p.column_backward;
+
+    Utilities::ThreadPool::get().parallel_for(Nblocks,1,[&](size_t start,size_t end){
+      for(size_t b = start ; b < end ; ++b)
+        F::execute_dft(block,c + b*mass_map_column_block,c + b*mass_map_column_block);
+    });
+    for(int k = Nblocks*mass_map_column_block ; k < H ; ++k) F::execute_dft(column,c + k,c + k);
+  }
+
+  /** \brief Deflection, shear and potential of the convergence in map on a Nnx x Nny zero padded grid
+   *
+   * Two complex H x Nny arrays are used, both in place.  One holds the transform of the
+   * potential and the other each of the outputs in turn.  Rows that are all padding are not
+   * transformed going forward and only the rows covering the map are transformed back.
+   */
+  template<typename T>
+  void mass_map_fft(MOKAmap *map,int Nnx,int Nny,double Nboxlx,double Nboxly){
+    typedef FFTWPrecision<T> F;
+    typedef typename F::complex complex;
+
+    const MassMapPlans<T> &p = mass_map_plans<T>(Nnx,Nny);
+    Utilities::ThreadPool &pool = Utilities::ThreadPool::get();
+    size_t batch = std::max<size_t>(1,Nny/(4*pool.size()));
+
+    int H = Nnx/2 + 1;
+    int nx = map->nx,ny = map->ny;
+    int i0 = Nnx/2 - nx/2,j0 = Nny/2 - ny/2;
+    size_t Nc = (size_t)H*Nny;
+
+    complex *fphi = (complex *)F::malloc(sizeof(complex)*Nc);
+    complex *fft = (complex *)F::malloc(sizeof(complex)*Nc);
+
+    // transform of the padded convergence
+    pool.parallel_for(Nny,batch,[&](size_t start,size_t end){
+      for(size_t j = start ; j < end ; ++j){
+        complex *row = fphi + j*H;
+        T *real_row = (T *)row;
+        if((int)j < j0 || (int)j >= j0 + ny){
+          for(int i = 0 ; i < H ; ++i) row[i][0] = row[i][1] = 0;
+          continue;
+        }
+        std::fill(real_row,real_row + 2*H,T(0));
+        for(int ii = 0 ; ii < nx ; ++ii) real_row[i0 + ii] = map->convergence[ii + nx*(j - j0)];
+        F::execute_r2c(p.row_forward,real_row,row);
       }
-    }
-    
-    //pp=fftw_plan_dft_c2r_2d(Nny,Nnx,fft,realsp,FFTW_ESTIMATE);
-    fftw_execute( pp );
-    //fftw_destroy_plan(pp);
-    
-    map->gamma1.resize(map->nx*map->ny);
-    
-    for( int j=Nny/2-map->ny/2; j<Nny/2+map->ny/2; j++ ){
-      for( int i=Nnx/2-map->nx/2; i<Nnx/2+map->nx/2; i++ ){
-        int ii = i-int(Nnx/2-map->nx/2);
-        int jj = j-int(Nny/2-map->ny/2);
-        
-        map->gamma1[ii+map->nx*jj] = float( realsp[i+Nnx*j]/Nnx/Nny);
-        
+    });
+    mass_map_columns<T>(p,fphi,H,true);
+
+    // potential, null for k2 = 0 so there is no divergence
+    pool.parallel_for(Nny,batch,[&](size_t start,size_t end){
+      for(size_t j = start ; j < end ; ++j){
+        double ky = ((j < (size_t)Nny/2) ? double(j) : double(j) - Nny)*2.*M_PI/Nboxly;
+        for(int i = 0 ; i < H ; ++i){
+          double kx = i*2.*M_PI/Nboxlx;
+          double k2 = kx*kx + ky*ky;
+          complex &f = fphi[i + H*j];
+          if(k2 == 0){
+            f[0] = f[1] = 0;
+          }else{
+            f[0] = -2.*f[0]/k2;
+            f[1] = -2.*f[1]/k2;
+          }
+        }
       }
+    });
+
+    /* each output is the inverse transform of factor(kx,ky)*fphi, multiplied by i if
+       imaginary is set, times sign */
+    struct Output{
+      std::valarray<double> *values;
+      bool imaginary;
+      double sign;
+      std::function<double(double,double)> factor;
+    };
+    Output outputs[] = {
+      {&map->alpha1,true,-1.,[](double kx,double){return kx;}}
+      ,{&map->alpha2,true,-1.,[](double,double ky){return ky;}}
+      ,{&map->gamma1,false,1.,[](double kx,double ky){return 0.5*(kx*kx - ky*ky);}}
+      ,{&map->gamma2,false,-1.,[](double kx,double ky){return kx*ky;}}
+      ,{&map->phi,false,1.,[](double,double){return 1.;}}
+    };
+
+    for(Output &out : outputs){
+      pool.parallel_for(Nny,batch,[&](size_t start,size_t end){
+        for(size_t j = start ; j < end ; ++j){
+          double ky = ((j < (size_t)Nny/2) ? double(j) : double(j) - Nny)*2.*M_PI/Nboxly;
+          for(int i = 0 ; i < H ; ++i){
+            double f = out.factor(i*2.*M_PI/Nboxlx,ky);
+            const complex &in = fphi[i + H*j];
+            if(out.imaginary){
+              fft[i + H*j][0] = -f*in[1];
+              fft[i + H*j][1] = f*in[0];
+            }else{
+              fft[i + H*j][0] = f*in[0];
+              fft[i + H*j][1] = f*in[1];
+            }
+          }
+        }
+      });
+      mass_map_columns<T>(p,fft,H,false);
+
+      double norm = out.sign/Nnx/Nny;
+      out.values->resize(nx*ny);
+      pool.parallel_for(ny,std::max<size_t>(1,ny/(4*pool.size())),[&](size_t start,size_t end){
+        for(size_t jj = start ; jj < end ; ++jj){
+          complex *row = fft + (j0 + jj)*H;
+          T *real_row = (T *)row;
+          F::execute_c2r(p.row_backward,row,real_row);
+          for(int ii = 0 ; ii < nx ; ++ii) (*out.values)[ii + nx*jj] = norm*real_row[i0 + ii];
+        }
+      });
     }
+
+    F::free(fft);
+    F::free(fphi);
   }
-  // gamma2
-  {
-    
-    // build modes for each pixel in the fourier space
-    for( int i=0; i<Nnx/2+1; i++ ){
-      double kx=double(i);
-      kx=kx*2.*M_PI/Nboxlx;
-      for( int j=0; j<Nny; j++ ){
-        double ky=(j<Nny/2)?double(j):double(j-Nny);
-        ky=ky*2.*M_PI/Nboxly;
-        
-        // gamma
-        fft[i+(Nnx/2+1)*j][0] = kx*ky*fphi[i+(Nnx/2+1)*j][0];
-        fft[i+(Nnx/2+1)*j][1] = kx*ky*fphi[i+(Nnx/2+1)*j][1];
-        
-      }
+}
+#endif
+
+/**
+ * \brief pre-process sourface mass density map computing deflection angles, shear and potential in FFT,
+ *  generalized to work with rectangular maps
+ *
+ * The transforms are done in place, split over rows and columns on the thread pool, with plans
+ * that are kept for all the maps of the same size.  The work arrays take 2*zerosize^2 times the
+ * map size in double, or float if fft_float is set and the library is compiled with
+ * ENABLE_FFTWF.  If fft_max_memory (in MB) is set and this would exceed it single precision is
+ * tried and then the padding is reduced.
+ */
+
+void LensHaloMassMap::PreProcessFFTWMap(){
+#ifdef ENABLE_FFTW
+  int pad = zerosize;
+  bool single = fft_float;
+#ifndef ENABLE_FFTWF
+  if(single){
+    std::cerr << "LensHaloMassMap::PreProcessFFTWMap(): single precision FFTs need ENABLE_FFTWF, using double" << std::endl;
+    single = false;
+  }
+#endif
+  
+  // bytes taken by the two work arrays
+  auto work_memory = [&](int pad,bool single){
+    return 2*sizeof(double)*(single ? 1 : 2)*(double)(pad*map->nx/2 + 1)*(pad*map->ny);
+  };
+  
+  if(fft_max_memory > 0){
+    double max_memory = fft_max_memory*1024.*1024.;
+#ifdef ENABLE_FFTWF
+    if(!single && work_memory(pad,false) > max_memory){
+      std::cerr << "LensHaloMassMap::PreProcessFFTWMap(): using single precision FFTs to stay within " << fft_max_memory << " MB" << std::endl;
+      single = true;
     }
-    
-    //pp=fftw_plan_dft_c2r_2d(Nny,Nnx,fft,realsp,FFTW_ESTIMATE);
-    fftw_execute( pp );
-    //fftw_destroy_plan(pp);
-    
-    map->gamma2.resize(map->nx*map->ny);
-    
-    for( int j=Nny/2-map->ny/2; j<Nny/2+map->ny/2; j++ ){
-      for( int i=Nnx/2-map->nx/2; i<Nnx/2+map->nx/2; i++ ){
-        int ii = i-int(Nnx/2-map->nx/2);
-        int jj = j-int(Nny/2-map->ny/2);
-        
-        map->gamma2[ii+map->nx*jj] = float(-realsp[i+Nnx*j]/Nnx/Nny);
-        
-      }
+#endif
+    if(work_memory(pad,single) > max_memory){
+      while(pad > 1 && work_memory(pad,single) > max_memory) --pad;
+      std::cerr << "LensHaloMassMap::PreProcessFFTWMap(): zero padding reduced from " << zerosize << " to " << pad
+      << " to stay within " << fft_max_memory << " MB" << std::endl;
+    }
+    if(work_memory(pad,single) > max_memory){
+      ERROR_MESSAGE();
+      throw std::runtime_error("LensHaloMassMap::PreProcessFFTWMap(): map too large for pixelmaps_fft_memory");
     }
   }
   
-  /*
-   double *phi    = new double[Nnx*Nny];
-   fftw_plan pp;
-   pp=fftw_plan_dft_c2r_2d(Nny,Nnx,fphi,phi,FFTW_ESTIMATE);
-   fftw_execute( pp );
-   fftw_destroy_plan(pp);
-   delete[] phi;
-   */
+  // size of the new map in x and y directions, factor by which each size is increased
+  int Nnx=int(pad*map->nx);
+  int Nny=int(pad*map->ny);
+  double Nboxlx = map->boxlMpc*pad;
+  double Nboxly = map->boxlMpc*pad/map->nx*map->ny;
   
-  // std:: cout << " remapping the map in the original size " << std:: endl;
-  delete[] fft;
-  delete[] realsp;
-  delete[] fphi;
+#ifdef ENABLE_FFTWF
+  if(single){
+    mass_map_fft<float>(map,Nnx,Nny,Nboxlx,Nboxly);
+    return;
+  }
+#endif
+  mass_map_fft<double>(map,Nnx,Nny,Nboxlx,Nboxly);
 #endif
 }
-
-
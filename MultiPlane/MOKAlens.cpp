@@ -63,10 +63,11 @@ void cmass(int n, std::valarray<double> map, std:: vector<double> x, double &xcm
  * \brief loads a mass map from a given filename
  */
 
-LensHaloMassMap::LensHaloMassMap(const std::string& filename, PixelMapType my_maptype,int pixel_map_zeropad,bool my_zeromean, const COSMOLOGY& lenscosmo)
+LensHaloMassMap::LensHaloMassMap(const std::string& filename, PixelMapType my_maptype,int pixel_map_zeropad,bool my_zeromean, const COSMOLOGY& lenscosmo,bool my_fft_float,size_t my_fft_max_memory)
 : LensHalo(),
 MOKA_input_file(filename), flag_MOKA_analyze(0), flag_background_field(0),
 maptype(my_maptype), cosmo(lenscosmo),zerosize(pixel_map_zeropad),zeromean(my_zeromean)
+,fft_float(my_fft_float),fft_max_memory(my_fft_max_memory)
 {
   initMap();
  	
@@ -87,9 +88,12 @@ LensHaloMassMap::LensHaloMassMap(
                                  ,int pixel_map_zeropad    /// factor by which to zero pad in FFTs, ex. 4
                                  ,bool my_zeromean         /// if true, subtracts average density
                                  ,const COSMOLOGY& lenscosmo  /// cosmology
+                                 ,bool my_fft_float           /// do the FFTs in single precision (needs ENABLE_FFTWF)
+                                 ,size_t my_fft_max_memory    /// limit in MB on the FFT work arrays, 0 for none
 )
 :LensHalo()
 , flag_MOKA_analyze(0), flag_background_field(0),maptype(pix_map),cosmo(lenscosmo),zerosize(pixel_map_zeropad),zeromean(my_zeromean)
+,fft_float(my_fft_float),fft_max_memory(my_fft_max_memory)
 {
   rscale = 1.0;
 
@@ -267,6 +271,8 @@ void LensHaloMassMap::initMap()
     // not needed for now does all in MOKAfits.cpp
     // convertmap(map,maptype);
   }
+  
+  interleaveMaps();
 }
 
 void LensHaloMassMap::convertmap(MOKAmap *map,PixelMapType maptype){
@@ -364,6 +370,7 @@ void LensHaloMassMap::setMap(
   exit(1);
 #endif
   
+  interleaveMaps();
 }
 
 /** \brief checks the cosmology against the MOKA map parameters
@@ -407,6 +414,11 @@ void LensHaloMassMap::assignParams(InputParams& params)
   zeromean = true;
   zerosize = 4;  /// not really used
   maptype = moka;
+  
+  if(!params.get("pixelmaps_fft_float",fft_float))
+    fft_float = false;
+  if(!params.get("pixelmaps_fft_memory",fft_max_memory))
+    fft_max_memory = 0;
 }
 
 /**
@@ -415,6 +427,7 @@ void LensHaloMassMap::assignParams(InputParams& params)
  * of the convergence
  */
 void LensHaloMassMap::saveImage(GridHndl grid,bool saveprofiles){
+  restoreMaps();
   std::stringstream f;
   std::string filename;
   
@@ -467,6 +480,7 @@ void LensHaloMassMap::saveImage(GridHndl grid,bool saveprofiles){
  * computing and saving the radial profile of the convergence, reduced tangential and parallel shear and of the shear
  *  */
 void LensHaloMassMap::saveProfiles(double &RE3,double &xxc,double &yyc){
+  restoreMaps();
   /* measuring the differential and cumulative profile*/
   double xmin = -map->boxlMpc*0.5;
   double xmax =  map->boxlMpc*0.5;
@@ -653,38 +667,145 @@ void LensHaloMassMap::force_halo(double *alpha
    */
   
   // interpolate from the maps
+  if(!sample(xx,alpha,kappa,gamma,phi)){
+    alpha[0] = alpha[1] = 0.0;
+    gamma[0] = gamma[1] = gamma[2] = 0.0;
+    *kappa = 0.0;
+    *phi = 0.0;
+  }
   
-  Utilities::Interpolator<valarray<double> > interp(xx,map->nx,map->boxlMpc,map->ny
-                                                    ,map->ny*map->boxlMpc/map->nx,map->center);
+  return;
+}
 
-  assert(map->nx == map->ny);
-  
-  size_t N = map->nx * map->ny;
+/// same as LensHalo::force_halo_batch() but with the rays sampling the map directly
+void LensHaloMassMap::force_halo_batch(PlaneForceBatch &batch,PosType const *x_halo)
+{
+  PosType alpha[2],x[2];
+  KappaType kappa,gamma[3],phi;
   
-  map->convergence.size();
+  for(size_t k = 0, n = batch.size(); k < n; ++k){
+    x[0] = batch.x[0][k] - x_halo[0];
+    x[1] = batch.x[1][k] - x_halo[1];
+    
+    if(!sample(x,alpha,&kappa,gamma,&phi)) continue;
+    
+    batch.alpha[0][k] -= alpha[0];
+    batch.alpha[1][k] -= alpha[1];
+    batch.kappa[k] += kappa;
+    batch.gamma[0][k] += gamma[0];
+    batch.gamma[1][k] += gamma[1];
+    batch.phi[k] += phi;
+  }
+}
+
+/** \brief moves the maps into samples so that the values needed for a pixel are in one place
+ *
+ * Must be called whenever the maps change.  The maps in MOKAmap are released
+ * afterwards, restoreMaps() gets them back for the analysis routines.
+ */
+void LensHaloMassMap::interleaveMaps()
+{
+  long nx = map->nx,ny = map->ny;
+  sample_tiles_x = (nx + sample_tile - 1)/sample_tile;
+  long tiles_y = (ny + sample_tile - 1)/sample_tile;
+  
+  samples.assign(sample_tiles_x*tiles_y*sample_tile*sample_tile*sample_fields,0);
+  
+  for(long j = 0 ; j < ny ; ++j){
+    for(long i = 0 ; i < nx ; ++i){
+      KappaType *s = &samples[sample_index(i,j)];
+      long index = i + nx*j;
+      s[0] = map->alpha1[index];
+      s[1] = map->alpha2[index];
+      s[2] = map->gamma1[index];
+      s[3] = map->gamma2[index];
+      s[4] = map->convergence[index];
+      s[5] = map->phi[index];
+    }
+  }
   
-  assert(map->alpha1.size() == N);
-  assert(map->alpha2.size() == N);
-  assert(map->gamma1.size() == N);
-  assert(map->gamma2.size() == N);
-  assert(map->convergence.size() == N);
-  assert(map->phi.size() == N);
+  map->alpha1.resize(0);
+  map->alpha2.resize(0);
+  map->gamma1.resize(0);
+  map->gamma2.resize(0);
+  map->convergence.resize(0);
+  map->phi.resize(0);
+}
+
+/** \brief refills the maps in MOKAmap from samples if interleaveMaps() has released them
+ */
+void LensHaloMassMap::restoreMaps()
+{
+  long nx = map->nx,ny = map->ny;
+  if(map->convergence.size() == (size_t)(nx*ny) || samples.size() == 0) return;
+  
+  map->alpha1.resize(nx*ny);
+  map->alpha2.resize(nx*ny);
+  map->gamma1.resize(nx*ny);
+  map->gamma2.resize(nx*ny);
+  map->convergence.resize(nx*ny);
+  map->phi.resize(nx*ny);
+  
+  for(long j = 0 ; j < ny ; ++j){
+    for(long i = 0 ; i < nx ; ++i){
+      const KappaType *s = &samples[sample_index(i,j)];
+      long index = i + nx*j;
+      map->alpha1[index] = s[0];
+      map->alpha2[index] = s[1];
+      map->gamma1[index] = s[2];
+      map->gamma2[index] = s[3];
+      map->convergence[index] = s[4];
+      map->phi[index] = s[5];
+    }
+  }
+}
 
-  alpha[0] = interp.interpolate(map->alpha1);
-  alpha[1] = interp.interpolate(map->alpha2);
-  gamma[0] = interp.interpolate(map->gamma1);
-  gamma[1] = interp.interpolate(map->gamma2);
+/** \brief bilinear interpolation of all the quantities at x from samples
+ *
+ * The pixel grid is the same as in Utilities::Interpolator.  Returns false without
+ * touching the outputs if x is off the map.
+ */
+bool LensHaloMassMap::sample(PosType const *x,PosType *alpha,KappaType *kappa,KappaType *gamma,KappaType *phi) const
+{
+  long nx = map->nx,ny = map->ny;
+  PosType range_y = ny*map->boxlMpc/nx;
+  
+  // position in pixel units
+  PosType fx = ((x[0] - map->center[0])/map->boxlMpc + 0.5)*(nx-1);
+  PosType fy = ((x[1] - map->center[1])/range_y + 0.5)*(ny-1);
+  if(fx < 0. || fx > nx-1 || fy < 0. || fy > ny-1) return false;
+  
+  long ix = (long)fx,iy = (long)fy;
+  if(ix == nx-1) ix = nx-2;
+  if(iy == ny-1) iy = ny-2;
+  fx -= ix;
+  fy -= iy;
+  
+  const KappaType *s00 = &samples[sample_index(ix,iy)];
+  const KappaType *s10 = &samples[sample_index(ix+1,iy)];
+  const KappaType *s01 = &samples[sample_index(ix,iy+1)];
+  const KappaType *s11 = &samples[sample_index(ix+1,iy+1)];
+  PosType w00 = (1-fx)*(1-fy),w10 = fx*(1-fy),w01 = (1-fx)*fy,w11 = fx*fy;
+  
+  PosType v[sample_fields];
+  for(int f = 0 ; f < sample_fields ; ++f) v[f] = w00*s00[f] + w10*s10[f] + w01*s01[f] + w11*s11[f];
+  
+  alpha[0] = v[0];
+  alpha[1] = v[1];
+  gamma[0] = v[2];
+  gamma[1] = v[3];
   gamma[2] = 0.0;
-  *kappa = interp.interpolate(map->convergence);
-  *phi = interp.interpolate(map->phi);
+  *kappa = v[4];
+  *phi = v[5];
   
-  return;
+  return true;
 }
 
 /**
  * compute the signal of \lambda_r and \lambda_t
  */
 void LensHaloMassMap::estSignLambdas(){
+  restoreMaps();
   map->Signlambdar.resize(map->nx*map->ny);
   map->Signlambdat.resize(map->nx*map->ny);
   double gamma,lambdar,lambdat;
@@ -709,6 +830,7 @@ void LensHaloMassMap::estSignLambdas(){
  * points present at the halo center
  */
 void LensHaloMassMap::EinsteinRadii(double &RE1, double &RE2, double &xxc, double &yyc){
+  restoreMaps();
   double signV;
   //  std:: vector<double> xci1,yci1;
   std:: vector<double> xci2,yci2;
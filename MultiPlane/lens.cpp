@@ -9,6 +9,9 @@
 #include <algorithm>
 #include "lens_halos.h"
 #include <iomanip>      // std::setprecision
+#include <fstream>
+#include <cstring>
+#include <unistd.h>
 
 using namespace std;
 
@@ -36,7 +39,7 @@ namespace
  * \brief Creates an empty lens. Main halos and field halos need to be inserted by hand from the user.
  */
 Lens::Lens(long* my_seed,PosType z_source, CosmoParamSet cosmoset,bool verbose)
-: seed(my_seed), cosmo(cosmoset),zsource(z_source), central_point_sphere(1,0,0), inv_ang_screening_scale(0)
+: seed(my_seed), cosmo(cosmoset),zsource(z_source), field_planes_version(0), central_point_sphere(1,0,0), inv_ang_screening_scale(0)
 {
   init_seed = 0;
   
@@ -63,7 +66,7 @@ Lens::Lens(long* my_seed,PosType z_source, CosmoParamSet cosmoset,bool verbose)
 }
 
 Lens::Lens(long* my_seed,PosType z_source, const COSMOLOGY &cosmoset,bool verbose)
-: seed(my_seed), cosmo(cosmoset),zsource(z_source), central_point_sphere(1,0,0), inv_ang_screening_scale(0)
+: seed(my_seed), cosmo(cosmoset),zsource(z_source), field_planes_version(0), central_point_sphere(1,0,0), inv_ang_screening_scale(0)
 {
   init_seed = 0;
   
@@ -92,7 +95,7 @@ Lens::Lens(long* my_seed,PosType z_source, const COSMOLOGY &cosmoset,bool verbos
  * \brief allocates space for the halo trees and the inout lens, if there is any
  */
 Lens::Lens(InputParams& params, long* my_seed, CosmoParamSet cosmoset, bool verbose)
-: seed(my_seed), cosmo(cosmoset), central_point_sphere(1,0,0), inv_ang_screening_scale(0)
+: seed(my_seed), cosmo(cosmoset), field_planes_version(0), central_point_sphere(1,0,0), inv_ang_screening_scale(0)
 {
   
   //init_params = params;
@@ -139,6 +142,10 @@ Lens::Lens(InputParams& params, long* my_seed, CosmoParamSet cosmoset, bool verb
     if(sim_input_flag){
       // Do Nothing ! No step is necessary here !
     }
+    else if(field_snapshot_file.size() > 0 && readFieldSnapshot(field_snapshot_file,true,verbose)){
+      // the tables, plane distances and halos were read from the snapshot
+      field_snapshot_loaded = true;
+    }
     else {
       if(field_buffer == 0.0){
         field_buffer = pow(3.0e14/800/pi/cosmo.rho_crit(0),1.0/3.);
@@ -164,7 +171,7 @@ Lens::Lens(InputParams& params, long* my_seed, CosmoParamSet cosmoset, bool verb
  * \brief allocates space for the halo trees and the inout lens, if there is any
  */
 Lens::Lens(InputParams& params, long* my_seed, const COSMOLOGY &cosmoset, bool verbose)
-: seed(my_seed), cosmo(cosmoset), central_point_sphere(1,0,0), inv_ang_screening_scale(0)
+: seed(my_seed), cosmo(cosmoset), field_planes_version(0), central_point_sphere(1,0,0), inv_ang_screening_scale(0)
 {
   
   //init_params = params;
@@ -211,6 +218,10 @@ Lens::Lens(InputParams& params, long* my_seed, const COSMOLOGY &cosmoset, bool v
     if(sim_input_flag){
       // Do Nothing ! No step is necessary here !
     }
+    else if(field_snapshot_file.size() > 0 && readFieldSnapshot(field_snapshot_file,true,verbose)){
+      // the tables, plane distances and halos were read from the snapshot
+      field_snapshot_loaded = true;
+    }
     else {
       if(field_buffer == 0.0){
         field_buffer = pow(3.0e14/800/pi/cosmo.rho_crit(0),1.0/3.);
@@ -285,6 +296,9 @@ void Lens::assignParams(InputParams& params,bool verbose)
 		main_galaxy_halo_type = null_gal;
 	}
 	
+	field_snapshot_loaded = false;
+	field_seed_start = field_seed_end = 0;
+	
 	if(!params.get("redshift_planes_file",redshift_planes_file))
 		read_redshift_planes = false;
 	else
@@ -395,6 +409,10 @@ void Lens::assignParams(InputParams& params,bool verbose)
           ERROR_MESSAGE();
           std::cout << "parameter field_fov needs to be set in the parameter file " << params.filename() << endl;
           exit(0);
+        }
+        if(!params.get("field_snapshot_file",field_snapshot_file))
+        {
+          field_snapshot_file = "";
         }
 			}
 			else
@@ -408,6 +426,10 @@ void Lens::assignParams(InputParams& params,bool verbose)
 					exit(0);
         }
         
+        if(!params.get("field_input_simulation_cache",field_input_sim_cache)){
+          field_input_sim_cache = true;
+        }
+        
         if(!params.get("field_input_simulation_center_RA",central_point_sphere.phi)){
           central_point_sphere.phi = 0.0;
         }else{
@@ -452,6 +474,12 @@ void Lens::assignParams(InputParams& params,bool verbose)
     }
     if(!params.get("pixelmaps_zeromean",pixel_map_zeromean)){
       pixel_map_zeromean = true;
+    }
+    if(!params.get("pixelmaps_fft_float",pixel_map_fft_float)){
+      pixel_map_fft_float = false;
+    }
+    if(!params.get("pixelmaps_fft_memory",pixel_map_fft_memory)){
+      pixel_map_fft_memory = 0;
     }
 	}
 	
@@ -468,6 +496,18 @@ void Lens::assignParams(InputParams& params,bool verbose)
   if(!params.get("lensing_off",flag_switch_lensing_off))
 		flag_switch_lensing_off = false;
   
+  if(!params.get("plane_major_shooting",flag_plane_major))
+		flag_plane_major = false;
+  
+  if(!params.get("fmm_shooting",flag_fmm))
+		flag_fmm = false;
+  
+  if(!params.get("field_theta_force",field_theta_force))
+		field_theta_force = 0.1;
+  
+  if(!params.get("field_expansion_order",field_expansion_order))
+		field_expansion_order = 2;
+  
 	// Some checks for valid parameters
 	if(flag_switch_field_off == false && field_Nplanes_original == 0 )
 	{
@@ -535,6 +575,8 @@ void Lens::defaultParams(PosType z_source,bool verbose)
   // toggles for testing
   flag_switch_deflection_off = false;
   flag_switch_lensing_off = false;
+  flag_plane_major = false;
+  flag_fmm = false;
 
   
   flag_switch_main_halo_on = true;
@@ -560,9 +602,15 @@ void Lens::defaultParams(PosType z_source,bool verbose)
   sim_input_flag = false;
   field_min_mass = 0;
   field_buffer = 0.0;
+  field_theta_force = 0.1;
+  field_expansion_order = 2;
   fieldofview = 0.0;
 
   field_input_sim_format = null_cat;
+  field_input_sim_cache = true;
+  field_snapshot_file = "";
+  field_snapshot_loaded = false;
+  field_seed_start = field_seed_end = 0;
   
   // spherical coordinates of center of field
   central_point_sphere.phi = 0.0;
@@ -575,6 +623,8 @@ void Lens::defaultParams(PosType z_source,bool verbose)
   pixel_map_input_file = "";
   pixel_map_zeropad = 0;
   pixel_map_zeromean = false;
+  pixel_map_fft_float = false;
+  pixel_map_fft_memory = 0;
 
   zsource = z_source;
   
@@ -583,6 +633,7 @@ void Lens::defaultParams(PosType z_source,bool verbose)
 
 void Lens::resetFieldNplanes(std::size_t Np, bool verbose)
 {
+  ++field_planes_version;
 	Utilities::delete_container(field_planes);
 	
 	field_Nplanes_original = field_Nplanes_current = Np;
@@ -601,7 +652,9 @@ void Lens::resetFieldNplanes(std::size_t Np, bool verbose)
 
 void Lens::resetFieldHalos(bool verbose)
 {
+  ++field_planes_version;
   Utilities::delete_container(field_halos);
+  field_halo_records.clear();
 	Utilities::delete_container(field_planes);
   field_Nplanes_current = field_Nplanes_original;
   field_plane_redshifts = field_plane_redshifts_original;
@@ -629,6 +682,331 @@ void Lens::resetFieldHalos(bool verbose)
 
 }
 
+namespace{
+  const char field_snapshot_magic[8] = {'G','L','F','S','N','A','P','1'};
+  const int32_t field_snapshot_version = 2;
+  
+  /// a field halo as it is stored in a snapshot
+  struct SnapshotHalo{
+    int32_t type;
+    PosType mass,Rsize,zlens,param,beta,fratio,pa;
+    PosType theta[2];
+    uint64_t id;
+  };
+  
+  template<typename T>
+  void snapshotWrite(std::ofstream &out,const T &value){
+    out.write((const char *)&value,sizeof(T));
+  }
+  template<typename T>
+  void snapshotWrite(std::ofstream &out,const std::vector<T> &vec){
+    uint64_t n = vec.size();
+    snapshotWrite(out,n);
+    if(n > 0) out.write((const char *)vec.data(),n*sizeof(T));
+  }
+  template<typename T>
+  void snapshotRead(std::ifstream &in,T &value){
+    in.read((char *)&value,sizeof(T));
+  }
+  template<typename T>
+  void snapshotRead(std::ifstream &in,std::vector<T> &vec,uint64_t max_size){
+    uint64_t n = 0;
+    snapshotRead(in,n);
+    if(!in || n > max_size){
+      in.setstate(std::ios::failbit);
+      return;
+    }
+    vec.resize(n);
+    if(n > 0) in.read((char *)vec.data(),n*sizeof(T));
+  }
+}
+
+LensHalo *Lens::makeFieldHalo(const FieldHaloRecord &record) const
+{
+  LensHalo *halo = NULL;
+  
+  switch(record.type)
+  {
+    case nfw_lens:
+      halo = new LensHaloNFW(record.mass,record.Rsize,record.zlens,record.param,record.fratio,record.pa,0);
+      break;
+    case pnfw_lens:
+      halo = new LensHaloPseudoNFW(record.mass,record.Rsize,record.zlens,record.param,record.beta,record.fratio,record.pa,0);
+      break;
+    case pl_lens:
+      halo = new LensHaloPowerLaw(record.mass,record.Rsize,record.zlens,record.beta,record.fratio,record.pa,0);
+      break;
+    case nsie_lens:
+      halo = new LensHaloRealNSIE(record.mass,record.zlens,record.param,0.0,record.fratio,record.pa,0);
+      break;
+    case dummy_lens:
+      halo = new LensHaloDummy;
+      halo->setZlens(record.zlens);
+      break;
+    case hern_lens:
+      halo = new LensHaloHernquist(record.mass,record.Rsize,record.zlens,record.param,record.fratio,record.pa,0);
+      break;
+    case jaffe_lens:
+      halo = new LensHaloJaffe(record.mass,record.Rsize,record.zlens,record.param,record.fratio,record.pa,0);
+      break;
+    default:
+      ERROR_MESSAGE();
+      std::cout << "field halo type " << record.type << " not supported." << std::endl;
+      break;
+  }
+  
+  return halo;
+}
+
+void Lens::save(const std::string &filename) const
+{
+  if(flag_switch_field_off) throw std::runtime_error("Lens::save: there are no field halos");
+  if(sim_input_flag) throw std::runtime_error("Lens::save: field halos read from a simulation catalog cannot be saved");
+  if(sigma_back_Tab.size() != field_Nplanes_original) throw std::runtime_error("Lens::save: the field planes have not been made");
+  
+  std::vector<SnapshotHalo> halos(field_halos.size());
+  for(size_t i = 0; i < field_halos.size(); ++i){
+    std::map<const LensHalo*,FieldHaloRecord>::const_iterator it = field_halo_records.find(field_halos[i]);
+    if(it == field_halo_records.end()) throw std::runtime_error("Lens::save: field halo was not drawn from the mass function");
+    
+    SnapshotHalo &halo = halos[i];
+    memset(&halo,0,sizeof(SnapshotHalo));
+    halo.type = it->second.type;
+    halo.mass = it->second.mass;
+    halo.Rsize = it->second.Rsize;
+    halo.zlens = it->second.zlens;
+    halo.param = it->second.param;
+    halo.beta = it->second.beta;
+    halo.fratio = it->second.fratio;
+    halo.pa = it->second.pa;
+    field_halos[i]->getTheta(halo.theta);
+    halo.id = field_halos[i]->getID();
+  }
+  
+  // the snapshot is written to a temporary file and then renamed so that other jobs never read a partial one
+  std::string tmpname = filename + ".tmp" + std::to_string(getpid());
+  std::ofstream out(tmpname.c_str(),std::ios::binary);
+  if(!out){
+    std::cout << "Can't open file " << tmpname << std::endl;
+    ERROR_MESSAGE();
+    throw std::runtime_error(" Cannot open file.");
+  }
+  
+  out.write(field_snapshot_magic,sizeof(field_snapshot_magic));
+  snapshotWrite(out,field_snapshot_version);
+  
+  snapshotWrite(out,(int64_t)field_seed_start);
+  snapshotWrite(out,(int64_t)field_seed_end);
+  
+  snapshotWrite(out,(PosType)cosmo.getOmega_matter());
+  snapshotWrite(out,(PosType)cosmo.getOmega_lambda());
+  snapshotWrite(out,(PosType)cosmo.gethubble());
+  
+  snapshotWrite(out,zsource);
+  snapshotWrite(out,fieldofview);
+  snapshotWrite(out,field_buffer);
+  snapshotWrite(out,field_min_mass);
+  snapshotWrite(out,mass_func_PL_slope);
+  snapshotWrite(out,inv_ang_screening_scale);
+  snapshotWrite(out,field_theta_force);
+  snapshotWrite(out,(int32_t)field_expansion_order);
+  snapshotWrite(out,(int32_t)field_mass_func_type);
+  snapshotWrite(out,(int32_t)field_int_prof_type);
+  snapshotWrite(out,(int32_t)flag_field_gal_on);
+  snapshotWrite(out,(int32_t)field_int_prof_gal_type);
+  
+  snapshotWrite(out,field_plane_redshifts_original);
+  snapshotWrite(out,field_Dl_original);
+  snapshotWrite(out,sigma_back_Tab);
+  
+  snapshotWrite(out,zbins);
+  snapshotWrite(out,NhalosbinZ);
+  snapshotWrite(out,Nhaloestot_Tab);
+  snapshotWrite(out,aveNhalosField);
+  snapshotWrite(out,Logm);
+  snapshotWrite(out,(uint64_t)NhalosbinMass.size());
+  for(const std::vector<PosType> &bins : NhalosbinMass) snapshotWrite(out,bins);
+  
+  snapshotWrite(out,halos);
+  
+  out.close();
+  if(!out || rename(tmpname.c_str(),filename.c_str()) != 0){
+    remove(tmpname.c_str());
+    std::cout << "Can't write file " << filename << std::endl;
+    ERROR_MESSAGE();
+    throw std::runtime_error(" Cannot write file.");
+  }
+}
+
+/**
+ * \brief Reads a snapshot written by Lens::save() and replaces the field halos with its halos.
+ *
+ * The cosmology and source redshift must agree with this lens.  If check_params is true the field
+ * parameters and the current seed must also agree, otherwise they are taken from the snapshot.  The seed
+ * is set to its value after the saved field halos were drawn, as if createFieldHalos() had been called.
+ * The field planes are not made.
+ */
+bool Lens::readFieldSnapshot(const std::string &filename,bool check_params,bool verbose)
+{
+  std::ifstream in(filename.c_str(),std::ios::binary);
+  if(!in) return false;
+  
+  in.seekg(0,std::ios::end);
+  const uint64_t file_size = in.tellg();
+  in.seekg(0,std::ios::beg);
+  
+  char magic[sizeof(field_snapshot_magic)];
+  int32_t version = 0;
+  in.read(magic,sizeof(magic));
+  snapshotRead(in,version);
+  if(!in || memcmp(magic,field_snapshot_magic,sizeof(magic)) != 0 || version != field_snapshot_version){
+    std::cout << filename << " is not a field snapshot of version " << field_snapshot_version << std::endl;
+    ERROR_MESSAGE();
+    throw std::runtime_error(" Bad snapshot file.");
+  }
+  
+  int64_t seed_start,seed_end;
+  snapshotRead(in,seed_start);
+  snapshotRead(in,seed_end);
+  
+  PosType Omega_matter,Omega_lambda,hubble;
+  snapshotRead(in,Omega_matter);
+  snapshotRead(in,Omega_lambda);
+  snapshotRead(in,hubble);
+  
+  PosType zs,fov,buffer,min_mass,PL_slope,screening,theta_force;
+  int32_t expansion_order,mass_func_type,prof_type,gal_on,gal_type;
+  snapshotRead(in,zs);
+  snapshotRead(in,fov);
+  snapshotRead(in,buffer);
+  snapshotRead(in,min_mass);
+  snapshotRead(in,PL_slope);
+  snapshotRead(in,screening);
+  snapshotRead(in,theta_force);
+  snapshotRead(in,expansion_order);
+  snapshotRead(in,mass_func_type);
+  snapshotRead(in,prof_type);
+  snapshotRead(in,gal_on);
+  snapshotRead(in,gal_type);
+  
+  if(!in || Omega_matter != cosmo.getOmega_matter() || Omega_lambda != cosmo.getOmega_lambda()
+     || hubble != cosmo.gethubble() || zs != zsource){
+    std::cout << filename << " was made with a different cosmology or source redshift" << std::endl;
+    ERROR_MESSAGE();
+    throw std::runtime_error(" Bad snapshot file.");
+  }
+  
+  std::vector<PosType> plane_zs,plane_Dl,sigma_back,z_bins,Nbin_z,Ntot,log_m;
+  std::vector<std::vector<PosType> > Nbin_mass;
+  PosType aveN = 0;
+  uint64_t Nsamples = 0;
+  std::vector<SnapshotHalo> halos;
+  
+  snapshotRead(in,plane_zs,file_size);
+  snapshotRead(in,plane_Dl,file_size);
+  snapshotRead(in,sigma_back,file_size);
+  snapshotRead(in,z_bins,file_size);
+  snapshotRead(in,Nbin_z,file_size);
+  snapshotRead(in,Ntot,file_size);
+  snapshotRead(in,aveN);
+  snapshotRead(in,log_m,file_size);
+  snapshotRead(in,Nsamples);
+  if(in && Nsamples <= file_size){
+    Nbin_mass.resize(Nsamples);
+    for(std::vector<PosType> &bins : Nbin_mass) snapshotRead(in,bins,file_size);
+  }else{
+    in.setstate(std::ios::failbit);
+  }
+  snapshotRead(in,halos,file_size);
+  
+  if(!in || plane_zs.size() == 0 || plane_Dl.size() != plane_zs.size() || sigma_back.size() != plane_zs.size()){
+    std::cout << filename << " is truncated or corrupted" << std::endl;
+    ERROR_MESSAGE();
+    throw std::runtime_error(" Bad snapshot file.");
+  }
+  
+  if(check_params && (fov != fieldofview || (field_buffer != 0.0 && buffer != field_buffer)
+                      || min_mass != field_min_mass || PL_slope != mass_func_PL_slope
+                      || screening != inv_ang_screening_scale || theta_force != field_theta_force
+                      || expansion_order != field_expansion_order || mass_func_type != field_mass_func_type
+                      || prof_type != field_int_prof_type || gal_on != flag_field_gal_on
+                      || (flag_field_gal_on && gal_type != field_int_prof_gal_type)
+                      || plane_zs.size() != field_Nplanes_original || seed_start != *seed)){
+    std::cout << filename << " was made with different field parameters or seed" << std::endl;
+    ERROR_MESSAGE();
+    throw std::runtime_error(" Bad snapshot file.");
+  }
+  
+  fieldofview = fov;
+  field_buffer = buffer;
+  field_min_mass = min_mass;
+  mass_func_PL_slope = PL_slope;
+  inv_ang_screening_scale = screening;
+  field_theta_force = theta_force;
+  field_expansion_order = expansion_order;
+  field_mass_func_type = (MassFuncType)mass_func_type;
+  field_int_prof_type = (LensHaloType)prof_type;
+  flag_field_gal_on = gal_on;
+  field_int_prof_gal_type = (GalaxyLensHaloType)gal_type;
+  
+  field_seed_start = seed_start;
+  field_seed_end = seed_end;
+  *seed = seed_end;
+  
+  field_Nplanes_original = field_Nplanes_current = plane_zs.size();
+  field_plane_redshifts = field_plane_redshifts_original = plane_zs;
+  field_Dl = field_Dl_original = plane_Dl;
+  sigma_back_Tab = sigma_back;
+  
+  zbins = z_bins;
+  NhalosbinZ = Nbin_z;
+  Nhaloestot_Tab = Ntot;
+  aveNhalosField = aveN;
+  Logm = log_m;
+  NhalosbinMass = Nbin_mass;
+  
+  // replace the field halos
+  ++field_planes_version;
+  Utilities::delete_container(field_planes);
+  Utilities::delete_container(field_halos);
+  field_halo_records.clear();
+  
+  field_halos.reserve(halos.size());
+  for(const SnapshotHalo &stored : halos){
+    FieldHaloRecord record = {(LensHaloType)stored.type,stored.mass,stored.Rsize,stored.zlens
+      ,stored.param,stored.beta,stored.fratio,stored.pa};
+    LensHalo *halo = makeFieldHalo(record);
+    if(halo == NULL) throw std::runtime_error("Lens: unsupported halo type in field snapshot");
+    
+    halo->setTheta(stored.theta[0],stored.theta[1]);
+    halo->setID(stored.id);
+    field_halos.push_back(halo);
+    field_halo_records[halo] = record;
+  }
+  
+  if(verbose) std::cout << field_halos.size() << " field halos read from " << filename << std::endl;
+  
+  return true;
+}
+
+void Lens::load(const std::string &filename,bool verbose)
+{
+  if(!readFieldSnapshot(filename,false,verbose)){
+    std::cout << "Can't open file " << filename << std::endl;
+    ERROR_MESSAGE();
+    throw std::runtime_error(" Cannot open file.");
+  }
+  flag_switch_field_off = false;
+  sim_input_flag = false;
+  
+  createFieldPlanes(verbose);
+  combinePlanes(verbose);
+  
+  if(WasInsertSubStructuresCalled == YES){
+    WasInsertSubStructuresCalled = MAYBE ;
+  }
+}
+
 void Lens::printMultiLens(){
 	std::cout << endl << "MAIN HALOS" << endl;
 	std::cout << "Main lens profile type:" << endl;
@@ -801,6 +1179,7 @@ void Lens::setupFieldPlanes()
  */
 void Lens::createFieldPlanes(bool verbose)
 {
+  ++field_planes_version;
 	if(verbose) std::cout << "Lens::createFieldPlanes zsource = " << zsource << std::endl;
     
 	assert(field_plane_redshifts.size() == field_Nplanes_original);
@@ -808,6 +1187,10 @@ void Lens::createFieldPlanes(bool verbose)
 	// the bounds for sorting field halos onto redshifts
 	PosType z1 = 0, z2 = 0;
 	std::size_t k1 = 0, k2 = 0;
+  
+  // the range of halos, background density and screening scale of each plane
+  std::vector<std::size_t> first(field_Nplanes_original),last(field_Nplanes_original);
+  std::vector<PosType> sigma_backs(field_Nplanes_original),screenings(field_Nplanes_original);
 	
   //for(size_t i=0;i<field_halos.size()-1;++i)
   //  assert(field_halos[i]->getZlens() <= field_halos[i+1]->getZlens());
@@ -877,20 +1260,31 @@ void Lens::createFieldPlanes(bool verbose)
       << " from sum of halos " << sb << " " << sb/sigma_back - 1 << std::endl;
 		if(sim_input_flag) sigma_back = sb;
 		//sigma_back = sb;
-		/*
-		 * create the lensing plane
-		 */
-		
 		if(verbose) std::cout << "  Building lensing plane " << i << " number of halos: "
       << k2-k1 << std::endl;
 		
     PosType tmp = inv_ang_screening_scale*(1+field_plane_redshifts[i])/field_Dl[i];
     
     if(tmp > 1/2.) tmp = 1/2.;  // TODO: Try to remove this arbitrary minimum distance
-		field_planes.push_back(new LensPlaneTree(&field_halos[k1], k2-k1, sigma_back,tmp));
-		//field_planes.push_back(new LensPlaneTree(&halo_pos[k1], &field_halos[k1], k2-k1, sigma_back) );
+    
+    first[i] = k1;
+    last[i] = k2;
+    sigma_backs[i] = sigma_back;
+    screenings[i] = tmp;
 	}
   
+	/*
+	 * create the lensing planes, each tree is built on its own thread and large trees use more threads
+	 */
+  std::vector<LensPlane*> planes(field_Nplanes_original);
+  Utilities::ThreadPool::get().parallel_for(field_Nplanes_original,1,[&](size_t start,size_t end){
+    for(size_t i = start; i < end; ++i){
+      planes[i] = new LensPlaneTree(&field_halos[first[i]], last[i]-first[i], sigma_backs[i],screenings[i]
+                                    ,field_theta_force,field_expansion_order);
+    }
+  });
+  field_planes.insert(field_planes.end(),planes.begin(),planes.end());
+  
 	assert(field_planes.size() == field_Nplanes_original);
 }
 
@@ -910,6 +1304,7 @@ void Lens::insertSubstructures(PosType Rregion,           // in radians
                                bool verbose
                                )
 {
+  ++field_planes_version;
   substructure.alpha = alpha;
   substructure.center.x[0] = center[0];
   substructure.center.x[1] = center[1];
@@ -1102,6 +1497,7 @@ void Lens::insertSubstructures(PosType Rregion,           // in radians
 
 
 void Lens::resetSubstructure(bool verbose){
+  ++field_planes_version;
 
   // test of whether insertSubstructures has been called :
   if(WasInsertSubStructuresCalled == NO)
@@ -1646,6 +2042,8 @@ void Lens::createFieldHalos(bool verbose)
   PosType r200=0, r_half_stel_mass=0;
   size_t haloid=0;
   
+  field_seed_start = *seed;
+  
   if (field_min_mass < 1.0e5) {
     std::cout << "Are you sure you want the minimum field halo mass to be " << field_min_mass << " Msun?" << std::endl;
     throw;
@@ -1656,11 +2054,19 @@ void Lens::createFieldHalos(bool verbose)
   
   // assign redshifts to field_halos according to the redshift distribution
   
-  int Nhalos = static_cast<std::size_t>(poidev(float(aveNhalosField), seed));
+  // each halo draws from its own substream so the field does not depend on the order in which it is made
+  Utilities::RandomNumbers_Philox ran(seed);
+  
+  int Nhalos = static_cast<std::size_t>(ran.poisson(aveNhalosField));
 
-  for(int i=0;i < Nhalos;++i){
-    halo_zs_vec.push_back(Utilities::InterpolateYvec(NhalosbinZ,zbins,ran2(seed)));
-  }
+  // the redshifts come from one stream that each thread seeks into
+  const Utilities::RandomNumbers_Philox z_ran = ran.substream(0);
+  halo_zs_vec.resize(Nhalos);
+  Utilities::ThreadPool::get().parallel_for(Nhalos,4096,[&](size_t first,size_t last){
+    Utilities::RandomNumbers_Philox my_ran = z_ran;
+    my_ran.seek(first);
+    for(size_t k=first;k<last;++k) halo_zs_vec[k] = Utilities::InterpolateYvec(NhalosbinZ,zbins,my_ran());
+  });
   
   if(verbose){
     std::cout << "redshift distribution function" << std::endl;
@@ -1702,10 +2108,11 @@ void Lens::createFieldHalos(bool verbose)
     }
     
 		for(i = k1; i < k2; i++){
+      Utilities::RandomNumbers_Philox halo_ran = ran.substream(i+1);
 			PosType Ds = cosmo.angDist(0,halo_zs_vec[i]);
       
 			maxr = pi*sqrt(fieldofview/pi)/180. + field_buffer/Ds; // fov is a circle
-			rr = maxr*sqrt(ran2(seed));
+			rr = maxr*sqrt(halo_ran());
       
       if(verbose) std::cout << "          maxr = " << maxr << std::endl;
 
@@ -1713,13 +2120,13 @@ void Lens::createFieldHalos(bool verbose)
       
 			theta_pos = new PosType[3];
       
-			theta = 2*pi*ran2(seed);
+			theta = 2*pi*halo_ran();
       
 			theta_pos[0] = rr*cos(theta);//*Ds;
 			theta_pos[1] = rr*sin(theta);//*Ds;
 			theta_pos[2] = 0.0;
       
-      float mass = pow(10,Utilities::InterpolateYvec(NhalosbinMass[np],Logm,ran2 (seed)));
+      float mass = pow(10,Utilities::InterpolateYvec(NhalosbinMass[np],Logm,halo_ran()));
       
 			halo_calc->reset(mass,halo_zs_vec[i]);
       
@@ -1743,56 +2150,43 @@ void Lens::createFieldHalos(bool verbose)
         field_galaxy_mass_fraction = 0;
       }
       
+      FieldHaloRecord record;
+      record.type = field_int_prof_type;
+      record.mass = mass*(1-field_galaxy_mass_fraction);
+      record.Rsize = Rsize;
+      record.zlens = halo_zs_vec[i];
+      record.param = 0;
+      record.beta = 1.0;
+      record.fratio = 1.0;
+      record.pa = 0;
+      
 			switch(field_int_prof_type)
 			{
-				case null_lens:
-					ERROR_MESSAGE();
-					std::cout << "field_int_prof_type is null!!!!" << std::endl;
-					break;
 				case nfw_lens:
-					//field_halos.push_back(new LensHaloNFW);
-          field_halos.push_back(new LensHaloNFW(mass*(1-field_galaxy_mass_fraction),Rsize,halo_zs_vec[i],Rsize/rscale,1.0,0,0));
+          record.param = Rsize/rscale;
 					break;
 				case pnfw_lens:
-					//field_halos.push_back(new LensHaloPseudoNFW);
-          field_halos.push_back(new LensHaloPseudoNFW(mass*(1-field_galaxy_mass_fraction),Rsize,halo_zs_vec[i],Rsize/rscale,3,1.0,0,0));
-					break;
-				case pl_lens:
-					//field_halos.push_back(new LensHaloPowerLaw);
-          field_halos.push_back(new LensHaloPowerLaw(mass*(1-field_galaxy_mass_fraction),Rsize,halo_zs_vec[i],1.0,1.0,0,0));
-          
+          record.param = Rsize/rscale;
+          record.beta = 3;
 					break;
 				case nsie_lens:
           //std::cout << "Warning: All galaxies are spherical" << std::endl;
-					field_halos.push_back(new LensHaloRealNSIE(mass*(1-field_galaxy_mass_fraction),halo_zs_vec[i],sigma,0.0,1.0,0,0));
-					//field_halos.push_back(new LensHaloRealNSIE);
-					break;
-				case ana_lens:
-					ERROR_MESSAGE();
-					std::cout << "AnaNSIE not supported." << std::endl;
-					break;
-				case uni_lens:
-					ERROR_MESSAGE();
-					std::cout << "UniNSIE not supported." << std::endl;
-					break;
-        case moka_lens:
-          ERROR_MESSAGE();
-          std::cout << "MOKA not supported." << std::endl;
-          break;
-				case dummy_lens:
-					field_halos.push_back(new LensHaloDummy);
-          field_halos[j]->setZlens(halo_zs_vec[i]);
+          record.param = sigma;
 					break;
 				case hern_lens:
-					//field_halos.push_back(new LensHaloHernquist);
-          field_halos.push_back(new LensHaloHernquist(mass*(1-field_galaxy_mass_fraction),Rsize,halo_zs_vec[i],rscale,1.0,0,0));
-					break;
 				case jaffe_lens:
-					//field_halos.push_back(new LensHaloJaffe);
-          field_halos.push_back(new LensHaloJaffe(mass*(1-field_galaxy_mass_fraction),Rsize,halo_zs_vec[i],rscale,1.0,0,0));
+          record.param = rscale;
 					break;
+        default:
+          break;
 			}
       
+      LensHalo *halo = makeFieldHalo(record);
+      if(halo != NULL){
+        field_halos.push_back(halo);
+        field_halo_records[halo] = record;
+      }
+      
 			if(mass > mass_max) {
 				mass_max = mass;
 				j_max = i;
@@ -1829,9 +2223,12 @@ void Lens::createFieldHalos(bool verbose)
             
             float sigma = 126*pow(mass*field_galaxy_mass_fraction/1.0e10,0.25); // From Tully-Fisher and Bell & de Jong 2001
             //std::cout << "Warning: All galaxies are spherical" << std::endl;
-            float fratio = (ran2(seed)+1)*0.5;  //TODO: Ben change this!  This is a kluge.
-            float pa = 2*pi*ran2(seed);  //TODO: This is a kluge.
-            field_halos.push_back(new LensHaloRealNSIE(mass*field_galaxy_mass_fraction,halo_zs_vec[i],sigma,0.0,fratio,pa,0));
+            float fratio = (halo_ran()+1)*0.5;  //TODO: Ben change this!  This is a kluge.
+            float pa = 2*pi*halo_ran();  //TODO: This is a kluge.
+            
+            FieldHaloRecord galaxy = {nsie_lens,mass*field_galaxy_mass_fraction,0,halo_zs_vec[i],sigma,1.0,fratio,pa};
+            field_halos.push_back(makeFieldHalo(galaxy));
+            field_halo_records[field_halos.back()] = galaxy;
             
             //field_halos[j]->initFromMassFunc(mass*field_galaxy_mass_fraction,Rsize,rscale,field_prof_internal_slope,seed);
             break;
@@ -1862,6 +2259,8 @@ void Lens::createFieldHalos(bool verbose)
     
   }
   
+  field_seed_end = *seed;
+  
 	if(verbose) std::cout << "leaving Lens::createFieldHalos()" << std::endl;
 }
 
@@ -1893,21 +2292,7 @@ void Lens::readInputSimFileMillennium(bool verbose)
   
   //size_t idnumber = 1;
   
-	std::ifstream file_in(field_input_sim_file.c_str());
-	if(!file_in){
-		std::cout << "Can't open file " << field_input_sim_file << std::endl;
-    ERROR_MESSAGE();
-    throw std::runtime_error(" Cannot open file.");
-		exit(1);
-	}
-  
-	// skip through header information in data file
-	i=0;
-	while(file_in.peek() == '#'){
-		file_in.ignore(10000,'\n');
-		++i;
-	}
-	if(verbose) std::cout << "   skipped "<< i << " comment lines in file " << field_input_sim_file << std::endl;
+	Utilities::CatalogTable table(field_input_sim_file,"iifffifff",',',field_input_sim_cache,verbose);
   
 	//std::vector<PosType *> halo_pos_vec;
   Utilities::Geometry::SphericalPoint tmp_sph_point(1,0,0);
@@ -1932,37 +2317,15 @@ void Lens::readInputSimFileMillennium(bool verbose)
 	addr[7] = &vmax;
 	addr[8] = &r_halfmass;
   
-	unsigned long myint;
-	PosType myPosType;
-	std::string myline;
-	std::string strg;
-	std::string f=",";
-	std::stringstream buffer;
-  
-	for(i=0,j=0 ; ; ++i){
-		// read a line of data
-		myline.clear();
-		std::getline(file_in,myline);
-    
-		if(myline[0] == '#')
-			break;
+	for(i=0,j=0 ; i < table.size() ; ++i){
 		for(int l=0;l<ncolumns; l++){
-			int pos = myline.find(f);
-			strg.assign(myline,0,pos);
-			buffer << strg;
 			if(l <= 1 || l == 5){
         //  if(l <= 2 || l == 7){
-				buffer >> myint;
-				*((unsigned long *)addr[l]) = myint;
+				*((unsigned long *)addr[l]) = table.integer(i,l);
 			}
 			else{
-				buffer >> myPosType;
-				*((PosType *)addr[l]) = myPosType;
+				*((PosType *)addr[l]) = table(i,l);
 			}
-			myline.erase(0,pos+1);
-			strg.clear();
-			buffer.clear();
-			buffer.str(std::string());
 		}
     
     if(np == 0) continue;
@@ -2136,7 +2499,6 @@ void Lens::readInputSimFileMillennium(bool verbose)
       
 		}
 	}
-	file_in.close();
 	if(verbose) std::cout << field_halos.size() << " halos read in."<< std::endl
     << "Max input mass = " << mass_max << "  R max = " << R_max << "  V max = " << V_max
     << "Min input mass = " << minmass << std::endl;
@@ -2240,55 +2602,18 @@ void Lens::readInputSimFileMultiDarkHalos(bool verbose)
   //for(int jj=0;jj<filenames.size();++jj){
   for(int jj=0;jj<1;++jj){
     
-    //std::ifstream file_in( field_input_sim_file + filenames[jj].c_str());
-    std::ifstream file_in( field_input_sim_file );
-    if(!file_in){
-      std::cout << "Can't open file " << field_input_sim_file + filenames[jj] << std::endl;
-      ERROR_MESSAGE();
-      throw std::runtime_error(" Cannot open file.");
-      exit(1);
-    }
-    
     std::cout << "reading halos from file: " << field_input_sim_file + filenames[jj] << std::endl;
     
-    // skip through header information in data file
-    i=0;
-    while(file_in.peek() == '#'){
-      file_in.ignore(10000,'\n');
-      ++i;
-    }
-    if(verbose) std::cout << "   skipped "<< i << " comment lines in file " <<  filenames[jj]
-      << std::endl;
+    //Utilities::CatalogTable table(field_input_sim_file + filenames[jj],std::string(ncolumns,'f'),' ',field_input_sim_cache,verbose);
+    Utilities::CatalogTable table(field_input_sim_file,std::string(ncolumns,'f'),' ',field_input_sim_cache,verbose);
     
     // read in data
     
-    PosType myPosType;
-    std::string myline;
-    std::string strg;
-    std::string f=" ";
-    std::stringstream buffer;
-    
-    i=j=0;
-    myline.clear();
-    while(std::getline(file_in,myline)){
-      
-      int pos = myline.find_first_not_of(f);
-      myline.erase(0,pos);
+    j=0;
+    for(i=0;i<table.size();++i){
       
       for(int l=0;l<ncolumns; l++){
-        pos = myline.find(f);
-        strg.assign(myline,0,pos);
-        buffer << strg;
-        buffer >> myPosType;
-        *((PosType *)addr[l]) = myPosType;
-        
-        myline.erase(0,pos);
-        strg.clear();
-        buffer.clear();
-        buffer.str(std::string());
-        
-        pos = myline.find_first_not_of(f);
-        myline.erase(0,pos);
+        *((PosType *)addr[l]) = table(i,l);
       }
       ++haloid;
       
@@ -2448,14 +2773,11 @@ void Lens::readInputSimFileMultiDarkHalos(bool verbose)
         }
         
       }
-      myline.clear();
-      ++i;
     }
     if(verbose){
       std::cout << field_halos.size() << " halos read in."<< std::endl;
       std::cout << "center is : theta:" << center[0]/field_halos.size() << "  phi:" << center[1]/field_halos.size() << std::endl;
     }
-    file_in.close();
   }
   
   
@@ -2561,60 +2883,25 @@ void Lens::readInputSimFileObservedGalaxies(bool verbose)
   addr[4] = &rcut;
   addr[5] = &vdist;
   
-  std::ifstream file_in( field_input_sim_file );
-  if(!file_in){
-    std::cout << "Can't open file " << field_input_sim_file << std::endl;
-    ERROR_MESSAGE();
-    throw std::runtime_error(" Cannot open file.");
-    exit(1);
-  }
-  
   std::cout << "reading halos from file: " << field_input_sim_file << std::endl;
   
-  // skip through header information in data file
-  i=0;
-  while(file_in.peek() == '#'){
-    file_in.ignore(10000,'\n');
-    ++i;
-  }
-  if(verbose) std::cout << "   skipped "<< i << " comment lines in file "
-    << std::endl;
+  Utilities::CatalogTable table(field_input_sim_file,"ifffff",' ',field_input_sim_cache,verbose);
   
   // read in data
   
-  PosType myPosType;
-  std::string myline;
-  std::string strg;
-  std::string f=" ";
-  std::stringstream buffer;
-  
-  i=j=0;
-  myline.clear();
-  while(std::getline(file_in,myline)){
-    
-    int pos = myline.find_first_not_of(f);
-    myline.erase(0,pos);
+  j=0;
+  for(i=0;i<table.size();++i){
     
-    for(int l=0;l<ncolumns; l++){
-      //std::cout << myline << std::endl;
-      
-      pos = myline.find(f);
-      strg.assign(myline,0,pos);
-      buffer << strg;
-      buffer >> myPosType;
-      *((PosType *)addr[l]) = myPosType;
-      
-      myline.erase(0,pos);
-      strg.clear();
-      buffer.clear();
-      buffer.str(std::string());
-      
-      pos = myline.find_first_not_of(f);
-      myline.erase(0,pos);
+    haloid = table.integer(i,0);
+    for(int l=1;l<ncolumns; l++){
+      *((PosType *)addr[l]) = table(i,l);
     }
     
-    for(int l=0;l<ncolumns; l++) std::cout << *((PosType *)(addr[l])) << "  ";
-    std::cout << std::endl;
+    if(verbose){
+      std::cout << haloid << "  ";
+      for(int l=1;l<ncolumns; l++) std::cout << *((PosType *)(addr[l])) << "  ";
+      std::cout << std::endl;
+    }
       
     tmp_sph_point.theta *= pi/180;
     tmp_sph_point.phi *= pi/180;
@@ -2760,15 +3047,11 @@ void Lens::readInputSimFileObservedGalaxies(bool verbose)
      ++j;
      }
      */
-    
-    myline.clear();
-    ++i;
   }
   if(verbose){
     std::cout << field_halos.size() << " halos read in."<< std::endl;
     std::cout << "center is at: theta:" << center[0]*180/pi/field_halos.size() << "  phi:" << center[1]*180/pi/field_halos.size() << " degrees" << std::endl;
   }
-  file_in.close();
   
   
   
@@ -2935,20 +3218,25 @@ void Lens::buildPlanes(InputParams& params, bool verbose)
 	// build field
 	if(!flag_switch_field_off)
 	{
-		// set the distances of the field planes
-		setupFieldPlanes();
-
-		// create or read the field halos
-		if(sim_input_flag){
-      if(field_input_sim_format == MillenniumObs) readInputSimFileMillennium(verbose);
-      if(field_input_sim_format == MultiDarkHalos) readInputSimFileMultiDarkHalos(verbose);
-      if(field_input_sim_format == ObservedData) readInputSimFileObservedGalaxies(verbose);
+    // the halos and the distances of the field planes may already have been read from field_snapshot_file
+    if(!field_snapshot_loaded){
+      // set the distances of the field planes
+      setupFieldPlanes();
+
+      // create or read the field halos
+      if(sim_input_flag){
+        if(field_input_sim_format == MillenniumObs) readInputSimFileMillennium(verbose);
+        if(field_input_sim_format == MultiDarkHalos) readInputSimFileMultiDarkHalos(verbose);
+        if(field_input_sim_format == ObservedData) readInputSimFileObservedGalaxies(verbose);
+      }
+      else{
+        createFieldHalos(verbose);
+      }
     }
-    else{
-      createFieldHalos(verbose);
-		}
     // create field planes and sort halos onto them
 		createFieldPlanes(verbose);
+
+    if(field_snapshot_file.size() > 0 && !field_snapshot_loaded) save(field_snapshot_file);
 	}
   
 	// build main
@@ -2986,7 +3274,6 @@ short Lens::ResetSourcePlane(
                              ,PosType *xx
                              ,bool verbose
                              ){
-	unsigned long j;
 	short out=0;
   
 	toggle_source_plane = true;
@@ -2996,6 +3283,21 @@ short Lens::ResetSourcePlane(
 		return out;
 	}
   
+	int j = FindSourcePlane(z,nearest,zs_implant,Ds_implant,dDs_implant);
+  
+	if(verbose) std::cout << "Source on plane " << j << " zs " << zs_implant << " Ds " << Ds_implant << " dDs " << dDs_implant << std::endl;
+  
+	index_of_new_sourceplane = j;
+  
+	out = j;
+	return out;
+}
+
+/** \brief Finds the index j of the plane that is replaced by a source at redshift z and the redshift, distance and
+ *  distance from plane j-1 that the source plane will have.  See ResetSourcePlane() for the meaning of nearest.
+ */
+int Lens::FindSourcePlane(PosType z,bool nearest,PosType &zs,PosType &Ds_source,PosType &dDs){
+	unsigned long j;
   
 	// distance to new source plane
 	PosType Ds = cosmo.coorDist(0,z);
@@ -3019,24 +3321,19 @@ short Lens::ResetSourcePlane(
 	}
   
 	if(nearest && (j < lensing_planes.size()) ){
-		zs_implant = plane_redshifts[j];
-		Ds_implant = Dl[j];
-		if(j > 0) dDs_implant = dDl[j];
-		else  dDs_implant = Ds_implant;
+		zs = plane_redshifts[j];
+		Ds_source = Dl[j];
+		if(j > 0) dDs = dDl[j];
+		else  dDs = Ds_source;
 	}else{
 		// if nearest==false or the source is at higher redshift than the last plane use the real redshift
-		Ds_implant = Ds;
-		zs_implant = z;
-		if(j > 0) dDs_implant = cosmo.coorDist(plane_redshifts[j-1],z); //Ds - Dl[j-1];
-		else  dDs_implant = Ds;
+		Ds_source = Ds;
+		zs = z;
+		if(j > 0) dDs = cosmo.coorDist(plane_redshifts[j-1],z); //Ds - Dl[j-1];
+		else  dDs = Ds;
 	}
   
-	if(verbose) std::cout << "Source on plane " << j << " zs " << zs_implant << " Ds " << Ds << " dDs " << dDs_implant << std::endl;
-  
-	index_of_new_sourceplane = j;
-  
-	out = j;
-	return out;
+	return j;
 }
 
 /// Sort field_halos[], brr[][], and id[] by content off arr[]
@@ -18,6 +18,7 @@ LensHalo::LensHalo(){
   Dist = -1;
   stars_N =0.0;
   zlens = 0.0;
+  profile_table = nullptr;
 }
 
 LensHalo::LensHalo(PosType z,COSMOLOGY &cosmo){
@@ -28,6 +29,7 @@ LensHalo::LensHalo(PosType z,COSMOLOGY &cosmo){
   Dist = cosmo.angDist(z);
   stars_N =0.0;
   zlens = z;
+  profile_table = nullptr;
 }
 
 LensHalo::LensHalo(InputParams& params,COSMOLOGY &cosmo,bool needRsize){
@@ -36,6 +38,7 @@ LensHalo::LensHalo(InputParams& params,COSMOLOGY &cosmo,bool needRsize){
   stars_implanted = false;
   posHalo[0] = posHalo[1] = 0.0;
   elliptical_flag = false;
+  profile_table = nullptr;
   setDist(cosmo);
 }
 LensHalo::LensHalo(InputParams& params,bool needRsize){
@@ -44,6 +47,7 @@ LensHalo::LensHalo(InputParams& params,bool needRsize){
   stars_implanted = false;
   posHalo[0] = posHalo[1] = 0.0;
   elliptical_flag = false;
+  profile_table = nullptr;
 }
 
 void LensHalo::initFromMassFunc(float my_mass, float my_Rsize, float my_rscale
@@ -54,6 +58,42 @@ void LensHalo::initFromMassFunc(float my_mass, float my_Rsize, float my_rscale
   xmax = Rsize/rscale;
 }
 
+/**
+ * \brief Builds the table from the functions tabulated at x = i*dx.
+ *
+ * Every stride-th value is used.  The kappa and gamma tables should hold kappa_h and gamma_h
+ * shapes, which go to zero at x=0, not the ffunction and g2function tables.
+ */
+LensHaloProfileTable::LensHaloProfileTable(
+                                           const PosType *alpha   /// shape of alpha_h
+                                           ,const PosType *kappa  /// shape of kappa_h
+                                           ,const PosType *gamma  /// shape of gamma_h
+                                           ,const PosType *phi    /// shape of phi_h
+                                           ,long N                /// number of values in each input
+                                           ,PosType my_dx         /// spacing of the input values
+                                           ,long stride           /// spacing of the table in input values
+){
+  long Nnodes = (N-1)/stride + 1;
+  if(Nnodes < 3) throw std::invalid_argument("LensHaloProfileTable: too few nodes");
+  
+  dx = my_dx*stride;
+  inv_dx = 1.0/dx;
+  jmax = Nnodes - 2;
+  table.resize(8*Nnodes);
+  
+  const PosType *f[4] = {alpha,kappa,gamma,phi};
+  for(int k = 0 ; k < 4 ; ++k){
+    for(long i = 0 ; i < Nnodes ; ++i){
+      table[8*i + 2*k] = f[k][i*stride];
+      
+      // derivative times dx, second order at the ends
+      if(i == 0) table[8*i + 2*k + 1] = -1.5*f[k][0] + 2*f[k][stride] - 0.5*f[k][2*stride];
+      else if(i == Nnodes-1) table[8*i + 2*k + 1] = 1.5*f[k][i*stride] - 2*f[k][(i-1)*stride] + 0.5*f[k][(i-2)*stride];
+      else table[8*i + 2*k + 1] = 0.5*(f[k][(i+1)*stride] - f[k][(i-1)*stride]);
+    }
+  }
+}
+
 void LensHalo::error_message1(std::string parameter,std::string file){
   ERROR_MESSAGE();
   std::cout << "Parameter " << parameter << " is needed to construct a LensHalo.  It needs to be set in parameter file " << file << "!" << std::endl;
@@ -132,6 +172,7 @@ PosType* LensHaloNFW::g2table = NULL;
 PosType* LensHaloNFW::htable = NULL;
 PosType* LensHaloNFW::xgtable = NULL;
 PosType*** LensHaloNFW::modtable= NULL; // was used for Ansatz IV
+LensHaloProfileTable* LensHaloNFW::radial_table = NULL;
 
 
 
@@ -140,6 +181,7 @@ LensHaloNFW::LensHaloNFW()
 {
   make_tables();
   gmax = InterpolateFromTable(gtable, xmax);
+  set_profile_table();
 }
 
 LensHaloNFW::LensHaloNFW(float my_mass,float my_Rsize,PosType my_zlens,float my_concentration,float my_fratio,float my_pa,int my_stars_N, EllipMethod my_ellip_method){
@@ -150,6 +192,7 @@ LensHaloNFW::LensHaloNFW(float my_mass,float my_Rsize,PosType my_zlens,float my_
   xmax = LensHalo::getRsize()/rscale;
   make_tables();
   gmax = InterpolateFromTable(gtable, xmax);
+  set_profile_table();
   
   
   set_slope(1);
@@ -193,6 +236,7 @@ LensHaloNFW::LensHaloNFW(InputParams& params):LensHalo(params)
   assignParams(params);
   make_tables();
   gmax = InterpolateFromTable(gtable, xmax);
+  set_profile_table();
   
   mnorm = renormalization(LensHalo::getRsize());
   
@@ -254,6 +298,13 @@ void LensHaloNFW::make_tables(){
       }
     }
     
+    std::vector<PosType> kappa_shape(NTABLE),gamma_shape(NTABLE);
+    for(i = 0 ; i< NTABLE; i++){
+      kappa_shape[i] = xtable[i]*xtable[i]*ftable[i];
+      gamma_shape[i] = xtable[i]*xtable[i]*g2table[i];
+    }
+    radial_table = new LensHaloProfileTable(gtable,kappa_shape.data(),gamma_shape.data(),htable,NTABLE,dx);
+    
     // modtable[axis ratio 100][potential slope beta 1000][Nmods 32] for Ansatz IV
     
     int j;
@@ -327,6 +378,12 @@ PosType LensHaloNFW::InterpolateFromTable(PosType *table, PosType y) const{
   return (table[j+1]-table[j])/(xtable[j+1]-xtable[j])*(y-xtable[j]) + table[j];
 }
 
+void LensHaloNFW::set_profile_table(){
+  PosType scale[4] = {-1.0/gmax,0.5/gmax,-0.5/gmax,0.25/gmax};
+  PosType offset[4] = {0,0,0
+    ,-0.25*InterpolateFromTable(htable,LensHalo::getRsize()/rscale)/gmax + log(LensHalo::getRsize())};
+  setProfileTable(radial_table,scale,offset);
+}
 
 void LensHaloNFW::assignParams(InputParams& params){
   PosType tmp;
@@ -349,6 +406,7 @@ LensHaloNFW::~LensHaloNFW(){
     delete[] g2table;
     delete[] htable;
     delete[] xgtable;
+    delete radial_table;
     
     // was used for Ansatz IV
     
@@ -374,6 +432,7 @@ void LensHaloNFW::initFromFile(float my_mass, long *seed, float vmax, float r_ha
   rscale = LensHalo::getRsize()/rscale; // Was the concentration
   xmax = LensHalo::getRsize()/rscale;
   gmax = InterpolateFromTable(gtable,xmax);
+  set_profile_table();
  // std::cout << Rmax_halo << " " << LensHalo::getRsize() << std::endl;
   
 }
@@ -382,6 +441,7 @@ void LensHaloNFW::initFromMassFunc(float my_mass, float my_Rsize, float my_rscal
 {
   LensHalo::initFromMassFunc(my_mass, my_Rsize, my_rscale, my_slope, seed);
   gmax = InterpolateFromTable(gtable,xmax);
+  set_profile_table();
 }
 
 const long LensHaloPseudoNFW::NTABLE = 10000;
@@ -870,6 +930,40 @@ void LensHalo::force_halo(
   }
 }
 
+/** \brief adds the lensing quantities of the halo to a batch of rays
+ *
+ *  The deflection is subtracted and the rest added, as in LensPlaneSingular::force().  By default
+ *  force_halo() is called for each ray.  Halos that can do better with many rays at once override this.
+ */
+void LensHalo::force_halo_batch(
+                                PlaneForceBatch &batch  /// rays, positions in physical Mpc
+                                ,PosType const *x_halo  /// position of the halo in physical Mpc
+)
+{
+  PosType alpha_tmp[2],x_tmp[2];
+  KappaType kappa_tmp,gamma_tmp[3],phi_tmp;
+  
+  for(size_t k = 0, n = batch.size(); k < n; ++k){
+    alpha_tmp[0] = alpha_tmp[1] = 0.0;
+    kappa_tmp = 0.0;
+    gamma_tmp[0] = gamma_tmp[1] = gamma_tmp[2] = 0.0;
+    phi_tmp = 0.0;
+    
+    x_tmp[0] = batch.x[0][k] - x_halo[0];
+    x_tmp[1] = batch.x[1][k] - x_halo[1];
+    
+    force_halo(alpha_tmp,&kappa_tmp,gamma_tmp,&phi_tmp,x_tmp,false);
+    
+    batch.alpha[0][k] -= alpha_tmp[0];
+    batch.alpha[1][k] -= alpha_tmp[1];
+    batch.kappa[k] += kappa_tmp;
+    batch.gamma[0][k] += gamma_tmp[0];
+    batch.gamma[1][k] += gamma_tmp[1];
+    batch.gamma[2][k] += gamma_tmp[2];
+    batch.phi[k] += phi_tmp;
+  }
+}
+
 /** \brief returns the lensing quantities of a ray in center of mass coordinates for a symmetric halo
  *
  *  phi is defined here in such a way that it differs from alpha by a sign (as we should have alpha = \nabla_x phi)
@@ -897,19 +991,31 @@ void LensHalo::force_halo_sym(
     PosType prefac = mass/rcm2/pi;
     PosType x = sqrt(rcm2)/rscale;
     // PosType xmax = Rmax/rscale;
-    PosType tmp = (alpha_h(x) + 1.0*subtract_point)*prefac;
+    PosType alpha_x;
+    KappaType kappa_x,gamma_x,phi_x;
+    
+    if(profile_table && x >= profile_table->xmin()){
+      profile_table->eval(x,profile_scale,profile_offset,alpha_x,kappa_x,gamma_x,phi_x);
+    }else{
+      alpha_x = alpha_h(x);
+      kappa_x = kappa_h(x);
+      gamma_x = gamma_h(x);
+      phi_x = phi_h(x);
+    }
+    
+    PosType tmp = (alpha_x + 1.0*subtract_point)*prefac;
     alpha[0] += tmp*xcm[0];
     alpha[1] += tmp*xcm[1];
     
-    *kappa += kappa_h(x)*prefac;
+    *kappa += kappa_x*prefac;
     
-    tmp = (gamma_h(x) + 2.0*subtract_point) * prefac / rcm2; // ;
+    tmp = (gamma_x + 2.0*subtract_point) * prefac / rcm2; // ;
     gamma[0] += 0.5*(xcm[0]*xcm[0]-xcm[1]*xcm[1])*tmp;
     gamma[1] += xcm[0]*xcm[1]*tmp;
     /*if (rcm2 < 1E-6){
       std::cout << kappa_h(x)*prefac << " " << 0.5*(xcm[0]*xcm[0]-xcm[1]*xcm[1])*gamma_h(x)*prefac/rcm2 << " "  << xcm[0]*xcm[1]*gamma_h(x)*prefac/rcm2 << " " <<rcm2 << " " << alpha_h(x)*prefac*xcm[0] << " " <<  alpha_h(x)*prefac*xcm[1] <<  std::endl;
     }*/
-    *phi += phi_h(x) * mass / pi ;
+    *phi += phi_x * mass / pi ;
   }
   else // the point particle is not subtracted
   {
@@ -1342,6 +1448,7 @@ PosType* LensHaloHernquist::gtable = NULL;
 PosType* LensHaloHernquist::g2table = NULL;
 PosType* LensHaloHernquist::htable = NULL;
 PosType* LensHaloHernquist::xgtable = NULL;
+LensHaloProfileTable* LensHaloHernquist::radial_table = NULL;
 
 /*
  LensHaloHernquist::LensHaloHernquist()
@@ -1364,6 +1471,7 @@ LensHaloHernquist::LensHaloHernquist(float my_mass,float my_Rsize,PosType my_zle
   xmax = LensHalo::getRsize()/rscale;
   make_tables();
   gmax = InterpolateFromTable(gtable,xmax);
+  set_profile_table();
   
   set_slope(1);
   /// If the axis ratio given in the parameter file is set to 1 all ellipticizing routines are skipped.
@@ -1392,6 +1500,7 @@ LensHaloHernquist::LensHaloHernquist(InputParams& params): LensHalo(params)
   assignParams(params);
   make_tables();
   gmax = InterpolateFromTable(gtable,xmax);
+  set_profile_table();
   
   set_slope(1);
   /// If the axis ratio given in the parameter file is set to 1 all ellipticizing routines are skipped.
@@ -1434,10 +1543,24 @@ void LensHaloHernquist::make_tables(){
         xgtable[i] = alpha_int(x);
       }
     }
+    
+    std::vector<PosType> kappa_shape(NTABLE),gamma_shape(NTABLE);
+    for(i = 0 ; i< NTABLE; i++){
+      kappa_shape[i] = xtable[i]*xtable[i]*ftable[i];
+      gamma_shape[i] = xtable[i]*xtable[i]*g2table[i];
+    }
+    // the cubic interpolation does not need the fine spacing of these tables
+    radial_table = new LensHaloProfileTable(gtable,kappa_shape.data(),gamma_shape.data(),htable,NTABLE,dx,10);
   }
   count++;
 }
 
+void LensHaloHernquist::set_profile_table(){
+  PosType scale[4] = {-0.25/gmax,0.25/gmax,-0.5/gmax,-0.25/gmax};
+  PosType offset[4] = {0,0,0,0};
+  setProfileTable(radial_table,scale,offset);
+}
+
 
 
 PosType LensHaloHernquist::InterpolateFromTable(PosType *table, PosType y) const{
@@ -1480,6 +1603,7 @@ LensHaloHernquist::~LensHaloHernquist(){
     delete[] htable;
     delete[] g2table;
     delete[] xgtable;
+    delete radial_table;
   }
 }
 
@@ -1492,6 +1616,7 @@ PosType* LensHaloJaffe::ftable = NULL;
 PosType* LensHaloJaffe::gtable = NULL;
 PosType* LensHaloJaffe::g2table = NULL;
 PosType* LensHaloJaffe::xgtable = NULL;
+LensHaloProfileTable* LensHaloJaffe::radial_table = NULL;
 
 
 //PosType* LensHaloJaffe::htable = NULL;
@@ -1515,6 +1640,7 @@ LensHaloJaffe::LensHaloJaffe(float my_mass,float my_Rsize,PosType my_zlens,float
   xmax = LensHalo::getRsize()/rscale;
   make_tables();
   gmax = InterpolateFromTable(gtable,xmax);
+  set_profile_table();
   
   set_slope(1);
   if(fratio!=1){
@@ -1542,6 +1668,7 @@ LensHaloJaffe::LensHaloJaffe(InputParams& params): LensHalo(params)
   assignParams(params);
   make_tables();
   gmax = InterpolateFromTable(gtable,xmax);
+  set_profile_table();
   
   set_slope(1);
   
@@ -1583,10 +1710,23 @@ void LensHaloJaffe::make_tables(){
         xgtable[i] = alpha_int(x);
       }
     }
+    
+    std::vector<PosType> kappa_shape(NTABLE),gamma_shape(NTABLE);
+    for(i = 0 ; i< NTABLE; i++){
+      kappa_shape[i] = xtable[i]*xtable[i]*ftable[i];
+      gamma_shape[i] = xtable[i]*xtable[i]*g2table[i];
+    }
+    radial_table = new LensHaloProfileTable(gtable,kappa_shape.data(),gamma_shape.data(),xgtable,NTABLE,dx);
   }
   count++;
 }
 
+void LensHaloJaffe::set_profile_table(){
+  PosType scale[4] = {-0.25/gmax,0.125/gmax,-0.25/gmax,-0.25/gmax};
+  PosType offset[4] = {0,0,0,0};
+  setProfileTable(radial_table,scale,offset);
+}
+
 PosType LensHaloJaffe::InterpolateFromTable(PosType *table, PosType y) const{
   int j;
   j=(int)(y/maxrm*NTABLE);
@@ -1625,6 +1765,7 @@ LensHaloJaffe::~LensHaloJaffe(){
     delete[] ftable;
     delete[] g2table;
     delete[] xgtable;
+    delete radial_table;
   }
 }
 
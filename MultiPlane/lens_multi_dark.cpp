@@ -22,7 +22,7 @@ void Lens::readPixelizedDensity()
   if(pixel_map_input_file.find(".fits") != pixel_map_input_file.npos){
     std::cout << "inputing PixelDensityMap file: " << pixel_map_input_file << std::endl;
     main_halos.push_back(new LensHaloMassMap(pixel_map_input_file, pix_map, pixel_map_zeropad
-                                             ,pixel_map_zeromean,cosmo));
+                                             ,pixel_map_zeromean,cosmo,pixel_map_fft_float,pixel_map_fft_memory));
   }else{
     
     std::cout << "reading PixelDMap files: " << pixel_map_input_file << std::endl;
@@ -53,7 +53,8 @@ void Lens::readPixelizedDensity()
       std::cout << "- " << mokafile << std::endl;
       
       // create the MOKA halo
-      main_halos.push_back(new LensHaloMassMap(mokafile, pix_map,pixel_map_zeropad,pixel_map_zeromean, cosmo));
+      main_halos.push_back(new LensHaloMassMap(mokafile, pix_map,pixel_map_zeropad,pixel_map_zeromean, cosmo
+                                               ,pixel_map_fft_float,pixel_map_fft_memory));
     }
   }
   
@@ -9,12 +9,56 @@
 
 #include <iterator>
 
+void LensPlane::force_batch(PlaneForceBatch &batch){
+  PosType xx[2],alpha[2];
+  KappaType gamma[3];
+  
+  for(size_t i = 0, n = batch.size(); i < n; ++i){
+    xx[0] = batch.x[0][i];
+    xx[1] = batch.x[1][i];
+    force(alpha,&batch.kappa[i],gamma,&batch.phi[i],xx);
+    batch.alpha[0][i] = alpha[0];
+    batch.alpha[1][i] = alpha[1];
+    batch.gamma[0][i] = gamma[0];
+    batch.gamma[1][i] = gamma[1];
+    batch.gamma[2][i] = gamma[2];
+  }
+}
+
+void LensPlane::force_grid(PlaneForceBatch &batch){
+  
+  const size_t piece = 1024;
+  
+  Utilities::ThreadPool::get().parallel_for(batch.size(),piece,[this,&batch](size_t start,size_t end){
+    PlaneForceBatch sub(end - start);
+    
+    for(size_t k = start; k < end; ++k){
+      sub.x[0][k - start] = batch.x[0][k];
+      sub.x[1][k - start] = batch.x[1][k];
+    }
+    
+    force_batch(sub);
+    
+    for(size_t k = start; k < end; ++k){
+      batch.alpha[0][k] = sub.alpha[0][k - start];
+      batch.alpha[1][k] = sub.alpha[1][k - start];
+      batch.kappa[k] = sub.kappa[k - start];
+      batch.gamma[0][k] = sub.gamma[0][k - start];
+      batch.gamma[1][k] = sub.gamma[1][k - start];
+      batch.gamma[2][k] = sub.gamma[2][k - start];
+      batch.phi[k] = sub.phi[k - start];
+    }
+  });
+}
+
+/// theta_force and expansion_order are passed on to the TreeQuad, see TreeQuad for details
 LensPlaneTree::LensPlaneTree(LensHaloHndl *my_halos,IndexType Nhalos
-                             ,PosType my_sigma_background,PosType inv_screening_scale)
+                             ,PosType my_sigma_background,PosType inv_screening_scale
+                             ,PosType theta_force,int expansion_order)
 : LensPlane(), halos(my_halos, my_halos + Nhalos)
 {
-	if(inv_screening_scale != 0) halo_tree = new TreeQuad(my_halos,Nhalos,my_sigma_background,5,0.1,true,inv_screening_scale);
-	else halo_tree = new TreeQuad(my_halos,Nhalos,my_sigma_background);
+	if(inv_screening_scale != 0) halo_tree = new TreeQuad(my_halos,Nhalos,my_sigma_background,5,theta_force,true,inv_screening_scale,expansion_order);
+	else halo_tree = new TreeQuad(my_halos,Nhalos,my_sigma_background,5,theta_force,false,0,expansion_order);
 }
 
 LensPlaneTree::~LensPlaneTree(){
@@ -26,6 +70,22 @@ void LensPlaneTree::force(PosType *alpha,KappaType *kappa,KappaType *gamma
 	halo_tree->force2D_recur(xx,alpha,kappa,gamma,phi);
 }
 
+/// same as LensPlane::force_batch() but the rays walk the tree together in packets
+void LensPlaneTree::force_batch(PlaneForceBatch &batch){
+  if(batch.size() == 0) return;
+  halo_tree->force2D_batch(batch.size(),&batch.x[0][0],&batch.x[1][0]
+                           ,&batch.alpha[0][0],&batch.alpha[1][0],&batch.kappa[0]
+                           ,&batch.gamma[0][0],&batch.gamma[1][0],&batch.gamma[2][0],&batch.phi[0]);
+}
+
+/// same as LensPlane::force_grid() but with the dual tree method TreeQuad::force2D_fmm()
+void LensPlaneTree::force_grid(PlaneForceBatch &batch){
+  if(batch.size() == 0) return;
+  halo_tree->force2D_fmm(batch.size(),&batch.x[0][0],&batch.x[1][0]
+                         ,&batch.alpha[0][0],&batch.alpha[1][0],&batch.kappa[0]
+                         ,&batch.gamma[0][0],&batch.gamma[1][0],&batch.gamma[2][0],&batch.phi[0]);
+}
+
 
 void LensPlaneTree::addHalo(LensHalo* halo)
 {
@@ -116,6 +176,30 @@ void LensPlaneSingular::force(PosType *alpha
 	}
 }
 
+/** \brief returns the lensing quantities of a batch of rays in physical coordinates
+ *
+ *  The loop over halos is on the outside so that each halo is only fetched once for the
+ *  whole batch.  The contributions to each ray are added in the same order as in force().
+ */
+void LensPlaneSingular::force_batch(PlaneForceBatch &batch)
+{
+  PosType x_halo[2];
+  size_t n = batch.size();
+  
+  for(size_t k = 0; k < n; ++k){
+    batch.alpha[0][k] = batch.alpha[1][k] = 0.0;
+    batch.kappa[k] = 0.0;
+    batch.gamma[0][k] = batch.gamma[1][k] = batch.gamma[2][k] = 0.0;
+    batch.phi[k] = 0.0;
+  }
+  
+  for(std::size_t i = 0; i < halos.size(); ++i)
+  {
+    halos[i]->getX(x_halo);
+    halos[i]->force_halo_batch(batch,x_halo);
+  }
+}
+
 /// It is assumed that the position of halo is in physical Mpc
 void LensPlaneSingular::addHalo(LensHalo* halo)
 {
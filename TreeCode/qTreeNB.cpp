@@ -8,7 +8,7 @@
 #include "slsimlib.h"
 
 QBranchNB::QBranchNB(){
-	static unsigned long n=0;
+	static std::atomic<unsigned long> n(0);
 	child0 = NULL;
 	child1 = NULL;
 	child2 = NULL;
@@ -18,8 +18,7 @@ QBranchNB::QBranchNB(){
 	particles = NULL;
 	big_particles = NULL;
 	nparticles = 0;
-	number = n;
-	++n;
+	number = n++;
 }
 QBranchNB::~QBranchNB(){};
 
@@ -276,13 +275,21 @@ void QTreeNB::moveToChild(int child){
 void QTreeNB::attachChildrenToCurrent(QBranchNB *branch0,QBranchNB *branch1
 		,QBranchNB *branch2,QBranchNB *branch3){
 
+	attachChildren(current,branch0,branch1,branch2,branch3);
+
+	return;
+}
+
+void QTreeNB::attachChildren(QBranchNB *parent,QBranchNB *branch0,QBranchNB *branch1
+		,QBranchNB *branch2,QBranchNB *branch3){
+
 	Nbranches += 4;
-	current->child0 = branch0;
-	current->child1 = branch1;
-	current->child2 = branch2;
-	current->child3 = branch3;
+	parent->child0 = branch0;
+	parent->child1 = branch1;
+	parent->child2 = branch2;
+	parent->child3 = branch3;
 
-	int level = current->level+1;
+	int level = parent->level+1;
 	branch0->level = level;
 	branch1->level = level;
 	branch2->level = level;
@@ -292,12 +299,12 @@ void QTreeNB::attachChildrenToCurrent(QBranchNB *branch0,QBranchNB *branch1
 	branch0->brother = branch1;
 	branch1->brother = branch2;
 	branch2->brother = branch3;
-	branch3->brother = current->brother;
+	branch3->brother = parent->brother;
 
-	branch0->prev = current;
-	branch1->prev = current;
-	branch2->prev = current;
-	branch3->prev = current;
+	branch0->prev = parent;
+	branch1->prev = parent;
+	branch2->prev = parent;
+	branch3->prev = parent;
 
 	return;
 }
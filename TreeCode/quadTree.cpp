@@ -26,11 +26,13 @@ TreeQuad::TreeQuad(
                    ,PosType theta_force
                    ,bool my_periodic_buffer  /// if true a periodic buffer will be imposed in the force calulation.  See documentation on TreeQuad::force2D() for details.  See note for TreeQuad::force2D_recur().
                    ,PosType my_inv_screening_scale   /// the inverse of the square of the sreening length. See note for TreeQuad::force2D_recur().
+                   ,int my_expansion_order  /// order of the multipole expansion of the cells, 2 (quadrupole) or more
                    ):
 	xp(xpt),MultiMass(Multimass), MultiRadius(Multisize), masses(my_masses)
   ,sizes(my_sizes),Nparticles(Npoints),sigma_background(my_sigma_background)
   ,Nbucket(bucket),force_theta(theta_force),periodic_buffer(my_periodic_buffer)
   ,inv_screening_scale2(my_inv_screening_scale*my_inv_screening_scale)
+  ,expansion_order(my_expansion_order),flat_multipoles(NULL)
 {
 	index = new IndexType[Npoints];
 	IndexType ii;
@@ -42,7 +44,8 @@ TreeQuad::TreeQuad(
 
 	tree = BuildQTreeNB(xp,Npoints,index);
 
-	CalcMoments();
+  FlattenTree();
+  CalcMultipoles();
   
   phiintconst = (120*log(2.) - 631.)/840 + 19./70;
 	return;
@@ -58,11 +61,14 @@ TreeQuad::TreeQuad(
                    ,PosType theta_force         /// the openning angle used in the criterion for decending into a subcell
                    ,bool periodic_buffer        /// if true a periodic buffer will be imposed in the force calulation.  See documentation on TreeQuad::force2D() for details. See note for TreeQuad::force2D_recur().                   
                    ,PosType my_inv_screening_scale   /// the inverse of the square of the sreening length. See note for TreeQuad::force2D_recur().
+                   ,int my_expansion_order  /// order of the multipole expansion of the cells, 2 (quadrupole) or more
+                   ,PosType **halo_positions  /// positions of the halos in the same units as the rays, if NULL LensHalo::getX() is used.  They are copied.
                    ):
 MultiMass(true),MultiRadius(true),masses(NULL),sizes(NULL)
 ,Nparticles(Npoints),sigma_background(my_sigma_background),Nbucket(bucket)
 ,force_theta(theta_force),halos(my_halos),periodic_buffer(periodic_buffer)
 ,inv_screening_scale2(my_inv_screening_scale*my_inv_screening_scale)
+,expansion_order(my_expansion_order),flat_multipoles(NULL)
 {
 	index = new IndexType[Npoints];
 	IndexType ii;
@@ -71,13 +77,21 @@ MultiMass(true),MultiRadius(true),masses(NULL),sizes(NULL)
   
   // copy halo positions into xp array to make compatable with QTreeNB
   xp = Utilities::PosTypeMatrix(Npoints,2);
-  for(ii=0;ii<Npoints;++ii) halos[ii]->getX(xp[ii]);
+  if(halo_positions){
+    for(ii=0;ii<Npoints;++ii){
+      xp[ii][0] = halo_positions[ii][0];
+      xp[ii][1] = halo_positions[ii][1];
+    }
+  }else{
+    for(ii=0;ii<Npoints;++ii) halos[ii]->getX(xp[ii]);
+  }
 
 	haloON = true;  //use internal halo parameters
 
 	tree = BuildQTreeNB(xp,Npoints,index);
 
-	CalcMoments();
+  FlattenTree();
+  CalcMultipoles();
 
   phiintconst = (120*log(2.) - 631.)/840 + 19./70;
 	return;
@@ -88,6 +102,13 @@ TreeQuad::~TreeQuad()
 {
 	delete tree;
 	delete[] index;
+  free(flat_nodes);
+  delete[] flat_info;
+  delete[] flat_x;
+  delete[] flat_mass;
+  delete[] flat_big;
+  delete[] flat_big_x;
+  delete[] flat_multipoles;
   if(haloON) Utilities::free_PosTypeMatrix(xp,Nparticles,2);
 	return;
 }
@@ -133,10 +154,9 @@ QTreeNBHndl TreeQuad::BuildQTreeNB(PosType **xp,IndexType Nparticles,IndexType *
   /* Initialize tree root */
   tree = new QTreeNB(xp,particles,Nparticles,p1,p2);
 
-  /* build the tree */
-  _BuildQTreeNB(Nparticles,particles);
+  /* build the tree, the moments of each branch are found after its children are built */
+  _BuildQTreeNB(tree->top,Nparticles,particles);
 
-  /* visit every branch to find center of mass and cutoff scale */
   tree->moveTop();
 
   return tree;
@@ -147,10 +167,13 @@ inline short TreeQuad::WhichQuad(PosType *x,QBranchNB &branch){
 	return (x[0] < branch.center[0]) + 2*(x[1] < branch.center[1]);
 }
 
-/// tree must be created and first branch must be set before start
-void TreeQuad::_BuildQTreeNB(IndexType nparticles,IndexType *particles){
+/** \brief Builds the branches below cbranch and calculates their moments.
+ *
+ * The tree must be created before start.  Branches with more than build_task_size particles
+ * build their four children on different threads.
+ */
+void TreeQuad::_BuildQTreeNB(QBranchNB *cbranch,IndexType nparticles,IndexType *particles){
 
-	QBranchNB *cbranch = tree->current; /* pointer to current branch */
 	IndexType i,j,cut,cut2,jt;
 
 	cbranch->center[0] = (cbranch->boundary_p1[0] + cbranch->boundary_p2[0])/2;
@@ -190,6 +213,7 @@ void TreeQuad::_BuildQTreeNB(IndexType nparticles,IndexType *particles){
 			cbranch->big_particles = NULL;
 		}
 
+		CalcMoments(cbranch);
 		return;
 	}
 
@@ -216,7 +240,7 @@ void TreeQuad::_BuildQTreeNB(IndexType nparticles,IndexType *particles){
 		Utilities::quickPartition(maxsize,&cut,particles,x,cbranch->nparticles);
 
 		if(cut < cbranch->nparticles){
-			if(tree->atTop()){
+			if(cbranch == tree->top){
 				cbranch->Nbig_particles = cut2 = cbranch->nparticles-cut;
 			}else{
 				Utilities::quickPartition(2*maxsize,&cut2,&particles[cut],&x[cut],cbranch->nparticles-cut);
@@ -247,6 +271,7 @@ void TreeQuad::_BuildQTreeNB(IndexType nparticles,IndexType *particles){
 
 	if(NpInChildren == 0){
 		delete[] x;
+		CalcMoments(cbranch);
 		return;
 	}
 
@@ -258,7 +283,7 @@ void TreeQuad::_BuildQTreeNB(IndexType nparticles,IndexType *particles){
 	QBranchNB *child2 = new QBranchNB();
 	QBranchNB *child3 = new QBranchNB();
 
-	tree->attachChildrenToCurrent(child0,child1,child2,child3);
+	tree->attachChildren(cbranch,child0,child1,child2,child3);
 
 	// initialize boundaries of children
 
@@ -344,66 +369,59 @@ void TreeQuad::_BuildQTreeNB(IndexType nparticles,IndexType *particles){
 
 	delete[] x;
 
-	tree->moveToChild(0);
-	_BuildQTreeNB(child0->nparticles,child0->particles);
-	tree->moveUp();
-
-	tree->moveToChild(1);
-	_BuildQTreeNB(child1->nparticles,child1->particles);
-	tree->moveUp();
-
-	tree->moveToChild(2);
-	_BuildQTreeNB(child2->nparticles,child2->particles);
-	tree->moveUp();
-
-	tree->moveToChild(3);
-	_BuildQTreeNB(child3->nparticles,child3->particles);
-	tree->moveUp();
+	QBranchNB *children[4] = {child0,child1,child2,child3};
+	if(cbranch->nparticles > build_task_size){
+		Utilities::ThreadPool::get().parallel_for(4,1,[&](size_t first,size_t last){
+			for(size_t k=first;k<last;++k) _BuildQTreeNB(children[k],children[k]->nparticles,children[k]->particles);
+		});
+	}else{
+		for(int k=0;k<4;++k) _BuildQTreeNB(children[k],children[k]->nparticles,children[k]->particles);
+	}
 
+	CalcMoments(cbranch);
 	return;
 }
 
-// calculates moments of the mass and the cutoff scale for each box
-void TreeQuad::CalcMoments(){
+/** \brief Calculates the mass, center of mass, quadropole moment and cutoff scale of a branch.
+ *
+ * The moments of a leaf are calculated from its particles.  Those of other branches are found from
+ * the moments of their children, which must already be calculated, by shifting them to the
+ * new center of mass.  This makes the whole tree O(N).
+ */
+void TreeQuad::CalcMoments(QBranchNB *cbranch){
 
-	//*** make compatable
 	IndexType i;
 	PosType rcom,xcm[2],xcut;
-	QBranchNB *cbranch;
 	PosType tmp;
 
-	tree->moveTop();
-	do{
-		cbranch=tree->current; /* pointer to current branch */
+	cbranch->rmax = sqrt( pow(cbranch->boundary_p2[0]-cbranch->boundary_p1[0],2)
+			+ pow(cbranch->boundary_p2[1]-cbranch->boundary_p1[1],2) );
 
-		cbranch->rmax = sqrt( pow(cbranch->boundary_p2[0]-cbranch->boundary_p1[0],2)
-				+ pow(cbranch->boundary_p2[1]-cbranch->boundary_p1[1],2) );
+	cbranch->mass = 0;
+	cbranch->center[0]=cbranch->center[1]=0;
+	cbranch->quad[0]=cbranch->quad[1]=cbranch->quad[2]=0;
 
+	if(tree->atLeaf(cbranch)){
 		// calculate mass
-		for(i=0,cbranch->mass=0;i<cbranch->nparticles;++i)
+		for(i=0;i<cbranch->nparticles;++i)
 			if(haloON ){
 				cbranch->mass +=  halos[cbranch->particles[i]]->get_mass();
 			}else{
 				cbranch->mass += masses[cbranch->particles[i]*MultiMass];
 			}
-			//cbranch->mass +=  haloON ? halos[cbranch->particles[i]*MultiMass].mass : masses[cbranch->particles[i]*MultiMass];
 
 		// calculate center of mass
-		cbranch->center[0]=cbranch->center[1]=0;
 		for(i=0;i<cbranch->nparticles;++i){
 			if(haloON ){
 				tmp = halos[cbranch->particles[i]]->get_mass();
 			}else{
 				tmp = masses[cbranch->particles[i]*MultiMass];
 			}
-			//tmp = haloON ? halos[cbranch->particles[i]*MultiMass].mass : masses[cbranch->particles[i]*MultiMass];
 			cbranch->center[0] += tmp*tree->xp[cbranch->particles[i]][0]/cbranch->mass;
 			cbranch->center[1] += tmp*tree->xp[cbranch->particles[i]][1]/cbranch->mass;
 		}
-		//////////////////////////////////////////////
+
 		// calculate quadropole moment of branch
-		//////////////////////////////////////////////
-		cbranch->quad[0]=cbranch->quad[1]=cbranch->quad[2]=0;
 		for(i=0;i<cbranch->nparticles;++i){
 			xcm[0]=tree->xp[cbranch->particles[i]][0]-cbranch->center[0];
 			xcm[1]=tree->xp[cbranch->particles[i]][1]-cbranch->center[1];
@@ -413,45 +431,223 @@ void TreeQuad::CalcMoments(){
 			}else{
 				tmp = masses[cbranch->particles[i]*MultiMass];
 			}
-			//tmp = haloON ? halos[cbranch->particles[i]*MultiMass].mass : masses[cbranch->particles[i]*MultiMass];
 
 			cbranch->quad[0] += (xcut-2*xcm[0]*xcm[0])*tmp;
 			cbranch->quad[1] += (xcut-2*xcm[1]*xcm[1])*tmp;
 			cbranch->quad[2] += -2*xcm[0]*xcm[1]*tmp;
 		}
+	}else{
+		// all the particles of a branch are in its children
+		QBranchNB *children[4] = {cbranch->child0,cbranch->child1,cbranch->child2,cbranch->child3};
 
-		// largest distance from center of mass of cell
-		for(i=0,rcom=0.0;i<2;++i) rcom += ( pow(cbranch->center[i]-cbranch->boundary_p1[i],2) > pow(cbranch->center[i]-cbranch->boundary_p2[i],2) ) ?
-		pow(cbranch->center[i]-cbranch->boundary_p1[i],2) : pow(cbranch->center[i]-cbranch->boundary_p2[i],2);
-
-		rcom=sqrt(rcom);
+		for(i=0;i<4;++i) cbranch->mass += children[i]->mass;
 
-		if(force_theta > 0.0) cbranch->rcrit_angle = 1.15470*rcom/(force_theta);
-		else  cbranch->rcrit_angle=1.0e100;
+		for(i=0;i<4;++i){
+			if(children[i]->nparticles == 0) continue;
+			cbranch->center[0] += children[i]->mass*children[i]->center[0]/cbranch->mass;
+			cbranch->center[1] += children[i]->mass*children[i]->center[1]/cbranch->mass;
+		}
 
-		/*if(MultiRadius){
+		// parallel axis theorem for the quadropole moments of the children
+		for(i=0;i<4;++i){
+			if(children[i]->nparticles == 0) continue;
+			xcm[0]=children[i]->center[0]-cbranch->center[0];
+			xcm[1]=children[i]->center[1]-cbranch->center[1];
+			xcut = pow(xcm[0],2) + pow(xcm[1],2);
+			tmp = children[i]->mass;
 
-			for(i=0,cbranch->maxrsph=0.0;i<cbranch->nparticles;++i){
-				tmp = haloON ? halos[cbranch->particles[i]].Rmax : sizes[cbranch->particles[i]];
-				if(cbranch->maxrsph <= tmp ){
-					cbranch->maxrsph = tmp;
-				}
-			}
+			cbranch->quad[0] += children[i]->quad[0] + (xcut-2*xcm[0]*xcm[0])*tmp;
+			cbranch->quad[1] += children[i]->quad[1] + (xcut-2*xcm[1]*xcm[1])*tmp;
+			cbranch->quad[2] += children[i]->quad[2] - 2*xcm[0]*xcm[1]*tmp;
+		}
+	}
 
-			cbranch->rcrit_part = rcom + 2*cbranch->maxrsph;
+	// largest distance from center of mass of cell
+	for(i=0,rcom=0.0;i<2;++i) rcom += ( pow(cbranch->center[i]-cbranch->boundary_p1[i],2) > pow(cbranch->center[i]-cbranch->boundary_p2[i],2) ) ?
+	pow(cbranch->center[i]-cbranch->boundary_p1[i],2) : pow(cbranch->center[i]-cbranch->boundary_p2[i],2);
 
-		}else{
-			// single size case
-			cbranch->maxrsph = haloON ? halos[0].Rmax : sizes[0];
-			cbranch->rcrit_part = rcom + 2*cbranch->maxrsph;
-		}*/
-		//cbranch->rcrit_angle += cbranch->rcrit_part;
+	rcom=sqrt(rcom);
 
-	}while(tree->WalkStep(true));
+	if(force_theta > 0.0) cbranch->rcrit_angle = 1.15470*rcom/(force_theta);
+	else  cbranch->rcrit_angle=1.0e100;
 
 	return;
 }
 
+/** \brief Makes the compact depth-first copy of the tree that is used in the force calculation.
+ *
+ *  Must be called after the tree is built.  The particle positions and masses are copied into the order
+ *  of the leaves so that the particles in a leaf are next to each other in memory.
+ */
+void TreeQuad::FlattenTree(){
+  
+  static_assert(sizeof(QFlatNode) <= 64,"QFlatNode should fit into a cache line");
+  
+  IndexType Nbig = 0;
+  Nflat = 0;
+  {
+    QTreeNB::iterator it(tree);
+    do{
+      if((*it)->nparticles > 0){
+        ++Nflat;
+        Nbig += (*it)->Nbig_particles;
+      }
+    }while(it.TreeWalkStep(true));
+  }
+  
+  void *mem = NULL;
+  if(posix_memalign(&mem,64,MAX(Nflat,1)*sizeof(QFlatNode)) != 0) throw std::bad_alloc();
+  flat_nodes = (QFlatNode *)mem;
+  flat_info = new QFlatInfo[Nflat];
+  flat_big = new IndexType[Nbig];
+  flat_big_x = new PosType[2*Nbig];
+  
+  flat_x = new PosType[2*Nparticles];
+  flat_mass = new PosType[Nparticles];
+  for(IndexType i = 0 ; i < Nparticles ; ++i){
+    flat_x[2*i] = xp[index[i]][0];
+    flat_x[2*i+1] = xp[index[i]][1];
+    if(haloON) flat_mass[i] = halos[MultiMass*index[i]]->get_mass();
+    else flat_mass[i] = masses[MultiMass*index[i]];
+  }
+  
+  IndexType n = 0;
+  Nbig = 0;
+  if(Nflat > 0) _FlattenTree(tree->top,n,Nbig);
+  assert(n == Nflat);
+}
+
+void TreeQuad::_FlattenTree(QBranchNB *branch,IndexType &Nnodes,IndexType &Nbig){
+  
+  IndexType i = Nnodes++;
+  QFlatNode &node = flat_nodes[i];
+  QFlatInfo &info = flat_info[i];
+  
+  PosType boxsize2 = (branch->boundary_p2[0]-branch->boundary_p1[0])*(branch->boundary_p2[0]-branch->boundary_p1[0]);
+  
+  node.center[0] = branch->center[0];
+  node.center[1] = branch->center[1];
+  node.mass = branch->mass;
+  node.quad[0] = branch->quad[0];
+  node.quad[1] = branch->quad[1];
+  node.quad[2] = branch->quad[2];
+  info.rbig2 = 5.83*boxsize2;
+  info.rmax = sqrt( MAX(pow(branch->center[0]-branch->boundary_p1[0],2),pow(branch->center[0]-branch->boundary_p2[0],2))
+                  + MAX(pow(branch->center[1]-branch->boundary_p1[1],2),pow(branch->center[1]-branch->boundary_p2[1],2)) );
+  node.ropen2 = MAX((branch->rcrit_angle)*(branch->rcrit_angle),info.rbig2);
+  
+  if(tree->atLeaf(branch)){
+    info.first = branch->particles - index;
+    info.nleaf = branch->nparticles;
+  }else{
+    info.first = 0;
+    info.nleaf = 0;
+  }
+  
+  info.first_big = Nbig;
+  info.Nbig = branch->Nbig_particles;
+  for(IndexType j = 0 ; j < branch->Nbig_particles ; ++j,++Nbig){
+    flat_big[Nbig] = branch->big_particles[j];
+    flat_big_x[2*Nbig] = xp[branch->big_particles[j]][0];
+    flat_big_x[2*Nbig+1] = xp[branch->big_particles[j]][1];
+  }
+  
+  if(branch->child0 != NULL && branch->child0->nparticles > 0) _FlattenTree(branch->child0,Nnodes,Nbig);
+  if(branch->child1 != NULL && branch->child1->nparticles > 0) _FlattenTree(branch->child1,Nnodes,Nbig);
+  if(branch->child2 != NULL && branch->child2->nparticles > 0) _FlattenTree(branch->child2,Nnodes,Nbig);
+  if(branch->child3 != NULL && branch->child3->nparticles > 0) _FlattenTree(branch->child3,Nnodes,Nbig);
+  
+  flat_nodes[i].next = Nnodes;
+}
+
+/** \brief Calculates the complex multipole coefficients of every node up to expansion_order.
+ *
+ *  The coefficients of a node about its center of mass c are a_n = sum_k m_k (z_k - c)^n where z_k
+ *  are the particle positions as complex numbers.  They are calculated directly for the leaves
+ *  and for the other nodes by shifting the coefficients of their children, so this is O(N).
+ *  Nothing is done if expansion_order == 2 because then the quadrupole moments from CalcMoments() are used.
+ */
+void TreeQuad::CalcMultipoles(){
+  
+  if(expansion_order < 2 || expansion_order > 16){
+    throw std::invalid_argument("TreeQuad expansion order must be between 2 and 16.");
+  }
+  if(expansion_order == 2 || Nflat == 0) return;
+  
+  const int p = expansion_order;
+  flat_multipoles = new std::complex<PosType>[Nflat*(p+1)];
+  
+  // binomial coefficients
+  std::vector<PosType> binomial((p+1)*(p+1),0);
+  for(int n = 0 ; n <= p ; ++n){
+    binomial[n*(p+1)] = 1;
+    for(int k = 1 ; k <= n ; ++k) binomial[n*(p+1) + k] = binomial[(n-1)*(p+1) + k - 1] + binomial[(n-1)*(p+1) + k];
+  }
+  
+  std::complex<PosType> t,tn;
+  
+  // the children always come after their parent
+  for(IndexType i = Nflat ; i-- > 0 ;){
+    const QFlatNode &node = flat_nodes[i];
+    const QFlatInfo &info = flat_info[i];
+    std::complex<PosType> *a = &flat_multipoles[i*(p+1)];
+    
+    for(int n = 0 ; n <= p ; ++n) a[n] = 0;
+    
+    if(info.nleaf > 0){
+      for(IndexType j = info.first ; j < info.first + info.nleaf ; ++j){
+        t = std::complex<PosType>(flat_x[2*j] - node.center[0],flat_x[2*j+1] - node.center[1]);
+        tn = flat_mass[j];
+        for(int n = 0 ; n <= p ; ++n){
+          a[n] += tn;
+          tn *= t;
+        }
+      }
+    }else{
+      for(IndexType c = i + 1 ; c < node.next ; c = flat_nodes[c].next){
+        const std::complex<PosType> *b = &flat_multipoles[c*(p+1)];
+        t = std::complex<PosType>(flat_nodes[c].center[0] - node.center[0],flat_nodes[c].center[1] - node.center[1]);
+        
+        // a_n = sum_k binomial(n,k) b_k t^(n-k)
+        std::complex<PosType> tpow[17];
+        tpow[0] = 1;
+        for(int n = 1 ; n <= p ; ++n) tpow[n] = tpow[n-1]*t;
+        for(int n = 0 ; n <= p ; ++n){
+          for(int k = 0 ; k <= n ; ++k) a[n] += binomial[n*(p+1) + k]*b[k]*tpow[n-k];
+        }
+      }
+    }
+  }
+}
+
+/** \brief Adds the contribution of the multipole expansion of a node to a ray.
+ *
+ *  With w the position of the ray relative to the center of mass of the node as a complex number,
+ *  f(w) = sum_n a_n / w^(n+1) and the deflection is conj(f)/pi, the shear conj(f')/pi and the potential
+ *  is (a_0 log|w| - Re sum_{n>0} a_n / (n w^n) )/pi.  Kappa is zero outside the node.
+ */
+inline void TreeQuad::multipole_force(IndexType node,PosType const *xcm,PosType rcm2,PosType screening
+                                      ,PosType *alpha,KappaType *gamma,KappaType *phi) const{
+  
+  const std::complex<PosType> *a = &flat_multipoles[node*(expansion_order+1)];
+  std::complex<PosType> u = std::complex<PosType>(-xcm[0],xcm[1])/rcm2;  // 1/w
+  std::complex<PosType> un = u,f = 0,fp = 0,pot = 0;
+  
+  for(int n = 0 ; n <= expansion_order ; ++n){
+    // un = u^(n+1)
+    f += a[n]*un;
+    if(n > 0) pot -= a[n]*un/(u*PosType(n));
+    un *= u;
+    fp -= PosType(n+1)*a[n]*un;
+  }
+  
+  alpha[0] += f.real()/pi*screening;
+  alpha[1] -= f.imag()/pi*screening;
+  gamma[0] += fp.real()/pi*screening;
+  gamma[1] -= fp.imag()/pi*screening;
+  *phi += (0.5*a[0].real()*log(rcm2) + pot.real())/pi*screening;
+}
+
 /// simple rotates the coordinates in the xp array
 void TreeQuad::rotate_coordinates(PosType **coord){
 	IndexType i;
@@ -812,11 +1008,11 @@ void TreeQuad::force2D_recur(const PosType *ray,PosType *alpha,KappaType *kappa,
       for(int j = -1;j<2;++j){
         tmp_ray[0] = tmp_c[0] + i*original_xl;
         tmp_ray[1] = tmp_c[1] + j*original_yl;
-        walkTree_recur(tree->top,tmp_ray,alpha,kappa,gamma,phi);
+        walkTree_flat(tmp_ray,alpha,kappa,gamma,phi);
       }
     }
   }else{
-    walkTree_recur(tree->top,ray,alpha,kappa,gamma,phi);
+    walkTree_flat(ray,alpha,kappa,gamma,phi);
   }
   
   // Subtract off uniform mass sheet to compensate for the extra mass
@@ -863,7 +1059,7 @@ void TreeQuad::walkTree_recur(QBranchNB *branch,PosType const *ray,PosType *alph
           xcm[1] = tree->xp[branch->particles[i]][1] - ray[1];
           
           rcm2 = xcm[0]*xcm[0] + xcm[1]*xcm[1];
-          double screening = exp(-rcm2*inv_screening_scale2);
+          double screening = (inv_screening_scale2 == 0) ? 1.0 : exp(-rcm2*inv_screening_scale2);
           if(rcm2 < 1e-20) rcm2 = 1e-20;
           
           tmp_index = MultiMass*branch->particles[i];
@@ -947,8 +1143,8 @@ void TreeQuad::walkTree_recur(QBranchNB *branch,PosType const *ray,PosType *alph
 				gamma[0] += 0.5*(xcm[0]*xcm[0]-xcm[1]*xcm[1])*tmp;
 				gamma[1] += xcm[0]*xcm[1]*tmp;
         
-        *phi += 0.5*tree->current->mass*log( rcm2cell )/pi*screening;
-        *phi -= 0.5*( tree->current->quad[0]*xcm[0]*xcm[0] + tree->current->quad[1]*xcm[1]*xcm[1] + 2*tree->current->quad[2]*xcm[0]*xcm[1] )/(pi*rcm2cell*rcm2cell)*screening;
+        *phi += 0.5*branch->mass*log( rcm2cell )/pi*screening;
+        *phi -= 0.5*( branch->quad[0]*xcm[0]*xcm[0] + branch->quad[1]*xcm[1]*xcm[1] + 2*branch->quad[2]*xcm[0]*xcm[1] )/(pi*rcm2cell*rcm2cell)*screening;
 			}
       
 			// quadrapole contribution
@@ -971,6 +1167,862 @@ void TreeQuad::walkTree_recur(QBranchNB *branch,PosType const *ray,PosType *alph
 	return;
 }
 
+/** \brief Does the same as walkTree_recur() starting from the top of the tree, but on the compact
+ *  copy of the tree so that the memory is read in order instead of following pointers.
+ */
+void TreeQuad::walkTree_flat(PosType const *ray,PosType *alpha,KappaType *kappa,KappaType *gamma, KappaType *phi){
+  
+  PosType xcm[2],rcm2cell,rcm2,tmp,prefac,screening;
+  IndexType i,j;
+  std::size_t tmp_index;
+  
+  i = 0;
+  while(i < Nflat){
+    const QFlatNode &node = flat_nodes[i];
+    
+    xcm[0] = node.center[0] - ray[0];
+    xcm[1] = node.center[1] - ray[1];
+    
+    rcm2cell = xcm[0]*xcm[0] + xcm[1]*xcm[1];
+    
+    if(rcm2cell < node.ropen2){
+      const QFlatInfo &info = flat_info[i];
+      
+      // Treat all particles in a leaf as a point particle
+      for(j = info.first ; j < info.first + info.nleaf ; ++j){
+        
+        xcm[0] = flat_x[2*j] - ray[0];
+        xcm[1] = flat_x[2*j+1] - ray[1];
+        
+        rcm2 = xcm[0]*xcm[0] + xcm[1]*xcm[1];
+        screening = (inv_screening_scale2 == 0) ? 1.0 : exp(-rcm2*inv_screening_scale2);
+        if(rcm2 < 1e-20) rcm2 = 1e-20;
+        
+        prefac = flat_mass[j];
+        prefac /= rcm2*pi/screening;
+        
+        alpha[0] += -1.0*prefac*xcm[0];
+        alpha[1] += -1.0*prefac*xcm[1];
+        
+        tmp = -2.0*prefac/rcm2;
+        
+        gamma[0] += 0.5*(xcm[0]*xcm[0]-xcm[1]*xcm[1])*tmp;
+        gamma[1] += xcm[0]*xcm[1]*tmp;
+        
+        *phi += prefac*rcm2*0.5*log(rcm2);
+      }
+      
+      // Find the particles that intersect with ray and add them individually.
+      if(rcm2cell < info.rbig2){
+        for(j = info.first_big ; j < info.first_big + info.Nbig ; ++j){
+          
+          tmp_index = flat_big[j];
+          
+          xcm[0] = flat_big_x[2*j] - ray[0];
+          xcm[1] = flat_big_x[2*j+1] - ray[1];
+          rcm2 = xcm[0]*xcm[0] + xcm[1]*xcm[1];
+          
+          if(haloON){
+            screening = exp(-rcm2*inv_screening_scale2);
+            halos[tmp_index]->force_halo(alpha,kappa,gamma,phi,xcm,true,screening);
+          }else{  // case of no halos just particles and no class derived from TreeQuad
+            
+            if(rcm2 < 1e-20) rcm2 = 1e-20;
+            
+            PosType size = sizes[tmp_index*MultiRadius];
+            
+            // intersecting, subtract the point particle
+            if(rcm2 < 4*size*size){
+              b_spline_profile(xcm,sqrt(rcm2),masses[MultiMass*tmp_index],size,alpha,kappa,gamma,phi);
+            }
+          }
+        }
+      }
+      
+      // on to the first child
+      ++i;
+    }else{
+      // use whole cell
+      
+      screening = exp(-rcm2cell*inv_screening_scale2);
+      
+      if(expansion_order > 2){
+        multipole_force(i,xcm,rcm2cell,screening,alpha,gamma,phi);
+        i = node.next;
+        continue;
+      }
+      
+      tmp = -1.0*node.mass/rcm2cell/pi*screening;
+      
+      alpha[0] += tmp*xcm[0];
+      alpha[1] += tmp*xcm[1];
+      
+      tmp = -2.0*node.mass/pi/rcm2cell/rcm2cell*screening;
+      gamma[0] += 0.5*(xcm[0]*xcm[0]-xcm[1]*xcm[1])*tmp;
+      gamma[1] += xcm[0]*xcm[1]*tmp;
+      
+      *phi += 0.5*node.mass*log( rcm2cell )/pi*screening;
+      *phi -= 0.5*( node.quad[0]*xcm[0]*xcm[0] + node.quad[1]*xcm[1]*xcm[1] + 2*node.quad[2]*xcm[0]*xcm[1] )/(pi*rcm2cell*rcm2cell)*screening;
+      
+      // quadrapole contribution
+      //   the kappa and gamma are not calculated to this order
+      alpha[0] -= (node.quad[0]*xcm[0] + node.quad[2]*xcm[1])
+      /(rcm2cell*rcm2cell)/pi*screening;
+      alpha[1] -= (node.quad[1]*xcm[1] + node.quad[2]*xcm[0])
+      /(rcm2cell*rcm2cell)/pi*screening;
+      
+      tmp = 4*(node.quad[0]*xcm[0]*xcm[0] + node.quad[1]*xcm[1]*xcm[1]
+               + 2*node.quad[2]*xcm[0]*xcm[1])/(rcm2cell*rcm2cell*rcm2cell)/pi*screening;
+      
+      alpha[0] += tmp*xcm[0];
+      alpha[1] += tmp*xcm[1];
+      
+      // skip the subtree
+      i = node.next;
+    }
+  }
+}
+
+/** \brief Calculates the same thing as TreeQuad::force2D_recur() for N rays at once.
+ *
+ *  The rays are cut into packets of up to TreeQuad::packet_size rays that walk the tree together.
+ *  Each cell is first tested against the bounding box of the packet so that when the whole packet
+ *  is far enough away the expansion is applied to all the rays without testing them one by one.
+ *  Otherwise only the rays that need it go on down into the children.  The contributions to each
+ *  ray are added in the same order as in force2D_recur() so the results are the same.
+ *
+ *  For this to be efficient rays that are close together should be next to each other in x0[], x1[].
+ *  The screening calculation is compiled out when inv_screening_scale2 == 0.
+ */
+void TreeQuad::force2D_batch(size_t N          /// number of rays
+                             ,const PosType *x0   /// first coordinate of the rays
+                             ,const PosType *x1   /// second coordinate of the rays
+                             ,PosType *alpha0,PosType *alpha1,KappaType *kappa
+                             ,KappaType *gamma0,KappaType *gamma1,KappaType *gamma2,KappaType *phi){
+  
+  assert(tree);
+  
+  RayPacket packet;
+  int active[packet_size];
+  int k;
+  
+  for(k = 0 ; k < packet_size ; ++k) active[k] = k;
+  
+  for(size_t start = 0 ; start < N ; start += packet_size){
+    
+    packet.n = (N - start < packet_size) ? N - start : packet_size;
+    
+    for(k = 0 ; k < packet.n ; ++k){
+      packet.alpha[0][k] = packet.alpha[1][k] = 0.0;
+      packet.gamma[0][k] = packet.gamma[1][k] = packet.gamma[2][k] = 0.0;
+      packet.kappa[k] = packet.phi[k] = 0.0;
+    }
+    
+    int Nshift = periodic_buffer ? 1 : 0;
+    for(int i = -Nshift ; i <= Nshift ; ++i){
+      for(int j = -Nshift ; j <= Nshift ; ++j){
+        for(k = 0 ; k < packet.n ; ++k){
+          packet.x[0][k] = x0[start + k] + i*original_xl;
+          packet.x[1][k] = x1[start + k] + j*original_yl;
+        }
+        
+        if(Nflat == 0) continue;
+        if(inv_screening_scale2 == 0) walkTree_packet<false>(0,packet,active,packet.n);
+        else walkTree_packet<true>(0,packet,active,packet.n);
+      }
+    }
+    
+    // Subtract off uniform mass sheet to compensate for the extra mass
+    //  added to the universe in the halos.
+    for(k = 0 ; k < packet.n ; ++k){
+      alpha0[start + k] = packet.alpha[0][k];
+      alpha1[start + k] = packet.alpha[1][k];
+      alpha0[start + k] -= x0[start + k]*sigma_background*(inv_screening_scale2 == 0);
+      alpha1[start + k] -= x1[start + k]*sigma_background*(inv_screening_scale2 == 0);
+      
+      kappa[start + k] = packet.kappa[k];
+      kappa[start + k] -= sigma_background;
+      
+      gamma0[start + k] = packet.gamma[0][k];
+      gamma1[start + k] = packet.gamma[1][k];
+      gamma2[start + k] = packet.gamma[2][k];
+      phi[start + k] = packet.phi[k];
+    }
+  }
+}
+
+/// copies the positions and the results so far of the rays index[0..n-1] in packet into lanes
+void TreeQuad::gatherLanes(const RayPacket &packet,const int *index,int n,RayLanes &lanes) const{
+  lanes.n = n;
+  lanes.npad = (n + lane_width - 1) & ~(lane_width - 1);
+  for(int a = 0 ; a < lanes.npad ; ++a){
+    const int k = (a < n) ? index[a] : index[0];
+    lanes.x[0][a] = packet.x[0][k];
+    lanes.x[1][a] = packet.x[1][k];
+    lanes.alpha[0][a] = packet.alpha[0][k];
+    lanes.alpha[1][a] = packet.alpha[1][k];
+    lanes.gamma[0][a] = packet.gamma[0][k];
+    lanes.gamma[1][a] = packet.gamma[1][k];
+    lanes.phi[a] = packet.phi[k];
+  }
+}
+
+/// copies the results in lanes back to the rays of packet they were gathered from
+void TreeQuad::scatterLanes(const RayLanes &lanes,const int *index,RayPacket &packet) const{
+  for(int a = 0 ; a < lanes.n ; ++a){
+    const int k = index[a];
+    packet.alpha[0][k] = lanes.alpha[0][a];
+    packet.alpha[1][k] = lanes.alpha[1][a];
+    packet.gamma[0][k] = lanes.gamma[0][a];
+    packet.gamma[1][k] = lanes.gamma[1][a];
+    packet.phi[k] = lanes.phi[a];
+  }
+}
+
+/** \brief Adds the monopole and quadrupole of flat_nodes[inode] to the rays in lanes.
+ *
+ *  lanes.rcm2[], lanes.log_rcm2[] and, with screening, lanes.screening[] must be filled in.  The
+ *  arithmetic is the same as in walkTree_recur() so the results are too.
+ */
+template <bool screening_on>
+void TreeQuad::cellForce_lanes(IndexType inode,RayLanes &lanes) const{
+  
+  const QFlatNode &node = flat_nodes[inode];
+  const PosType cx = node.center[0],cy = node.center[1],mass = node.mass;
+  const PosType q0 = node.quad[0],q1 = node.quad[1],q2 = node.quad[2];
+  // the mask lets the compiler see that n is a multiple of lane_width so no remainder loop is needed
+  const int n = lanes.npad & ~(lane_width - 1);
+  
+  for(int a = 0 ; a < n ; ++a){
+    const PosType x0 = cx - lanes.x[0][a];
+    const PosType x1 = cy - lanes.x[1][a];
+    const PosType rcm2 = lanes.rcm2[a];
+    const PosType screening = screening_on ? lanes.screening[a] : 1.0;
+    
+    PosType tmp = -1.0*mass/rcm2/pi*screening;
+    
+    lanes.alpha[0][a] += tmp*x0;
+    lanes.alpha[1][a] += tmp*x1;
+    
+    tmp = -2.0*mass/pi/rcm2/rcm2*screening;
+    lanes.gamma[0][a] += 0.5*(x0*x0-x1*x1)*tmp;
+    lanes.gamma[1][a] += x0*x1*tmp;
+    
+    lanes.phi[a] += 0.5*mass*lanes.log_rcm2[a]/pi*screening;
+    lanes.phi[a] -= 0.5*( q0*x0*x0 + q1*x1*x1 + 2*q2*x0*x1 )/(pi*rcm2*rcm2)*screening;
+    
+    // quadrapole contribution
+    lanes.alpha[0][a] -= (q0*x0 + q2*x1)/(rcm2*rcm2)/pi*screening;
+    lanes.alpha[1][a] -= (q1*x1 + q2*x0)/(rcm2*rcm2)/pi*screening;
+    
+    tmp = 4*(q0*x0*x0 + q1*x1*x1 + 2*q2*x0*x1)/(rcm2*rcm2*rcm2)/pi*screening;
+    
+    lanes.alpha[0][a] += tmp*x0;
+    lanes.alpha[1][a] += tmp*x1;
+  }
+}
+
+/** \brief Same as multipole_force() for all the rays in lanes.
+ *
+ *  The complex arithmetic is written out in real and imaginary parts with the loop over the rays
+ *  inside the loop over the order.  The results agree with multipole_force() to rounding.
+ */
+template <bool screening_on>
+void TreeQuad::multipoleForce_lanes(IndexType inode,RayLanes &lanes) const{
+  
+  const QFlatNode &node = flat_nodes[inode];
+  const std::complex<PosType> *coef = &flat_multipoles[inode*(expansion_order+1)];
+  // the mask lets the compiler see that n is a multiple of lane_width so no remainder loop is needed
+  const int n = lanes.npad & ~(lane_width - 1);
+  int a;
+  
+  // u = 1/w, p = u^n
+  PosType ur[packet_size],ui[packet_size],pr[packet_size],pi_[packet_size];
+  PosType fr[packet_size],fi[packet_size],fpr[packet_size],fpi[packet_size],pot[packet_size];
+  
+  for(a = 0 ; a < n ; ++a){
+    ur[a] = -(node.center[0] - lanes.x[0][a])/lanes.rcm2[a];
+    ui[a] = (node.center[1] - lanes.x[1][a])/lanes.rcm2[a];
+    pr[a] = 1;
+    pi_[a] = 0;
+    fr[a] = fi[a] = fpr[a] = fpi[a] = pot[a] = 0;
+  }
+  
+  for(int m = 0 ; m <= expansion_order ; ++m){
+    const PosType cr = coef[m].real(),ci = coef[m].imag();
+    
+    for(a = 0 ; a < n ; ++a){
+      // u^(m+1) and u^(m+2)
+      const PosType u1r = pr[a]*ur[a] - pi_[a]*ui[a],u1i = pr[a]*ui[a] + pi_[a]*ur[a];
+      const PosType u2r = u1r*ur[a] - u1i*ui[a],u2i = u1r*ui[a] + u1i*ur[a];
+      
+      fr[a] += cr*u1r - ci*u1i;
+      fi[a] += cr*u1i + ci*u1r;
+      if(m > 0) pot[a] -= (cr*pr[a] - ci*pi_[a])/m;
+      fpr[a] -= (m+1)*(cr*u2r - ci*u2i);
+      fpi[a] -= (m+1)*(cr*u2i + ci*u2r);
+      
+      pr[a] = u1r;
+      pi_[a] = u1i;
+    }
+  }
+  
+  const PosType a0 = coef[0].real();
+  for(a = 0 ; a < n ; ++a){
+    const PosType screening = screening_on ? lanes.screening[a] : 1.0;
+    lanes.alpha[0][a] += fr[a]/pi*screening;
+    lanes.alpha[1][a] -= fi[a]/pi*screening;
+    lanes.gamma[0][a] += fpr[a]/pi*screening;
+    lanes.gamma[1][a] -= fpi[a]/pi*screening;
+    lanes.phi[a] += (0.5*a0*lanes.log_rcm2[a] + pot[a])/pi*screening;
+  }
+}
+
+/** \brief Adds a point particle at (px,py) to the rays in lanes.
+ *
+ *  lanes.rcm2[] must hold the squared distances clamped at 1e-20, lanes.log_rcm2[] their log and,
+ *  with screening, lanes.screening[] the screening factors.  The clamp is left to the log() loop
+ *  because a comparison in this loop would stop it from being vectorized.
+ */
+template <bool screening_on>
+void TreeQuad::pointForce_lanes(PosType px,PosType py,PosType mass,RayLanes &lanes) const{
+  
+  // the mask lets the compiler see that n is a multiple of lane_width so no remainder loop is needed
+  const int n = lanes.npad & ~(lane_width - 1);
+  
+  for(int a = 0 ; a < n ; ++a){
+    const PosType x0 = px - lanes.x[0][a];
+    const PosType x1 = py - lanes.x[1][a];
+    const PosType rcm2 = lanes.rcm2[a];
+    const PosType screening = screening_on ? lanes.screening[a] : 1.0;
+    
+    PosType prefac = mass;
+    prefac /= rcm2*pi/screening;
+    
+    lanes.alpha[0][a] += -1.0*prefac*x0;
+    lanes.alpha[1][a] += -1.0*prefac*x1;
+    
+    const PosType tmp = -2.0*prefac/rcm2;
+    
+    lanes.gamma[0][a] += 0.5*(x0*x0-x1*x1)*tmp;
+    lanes.gamma[1][a] += x0*x1*tmp;
+    
+    lanes.phi[a] += prefac*rcm2*0.5*lanes.log_rcm2[a];
+  }
+}
+
+/// walks the subtree of flat_nodes[inode] for the rays in packet that are listed in active[]
+template <bool screening_on>
+void TreeQuad::walkTree_packet(IndexType inode,RayPacket &packet,const int *active,int Nactive){
+  
+  if(Nactive == 0) return;
+  
+  const QFlatNode &node = flat_nodes[inode];
+  
+  PosType xcm[2];
+  PosType rcm2cell[packet_size];
+  int near[packet_size],Nnear = 0;
+  int far[packet_size],Nfar = 0;
+  int a,k;
+  
+  // test the bounding box of the packet first
+  PosType p1[2] = {packet.x[0][active[0]],packet.x[1][active[0]]};
+  PosType p2[2] = {p1[0],p1[1]};
+  for(a = 1 ; a < Nactive ; ++a){
+    k = active[a];
+    p1[0] = MIN(p1[0],packet.x[0][k]);
+    p2[0] = MAX(p2[0],packet.x[0][k]);
+    p1[1] = MIN(p1[1],packet.x[1][k]);
+    p2[1] = MAX(p2[1],packet.x[1][k]);
+  }
+  xcm[0] = MAX(0,MAX(p1[0] - node.center[0],node.center[0] - p2[0]));
+  xcm[1] = MAX(0,MAX(p1[1] - node.center[1],node.center[1] - p2[1]));
+  
+  if( xcm[0]*xcm[0] + xcm[1]*xcm[1] > node.ropen2*(1 + 1.0e-8) ){
+    // the whole packet is far enough away
+    for(a = 0 ; a < Nactive ; ++a){
+      k = active[a];
+      far[a] = k;
+      xcm[0] = node.center[0] - packet.x[0][k];
+      xcm[1] = node.center[1] - packet.x[1][k];
+      rcm2cell[k] = xcm[0]*xcm[0] + xcm[1]*xcm[1];
+    }
+    Nfar = Nactive;
+  }else{
+    for(a = 0 ; a < Nactive ; ++a){
+      k = active[a];
+      xcm[0] = node.center[0] - packet.x[0][k];
+      xcm[1] = node.center[1] - packet.x[1][k];
+      rcm2cell[k] = xcm[0]*xcm[0] + xcm[1]*xcm[1];
+      
+      if( rcm2cell[k] < node.ropen2 ) near[Nnear++] = k;
+      else far[Nfar++] = k;
+    }
+  }
+  
+  // use whole cell
+  if(Nfar > 0){
+    RayLanes lanes;
+    gatherLanes(packet,far,Nfar,lanes);
+    for(a = 0 ; a < lanes.npad ; ++a) lanes.rcm2[a] = rcm2cell[(a < Nfar) ? far[a] : far[0]];
+    
+    for(a = 0 ; a < lanes.npad ; ++a) lanes.log_rcm2[a] = log(lanes.rcm2[a]);
+    if(screening_on){
+      for(a = 0 ; a < lanes.npad ; ++a) lanes.screening[a] = exp(-lanes.rcm2[a]*inv_screening_scale2);
+    }
+    
+    if(expansion_order > 2) multipoleForce_lanes<screening_on>(inode,lanes);
+    else cellForce_lanes<screening_on>(inode,lanes);
+    
+    scatterLanes(lanes,far,packet);
+  }
+  
+  if(Nnear == 0) return;
+  
+  addNodeParticles_packet<screening_on>(inode,packet,near,Nnear,rcm2cell);
+  
+  // the children follow their parent in the array
+  for(IndexType child = inode + 1 ; child < node.next ; child = flat_nodes[child].next)
+    walkTree_packet<screening_on>(child,packet,near,Nnear);
+}
+
+/** \brief Adds the particles that belong to flat_nodes[inode] itself, not to its children, to the rays
+ *  in packet that are listed in near[].  These are the rays that open the node.  rcm2cell[] is the
+ *  squared distance of each ray in the packet to the center of mass of the node.
+ */
+template <bool screening_on>
+void TreeQuad::addNodeParticles_packet(IndexType inode,RayPacket &packet,const int *near,int Nnear,const PosType *rcm2cell){
+  
+  PosType xcm[2],rcm2,screening;
+  int a,k;
+  IndexType j;
+  std::size_t tmp_index;
+  
+  const QFlatInfo &info = flat_info[inode];
+  
+  // Treat all particles in a leaf as a point particle
+  if(info.nleaf > 0){
+    RayLanes lanes;
+    gatherLanes(packet,near,Nnear,lanes);
+    const int npad = lanes.npad & ~(lane_width - 1);
+    
+    for(j = info.first ; j < info.first + info.nleaf ; ++j){
+      
+      const PosType px = flat_x[2*j],py = flat_x[2*j+1];
+      
+      for(a = 0 ; a < npad ; ++a){
+        xcm[0] = px - lanes.x[0][a];
+        xcm[1] = py - lanes.x[1][a];
+        lanes.rcm2[a] = xcm[0]*xcm[0] + xcm[1]*xcm[1];
+      }
+      if(screening_on){
+        for(a = 0 ; a < npad ; ++a) lanes.screening[a] = exp(-lanes.rcm2[a]*inv_screening_scale2);
+      }
+      for(a = 0 ; a < npad ; ++a){
+        if(lanes.rcm2[a] < 1e-20) lanes.rcm2[a] = 1e-20;
+        lanes.log_rcm2[a] = log(lanes.rcm2[a]);
+      }
+      
+      pointForce_lanes<screening_on>(px,py,flat_mass[j],lanes);
+    }
+    
+    scatterLanes(lanes,near,packet);
+  }
+  
+  // Find the particles that intersect with the rays and add them individually.
+  if(info.Nbig > 0){
+    int close[packet_size],Nclose = 0;
+    for(a = 0 ; a < Nnear ; ++a) if(rcm2cell[near[a]] < info.rbig2) close[Nclose++] = near[a];
+    
+    PosType alpha_tmp[2];
+    KappaType gamma_tmp[3];
+    
+    for(j = info.first_big ; j < info.first_big + info.Nbig ; ++j){
+      
+      tmp_index = flat_big[j];
+      
+      for(a = 0 ; a < Nclose ; ++a){
+        k = close[a];
+        
+        xcm[0] = flat_big_x[2*j] - packet.x[0][k];
+        xcm[1] = flat_big_x[2*j+1] - packet.x[1][k];
+        rcm2 = xcm[0]*xcm[0] + xcm[1]*xcm[1];
+        
+        alpha_tmp[0] = packet.alpha[0][k];
+        alpha_tmp[1] = packet.alpha[1][k];
+        gamma_tmp[0] = packet.gamma[0][k];
+        gamma_tmp[1] = packet.gamma[1][k];
+        gamma_tmp[2] = packet.gamma[2][k];
+        
+        if(haloON){
+          screening = screening_on ? exp(-rcm2*inv_screening_scale2) : 1.0;
+          halos[tmp_index]->force_halo(alpha_tmp,&packet.kappa[k],gamma_tmp,&packet.phi[k],xcm,true,screening);
+        }else{  // case of no halos just particles and no class derived from TreeQuad
+          
+          if(rcm2 < 1e-20) rcm2 = 1e-20;
+          
+          PosType size = sizes[tmp_index*MultiRadius];
+          
+          // intersecting, subtract the point particle
+          if(rcm2 < 4*size*size){
+            b_spline_profile(xcm,sqrt(rcm2),masses[MultiMass*tmp_index],size,alpha_tmp,&packet.kappa[k],gamma_tmp,&packet.phi[k]);
+          }
+        }
+        
+        packet.alpha[0][k] = alpha_tmp[0];
+        packet.alpha[1][k] = alpha_tmp[1];
+        packet.gamma[0][k] = gamma_tmp[0];
+        packet.gamma[1][k] = gamma_tmp[1];
+        packet.gamma[2][k] = gamma_tmp[2];
+      }
+    }
+  }
+}
+
+/** \brief Calculates the same thing as TreeQuad::force2D_batch() with a dual tree method that pays off
+ *  when there are many rays, for example all the rays of a GridMap.
+ *
+ *  A quadtree is built on the rays.  Going down this tree, the nodes of the particle tree that every ray
+ *  in a ray cell would use as a whole are put into a local (Taylor) expansion about the center of the
+ *  ray cell.  This is shifted on to the subcells and evaluated once for each ray at the leaves.  Nodes
+ *  that every ray in the cell opens have their own particles added directly and are replaced by their
+ *  children.  Only the nodes that some of the rays open and others do not are walked ray by ray with
+ *  walkTree_packet().  The nodes that are used as a whole are the same ones as in force2D_recur() so the
+ *  only additional error comes from cutting off the local expansions at order fmm_order.  The cost goes
+ *  as N + M instead of N log M for N rays and M particles.
+ *
+ *  The ray cells are done in parallel on the Utilities::ThreadPool.  For expansion_order >= 3 the deflections
+ *  agree with force2D_batch() to about 1e-7 relative.  The local expansions are built from the complex
+ *  multipoles, which at expansion_order == 2 do not match the quadrupole moments used by the other walks
+ *  (they differ by the quadrupole truncation error, about 1e-2 with theta_force = 0.5), so in that case,
+ *  with screening or for only a few rays force2D_batch() is used instead.
+ */
+void TreeQuad::force2D_fmm(size_t N          /// number of rays
+                           ,const PosType *x0   /// first coordinate of the rays
+                           ,const PosType *x1   /// second coordinate of the rays
+                           ,PosType *alpha0,PosType *alpha1,KappaType *kappa
+                           ,KappaType *gamma0,KappaType *gamma1,KappaType *gamma2,KappaType *phi){
+  
+  assert(tree);
+  
+  // the screening is not harmonic so it cannot be put into the local expansions and
+  // at quadrupole order there are no complex multipoles to build them from
+  if(expansion_order < 3 || inv_screening_scale2 != 0 || Nflat == 0 || N < 8*packet_size){
+    force2D_batch(N,x0,x1,alpha0,alpha1,kappa,gamma0,gamma1,gamma2,phi);
+    return;
+  }
+  
+  size_t k;
+  FMMTargets targets;
+  
+  targets.x[0] = x0;
+  targets.x[1] = x1;
+  targets.alpha[0] = alpha0;
+  targets.alpha[1] = alpha1;
+  targets.kappa = kappa;
+  targets.gamma[0] = gamma0;
+  targets.gamma[1] = gamma1;
+  targets.gamma[2] = gamma2;
+  targets.phi = phi;
+  
+  for(k = 0 ; k < N ; ++k){
+    alpha0[k] = alpha1[k] = 0.0;
+    gamma0[k] = gamma1[k] = gamma2[k] = 0.0;
+    kappa[k] = phi[k] = 0.0;
+  }
+  
+  // binomial coefficients
+  targets.nmax = expansion_order + fmm_order;
+  int n1 = targets.nmax + 1;
+  targets.binomial.assign(n1*n1,0);
+  for(int n = 0 ; n <= targets.nmax ; ++n){
+    targets.binomial[n*n1] = 1;
+    for(int m = 1 ; m <= n ; ++m) targets.binomial[n*n1 + m] = targets.binomial[(n-1)*n1 + m - 1] + targets.binomial[(n-1)*n1 + m];
+  }
+  
+  BuildFMMTargets(targets,N);
+  
+  Utilities::ThreadPool &pool = Utilities::ThreadPool::get();
+  
+  int Nshift = periodic_buffer ? 1 : 0;
+  for(int i = -Nshift ; i <= Nshift ; ++i){
+    for(int j = -Nshift ; j <= Nshift ; ++j){
+      targets.shift[0] = i*original_xl;
+      targets.shift[1] = j*original_yl;
+      
+      std::vector<FMMTask> tasks(1),children;
+      tasks[0].node = 0;
+      tasks[0].candidates.push_back(0);
+      for(int m = 0 ; m <= fmm_order ; ++m) tasks[0].L[m] = 0;
+      
+      // go down the ray tree until there are enough cells to keep all the threads busy
+      bool split = true;
+      while(split && tasks.size() < size_t(8*pool.size())){
+        split = false;
+        children.clear();
+        for(FMMTask &task : tasks){
+          if(targets.nodes[task.node].next == task.node + 1){
+            children.push_back(task);
+          }else{
+            fmm_interact(targets,task);
+            fmm_split(targets,task,children);
+            split = true;
+          }
+        }
+        tasks.swap(children);
+      }
+      
+      pool.parallel_for(tasks.size(),1,[this,&targets,&tasks](size_t start,size_t end){
+        for(size_t t = start ; t < end ; ++t) fmm_walk(targets,tasks[t]);
+      });
+    }
+  }
+  
+  // Subtract off uniform mass sheet to compensate for the extra mass
+  //  added to the universe in the halos.
+  for(k = 0 ; k < N ; ++k){
+    alpha0[k] -= x0[k]*sigma_background;
+    alpha1[k] -= x1[k]*sigma_background;
+    kappa[k] -= sigma_background;
+  }
+}
+
+/// builds the quadtree on the rays that is used in force2D_fmm()
+void TreeQuad::BuildFMMTargets(FMMTargets &targets,size_t N){
+  
+  targets.order.resize(N);
+  for(size_t i = 0 ; i < N ; ++i) targets.order[i] = i;
+  targets.nodes.clear();
+  targets.nodes.reserve(2*N/fmm_leaf_size + 1);
+  
+  PosType p1[2] = {targets.x[0][0],targets.x[1][0]};
+  PosType p2[2] = {p1[0],p1[1]};
+  for(size_t i = 1 ; i < N ; ++i){
+    p1[0] = MIN(p1[0],targets.x[0][i]);
+    p2[0] = MAX(p2[0],targets.x[0][i]);
+    p1[1] = MIN(p1[1],targets.x[1][i]);
+    p2[1] = MAX(p2[1],targets.x[1][i]);
+  }
+  
+  _BuildFMMTargets(targets,0,N,p1,MAX(p2[0]-p1[0],p2[1]-p1[1]),0);
+}
+
+void TreeQuad::_BuildFMMTargets(FMMTargets &targets,size_t first,size_t n,PosType const *p1,PosType boxsize,int depth){
+  
+  size_t inode = targets.nodes.size();
+  targets.nodes.push_back(FMMNode());
+  
+  const PosType *x = targets.x[0],*y = targets.x[1];
+  PosType center[2] = {p1[0] + boxsize/2,p1[1] + boxsize/2};
+  PosType r2,r2max = 0;
+  size_t *ray = &targets.order[first];
+  
+  for(size_t i = 0 ; i < n ; ++i){
+    r2 = (x[ray[i]] - center[0])*(x[ray[i]] - center[0]) + (y[ray[i]] - center[1])*(y[ray[i]] - center[1]);
+    r2max = MAX(r2max,r2);
+  }
+  
+  FMMNode &node = targets.nodes[inode];
+  node.center[0] = center[0];
+  node.center[1] = center[1];
+  node.radius = sqrt(r2max);
+  node.first = first;
+  node.n = n;
+  
+  // the depth limit is for rays that are all at the same position
+  if(n > fmm_leaf_size && depth < 48){
+    
+    // sort into quadrants, first by y and then by x
+    size_t *mid = std::partition(ray,ray + n,[y,&center](size_t i){return y[i] < center[1];});
+    size_t *bounds[5] = {ray
+      ,std::partition(ray,mid,[x,&center](size_t i){return x[i] < center[0];})
+      ,mid
+      ,std::partition(mid,ray + n,[x,&center](size_t i){return x[i] < center[0];})
+      ,ray + n};
+    
+    PosType half = boxsize/2,p1c[2];
+    for(int c = 0 ; c < 4 ; ++c){
+      if(bounds[c+1] == bounds[c]) continue;
+      p1c[0] = p1[0] + (c%2)*half;
+      p1c[1] = p1[1] + (c/2)*half;
+      _BuildFMMTargets(targets,first + (bounds[c] - ray),bounds[c+1] - bounds[c],p1c,half,depth+1);
+    }
+  }
+  
+  targets.nodes[inode].next = targets.nodes.size();
+}
+
+/** \brief Sorts the candidate source nodes of a ray cell into the ones that go into its local expansion,
+ *  the ones that all the rays open and the ones that have to be passed on to the subcells.
+ *
+ *  A node goes into the local expansion when every ray in the cell is outside its opening radius and the
+ *  cell is small compared to the distance.  The local expansion coefficients of the complex potential
+ *  a_0 log(w) - sum_{n>0} a_n / (n w^n) about the cell center, with d the cell center relative to the
+ *  node, are L_0 = a_0 log|d| - sum_{n>0} a_n / (n d^n) and
+ *  L_k = (-1)^(k+1)/k sum_n binomial(n+k-1,k-1) a_n / d^(n+k).
+ */
+void TreeQuad::fmm_interact(FMMTargets &targets,FMMTask &task){
+  
+  // largest ratio of the ray cell radius to the distance from the edge of the source node
+  const PosType fmm_theta = 0.5;
+  
+  const FMMNode &tnode = targets.nodes[task.node];
+  const int p = expansion_order,q = fmm_order,n1 = targets.nmax + 1;
+  PosType d[2],r,sign;
+  std::complex<PosType> dpow[2*fmm_order + 1],sum;
+  std::vector<IndexType> remaining;
+  int n,k;
+  
+  // the children of opened nodes are added to the end of the list
+  for(size_t c = 0 ; c < task.candidates.size() ; ++c){
+    IndexType s = task.candidates[c];
+    const QFlatNode &snode = flat_nodes[s];
+    
+    d[0] = tnode.center[0] + targets.shift[0] - snode.center[0];
+    d[1] = tnode.center[1] + targets.shift[1] - snode.center[1];
+    r = sqrt(d[0]*d[0] + d[1]*d[1]);
+    
+    if(r > tnode.radius && (r - tnode.radius)*(r - tnode.radius) >= snode.ropen2
+       && tnode.radius <= fmm_theta*(r - flat_info[s].rmax) ){
+      
+      const std::complex<PosType> *a = &flat_multipoles[s*(p+1)];
+      
+      dpow[0] = 1;
+      dpow[1] = 1.0/std::complex<PosType>(d[0],d[1]);
+      for(n = 2 ; n <= p + q ; ++n) dpow[n] = dpow[n-1]*dpow[1];
+      
+      task.L[0] += a[0]*log(r);
+      for(n = 1 ; n <= p ; ++n) task.L[0] -= a[n]*dpow[n]/PosType(n);
+      
+      sign = 1;
+      for(k = 1 ; k <= q ; ++k){
+        sum = 0;
+        for(n = 0 ; n <= p ; ++n) sum += targets.binomial[(n+k-1)*n1 + k-1]*a[n]*dpow[n+k];
+        task.L[k] += sign*sum/PosType(k);
+        sign = -sign;
+      }
+    }else if( (r + tnode.radius)*(r + tnode.radius) < snode.ropen2 ){
+      task.opened.push_back(s);
+      for(IndexType child = s + 1 ; child < snode.next ; child = flat_nodes[child].next)
+        task.candidates.push_back(child);
+    }else{
+      remaining.push_back(s);
+    }
+  }
+  
+  task.candidates.swap(remaining);
+}
+
+/// makes the tasks for the subcells of a ray cell with the local expansion shifted to their centers
+void TreeQuad::fmm_split(FMMTargets &targets,const FMMTask &task,std::vector<FMMTask> &children){
+  
+  const FMMNode &tnode = targets.nodes[task.node];
+  const int q = fmm_order,n1 = targets.nmax + 1;
+  std::complex<PosType> t,tpow[fmm_order + 1];
+  int k,l;
+  
+  for(size_t c = task.node + 1 ; c < tnode.next ; c = targets.nodes[c].next){
+    children.push_back(FMMTask());
+    FMMTask &child = children.back();
+    
+    child.node = c;
+    child.candidates = task.candidates;
+    child.opened = task.opened;
+    
+    t = std::complex<PosType>(targets.nodes[c].center[0] - tnode.center[0],targets.nodes[c].center[1] - tnode.center[1]);
+    tpow[0] = 1;
+    for(k = 1 ; k <= q ; ++k) tpow[k] = tpow[k-1]*t;
+    
+    // L'_l = sum_{k>=l} binomial(k,l) L_k t^(k-l)
+    for(l = 0 ; l <= q ; ++l){
+      child.L[l] = 0;
+      for(k = l ; k <= q ; ++k) child.L[l] += targets.binomial[k*n1 + l]*task.L[k]*tpow[k-l];
+    }
+  }
+}
+
+/// does a ray cell and all of its subcells
+void TreeQuad::fmm_walk(FMMTargets &targets,FMMTask &task){
+  
+  fmm_interact(targets,task);
+  
+  if(targets.nodes[task.node].next == task.node + 1){
+    fmm_leaf(targets,task);
+  }else{
+    std::vector<FMMTask> children;
+    fmm_split(targets,task,children);
+    for(FMMTask &child : children) fmm_walk(targets,child);
+  }
+}
+
+/** \brief Adds the local expansion, the particles of the opened source nodes and the source nodes that
+ *  are still unresolved to the rays in a leaf of the ray tree.
+ */
+void TreeQuad::fmm_leaf(FMMTargets &targets,const FMMTask &task){
+  
+  const FMMNode &tnode = targets.nodes[task.node];
+  const int q = fmm_order;
+  
+  RayPacket packet;
+  int active[packet_size];
+  PosType rcm2cell[packet_size],xcm[2];
+  std::complex<PosType> y,Phi,f,fp;
+  int k,n;
+  
+  for(k = 0 ; k < packet_size ; ++k) active[k] = k;
+  
+  for(size_t start = 0 ; start < tnode.n ; start += packet_size){
+    
+    const size_t *ray = &targets.order[tnode.first + start];
+    packet.n = (tnode.n - start < packet_size) ? tnode.n - start : packet_size;
+    
+    for(k = 0 ; k < packet.n ; ++k){
+      packet.x[0][k] = targets.x[0][ray[k]] + targets.shift[0];
+      packet.x[1][k] = targets.x[1][ray[k]] + targets.shift[1];
+      
+      // local expansion, Phi is the complex potential, f = Phi' and fp = Phi''
+      y = std::complex<PosType>(targets.x[0][ray[k]] - tnode.center[0],targets.x[1][ray[k]] - tnode.center[1]);
+      Phi = task.L[q];
+      f = PosType(q)*task.L[q];
+      fp = PosType(q*(q-1))*task.L[q];
+      for(n = q - 1 ; n >= 0 ; --n){
+        Phi = Phi*y + task.L[n];
+        if(n > 0) f = f*y + PosType(n)*task.L[n];
+        if(n > 1) fp = fp*y + PosType(n*(n-1))*task.L[n];
+      }
+      
+      packet.alpha[0][k] = f.real()/pi;
+      packet.alpha[1][k] = -f.imag()/pi;
+      packet.gamma[0][k] = fp.real()/pi;
+      packet.gamma[1][k] = -fp.imag()/pi;
+      packet.gamma[2][k] = 0.0;
+      packet.kappa[k] = 0.0;
+      packet.phi[k] = Phi.real()/pi;
+    }
+    
+    for(IndexType s : task.opened){
+      for(k = 0 ; k < packet.n ; ++k){
+        xcm[0] = flat_nodes[s].center[0] - packet.x[0][k];
+        xcm[1] = flat_nodes[s].center[1] - packet.x[1][k];
+        rcm2cell[k] = xcm[0]*xcm[0] + xcm[1]*xcm[1];
+      }
+      addNodeParticles_packet<false>(s,packet,active,packet.n,rcm2cell);
+    }
+    
+    for(IndexType s : task.candidates) walkTree_packet<false>(s,packet,active,packet.n);
+    
+    for(k = 0 ; k < packet.n ; ++k){
+      targets.alpha[0][ray[k]] += packet.alpha[0][k];
+      targets.alpha[1][ray[k]] += packet.alpha[1][k];
+      targets.kappa[ray[k]] += packet.kappa[k];
+      targets.gamma[0][ray[k]] += packet.gamma[0][k];
+      targets.gamma[1][ray[k]] += packet.gamma[1][k];
+      targets.gamma[2][ray[k]] += packet.gamma[2][k];
+      targets.phi[ray[k]] += packet.phi[k];
+    }
+  }
+}
+
 /** This is a diagnostic routine that prints the position of every point in a
  * given branch of the tree.
  */
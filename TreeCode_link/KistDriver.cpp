@@ -107,6 +107,18 @@ void TreeStruct::FindAllBoxNeighborsKist(Point *point,Kist<Point> * neighbors) c
 // *************************************************/
 	return;
 }
+/** \ingroup ImageFundingL2
+ *
+ * \brief Same as FindAllBoxNeighborsKist() but the neighbors are appended to a FlatKist
+ * which is not emptied first.
+ */
+void TreeStruct::FindAllBoxNeighbors(Point *point,FlatKist<Point> &neighbors) const{
+  for(std::list<Branch *>::const_iterator it = point->leaf->neighbors.begin();
+      it != point->leaf->neighbors.end() ; ++it){
+    assert((*it)->npoints <= 1);
+    if((*it)->npoints == 1) neighbors.push_back((*it)->points);
+  }
+}
 /**  \ingroup LowLevel
  * A recessive function that was used in FindAllBoxNeighborsKist().
 *    It has been known to cause stack overflow. Use _FindAllBoxNeighborsKist_iter instead.
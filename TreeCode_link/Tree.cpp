@@ -160,9 +160,12 @@ void FreeBranch(Branch *branch){
  **/
 Point *NewPointArray(
 		unsigned long N  /// number of points in array
+		,PointPool *pool /// if not NULL the array is taken from this pool
 		){
 
   if(N <= 0) return NULL;
+  if(pool != NULL) return pool->NewPointArray(N);
+  
   Point *points = new Point[N];
   points[0].head = N;
 
@@ -183,7 +186,7 @@ void FreePointArray(Point *array,bool NewXs){
 	  //if(NewXs) for(i=0;i<array[0].head;++i) free(array[i].x);
 	  //free(array);
 	  //if(NewXs) for(i=0;i<array[0].head;++i) delete[] array[i].x;
-	  delete[] array;
+	  if(!PointPool::Free(array)) delete[] array;
   }else{
 	  ERROR_MESSAGE();
 	  std::cout << "ERROR: FreePointArray, miss aligned attempt to free point array" << std::endl;
@@ -191,6 +194,139 @@ void FreePointArray(Point *array,bool NewXs){
   }
 }
 
+std::map<const Point *,PointPool::Slab *> PointPool::registry;
+std::mutex PointPool::registry_mutex;
+
+PointPool::PointPool(
+    size_t my_slab_size  /// minimum number of points in each slab
+    ):slab_size(my_slab_size),current(NULL),Npoints(0),bytes(0),high_water(0)
+{
+  if(slab_size < 1) throw std::invalid_argument("PointPool: slab size must be positive");
+}
+
+PointPool::~PointPool(){
+  std::lock_guard<std::mutex> lock(mtx);
+  while(slabs.size() > 0) releaseSlab(slabs.back());
+}
+
+Point *PointPool::NewPointArray(unsigned long N){
+  if(N <= 0) return NULL;
+  
+  std::lock_guard<std::mutex> lock(mtx);
+  
+  Slab *slab;
+  if(N > slab_size){
+    // large arrays get a slab of their own
+    slab = newSlab(N);
+  }else{
+    if(current == NULL || current->capacity - current->used < N) current = newSlab(slab_size);
+    slab = current;
+  }
+  
+  Point *points = slab->base + slab->used;
+  slab->used += N;
+  ++(slab->Narrays);
+  Npoints += N;
+  
+  for(unsigned long i = 0; i < N; ++i) new (points + i) Point;
+  points[0].head = N;
+  for(unsigned long i = 1; i < N; i++) points[i].head = 0;
+  
+  return points;
+}
+
+bool PointPool::Free(Point *array){
+  Slab *slab = NULL;
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    if(registry.size() == 0) return false;
+    auto it = registry.upper_bound(array);
+    if(it == registry.begin()) return false;
+    --it;
+    if(array >= it->second->base + it->second->capacity) return false;
+    slab = it->second;
+  }
+  
+  // the slab cannot be released by another thread while this array is still in it
+  slab->pool->free(slab,array);
+  return true;
+}
+
+void PointPool::free(Slab *slab,Point *array){
+  std::lock_guard<std::mutex> lock(mtx);
+  
+  Npoints -= array->head;
+  if(--(slab->Narrays) > 0) return;
+  
+  if(slab == current){
+    // keep the slab that is being filled and start again at the beginning
+    for(size_t i = 0; i < slab->used; ++i) slab->base[i].~Point();
+    slab->used = 0;
+  }else{
+    releaseSlab(slab);
+  }
+}
+
+size_t PointPool::getNpoints() const{
+  std::lock_guard<std::mutex> lock(mtx);
+  return Npoints;
+}
+size_t PointPool::getBytes() const{
+  std::lock_guard<std::mutex> lock(mtx);
+  return bytes;
+}
+size_t PointPool::getHighWaterBytes() const{
+  std::lock_guard<std::mutex> lock(mtx);
+  return high_water;
+}
+size_t PointPool::getNslabs() const{
+  std::lock_guard<std::mutex> lock(mtx);
+  return slabs.size();
+}
+
+/// must be called with mtx locked
+PointPool::Slab *PointPool::newSlab(size_t capacity){
+  Slab *slab = new Slab;
+  slab->pool = this;
+  slab->base = static_cast<Point *>(::operator new(capacity*sizeof(Point)));
+  slab->capacity = capacity;
+  slab->used = 0;
+  slab->Narrays = 0;
+  
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry[slab->base] = slab;
+  }
+  slabs.push_back(slab);
+  
+  bytes += capacity*sizeof(Point);
+  if(bytes > high_water) high_water = bytes;
+  
+  return slab;
+}
+
+/// must be called with mtx locked, the Points that were constructed in the slab are destroyed before the memory is given back
+void PointPool::releaseSlab(Slab *slab){
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.erase(slab->base);
+  }
+  
+  for(size_t i = 0; i < slabs.size(); ++i){
+    if(slabs[i] == slab){
+      slabs[i] = slabs.back();
+      slabs.pop_back();
+      break;
+    }
+  }
+  if(slab == current) current = NULL;
+  
+  bytes -= slab->capacity*sizeof(Point);
+  for(size_t i = 0; i < slab->used; ++i) slab->base[i].~Point();
+  ::operator delete(slab->base);
+  delete slab;
+}
+
 std::mutex TreeStruct::mutex;
 /**
  *  \brief  Make a new tree and the linked list of points in it.  Does
@@ -615,7 +751,7 @@ int checkBranch(Branch *branch){
    	return 0;
 }
 
-Point *AddPointToArray(Point *points,unsigned long N,unsigned long Nold){
+Point *AddPointToArray(Point *points,unsigned long N,unsigned long Nold,PointPool *pool){
 
   if(N==Nold) return points;
 
@@ -623,10 +759,10 @@ Point *AddPointToArray(Point *points,unsigned long N,unsigned long Nold){
   Point *newpoints;
 
   if(Nold==0){
-	  newpoints = NewPointArray(N);
+	  newpoints = NewPointArray(N,pool);
   }else{
 	  if(points[0].head != Nold){ ERROR_MESSAGE(); std::cout << "ERROR: AddPointToArray head not set correctly" << std::endl; exit(0);}
-	  newpoints = NewPointArray(N);
+	  newpoints = NewPointArray(N,pool);
 	  //for(i=N;i<Nold;++i) free(points[i].x);
 
 	  assert(points);
@@ -245,8 +245,7 @@ void divide_images_kist(
       ,std::vector<ImageInfo> &imageinfo
 	    ,int *Nimages
 	    ){
-	unsigned long i,j,Ntemp,Ntest;
-	Kist<Point> new_imagekist;
+	unsigned long i,Ntest;
 	PosType tmp = 0;
 
   
@@ -256,137 +255,65 @@ void divide_images_kist(
 		return ;
 	}
 
-	  // mark points in tree as in image and transfer points to temporary temporary new_imagekist
+	  // mark points in tree as in image and take the list of all of them out of the first image
 
-	imageinfo[0].imagekist->MoveToTop();
-	Ntest = imageinfo[0].imagekist->Nunits();
-	while(imageinfo[0].imagekist->Nunits() > 0){
-		imageinfo[0].imagekist->getCurrent()->in_image = YES;
-		imageinfo[0].imagekist->getCurrent()->image->in_image = YES;
-		new_imagekist.InsertAfterCurrent(imageinfo[0].imagekist->TakeOutCurrent());
-		new_imagekist.Down();
-	}
-
-  /*{ //Test
-    size_t yeses = 0;
-    PointList::iterator i_tree_pointlist_current(i_tree->pointlist->Top());
-    for(size_t i=0;i<i_tree->pointlist->size();++i){
-      if( (*i_tree_pointlist_current)->in_image == YES) ++yeses;
-      --i_tree_pointlist_current;
-    }
-
-    assert(yeses == new_imagekist.Nunits());
-  }*/
+  Kist<Point> *all_points = imageinfo[0].imagekist;
+  imageinfo[0].imagekist = new Kist<Point>;
+  all_points->SetInImage(YES);
+	Ntest = all_points->Nunits();
 
+  // reused for every image
+  FlatKist<Point> stack;
+  
+  // the points before it have all been put into images
+  Kist<Point>::iterator it = all_points->TopIt();
+  
 	i=0;
 	do{
 
     if(i > imageinfo.size()-1) imageinfo.resize(i+5);
-    //assert(imageinfo[i].imagekist->Nunits() == 0);
-
-		//printf("   new_imagekist %li\n",new_imagekist.Nunits());
-		imageinfo[i].area = partition_images_kist(new_imagekist.getCurrent(),imageinfo[i].imagekist,i_tree);
 
-/*		if(imageinfo[i].imagekist->Nunits() > new_imagekist.Nunits()){
-			bool test1,test2;
-			test1 = new_imagekist.AreDataUnique();
-			test2 = imageinfo[i].imagekist->AreDataUnique();
-			assert(imageinfo[i].imagekist->Nunits() <= new_imagekist.Nunits());  // check that no more than
-		}
-*/
-
-		// take out points that got un-marked in partition_images
+		partition_images_flat(&(*it),imageinfo[i].imagekist,stack,i_tree);
 
-		Ntemp = new_imagekist.Nunits();
+		// calculates area of image and its centroid
 		imageinfo[i].area = imageinfo[i].area_error = 0.0;
-
-		for( j=0,new_imagekist.MoveToTop() ; j < Ntemp ; ++j){
-			if(new_imagekist.getCurrent()->in_image == NO){
-
-				// calculates area of image
-				tmp = pow(new_imagekist.getCurrent()->gridsize,2 );
-				imageinfo[i].area += tmp;
-			    if(imageinfo[i].area_error < tmp) imageinfo[i].area_error = tmp;
-
-			    if(new_imagekist.AtTop()){
-			    	new_imagekist.TakeOutCurrent();
-			    }else{
-			    	new_imagekist.TakeOutCurrent();
-			    	new_imagekist.Down();
-			    }
-			}else{
-				new_imagekist.Down();
-			}
-
-			//printf("%li %li\n",new_imagekist.Nunits(),imageinfo[i].imagekist->Nunits());
-		}
-		imageinfo[i].area_error /= imageinfo[i].area;
-
-		// calculate image centroid
 		imageinfo[i].centroid[0] = 0;
 		imageinfo[i].centroid[1] = 0;
     imageinfo[i].gridrange[0] = imageinfo[i].gridrange[2] = imageinfo[i].imagekist->getCurrent()->gridsize;
     
-		imageinfo[i].imagekist->MoveToTop();
-		do{
-			tmp = imageinfo[i].imagekist->getCurrent()->gridsize;
-			imageinfo[i].centroid[0] += tmp*tmp*imageinfo[i].imagekist->getCurrent()->x[0];
-			imageinfo[i].centroid[1] += tmp*tmp*imageinfo[i].imagekist->getCurrent()->x[1];
-      imageinfo[i].gridrange[0] = MAX(imageinfo[i].gridrange[0],tmp);
-      imageinfo[i].gridrange[2] = MIN(imageinfo[i].gridrange[2],tmp);
-		}while(imageinfo[i].imagekist->Down());
+    for(Kist<Point>::iterator p = imageinfo[i].imagekist->TopIt() ; !(p.atend()) ; --p){
+			tmp = (*p).gridsize*(*p).gridsize;
+			imageinfo[i].area += tmp;
+      if(imageinfo[i].area_error < tmp) imageinfo[i].area_error = tmp;
+      
+			imageinfo[i].centroid[0] += tmp*(*p).x[0];
+			imageinfo[i].centroid[1] += tmp*(*p).x[1];
+      imageinfo[i].gridrange[0] = MAX(imageinfo[i].gridrange[0],(*p).gridsize);
+      imageinfo[i].gridrange[2] = MIN(imageinfo[i].gridrange[2],(*p).gridsize);
+    }
+		imageinfo[i].area_error /= imageinfo[i].area;
 		imageinfo[i].centroid[0] /= imageinfo[i].area;
 		imageinfo[i].centroid[1] /= imageinfo[i].area;
     imageinfo[i].gridrange[1] = imageinfo[i].gridrange[2];
     
-    //std::cout << imageinfo[i].imagekist->Nunits() << std::endl;
-     // Probably caused by a point outside the image having in_image == YES on entry
-		assert((Ntemp - new_imagekist.Nunits() - imageinfo[i].imagekist->Nunits()) == 0);
-		assert(new_imagekist.OffBottom());
+		imageinfo[i].ShouldNotRefine = 0;
+    Ntest -= imageinfo[i].imagekist->Nunits();
+    
+    // skip the points that got un-marked in partition_images
+    while(!(it.atend()) && (*it).in_image == NO) --it;
+    
 		++i;
-	}while(new_imagekist.Nunits() > 0 );
+	}while(!(it.atend()));
 
 	*Nimages = i;
 
-
-	// If there are more than NimageMax images, put the extra points into the closest image.
-	/*if(i == Nimagesmax){
-		PosType r2,rmin;
-
-		while(new_imagekist.Nunits() > 0){
-			for(i=0,rmin=1.0e200,j=0;i<*Nimages;++i){
-				r2 = pow(new_imagekist.getCurrent()->x[0] - imageinfo[i].centroid[0],2)
-					+ pow(new_imagekist.getCurrent()->x[1] - imageinfo[i].centroid[1],2);
-				if(rmin > r2 ){
-					rmin = r2;
-					j = i;
-				}
-			}
-			tmp = pow(new_imagekist.getCurrent()->gridsize,2);
-			imageinfo[j].centroid[0] = ( imageinfo[j].centroid[0]*imageinfo[j].area
-						+ tmp*new_imagekist.getCurrent()->x[0] )/(imageinfo[j].area + tmp);
-			imageinfo[j].centroid[1] = ( imageinfo[j].centroid[1]*imageinfo[j].area
-						+ tmp*new_imagekist.getCurrent()->x[1] )/(imageinfo[j].area + tmp);
-			imageinfo[j].area += tmp;
-			imageinfo[j].imagekist->InsertAfterCurrent(new_imagekist.TakeOutCurrent());
-		}
-	}*/
-
-	assert(new_imagekist.Nunits() == 0);
-  
-	// mark all image points
-	for(i=0;i<*Nimages;++i){
-		imageinfo[i].ShouldNotRefine = 0;
-		imageinfo[i].imagekist->MoveToTop();
-		do{
-			imageinfo[i].imagekist->getCurrent()->in_image = YES;
-			imageinfo[i].imagekist->getCurrent()->image->in_image = YES;
-			--Ntest;
-		}while(imageinfo[i].imagekist->Down());
-	}
-
   imageinfo.resize(*Nimages);
+  delete all_points;
+  
+  // mark image points
+  for(i=0;i<*Nimages;++i) imageinfo[i].imagekist->SetInImage(YES);
   
+   // Probably caused by a point outside the image having in_image == YES on entry
 	assert(Ntest == 0);
 	return;
 }
@@ -436,6 +363,50 @@ void partition_images(Point *point,unsigned long *N_in_image,TreeHndl i_tree){
 	return;
 }
 
+/** \ingroup ImageFindingL2
+ *
+ *  Same as partition_images_kist() but the neighbors are found by a flood fill that uses
+ *  stack as temporary storage so that no memory needs to be allocated when it is called
+ *  repeatedly with the same FlatKist.  Each point is marked in_image = NO when it is first
+ *  reached so it is only put in imagekist once.
+ */
+PosType partition_images_flat(Point *point,Kist<Point> *imagekist,FlatKist<Point> &stack,TreeHndl i_tree){
+	assert(point);
+	assert(i_tree);
+	assert(point->in_image == YES);
+
+	PosType area = 0.0;
+
+	imagekist->Empty();
+  stack.Empty();
+  
+  point->in_image = NO;
+  stack.push_back(point);
+	while(!stack.empty()){
+    point = stack.back();
+    stack.pop_back();
+    
+    imagekist->InsertAfterCurrent(point);
+    imagekist->Down();
+    area += point->gridsize*point->gridsize;
+
+    // find all the neighbors of point that are marked as in image
+    size_t n = stack.size();
+    i_tree->FindAllBoxNeighbors(point,stack);
+    for(size_t j = n ; j < stack.size() ;){
+      if(stack[j]->in_image == YES){
+        stack[j]->in_image = NO;
+        ++j;
+      }else{
+        stack.vec()[j] = stack.back();
+        stack.pop_back();
+      }
+    }
+	}
+
+	return area;
+}
+
 /** \ingroup ImageFindingL2
  *
  *  finds all the points in i_tree with in_image = YES that are connected to point
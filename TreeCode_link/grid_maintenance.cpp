@@ -7,11 +7,8 @@
 
 #include "slsimlib.h"
 #include "Tree.h"
-#include <mutex>
 #include <thread>
 
-std::mutex Grid::grid_mutex;
-
 /** \ingroup Constructor
  * \brief Constructor for initializing square grid.
  *
@@ -22,7 +19,7 @@ Grid::Grid(
 		,unsigned long N1d          /// Initial number of grid points in each dimension.
 		,const PosType center[2]    /// Center of grid (usually in radian units)
 		,PosType range              /// Full width of grid in whatever units will be used.
-           ): Ngrid_init(N1d),Ngrid_init2(N1d),Ngrid_block(3),axisratio(1.0){
+           ): Ngrid_init(N1d),Ngrid_init2(N1d),Ngrid_block(3),axisratio(1.0),use_static_cache(false){
 
 	Point *i_points,*s_points;
     pointID = 0;
@@ -34,14 +31,11 @@ Grid::Grid(
 	if(range <= 0){ERROR_MESSAGE(); std::cout << "cannot make Grid with no range" << std::endl; exit(1);}
   //if( (N1d & (N1d-1)) != 0 ){ERROR_MESSAGE(); std::printf("ERROR: Grid cannot be initialized with pixels less than a power of 2\n"); exit(1);}
 
-	i_points = NewPointArray(Ngrid_init*Ngrid_init);
+	i_points = NewPointArray(Ngrid_init*Ngrid_init,&point_pool);
 	xygridpoints(i_points,range,center,Ngrid_init,0);
-	s_points=LinkToSourcePoints(i_points,Ngrid_init*Ngrid_init);
+	s_points=LinkToSourcePoints(i_points,Ngrid_init*Ngrid_init,&point_pool);
 
-    {
-    std::lock_guard<std::mutex> hold(grid_mutex);
-  	lens->rayshooterInternal(Ngrid_init*Ngrid_init,i_points);
-    }
+    shoot(lens,Ngrid_init*Ngrid_init,i_points);
   
 	// Build trees
 	i_tree = new TreeStruct(i_points,Ngrid_init*Ngrid_init);
@@ -68,7 +62,7 @@ Grid::Grid(
            ,const PosType center[2]  /// Center of grid.
            ,PosType rangeX   /// Full width of grid in x direction in whatever units will be used.
            ,PosType rangeY  /// Full width of grid in y direction in whatever units will be used.
-           ): Ngrid_init(Nx),Ngrid_block(3),axisratio(rangeY/rangeX){
+           ): Ngrid_init(Nx),Ngrid_block(3),axisratio(rangeY/rangeX),use_static_cache(false){
     
 	Point *i_points,*s_points;
     pointID = 0;
@@ -90,7 +84,7 @@ Grid::Grid(
     Ngrid_init2 = (int)(Ngrid_init*axisratio);
     //if(Ngrid_init2 % 2 == 1) ++Ngrid_init2;
     
-    i_points = NewPointArray(Ngrid_init*Ngrid_init2);
+    i_points = NewPointArray(Ngrid_init*Ngrid_init2,&point_pool);
     
     int i;
     // set grid of positions
@@ -110,12 +104,9 @@ Grid::Grid(
 
     assert(i == Ngrid_init*Ngrid_init2-1);
  
-    s_points=LinkToSourcePoints(i_points,Ngrid_init*Ngrid_init2);
+    s_points=LinkToSourcePoints(i_points,Ngrid_init*Ngrid_init2,&point_pool);
     
-    {
-        std::lock_guard<std::mutex> hold(grid_mutex);
-        lens->rayshooterInternal(Ngrid_init*Ngrid_init2,i_points);
-    }
+    shoot(lens,Ngrid_init*Ngrid_init2,i_points);
               
 	// Build trees
 	i_tree = new TreeStruct(i_points,Ngrid_init*Ngrid_init2);
@@ -164,7 +155,7 @@ void Grid::ReInitializeGrid(LensHndl lens){
   
 
 	// build new initial grid
-	i_points = NewPointArray(Ngrid_init*Ngrid_init2);
+	i_points = NewPointArray(Ngrid_init*Ngrid_init2,&point_pool);
 	if(Ngrid_init == Ngrid_init2){
     xygridpoints(i_points,rangeX,center,Ngrid_init,0);
   }else{
@@ -185,12 +176,9 @@ void Grid::ReInitializeGrid(LensHndl lens){
     }
 
   }
-	s_points=LinkToSourcePoints(i_points,Ngrid_init*Ngrid_init2);
+	s_points=LinkToSourcePoints(i_points,Ngrid_init*Ngrid_init2,&point_pool);
   
-  {
-    std::lock_guard<std::mutex> hold(grid_mutex);
-	  lens->rayshooterInternal(Ngrid_init*Ngrid_init2,i_points);
-  }
+  shoot(lens,Ngrid_init*Ngrid_init2,i_points);
 	// need to resize root of source tree.  It can change in size
 	s_tree->getTop()->boundary_p1[0]=s_points[0].x[0]; s_tree->getTop()->boundary_p1[1]=s_points[0].x[1];
 	s_tree->getTop()->boundary_p2[0]=s_points[0].x[0]; s_tree->getTop()->boundary_p2[1]=s_points[0].x[1];
@@ -246,7 +234,7 @@ void Grid::ReShoot(LensHndl lens){
   
   // clear source tree
   delete s_tree;
-  s_points = NewPointArray(i_tree->pointlist->size());
+  s_points = NewPointArray(i_tree->pointlist->size(),&point_pool);
   
 	// build new initial grid
   PointList::iterator i_tree_pointlist_it;
@@ -264,11 +252,8 @@ void Grid::ReShoot(LensHndl lens){
         s_points[k].gridsize = i_points[j].gridsize;
       };
 
-      {
       // reshoot the rays
-        std::lock_guard<std::mutex> hold(grid_mutex);
-         lens->rayshooterInternal(i_points->head,i_points);
-      }
+      shoot(lens,i_points->head,i_points);
     }
     
     --i_tree_pointlist_it;
@@ -354,7 +339,7 @@ unsigned long Grid::getNumberOfPoints() const{
 
 Point * Grid::RefineLeaf(LensHndl lens,Point *point){
 
-	Point *i_points = NewPointArray(Ngrid_block*Ngrid_block-1);
+	Point *i_points = NewPointArray(Ngrid_block*Ngrid_block-1,&point_pool);
 	Point *s_points;
 	int Nout,kk;
 
@@ -395,12 +380,9 @@ Point * Grid::RefineLeaf(LensHndl lens,Point *point){
 
 	int  Ntemp = Ngrid_block*Ngrid_block-1-Nout;
 
-	s_points = LinkToSourcePoints(i_points,Ntemp);
+	s_points = LinkToSourcePoints(i_points,Ntemp,&point_pool);
   
-  {
-    std::lock_guard<std::mutex> hold(grid_mutex);
-	  lens->rayshooterInternal(Ntemp,i_points);
-  }
+  shoot(lens,Ntemp,i_points);
   
 	// remove the points that are outside initial source grid
 	for(kk=0,Nout=0;kk < Ntemp;++kk){
@@ -435,8 +417,8 @@ Point * Grid::RefineLeaf(LensHndl lens,Point *point){
 		//i_points = AddPointToArray(i_points,Ngrid_block*Ngrid_block-1-Nout,Ngrid_block*Ngrid_block-1);
 		//s_points = AddPointToArray(s_points,Ngrid_block*Ngrid_block-1-Nout,Ntemp);
 
-		i_points = AddPointToArray(i_points,Ngrid_block*Ngrid_block-1-Nout,i_points->head);
-		s_points = AddPointToArray(s_points,Ngrid_block*Ngrid_block-1-Nout,s_points->head);
+		i_points = AddPointToArray(i_points,Ngrid_block*Ngrid_block-1-Nout,i_points->head,&point_pool);
+		s_points = AddPointToArray(s_points,Ngrid_block*Ngrid_block-1-Nout,s_points->head,&point_pool);
 	}
 	assert(i_points->head == s_points->head);
 
@@ -473,20 +455,26 @@ Point * Grid::RefineLeaf(LensHndl lens,Point *point){
 /**
  * \brief Same as RefineLeaf() but multiple points can be passed.  The rays are shot all together so that more
  * parallelization can be achieved in the rayshooting.
+ *
+ * The new points are made for all the leaves in parallel and the ones that are off the image or
+ * source grid are taken out by compacting the arrays in one pass so the cost is linear in the number
+ * of new points.  The order of the points that are kept is the same as if the leaves were refined
+ * one at a time.
  */
 Point * Grid::RefineLeaves(LensHndl lens,std::vector<Point *>& points){
 
 	if(points.size() == 0) return NULL;
 
 	size_t Nleaves = points.size();
-	Point *i_points = NewPointArray((Ngrid_block*Ngrid_block-1)*Nleaves);
+	const size_t Nblock = Ngrid_block*Ngrid_block-1;
+	Point *i_points;
 	Point *s_points;
-	size_t Nout,kk,ii;
-	size_t Nadded,Nout_tot;
+	size_t ii;
+	size_t Nadded;
   std::vector<size_t> addedtocell(points.size());
+  std::vector<size_t> offsets(points.size() + 1);
 
-	Nout_tot=0;
-	for(ii=0,Nadded=0;ii<Nleaves;++ii){
+	for(ii=0;ii<Nleaves;++ii){
 		assert(points[ii]->leaf->child1 == NULL && points[ii]->leaf->child2 == NULL);
 		assert(points[ii]->image->leaf->child1 == NULL && points[ii]->image->leaf->child2 == NULL);
     
@@ -497,58 +485,73 @@ Point * Grid::RefineLeaves(LensHndl lens,std::vector<Point *>& points){
       throw std::runtime_error("Cell size is too small for double precision");
     };
     //assert(points[ii]->gridsize > 1.0e-10*MAX(fabs(points[ii]->x[0]),fabs(points[ii]->x[1])) ); // If cells are too small they will cause problems.
-
-		points[ii]->leaf->refined = true;
-		xygridpoints(&i_points[Nadded],points[ii]->gridsize*(Ngrid_block-1)/Ngrid_block
-				,points[ii]->x,Ngrid_block,1);
-		points[ii]->gridsize /= Ngrid_block;
-		points[ii]->image->gridsize /= Ngrid_block;
-
-    assert(points[ii]->gridsize > 0.0);
-    
-		// take out points that are outside of original grid
-		Nout = 0;
-		//if( (points[ii]->x[0] <= i_tree->getTop()->boundary_p1[0]) || (points[ii]->x[0] >= i_tree->getTop()->boundary_p2[0])
-		//	|| (points[ii]->x[1] <= i_tree->getTop()->boundary_p1[1]) || (points[ii]->x[1] >= i_tree->getTop()->boundary_p2[1]) ){
+  }
+  
+  // The new points for each leaf are made in its own slot of the scratch array and
+  // the ones that are outside of the original grid are marked.  The ids are the same
+  // as they would be if the leaves were done one after another.
+  if(refine_scratch.size() < Nblock*Nleaves) refine_scratch.resize(Nblock*Nleaves);
+  std::vector<char> keep(Nblock*Nleaves);
+  const unsigned long first_id = pointID;
+  pointID += Ngrid_block*Ngrid_block*Nleaves;
+  
+  Utilities::ThreadPool &pool = Utilities::ThreadPool::get();
+  const size_t leaf_batch = std::max<size_t>(1,Nleaves/(8*pool.size()));
+  
+  pool.parallel_for(Nleaves,leaf_batch,[&](size_t start,size_t end){
+    for(size_t ii=start;ii<end;++ii){
+      Point *cell_points = &refine_scratch[ii*Nblock];
       
-    Point *point;
-    // remove the points that are outside initial image grid
-    for(kk=0,Nout=0;kk < (Ngrid_block*Ngrid_block-1);++kk){
-      point = &i_points[Nadded + kk - Nout];
-      if( !inbox(point->x,i_tree->getTop()->boundary_p1,i_tree->getTop()->boundary_p2)
-           || point->gridsize < 1.0e-10*MAX(fabs(point->x[0]),fabs(point->x[1])) ){
-        
-					// This maintains the ordering in parent cells, but is rather inefficient
-        for(unsigned long nn = Nadded + kk - Nout
-							; nn < (Ngrid_block*Ngrid_block-1)*Nleaves - 1 - Nout - Nout_tot ; ++nn){
-          assert(nn+1 < i_points[0].head);
-          SwapPointsInArray(&i_points[nn],&i_points[nn + 1]);
-        }
-        ++Nout;
-					//std::cout << "Nout_tot = " << Nout_tot << std::endl;
+      points[ii]->leaf->refined = true;
+      xygridpoints(cell_points,points[ii]->gridsize*(Ngrid_block-1)/Ngrid_block
+                   ,points[ii]->x,Ngrid_block,1,first_id + ii*Ngrid_block*Ngrid_block);
+      points[ii]->gridsize /= Ngrid_block;
+      points[ii]->image->gridsize /= Ngrid_block;
+      
+      assert(points[ii]->gridsize > 0.0);
+      
+      // take out points that are outside of original grid
+      size_t n = 0;
+      for(size_t kk=0;kk < Nblock;++kk){
+        Point *point = &cell_points[kk];
+        keep[ii*Nblock + kk] = inbox(point->x,i_tree->getTop()->boundary_p1,i_tree->getTop()->boundary_p2)
+           && !(point->gridsize < 1.0e-10*MAX(fabs(point->x[0]),fabs(point->x[1])));
+        n += keep[ii*Nblock + kk];
       }
+      addedtocell[ii] = n;
     }
-
-		Nout_tot += Nout;
-		Nadded += Ngrid_block*Ngrid_block-1 - Nout;
-		addedtocell[ii] = Ngrid_block*Ngrid_block-1 - Nout;
-    
+  });
+  
+  offsets[0] = 0;
+  for(ii=0;ii<Nleaves;++ii){
+    offsets[ii+1] = offsets[ii] + addedtocell[ii];
     if(addedtocell[ii] == 0){
       points[ii]->leaf->refined = false;
       points[ii]->gridsize *= Ngrid_block;
       points[ii]->image->gridsize *= Ngrid_block;
     }
-		//if(Nout > 0) i_points = AddPointToArray(i_points,Ngrid_block*Ngrid_block-1-Nout,Ngrid_block*Ngrid_block-1);
-	} 
+  }
+  Nadded = offsets[Nleaves];
 
-	assert(Nadded == (Ngrid_block*Ngrid_block-1)*Nleaves-Nout_tot);
+	if(Nadded == 0) return NULL;
   
-	if(Nadded == 0){
-		FreePointArray(i_points,true);
-		return NULL;
-	}
+  // copy the points that are kept, in order, into the new array
+	i_points = NewPointArray(Nadded,&point_pool);
+  pool.parallel_for(Nleaves,leaf_batch,[&](size_t start,size_t end){
+    for(size_t ii=start;ii<end;++ii){
+      size_t j = offsets[ii];
+      for(size_t kk=ii*Nblock;kk < (ii+1)*Nblock;++kk){
+        if(!keep[kk]) continue;
+        i_points[j].id = refine_scratch[kk].id;
+        i_points[j].x[0] = refine_scratch[kk].x[0];
+        i_points[j].x[1] = refine_scratch[kk].x[1];
+        i_points[j].gridsize = refine_scratch[kk].gridsize;
+        ++j;
+      }
+    }
+  });
 
-	s_points = LinkToSourcePoints(i_points,Nadded);
+	s_points = LinkToSourcePoints(i_points,Nadded,&point_pool);
 
   // This interpolation does not work for some reason and needs to be fixed some time.
 	/*/ Here the points that are in uniform magnification regions are calculated by interpolation and marked with in_image = MAYBE
@@ -612,10 +615,7 @@ Point * Grid::RefineLeaves(LensHndl lens,std::vector<Point *>& points){
 
 	}*/
 
-  {
-    std::lock_guard<std::mutex> hold(grid_mutex);
-    lens->rayshooterInternal(Nadded,i_points);
-  }
+  shoot(lens,Nadded,i_points);
 
 	/*********************** TODO test line *******************************
 	for(ii=0;ii<Nadded;++ii){
@@ -624,57 +624,58 @@ Point * Grid::RefineLeaves(LensHndl lens,std::vector<Point *>& points){
 	}
 	/ ******************************************************/
 	// remove the points that are outside initial source grid
-	int j,Noutcell;
-	for(ii=0,kk=0,Nout=0;ii<Nleaves;++ii){
-    if(addedtocell[ii] == 0) continue;
-		for(j = 0,Noutcell=0; j < addedtocell[ii]; ++j){
-			if( !inbox(s_points[kk - Nout].x,s_tree->getTop()->boundary_p1,s_tree->getTop()->boundary_p2) ){
-				//SwapPointsInArray(&i_points[kk - Nout],&i_points[Nadded - 1 - Nout]);
-				//SwapPointsInArray(&s_points[kk - Nout],&s_points[Nadded - 1 - Nout]);
-				for(long nn = kk - Nout; nn < Nadded - 1 - Nout;++nn){
-					assert(nn+1 < s_points[0].head);
-					assert(nn+1 < i_points[0].head);
-					SwapPointsInArray(&i_points[nn],&i_points[nn+1]);
-					SwapPointsInArray(&s_points[nn],&s_points[nn+1]);
-				}
-				++Nout;
-				++Noutcell;
-			}
-			++kk;
-		}
-		addedtocell[ii] -= Noutcell;
-		if(addedtocell[ii] == 0){  // case where all of the parent cell is out of source plane region
+  pool.parallel_for(Nleaves,leaf_batch,[&](size_t start,size_t end){
+    for(size_t ii=start;ii<end;++ii){
+      size_t n = 0;
+      for(size_t kk=offsets[ii];kk < offsets[ii+1];++kk){
+        keep[kk] = inbox(s_points[kk].x,s_tree->getTop()->boundary_p1,s_tree->getTop()->boundary_p2);
+        n += keep[kk];
+      }
+      addedtocell[ii] = n;
+    }
+  });
+  
+  size_t Nkept = 0;
+	for(ii=0;ii<Nleaves;++ii){
+    if(offsets[ii+1] > offsets[ii] && addedtocell[ii] == 0){  // case where all of the parent cell is out of source plane region
 			points[ii]->leaf->refined = false;
 			points[ii]->gridsize *= Ngrid_block;
 			points[ii]->image->gridsize *= Ngrid_block;
 		}
+    Nkept += addedtocell[ii];
 	}
 
-	assert(i_points->head == (Ngrid_block*Ngrid_block-1)*Nleaves);
-	assert(s_points->head == Nadded);
-
-	Nadded -= Nout;
-/*
-	for(kk=0,Nout=0;kk < Nadded;++kk){
-		assert(s_points[kk - Nout].x[0] == s_points[kk - Nout].x[0]);
-		if( !inbox(s_points[kk - Nout].x,s_tree->getTop()->boundary_p1,s_tree->getTop()->boundary_p2) ){
-			SwapPointsInArray(&i_points[kk - Nout],&i_points[Nadded - 1 - Nout]);
-			SwapPointsInArray(&s_points[kk - Nout],&s_points[Nadded - 1 - Nout]);
-			++Nout;
-		}
-	}
-*/
-
 	// free memory of points that where outside image and source regions
-	if(Nadded == 0){
+	if(Nkept == 0){
 		FreePointArray(i_points);
 		FreePointArray(s_points);
 		return NULL;
 	}
 
-	if(Nadded < (Ngrid_block*Ngrid_block-1)*Nleaves){
-		i_points = AddPointToArray(i_points,Nadded,i_points->head);
-		s_points = AddPointToArray(s_points,Nadded,s_points->head);
+	if(Nkept < Nadded){
+    // compact both arrays in one pass keeping the order and the links between them
+    std::vector<size_t> new_offsets(Nleaves + 1);
+    new_offsets[0] = 0;
+    for(ii=0;ii<Nleaves;++ii) new_offsets[ii+1] = new_offsets[ii] + addedtocell[ii];
+    
+    Point *i_tmp = NewPointArray(Nkept,&point_pool);
+    Point *s_tmp = NewPointArray(Nkept,&point_pool);
+    pool.parallel_for(Nleaves,leaf_batch,[&](size_t start,size_t end){
+      for(size_t ii=start;ii<end;++ii){
+        size_t j = new_offsets[ii];
+        for(size_t kk=offsets[ii];kk < offsets[ii+1];++kk){
+          if(!keep[kk]) continue;
+          PointCopy(&i_tmp[j],&i_points[kk]);
+          PointCopy(&s_tmp[j],&s_points[kk]);
+          ++j;
+        }
+      }
+    });
+    FreePointArray(i_points,false);
+    FreePointArray(s_points,false);
+    i_points = i_tmp;
+    s_points = s_tmp;
+    Nadded = Nkept;
 	}
 	assert(i_points->head == s_points->head);
   assert(i_points->head == Nadded);
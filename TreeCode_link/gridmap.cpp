@@ -7,10 +7,72 @@
 //
 
 #include "gridmap.h"
-#include <mutex>
 #include <thread>
 
-std::mutex GridMap::grid_mutex;
+namespace{
+  /// the quantities of a ray that can be put into a map
+  struct RayView{
+    const PosType *x;       // image position
+    const PosType *y;       // source position
+    KappaType kappa;
+    const KappaType *gamma;
+    KappaType invmag;
+    double dt;
+  };
+  
+  /** \brief Puts the LensingVariable val of rays [start,start + size) into the pixels of map at their image positions.
+   *
+   * ray(i) returns the RayView of ray i so this works for any way the rays are stored.
+   */
+  template <typename RayAccessor>
+  void write_lensing_variable(size_t start,size_t size,PixelMap *map,LensingVariable val,RayAccessor ray){
+    double tmp;
+    long index;
+    
+    for(size_t i = start; i< start + size; ++i){
+      const RayView r = ray(i);
+      switch (val) {
+        case ALPHA:
+          tmp = sqrt((r.x[0] - r.y[0])*(r.x[0] - r.y[0]) + (r.x[1] - r.y[1])*(r.x[1] - r.y[1]));
+          break;
+        case ALPHA1:
+          tmp = (r.x[0] - r.y[0]);
+          break;
+        case ALPHA2:
+          tmp = (r.x[1] - r.y[1]);
+          break;
+        case KAPPA:
+          tmp = r.kappa;
+          break;
+        case GAMMA:
+          tmp = sqrt((PosType)r.gamma[0]*r.gamma[0] + (PosType)r.gamma[1]*r.gamma[1]);
+          break;
+        case GAMMA1:
+          tmp = r.gamma[0];
+          break;
+        case GAMMA2:
+          tmp = r.gamma[1];
+          break;
+        case GAMMA3:
+          tmp = r.gamma[2];
+          break;
+        case INVMAG:
+          tmp = r.invmag;
+          break;
+        case DT:
+          tmp = r.dt;
+          break;
+        default:
+          std::cerr << "GridMap::writePixelMapUniform() does not work for the input LensingVariable" << std::endl;
+          throw std::runtime_error("GridMap::writePixelMapUniform() does not work for the input LensingVariable");
+          break;
+      }
+      
+      index = map->find_index(r.x);
+      if(index != -1)(*map)[index] = tmp;
+    }
+  }
+}
 
 /** \ingroup Constructor
  * \brief Constructor for initializing rectangular grid.
@@ -27,7 +89,8 @@ GridMap::GridMap(
                  ,const PosType my_center[2]  /// Center of grid.
                  ,PosType rangeX   /// Full width of grid in x direction in whatever units will be used.
                  ,PosType rangeY  /// Full width of grid in y direction in whatever units will be used.
-): Ngrid_init(Nx),axisratio(rangeY/rangeX),x_range(rangeX){
+                 ,GridMapStorage storage  /// how the rays are stored, see GridMapStorage
+): Ngrid_init(Nx),axisratio(rangeY/rangeX),x_range(rangeX),compact(storage == GridMapStorage::compact),use_static_cache(false){
   
   pointID = 0;
   
@@ -50,30 +113,42 @@ GridMap::GridMap(
   Ngrid_init2 = (int)(Ngrid_init*axisratio);
   //if(Ngrid_init2 % 2 == 1) ++Ngrid_init2;
   
-  i_points = NewPointArray(Ngrid_init*Ngrid_init2);
+  if(compact){
+    i_points = s_points = nullptr;
+    image_x.resize(2*Ngrid_init*Ngrid_init2);
+  }else{
+    i_points = NewPointArray(Ngrid_init*Ngrid_init2);
+  }
   
   int i;
+  PosType *x;
   // set grid of positions
   for(int ii=0;ii<Ngrid_init;++ii){
     for(int jj=0;jj<Ngrid_init2;++jj){
       
       i = ii + jj*Ngrid_init;
       
-      i_points[i].id=pointID;
-      ++pointID;
+      if(compact){
+        x = &image_x[2*i];
+      }else{
+        i_points[i].id=pointID;
+        ++pointID;
+        i_points[i].gridsize=rangeX/(Ngrid_init-1);
+        x = i_points[i].x;
+      }
       
-      i_points[i].x[0] = center[0] + rangeX*ii/(Ngrid_init-1) - 0.5*rangeX;
-      i_points[i].x[1] = center[1] + rangeX*jj/(Ngrid_init-1) - 0.5*rangeY;
-      i_points[i].gridsize=rangeX/(Ngrid_init-1);
+      x[0] = center[0] + rangeX*ii/(Ngrid_init-1) - 0.5*rangeX;
+      x[1] = center[1] + rangeX*jj/(Ngrid_init-1) - 0.5*rangeY;
     }
   }
   
   assert(i == Ngrid_init*Ngrid_init2-1);
   
-  s_points=LinkToSourcePoints(i_points,Ngrid_init*Ngrid_init2);
-  {
-    std::lock_guard<std::mutex> hold(grid_mutex);
-    lens->rayshooterInternal(Ngrid_init*Ngrid_init2,i_points);
+  if(compact){
+    ShootCompact(lens);
+  }else{
+    s_points=LinkToSourcePoints(i_points,Ngrid_init*Ngrid_init2);
+    shoot(lens,Ngrid_init*Ngrid_init2,i_points);
   }
 }
 
@@ -87,7 +162,8 @@ GridMap::GridMap(
                  ,unsigned long N1d          /// Initial number of grid points in each dimension.
                  ,const PosType my_center[2]    /// Center of grid.
                  ,PosType range              /// Full width of grid in whatever units will be used.
-): Ngrid_init(N1d),Ngrid_init2(N1d),axisratio(1.0),x_range(range){
+                 ,GridMapStorage storage     /// how the rays are stored, see GridMapStorage
+): Ngrid_init(N1d),Ngrid_init2(N1d),axisratio(1.0),x_range(range),compact(storage == GridMapStorage::compact),use_static_cache(false){
   
   pointID = 0;
   
@@ -99,31 +175,89 @@ GridMap::GridMap(
   if(N1d <= 0){ERROR_MESSAGE(); std::cout << "cannot make GridMap with no points" << std::endl; exit(1);}
   if(range <= 0){ERROR_MESSAGE(); std::cout << "cannot make GridMap with no range" << std::endl; exit(1);}
   
+  if(compact){
+    i_points = s_points = nullptr;
+    image_x.resize(2*Ngrid_init*Ngrid_init);
+    for(size_t i=0;i<Ngrid_init*Ngrid_init;++i)
+      Utilities::PositionFromIndex(i,&image_x[2*i],Ngrid_init,range,center.x);
+    
+    ShootCompact(lens);
+    return;
+  }
+  
   i_points = NewPointArray(Ngrid_init*Ngrid_init);
   xygridpoints(i_points,range,center.x,Ngrid_init,0);
   s_points=LinkToSourcePoints(i_points,Ngrid_init*Ngrid_init);
     
-  {
-    std::lock_guard<std::mutex> hold(grid_mutex);
-    lens->rayshooterInternal(Ngrid_init*Ngrid_init,i_points);
-  }
+  shoot(lens,Ngrid_init*Ngrid_init,i_points);
   
 }
 
 GridMap::~GridMap(){
+  if(compact) return;
   FreePointArray(i_points);
   FreePointArray(s_points);
 }
 
 void GridMap::ReInitializeGrid(LensHndl lens){
   
-  {
-    std::lock_guard<std::mutex> hold(grid_mutex);
-    lens->rayshooterInternal(Ngrid_init*Ngrid_init,i_points);
+  if(compact){
+    ShootCompact(lens);
+    return;
   }
+  
+  shoot(lens,Ngrid_init*Ngrid_init2,i_points);
   ClearSurfaceBrightnesses();
 }
 
+/** \brief Shoots the rays of a compact GridMap.
+ *
+ *  The rays are shot compact_block_size at a time through one reused block of Points and the
+ *  results copied into the flat arrays.  The surface brightnesses are cleared.
+ */
+void GridMap::ShootCompact(LensHndl lens){
+  size_t N = getNumberOfPoints();
+  size_t block = compact_block_size;
+  if(N < block) block = N;
+  
+  source_x.resize(2*N);
+  ray_kappa.resize(N);
+  ray_gamma.resize(3*N);
+  ray_invmag.resize(N);
+  ray_dt.resize(N);
+  ray_sb.assign(N,0);
+  
+  Point *points = NewPointArray(block);
+  Point *images = LinkToSourcePoints(points,block);
+  
+  for(size_t start = 0 ; start < N ; start += block){
+    size_t n = (N - start < block) ? N - start : block;
+    
+    for(size_t i = 0 ; i < n ; ++i){
+      points[i].x[0] = image_x[2*(start+i)];
+      points[i].x[1] = image_x[2*(start+i)+1];
+      points[i].gridsize = getResolution();
+    }
+    
+    shoot(lens,n,points);
+    
+    for(size_t i = 0 ; i < n ; ++i){
+      size_t k = start + i;
+      source_x[2*k] = images[i].x[0];
+      source_x[2*k+1] = images[i].x[1];
+      ray_kappa[k] = points[i].kappa;
+      ray_gamma[3*k] = points[i].gamma[0];
+      ray_gamma[3*k+1] = points[i].gamma[1];
+      ray_gamma[3*k+2] = points[i].gamma[2];
+      ray_invmag[k] = points[i].invmag;
+      ray_dt[k] = points[i].dt;
+    }
+  }
+  
+  FreePointArray(points);
+  FreePointArray(images);
+}
+
 /// Output a PixelMap of the surface brightness with same res as the GridMap
 PixelMap GridMap::getPixelMap(int resf){
   
@@ -142,7 +276,7 @@ PixelMap GridMap::getPixelMap(int resf){
   for(size_t i = 0 ; i < Ngrid_init ; ++i){
     for(size_t j = 0 ; j < Ngrid_init2 ; ++j){
       map.data()[i/resf + map.getNx() * (j / resf)] +=
-      i_points[ i + Ngrid_init * j].surface_brightness/factor;
+      surface_brightness(i + Ngrid_init * j)/factor;
     }
   }
   
@@ -174,7 +308,7 @@ void GridMap::getPixelMap(PixelMap &map){
   for(size_t i = 0 ; i < Ngrid_init ; ++i){
     for(size_t j = 0 ; j < Ngrid_init2 ; ++j){
       map.data()[i/resf + map.getNx() * (j / resf)] +=
-      i_points[ i + Ngrid_init * j].surface_brightness/factor;
+      surface_brightness(i + Ngrid_init * j)/factor;
     }
   }
   
@@ -184,6 +318,15 @@ void GridMap::getPixelMap(PixelMap &map){
 double GridMap::RefreshSurfaceBrightnesses(SourceHndl source){
   PosType total=0,tmp;
   
+  if(compact){
+    for(size_t i=0;i<getNumberOfPoints();++i){
+      tmp = source->SurfaceBrightness(&source_x[2*i]);
+      ray_sb[i] = tmp;
+      total += tmp;
+    }
+    return total;
+  }
+  
   for(size_t i=0;i <s_points[0].head;++i){
     tmp = source->SurfaceBrightness(s_points[i].x);
     s_points[i].surface_brightness = s_points[i].image->surface_brightness
@@ -197,6 +340,11 @@ double GridMap::RefreshSurfaceBrightnesses(SourceHndl source){
 
 void GridMap::ClearSurfaceBrightnesses(){
   
+  if(compact){
+    ray_sb.assign(getNumberOfPoints(),0);
+    return;
+  }
+  
   for(size_t i=0;i <s_points[0].head;++i){
     s_points[i].surface_brightness = s_points[i].image->surface_brightness
     = 0.0;
@@ -264,63 +412,108 @@ void GridMap::writePixelMapUniform(
   for(int ii = 0; ii < nthreads ;++ii){
     if(ii == nthreads-1)
       size = getNumberOfPoints() - (nthreads-1)*chunk_size;
-    thr[ii] = std::thread(&GridMap::writePixelMapUniform_,this,&(i_points[ii*chunk_size]),size,&map,lensvar);
+    if(compact)
+      thr[ii] = std::thread(&GridMap::writeCompactPixelMap_,this,ii*chunk_size,size,&map,lensvar);
+    else
+      thr[ii] = std::thread(&GridMap::writePixelMapUniform_,this,&(i_points[ii*chunk_size]),size,&map,lensvar);
   }
   for(int ii = 0; ii < nthreads ;++ii) thr[ii].join();
   
 }
 
 void GridMap::writePixelMapUniform_(Point* points,size_t size,PixelMap *map,LensingVariable val){
-  double tmp;
-  PosType tmp2[2];
-  long index;
-  
-  for(size_t i = 0; i< size; ++i){
-    switch (val) {
-      case ALPHA:
-        tmp2[0] = points[i].x[0] - points[i].image->x[0];
-        tmp2[1] = points[i].x[1] - points[i].image->x[1];
-        tmp = sqrt(tmp2[0]*tmp2[0] + tmp2[1]*tmp2[1]);
-        break;
-      case ALPHA1:
-        tmp = (points[i].x[0] - points[i].image->x[0]);
-        break;
-      case ALPHA2:
-        tmp = (points[i].x[1] - points[i].image->x[1]);
-        break;
-      case KAPPA:
-        tmp = points[i].kappa;
-        break;
-      case GAMMA:
-        tmp2[0] = points[i].gamma[0];
-        tmp2[1] = points[i].gamma[1];
-        tmp = sqrt(tmp2[0]*tmp2[0] + tmp2[1]*tmp2[1]);
-        break;
-      case GAMMA1:
-        tmp = points[i].gamma[0];
-        break;
-      case GAMMA2:
-        tmp = points[i].gamma[1];
-        break;
-      case GAMMA3:
-        tmp = points[i].gamma[2];
-        break;
-      case INVMAG:
-        tmp = points[i].invmag;
-        break;
-      case DT:
-        tmp = points[i].dt;
-        break;
-      default:
-        std::cerr << "PixelMap::AddGrid() does not work for the input LensingVariable" << std::endl;
-        throw std::runtime_error("PixelMap::AddGrid() does not work for the input LensingVariable");
-        break;
-        // If this list is to be expanded to include ALPHA or GAMMA take care to add them as vectors
+  write_lensing_variable(0,size,map,val,[points](size_t i){
+    RayView r = {points[i].x,points[i].image->x,points[i].kappa,points[i].gamma,points[i].invmag,points[i].dt};
+    return r;
+  });
+}
+
+/** \brief Shoots the grid to several source redshifts in one pass through the lens planes.
+ *
+ * The results are kept separately from the grid's own rays, which still belong to the lens's
+ * source plane, and can be made into maps with writePixelMapUniform(lensvar,source).
+ */
+void GridMap::ShootSourcePlanes(
+                                LensHndl lens
+                                ,const std::vector<PosType> &zsources  /// source redshifts in ascending order
+){
+  if(!compact){
+    lens->rayshooterMultiSource(getNumberOfPoints(),i_points,zsources,source_rays);
+    source_z = zsources;
+    return;
+  }
+  
+  size_t N = getNumberOfPoints();
+  size_t block = compact_block_size;
+  if(N < block) block = N;
+  std::vector<std::vector<RayState> > rays;
+  Point *points = NewPointArray(block);
+  
+  source_rays.resize(zsources.size());
+  for(auto &r : source_rays) r.resize(N);
+  
+  for(size_t start = 0 ; start < N ; start += block){
+    size_t n = (N - start < block) ? N - start : block;
+    
+    for(size_t i = 0 ; i < n ; ++i){
+      points[i].x[0] = image_x[2*(start+i)];
+      points[i].x[1] = image_x[2*(start+i)+1];
     }
     
-    index = map->find_index(points[i].x);
-    if(index != -1)(*map)[index] = tmp;
+    lens->rayshooterMultiSource(n,points,zsources,rays);
+    for(size_t s = 0 ; s < rays.size() ; ++s)
+      std::copy(rays[s].begin(),rays[s].end(),source_rays[s].begin() + start);
   }
+  
+  FreePointArray(points);
+  source_z = zsources;
+}
+
+PixelMap GridMap::writePixelMapUniform(
+                                       LensingVariable lensvar  /// which quantity is to be displayed
+                                       ,size_t source           /// index into the redshifts given to ShootSourcePlanes()
+){
+  if(source >= source_rays.size()) throw std::invalid_argument("GridMap::writePixelMapUniform: no such source plane, use ShootSourcePlanes() first");
+  
+  size_t Nx =  Ngrid_init;
+  size_t Ny = Ngrid_init2;
+  
+  PixelMap map( center.x, Nx, Ny,x_range/(Nx-1) );
+  map.Clean();
+  
+  std::thread thr[20];
+  int nthreads = Utilities::GetNThreads();
+  
+  int chunk_size;
+  do{
+    chunk_size =  getNumberOfPoints()/nthreads;
+    if(chunk_size == 0) nthreads /= 2;
+  }while(chunk_size == 0);
+  
+  size_t size = chunk_size;
+  for(int ii = 0; ii < nthreads ;++ii){
+    if(ii == nthreads-1)
+      size = getNumberOfPoints() - (nthreads-1)*chunk_size;
+    thr[ii] = std::thread(&GridMap::writeSourcePixelMap_,this,source,ii*chunk_size,size,&map,lensvar);
+  }
+  for(int ii = 0; ii < nthreads ;++ii) thr[ii].join();
+  
+  return map;
+}
+
+void GridMap::writeSourcePixelMap_(size_t source,size_t start,size_t size,PixelMap *map,LensingVariable val){
+  write_lensing_variable(start,size,map,val,[this,source](size_t i){
+    const RayState &ray = source_rays[source][i];
+    RayView r = {image_position(i),ray.x,ray.kappa,ray.gamma,ray.invmag,ray.dt};
+    return r;
+  });
+}
+
+void GridMap::writeCompactPixelMap_(size_t start,size_t size,PixelMap *map,LensingVariable val){
+  write_lensing_variable(start,size,map,val,[this](size_t i){
+    RayView r = {&image_x[2*i],&source_x[2*i],ray_kappa[i],&ray_gamma[3*i],ray_invmag[i],ray_dt[i]};
+    return r;
+  });
 }
 
 void GridMap::writeFitsUniform(
@@ -407,7 +600,7 @@ PosType GridMap::EisnsteinArea() const{
   size_t count = 0;
   size_t N = Ngrid_init*Ngrid_init2;
   for(size_t i=0;i<N;++i){
-    if(i_points[i].invmag < 0) ++count;
+    if((compact ? ray_invmag[i] : i_points[i].invmag) < 0) ++count;
   }
   
   return count*x_range*x_range/Ngrid_init/Ngrid_init;
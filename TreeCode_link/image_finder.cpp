@@ -782,6 +782,13 @@ void findborders3(TreeHndl i_tree,OldImageInfo *imageinfo){
 }
 
 void Grid::xygridpoints(Point *i_points,PosType range,const PosType *center,long Ngrid_1d,short remove_center){
+  xygridpoints(i_points,range,center,Ngrid_1d,remove_center,pointID);
+  pointID += Ngrid_1d*Ngrid_1d;
+}
+
+/// same as above but the ids start at id and pointID is not changed so it can be used from several threads
+void Grid::xygridpoints(Point *i_points,PosType range,const PosType *center,long Ngrid_1d,short remove_center
+                        ,unsigned long id) const{
   /* make a new rectolinear grid of points on the image plane **/
   /* and link them to points on the source plane **/
   /* remove_center = 0 include center point of grid */
@@ -794,8 +801,8 @@ void Grid::xygridpoints(Point *i_points,PosType range,const PosType *center,long
     for(i=0,j=0;i<Ngrid_1d*Ngrid_1d;++i){
 
       if( (2*(i/Ngrid_1d)/(Ngrid_1d-1) == 1) && (i%Ngrid_1d == Ngrid_1d/2+1) ) j=1;
-      i_points[i-j].id=pointID;
-      ++pointID;
+      i_points[i-j].id=id;
+      ++id;
       Utilities::PositionFromIndex(i,i_points[i-j].x,Ngrid_1d,range,center);
       //i_points[i-j].x[0] = center[0] + range*( 1.0*(i%Ngrid_1d)/(Ngrid_1d-1) - 0.5 );
       //i_points[i-j].x[1] = center[1] + range*( 1.0*(i/Ngrid_1d)/(Ngrid_1d-1) - 0.5 );
@@ -805,8 +812,8 @@ void Grid::xygridpoints(Point *i_points,PosType range,const PosType *center,long
   }else{
     /*i_points=NewPointArray(Ngrid_1d*Ngrid_1d);*/
     for(i=0;i<Ngrid_1d*Ngrid_1d;++i){
-      i_points[i].id=pointID;
-      ++pointID;
+      i_points[i].id=id;
+      ++id;
       Utilities::PositionFromIndex(i,i_points[i].x,Ngrid_1d,range,center);
       //i_points[i].x[0] = center[0] + range*( 1.0*(i%Ngrid_1d)/(Ngrid_1d-1) - 0.5 );
       //i_points[i].x[1] = center[1] + range*( 1.0*(i/Ngrid_1d)/(Ngrid_1d-1) - 0.5 );
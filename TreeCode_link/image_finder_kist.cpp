@@ -1971,18 +1971,12 @@ int ImageFinding::IF_routines::refine_grid_kist(
  *   false for non-image points.
  */
 void findborders4(TreeHndl i_tree,ImageInfo *imageinfo){
-  int i;
-  unsigned long j;
   bool addinner;
   bool allin = false;
   
   
   if(i_tree->pointlist->size() == imageinfo->imagekist->Nunits()) allin = true;    // all points on the grid are in the image
   
-  //printf("beginning findborders2\n");
-  //checkTree(i_tree);
-  
-  //point=(Point *)malloc(sizeof(Point));
   imageinfo->innerborder->Empty();
   imageinfo->outerborder->Empty();
   
@@ -1992,79 +1986,52 @@ void findborders4(TreeHndl i_tree,ImageInfo *imageinfo){
   
   if(imageinfo->imagekist->Nunits() < 1) return;
   
-  Kist<Point> * neighborkist = new Kist<Point>;
-  
-  Kist<Point> * imagekist = imageinfo->imagekist; assert(imageinfo->imagekist);
+  FlatKist<Point> neighbors;
+  Point *point;
   
-  imagekist->MoveToTop();
-  for(j=0;j<imagekist->Nunits();++j,imagekist->Down()){
+  for(Kist<Point>::iterator it = imageinfo->imagekist->TopIt() ; !(it.atend()) ; --it){
+    point = &(*it);
     
-    if(imageinfo->gridrange[1] < imagekist->getCurrent()->gridsize)
-      imageinfo->gridrange[1] = imagekist->getCurrent()->gridsize;
-    if(imageinfo->gridrange[2] > imagekist->getCurrent()->gridsize)
-      imageinfo->gridrange[2] = imagekist->getCurrent()->gridsize;
+    if(imageinfo->gridrange[1] < point->gridsize) imageinfo->gridrange[1] = point->gridsize;
+    if(imageinfo->gridrange[2] > point->gridsize) imageinfo->gridrange[2] = point->gridsize;
     
     addinner=false;
     
-    i_tree->FindAllBoxNeighborsKist(imagekist->getCurrent(),neighborkist);
+    neighbors.Empty();
+    i_tree->FindAllBoxNeighbors(point,neighbors);
     
-    if( allin && neighborkist->Nunits() < 4){
-      imageinfo->innerborder->InsertAfterCurrent(imagekist->getCurrent());
+    if( allin && neighbors.size() < 4){
+      imageinfo->innerborder->InsertAfterCurrent(point);
+      imageinfo->innerborder->Down();
     }else{
       
-      neighborkist->MoveToTop();
-      for(i=0;i<neighborkist->Nunits();++i){
+      for(Point *neighbor : neighbors){
         
-        if( neighborkist->getCurrent()->in_image != YES){  // point is a neighbor
+        if( neighbor->in_image != YES){  // point is a neighbor
           addinner=true;
-          /*
-           // check if point is already in list
-           MoveToTopKist(imageinfo->outerborder);
-           for(m=0;m<imageinfo->outerborder->Nunits();++m){
-           if( getCurrentKist(imageinfo->outerborder) == getCurrentKist(neighborkist) ) break;
-           MoveDownKist(imageinfo->outerborder);
-           }
-           
-           if(m == imageinfo->outerborder->Nunits()){
-           // add point to outerborder
-           InsertAfterCurrentKist(imageinfo->outerborder,getCurrentKist(neighborkist));
-           MoveDownKist(imageinfo->outerborder);
-           }
-           */
           
-          if(neighborkist->getCurrent()->in_image == NO){  // if point is not yet in outerborder
+          if(neighbor->in_image == NO){  // if point is not yet in outerborder
             // add point to outerborder
-            neighborkist->getCurrent()->in_image = MAYBE;
-            imageinfo->outerborder->InsertAfterCurrent(neighborkist->getCurrent());
+            neighbor->in_image = MAYBE;
+            imageinfo->outerborder->InsertAfterCurrent(neighbor);
             imageinfo->outerborder->Down();
           }
         }
-        neighborkist->Down();
       }
       
       if(addinner){
-        // add point to innerborderkist
-        imageinfo->innerborder->InsertAfterCurrent(imagekist->getCurrent());
+        imageinfo->innerborder->InsertAfterCurrent(point);
         imageinfo->innerborder->Down();
       }
     }
-    
   }
   
-		// mark outer borders back to in_image=NO
-		
-  if(!allin  && imageinfo->outerborder->Nunits() > 0){
-    imageinfo->outerborder->MoveToTop();
-    do{
-      imageinfo->outerborder->getCurrent()->in_image = NO;
-      
-      if(imageinfo->gridrange[0] < imageinfo->outerborder->getCurrent()->gridsize)
-        imageinfo->gridrange[0] = imageinfo->outerborder->getCurrent()->gridsize;
-    }while(imageinfo->outerborder->Down());
+  // mark outer borders back to in_image=NO
+  for(Kist<Point>::iterator it = imageinfo->outerborder->TopIt() ; !(it.atend()) ; --it){
+    (*it).in_image = NO;
+    if(imageinfo->gridrange[0] < (*it).gridsize) imageinfo->gridrange[0] = (*it).gridsize;
   }
   
-  delete neighborkist;
-  
   return;
 }
 
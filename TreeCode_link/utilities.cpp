@@ -9,15 +9,18 @@
 #include "slsimlib.h"
 #include "utilities_slsim.h"
 #include <random>
+#include <cstring>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 
-Point *LinkToSourcePoints(Point *i_points,unsigned long Npoints){
+Point *LinkToSourcePoints(Point *i_points,unsigned long Npoints,PointPool *pool){
   Point *s_points;
   long i;
 
   if(Npoints < 1) return NULL;
 
-  s_points = NewPointArray(Npoints);
+  s_points = NewPointArray(Npoints,pool);
 
   for(i=0;i<Npoints;++i){
     s_points[i].id=i_points[i].id;
@@ -415,6 +418,110 @@ unsigned long prevpower(unsigned long k){
     else return temp;
   }
   
+  RandomNumbers_Philox::RandomNumbers_Philox(uint64_t my_seed,uint64_t my_stream):
+  seed(my_seed),stream(my_stream),index(0),block_counter(0),block_valid(false),count(true)
+  {
+  }
+  
+  RandomNumbers_Philox::RandomNumbers_Philox(long *nr_seed):
+  stream(0),index(0),block_counter(0),block_valid(false),count(true)
+  {
+    seed = (uint64_t)(ran2(nr_seed)*4294967296.0) << 32;
+    seed |= (uint64_t)(ran2(nr_seed)*4294967296.0);
+  }
+  
+  void RandomNumbers_Philox::philox(const uint32_t counter[4],const uint32_t key[2],uint32_t out[4]){
+    uint32_t c[4] = {counter[0],counter[1],counter[2],counter[3]};
+    uint32_t k[2] = {key[0],key[1]};
+    uint64_t p0,p1;
+    
+    for(int round = 0 ; round < 10 ; ++round){
+      if(round > 0){
+        k[0] += 0x9E3779B9;
+        k[1] += 0xBB67AE85;
+      }
+      p0 = (uint64_t)0xD2511F53*c[0];
+      p1 = (uint64_t)0xCD9E8D57*c[2];
+      
+      uint32_t t[4] = {(uint32_t)(p1 >> 32) ^ c[1] ^ k[0],(uint32_t)p1
+                      ,(uint32_t)(p0 >> 32) ^ c[3] ^ k[1],(uint32_t)p0};
+      c[0] = t[0]; c[1] = t[1]; c[2] = t[2]; c[3] = t[3];
+    }
+    out[0] = c[0]; out[1] = c[1]; out[2] = c[2]; out[3] = c[3];
+  }
+  
+  /// return a uniform random number in (0,1) with 53 random bits
+  PosType RandomNumbers_Philox::operator()(void){
+    uint64_t n = index++;
+    
+    if(!block_valid || block_counter != n/2){
+      block_counter = n/2;
+      const uint32_t counter[4] = {(uint32_t)block_counter,(uint32_t)(block_counter >> 32)
+                                  ,(uint32_t)stream,(uint32_t)(stream >> 32)};
+      const uint32_t key[2] = {(uint32_t)seed,(uint32_t)(seed >> 32)};
+      philox(counter,key,block);
+      block_valid = true;
+    }
+    
+    const uint32_t *w = &block[2*(n % 2)];
+    return ((PosType)((uint64_t)(w[0] >> 5)*67108864 + (w[1] >> 6)) + 0.5)/9007199254740992.0;
+  }
+  
+  PosType RandomNumbers_Philox::gauss(){
+    if(count){
+      do{
+        u = 2*(*this)() - 1;
+        v = 2*(*this)() - 1;
+        s = u*u +v*v;
+      }while( s > 1.0 || s == 0.0);
+      
+      s = sqrt(-2*log(s)/s);
+      count = false;
+      return s*u;
+    }else{
+      count = true;
+      return s*v;
+    }
+  }
+  
+  /// same method as NR poidev(), direct for small means and rejection from a Lorentzian for large ones
+  long RandomNumbers_Philox::poisson(PosType xm){
+    PosType em,t,y;
+    
+    if(xm <= 0) return 0;
+    if(xm < 12.0){
+      PosType g = exp(-xm);
+      em = -1;
+      t = 1.0;
+      do{
+        ++em;
+        t *= (*this)();
+      }while(t > g);
+    }else{
+      PosType sq = sqrt(2.0*xm);
+      PosType alxm = log(xm);
+      PosType g = xm*alxm - std::lgamma(xm + 1.0);
+      do{
+        do{
+          y = tan(pi*(*this)());
+          em = sq*y + xm;
+        }while(em < 0.0);
+        em = floor(em);
+        t = 0.9*(1.0 + y*y)*exp(em*alxm - std::lgamma(em + 1.0) - g);
+      }while((*this)() > t);
+    }
+    return (long)em;
+  }
+  
+  RandomNumbers_Philox RandomNumbers_Philox::substream(uint64_t i) const{
+    // splitmix64 of the parent stream and i
+    uint64_t z = stream*0x9E3779B97F4A7C15ULL + i + 0x632BE59BD9B4E019ULL;
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return RandomNumbers_Philox(seed,z);
+  }
+  
   
 #ifdef ENABLE_FFTW
   
@@ -644,5 +751,335 @@ unsigned long prevpower(unsigned long k){
   }
 
   int GetNThreads(){return N_THREADS;}
+  
+  ThreadPool::ThreadPool(int nthreads):stop(false){
+    for(int i=1;i<nthreads;++i) workers.push_back(std::thread(&ThreadPool::run,this));
+  }
+  
+  ThreadPool::~ThreadPool(){
+    {
+      std::lock_guard<std::mutex> hold(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for(auto &thr : workers) thr.join();
+  }
+  
+  ThreadPool& ThreadPool::get(){
+    static ThreadPool pool(GetNThreads());
+    return pool;
+  }
+  
+  ThreadPool::Job::Job(size_t my_N,size_t my_batch_size,int nblocks
+                       ,const std::function<void(size_t,size_t)> &my_func)
+  :func(my_func),N(my_N),batch_size(my_batch_size),tickets(0),done(0)
+  {
+    Nbatches = (N + batch_size - 1)/batch_size;
+    Nblocks = std::max<size_t>(1,std::min<size_t>(nblocks,Nbatches));
+    blocks.reset(new Block[Nblocks]);
+    
+    // deal the batches out in contiguous blocks, one per thread
+    size_t start = 0;
+    for(size_t i=0;i<Nblocks;++i){
+      blocks[i].next = start;
+      start += Nbatches/Nblocks + ( i < Nbatches % Nblocks );
+      blocks[i].end = start;
+    }
+    assert(start == Nbatches);
+  }
+  
+  bool ThreadPool::Job::work(int ticket){
+    size_t count = 0,ib,start;
+    
+    // start on its own block and then steal from the others
+    for(size_t k=0;k<Nblocks;++k){
+      Block &block = blocks[(ticket + k) % Nblocks];
+      while( block.next.load(std::memory_order_relaxed) < block.end ){
+        ib = block.next.fetch_add(1);
+        if(ib >= block.end) break;
+        
+        start = ib*batch_size;
+        func(start,std::min(start + batch_size,N));
+        ++count;
+      }
+    }
+    
+    if(count > 0 && done.fetch_add(count) + count == Nbatches){
+      std::lock_guard<std::mutex> hold(mutex);
+      finished.notify_all();
+    }
+    
+    return count > 0;
+  }
+  
+  void ThreadPool::run(){
+    std::shared_ptr<Job> job;
+    
+    while(true){
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock,[this]{return stop || !jobs.empty();});
+        if(stop) return;
+        job = jobs.front();
+      }
+      
+      // the job is taken off the queue by whoever finds it has nothing left to hand out
+      if(!job->work(job->tickets.fetch_add(1))){
+        std::lock_guard<std::mutex> hold(mutex);
+        if(!jobs.empty() && jobs.front() == job) jobs.pop_front();
+      }
+      job.reset();
+    }
+  }
+  
+  void ThreadPool::parallel_for(size_t N,size_t batch_size
+                                ,const std::function<void(size_t,size_t)> &func){
+    if(N == 0) return;
+    if(batch_size < 1) batch_size = 1;
+    
+    // not worth waking anybody up
+    if(workers.size() == 0 || N <= batch_size){
+      func(0,N);
+      return;
+    }
+    
+    std::shared_ptr<Job> job(new Job(N,batch_size,size(),func));
+    {
+      std::lock_guard<std::mutex> hold(mutex);
+      jobs.push_back(job);
+    }
+    wake.notify_all();
+    
+    job->work(job->tickets.fetch_add(1));
+    
+    {
+      std::unique_lock<std::mutex> lock(job->mutex);
+      job->finished.wait(lock,[&job]{return job->done.load() == job->Nbatches;});
+    }
+    
+    std::lock_guard<std::mutex> hold(mutex);
+    auto it = std::find(jobs.begin(),jobs.end(),job);
+    if(it != jobs.end()) jobs.erase(it);
+  }
+  
+  namespace {
+    const char catalog_magic[8] = {'G','C','A','T','B','I','N','1'};
+    
+    inline bool column_space(char c){return c == ' ' || c == '\t' || c == '\r';}
+  }
+  
+  CatalogTable::CatalogTable(const std::string &filename,const std::string &column_types
+                             ,char my_separator,bool use_cache,bool verbose)
+  :types(column_types),separator(my_separator),Nrows(0),mapped(nullptr),mapped_size(0)
+  {
+    Header header;
+    
+    if(types.size() == 0 || types.size() > sizeof(header.types))
+      throw std::invalid_argument("CatalogTable: bad number of columns");
+    for(char c : types){
+      if(c != 'i' && c != 'f') throw std::invalid_argument("CatalogTable: column types must be 'i' or 'f'");
+    }
+    
+    struct stat source;
+    if(stat(filename.c_str(),&source) != 0){
+      std::cout << "Can't open file " << filename << std::endl;
+      ERROR_MESSAGE();
+      throw std::runtime_error(" Cannot open file.");
+    }
+    
+    memset(&header,0,sizeof(Header));
+    memcpy(header.magic,catalog_magic,sizeof(header.magic));
+    header.source_size = source.st_size;
+    header.source_mtime = source.st_mtime;
+    header.Ncolumns = types.size();
+    memcpy(header.types,types.data(),types.size());
+    
+    std::string cachename = filename + ".bin";
+    
+    if(use_cache && readCache(cachename,header)){
+      if(verbose) std::cout << "   read " << Nrows << " rows from cache " << cachename << std::endl;
+      return;
+    }
+    
+    parse(filename,verbose);
+    
+    if(use_cache){
+      header.Nrows = Nrows;
+      writeCache(cachename,header);
+    }
+  }
+  
+  CatalogTable::~CatalogTable(){
+    if(mapped) munmap(mapped,mapped_size);
+  }
+  
+  bool CatalogTable::readCache(const std::string &cachename,const Header &expected){
+    int fd = open(cachename.c_str(),O_RDONLY);
+    if(fd < 0) return false;
+    
+    Header header;
+    struct stat cache;
+    if(fstat(fd,&cache) != 0 || read(fd,&header,sizeof(Header)) != (ssize_t)sizeof(Header)
+       || memcmp(header.magic,expected.magic,sizeof(header.magic)) != 0
+       || header.source_size != expected.source_size
+       || header.source_mtime != expected.source_mtime
+       || header.Ncolumns != expected.Ncolumns
+       || memcmp(header.types,expected.types,sizeof(header.types)) != 0
+       || (size_t)cache.st_size != sizeof(Header) + header.Nrows*header.Ncolumns*sizeof(Cell)
+       ){
+      close(fd);
+      return false;
+    }
+    
+    void *map = mmap(nullptr,cache.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(map == MAP_FAILED) return false;
+    
+    mapped = map;
+    mapped_size = cache.st_size;
+    Nrows = header.Nrows;
+    
+    const Cell *start = (const Cell *)((char *)mapped + sizeof(Header));
+    columns.resize(types.size());
+    for(size_t l=0;l<types.size();++l) columns[l] = start + l*Nrows;
+    
+    return true;
+  }
+  
+  void CatalogTable::parse(const std::string &filename,bool verbose){
+    
+    std::string text;
+    {
+      std::ifstream file_in(filename.c_str(),std::ios::binary);
+      if(!file_in){
+        std::cout << "Can't open file " << filename << std::endl;
+        ERROR_MESSAGE();
+        throw std::runtime_error(" Cannot open file.");
+      }
+      file_in.seekg(0,std::ios::end);
+      text.resize(file_in.tellg());
+      file_in.seekg(0,std::ios::beg);
+      file_in.read(&text[0],text.size());
+    }
+    
+    // skip through header information
+    size_t begin = 0,Ncomments = 0;
+    while(begin < text.size() && text[begin] == '#'){
+      begin = text.find('\n',begin);
+      begin = (begin == std::string::npos) ? text.size() : begin + 1;
+      ++Ncomments;
+    }
+    if(verbose) std::cout << "   skipped "<< Ncomments << " comment lines in file " << filename << std::endl;
+    
+    // a comment line after the data ends it
+    size_t end = text.find("\n#",begin);
+    end = (end == std::string::npos) ? text.size() : end + 1;
+    
+    // cut the text into chunks at line boundaries
+    ThreadPool &pool = ThreadPool::get();
+    size_t Nchunks = std::max<size_t>(1,std::min<size_t>(4*pool.size(),(end - begin)/(1 << 16)));
+    std::vector<size_t> bounds(Nchunks + 1);
+    bounds[0] = begin;
+    bounds[Nchunks] = end;
+    for(size_t k=1;k<Nchunks;++k){
+      size_t b = std::max(bounds[k-1],begin + k*(end - begin)/Nchunks);
+      while(b < end && b > begin && text[b-1] != '\n') ++b;
+      bounds[k] = b;
+    }
+    
+    const int Ncolumns = types.size();
+    std::vector<std::vector<Cell> > rows(Nchunks);
+    std::vector<size_t> bad_line(Nchunks,0);
+    
+    pool.parallel_for(Nchunks,1,[&](size_t first,size_t last){
+      for(size_t k=first;k<last;++k){
+        const char *p = text.c_str() + bounds[k];
+        const char *chunk_end = text.c_str() + bounds[k+1];
+        std::vector<Cell> &chunk = rows[k];
+        chunk.reserve((chunk_end - p)/(8*Ncolumns) + 1);
+        Cell cell;
+        
+        while(p < chunk_end){
+          const char *line_end = (const char *)memchr(p,'\n',chunk_end - p);
+          if(line_end == nullptr) line_end = chunk_end;
+          
+          while(p < line_end && column_space(*p)) ++p;
+          if(p == line_end){  // blank line
+            p = line_end + 1;
+            continue;
+          }
+          
+          for(int l=0;l<Ncolumns;++l){
+            while(p < line_end && column_space(*p)) ++p;
+            char *q;
+            if(types[l] == 'i') cell.i = strtoll(p,&q,10);
+            else cell.f = strtod(p,&q);
+            if(q == p || q > line_end){
+              bad_line[k] = line_end - text.c_str();
+              break;
+            }
+            chunk.push_back(cell);
+            
+            // skip whatever is left of the field
+            p = q;
+            while(p < line_end && *p != separator && !column_space(*p)) ++p;
+            while(p < line_end && column_space(*p)) ++p;
+            if(p < line_end && *p == separator) ++p;
+          }
+          if(bad_line[k] > 0) break;
+          p = line_end + 1;
+        }
+      }
+    });
+    
+    for(size_t k=0;k<Nchunks;++k){
+      if(bad_line[k] > 0){
+        size_t line = Ncomments + 1 + std::count(text.begin() + begin,text.begin() + bad_line[k],'\n');
+        std::cout << "Too few columns on line " << line << " of " << filename << std::endl;
+        ERROR_MESSAGE();
+        throw std::runtime_error("CatalogTable: badly formed line");
+      }
+    }
+    
+    // transpose into columns
+    std::vector<size_t> offsets(Nchunks + 1,0);
+    for(size_t k=0;k<Nchunks;++k) offsets[k+1] = offsets[k] + rows[k].size()/Ncolumns;
+    Nrows = offsets[Nchunks];
+    
+    data.resize(Nrows*Ncolumns);
+    pool.parallel_for(Nchunks,1,[&](size_t first,size_t last){
+      for(size_t k=first;k<last;++k){
+        size_t n = rows[k].size()/Ncolumns;
+        for(size_t i=0;i<n;++i){
+          for(int l=0;l<Ncolumns;++l) data[l*Nrows + offsets[k] + i] = rows[k][i*Ncolumns + l];
+        }
+        std::vector<Cell>().swap(rows[k]);
+      }
+    });
+    
+    columns.resize(Ncolumns);
+    for(int l=0;l<Ncolumns;++l) columns[l] = data.data() + l*Nrows;
+    
+    if(verbose) std::cout << "   read " << Nrows << " rows from " << filename << std::endl;
+  }
+  
+  void CatalogTable::writeCache(const std::string &cachename,const Header &header){
+    
+    // written under a temporary name and renamed so that nobody maps a half written file
+    std::string tmpname = cachename + ".tmp" + std::to_string(getpid());
+    FILE *file = fopen(tmpname.c_str(),"wb");
+    if(file == nullptr){
+      std::cout << "CatalogTable: could not write cache " << cachename << std::endl;
+      return;
+    }
+    
+    bool good = (fwrite(&header,sizeof(Header),1,file) == 1);
+    if(Nrows > 0) good = good && (fwrite(data.data(),sizeof(Cell),data.size(),file) == data.size());
+    good = (fclose(file) == 0) && good;
+    
+    if(!good || rename(tmpname.c_str(),cachename.c_str()) != 0){
+      std::cout << "CatalogTable: could not write cache " << cachename << std::endl;
+      remove(tmpname.c_str());
+    }
+  }
 }
-
@@ -10,6 +10,8 @@
 
 //#include "pointlist.h"
 #include "point.h"
+#include <vector>
+#include <algorithm>
 
 /// Internal container used in Kist container class
 template <class T>
@@ -815,6 +817,144 @@ template <class Data> void test_iterator2(Kist<Data> &kist){
   }
   assert(i == kist.Nunits());
 }
+/** \ingroup ImageFindingL2
+ * \brief A set of pointers to data (default is Point) that is stored contiguously.
+ *
+ * This is meant for the inner loops of the image finding routines where a Kist would be walked,
+ * spliced and copied many times.  There is no current position.  Points are accessed by index or
+ * iterator and removals are done in bulk with remove_if() or partition() so that nothing is moved
+ * one element at a time.  The order of the elements has no meaning unless stated.
+ *
+ * Conversion to and from a Kist is provided so that the results can be passed back to
+ * routines that still use Kists, ImageInfo::imagekist for example.
+ *
+ <pre>
+ example:
+ 
+ FlatKist<Point> image;
+ image.copy(*imageinfo.imagekist);
+ image.SetInImage(YES);
+ 
+ size_t n = image.partition([](Point *p){return p->gridsize > 1.0e-3;});
+ // the first n points now have gridsize > 1.0e-3
+ 
+ image.copy_to(*imageinfo.imagekist);
+ </pre>
+ */
+template <class Data>
+struct FlatKist{
+public:
+  typedef typename std::vector<Data *>::iterator iterator;
+  typedef typename std::vector<Data *>::const_iterator const_iterator;
+  
+  FlatKist(){};
+  FlatKist(const Kist<Data> &kist){copy(kist);}
+  
+  /// Number of elements
+  size_t size() const {return units.size();}
+  bool empty() const {return units.empty();}
+  void reserve(size_t n){units.reserve(n);}
+  /// Removes all elements without destroying the data.  Memory is kept for reuse.
+  void Empty(){units.clear();}
+  
+  void push_back(Data *data){units.push_back(data);}
+  Data *back() const {return units.back();}
+  void pop_back(){units.pop_back();}
+  
+  Data *operator[](size_t i) const {return units[i];}
+  
+  iterator begin(){return units.begin();}
+  iterator end(){return units.end();}
+  const_iterator begin() const {return units.begin();}
+  const_iterator end() const {return units.end();}
+  
+  /// underlying vector
+  std::vector<Data *> &vec(){return units;}
+  const std::vector<Data *> &vec() const {return units;}
+  
+  /// replace the contents with the contents of kist, the order of kist is kept
+  void copy(const Kist<Data> &kist){
+    units.resize(kist.Nunits());
+    size_t i = 0;
+    for(auto it = kist.TopIt() ; !(it.atend()) ; --it,++i) units[i] = &(*it);
+  }
+  /// replace the contents of kist with the contents of this
+  void copy_to(Kist<Data> &kist) const {
+    kist.Empty();
+    for(size_t i = 0 ; i < units.size() ; ++i){
+      kist.InsertAfterCurrent(units[i]);
+      kist.Down();
+    }
+  }
+  
+  /// Set the in_image flag of every element and of its image to value
+  void SetInImage(Boo value){
+    for(size_t i = 0 ; i < units.size() ; ++i){
+      units[i]->in_image = value;
+      units[i]->image->in_image = value;
+    }
+  }
+  /// check if all in_image flags are set to value
+  bool CheckInImage(Boo value) const{
+    for(size_t i = 0 ; i < units.size() ; ++i) if(units[i]->in_image != value) return false;
+    return true;
+  }
+  /// Transform all elements from image to source plane or vis versus.  Data type must have an "image" attribute.
+  void TranformPlanes(){
+    for(size_t i = 0 ; i < units.size() ; ++i){
+      assert(units[i]->image);
+      units[i] = units[i]->image;
+    }
+  }
+  
+  /** \brief Moves the elements for which pred is true to the front keeping their relative order
+   * and returns the number of them.
+   */
+  template <typename Pred>
+  size_t partition(Pred pred){
+    return std::stable_partition(units.begin(),units.end(),pred) - units.begin();
+  }
+  /// Takes out all the elements for which pred is true, the order of the others is kept
+  template <typename Pred>
+  void remove_if(Pred pred){
+    units.erase(std::remove_if(units.begin(),units.end(),pred),units.end());
+  }
+  
+  /// Adds the elements of set that are not already in this one.  The order of this one is kept.
+  void unite(const FlatKist<Data> &set){
+    std::vector<Data *> sorted(units);
+    std::sort(sorted.begin(),sorted.end());
+    size_t n = units.size();
+    for(size_t i = 0 ; i < set.size() ; ++i){
+      if(!std::binary_search(sorted.begin(),sorted.end(),set[i])) units.push_back(set[i]);
+    }
+    // set itself might have repeats
+    if(units.size() - n > 1){
+      std::vector<Data *> added(units.begin() + n,units.end());
+      std::sort(added.begin(),added.end());
+      added.erase(std::unique(added.begin(),added.end()),added.end());
+      units.resize(n);
+      units.insert(units.end(),added.begin(),added.end());
+    }
+  }
+  /// Takes out the elements that are also in set.  The order of the others is kept.
+  void subtract(const FlatKist<Data> &set){
+    std::vector<Data *> sorted(set.units);
+    std::sort(sorted.begin(),sorted.end());
+    remove_if([&sorted](Data *p){return std::binary_search(sorted.begin(),sorted.end(),p);});
+  }
+  
+  /// returns true if all the members have unique addresses
+  bool AreDataUnique() const{
+    std::vector<Data *> sorted(units);
+    std::sort(sorted.begin(),sorted.end());
+    return std::adjacent_find(sorted.begin(),sorted.end()) == sorted.end();
+  }
+  
+private:
+  std::vector<Data *> units;
+};
+
 /*
  * These functions are provided for backwards compatibility, but the kist member methods
  * should be used in the future.
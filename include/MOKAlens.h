@@ -69,6 +69,8 @@ public:
                   ,int pixel_map_zeropad
                   ,bool my_zeromean
                   , const COSMOLOGY& lenscosmo
+                  ,bool fft_float = false
+                  ,size_t fft_max_memory = 0
                   );
   
   //LensHaloMassMap(PixelMap &map,double massconvertion,double zlens,double zsource,int pixel_map_zeropad,const COSMOLOGY& lenscosmo);
@@ -82,6 +84,8 @@ public:
                   ,int pixel_map_zeropad    /// factor by which to zero pad in FFTs, ex. 4
                   ,bool my_zeromean         /// if true, subtracts average density
                   ,const COSMOLOGY& lenscosmo  /// cosmology
+                  ,bool fft_float = false      /// do the FFTs in single precision (needs ENABLE_FFTWF)
+                  ,size_t fft_max_memory = 0   /// limit in MB on the FFT work arrays, 0 for none
   );
 
 	~LensHaloMassMap();
@@ -101,6 +105,7 @@ public:
 	void saveProfiles(double &RE3, double &xxc, double &yyc);
     
 	void force_halo(double *alpha,KappaType *kappa,KappaType *gamma,KappaType *phi,double const *xcm,bool subtract_point=false,PosType screening = 1.0);
+	void force_halo_batch(PlaneForceBatch &batch,PosType const *x_halo);
     
 	void saveImage(GridHndl grid,bool saveprofiles);
 	
@@ -141,6 +146,25 @@ private:
 	void PreProcessFFTWMap();
   int zerosize;
   bool zeromean;
+  /// do the FFTs in single precision
+  bool fft_float;
+  /// limit in MB on the memory used by the FFTs, 0 for none
+  size_t fft_max_memory;
+  
+  /// alpha1, alpha2, gamma1, gamma2, convergence and phi of each pixel together, the pixels in square tiles.
+  /// Once these are filled the corresponding maps in MOKAmap are released.
+  std::vector<KappaType> samples;
+  static const int sample_fields = 6;
+  static const int sample_tile = 8;
+  long sample_tiles_x;
+  void interleaveMaps();
+  void restoreMaps();
+  bool sample(PosType const *x,PosType *alpha,KappaType *kappa,KappaType *gamma,KappaType *phi) const;
+  /// position in samples of pixel (i,j)
+  size_t sample_index(long i,long j) const{
+    return ( ( (j/sample_tile)*sample_tiles_x + i/sample_tile )*sample_tile*sample_tile
+            + (j%sample_tile)*sample_tile + i%sample_tile )*sample_fields;
+  }
 };
   
 
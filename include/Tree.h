@@ -10,6 +10,8 @@
 #define treetypes_declare
 
 #include <mutex>
+#include <map>
+#include <vector>
 //#include "pointlist.h"
 #include "point.h"
 #include "Kist.h"
@@ -124,6 +126,7 @@ public:
 
   //void FindAllBoxNeighbors(Point *point,ListHndl neighbors);
   void FindAllBoxNeighborsKist(Point *point,Kist<Point> * neighbors) const;
+  void FindAllBoxNeighbors(Point *point,FlatKist<Point> &neighbors) const;
   void PointsWithinEllipKist(const PosType* center,float rmax,float rmin,float posangle,Kist<Point> * neighborkist) const;
   PosType PointsWithinKist(const PosType* center,PosType rmax,Kist<Point> * neighborkist,short markpoints) const;
   void PointsWithinKist_iter(const PosType* center,float rmin,float rmax,Kist<Point> * neighborkist) const;
@@ -256,9 +259,69 @@ bool BoxIntersectCircle(const PosType* center,PosType radius,PosType *p1,PosType
 
 // Point arrays
 
+/** \brief Slab allocator for arrays of Points.
+ *
+ * Arrays are cut out of large slabs so that the many small allocations made while refining
+ * a grid do not each go to the heap.  A slab is given back when the last array in it is freed
+ * and everything is released when the pool is destroyed.  Arrays from a pool are freed with
+ * FreePointArray() like any other.
+ *
+ * The counters can be used to see how much memory the points of a Grid are taking up.
+ */
+class PointPool{
+public:
+  PointPool(size_t slab_size = 65536);
+  ~PointPool();
+  
+  /// allocate an array of N points, head is set as in NewPointArray()
+  Point *NewPointArray(unsigned long N);
+  
+  /// number of points in arrays that have not been freed
+  size_t getNpoints() const;
+  /// bytes of memory held by the pool, including space in slabs that is not in use
+  size_t getBytes() const;
+  /// maximum of getBytes() over the life of the pool
+  size_t getHighWaterBytes() const;
+  /// number of slabs held
+  size_t getNslabs() const;
+  
+  /// frees an array if it came from a PointPool, returns false if it did not
+  static bool Free(Point *array);
+  
+private:
+  struct Slab{
+    PointPool *pool;
+    Point *base;
+    size_t capacity;
+    size_t used;
+    size_t Narrays;   // number of arrays in slab that have not been freed
+  };
+  
+  Slab *newSlab(size_t capacity);
+  void releaseSlab(Slab *slab);
+  void free(Slab *slab,Point *array);
+  
+  size_t slab_size;
+  Slab *current;
+  std::vector<Slab *> slabs;
+  
+  size_t Npoints;
+  size_t bytes;
+  size_t high_water;
+  mutable std::mutex mtx;
+  
+  // slabs of all pools ordered by address so that FreePointArray() can find them
+  static std::map<const Point *,Slab *> registry;
+  static std::mutex registry_mutex;
+  
+  // make a PointPool uncopyable
+  PointPool(const PointPool &p);
+  PointPool &operator=(const PointPool &p);
+};
+
 void PrintPoint(Point *point);
-Point *NewPointArray(unsigned long N);
-Point *AddPointToArray(Point *points,unsigned long N,unsigned long Nold);
+Point *NewPointArray(unsigned long N,PointPool *pool = NULL);
+Point *AddPointToArray(Point *points,unsigned long N,unsigned long Nold,PointPool *pool = NULL);
 void FreePointArray(Point *array,bool NewXs = true);
 void SwapPointsInArray(Point *p1,Point *p2);
 void SwapPointsInArrayData(Point *p1,Point *p2);
@@ -291,7 +354,7 @@ void findborders4(TreeHndl i_tree,ImageInfo *imageinfo);
 // in find_crit.c
 void findborders(TreeHndl i_tree,ImageInfo *imageinfo);
 
-Point *LinkToSourcePoints(Point *i_points,unsigned long Npoints);
+Point *LinkToSourcePoints(Point *i_points,unsigned long Npoints,PointPool *pool = NULL);
 
 /// \ingroup Util
 namespace Utilities{
@@ -8,6 +8,7 @@
 #ifndef BASE_ANALENS_H_
 #define BASE_ANALENS_H_
 
+#include <mutex>
 #include "quadTree.h"
 #include "source.h"
 #include "InputParams.h"
@@ -96,6 +97,7 @@ public:
   PosType sub_Mmin;
   PosType sub_theta_force;
   LensHalo *subs;
+  /// tree for the substructure force, built from subs[] and sub_x[] on first use (see getSubTree())
   TreeQuad *sub_tree;
   IndexType *sub_substructures;
   ClumpInternal main_sub_type;
@@ -110,6 +112,9 @@ public:
   // in randoimize_lens.c
   PosType averageSubMass();
 
+  /// must be called after subs[] or sub_x[] are changed so that the substructure tree is rebuilt
+  void clearSubTree();
+
   // in readlens_ana.c
   void reNormSubstructure(PosType kappa_sub);
   //void toggleStars(bool implanted);
@@ -167,6 +172,13 @@ protected:
 
   bool substruct_implanted;
 
+  /// above this number of substructures their force is calculated with sub_tree instead of by direct summation
+  static const int sub_tree_Nmin = 100;
+  TreeQuad *getSubTree();
+  std::vector<LensHalo *> sub_tree_halos;
+  std::atomic<bool> sub_tree_built;
+  std::mutex sub_tree_mutex;
+
    // private derived quantities
    /// private: conversion factor between Mpc on the lens plane and arcseconds
    PosType MpcToAsec;
@@ -17,5 +17,6 @@ void divide_images(TreeHndl i_tree,ImageInfo *imageinfo,int *Nimages,int Nimages
 void partition_images(Point *point,unsigned long *N_in_image,TreeHndl i_tree);
 void divide_images_kist(TreeHndl i_tree,std::vector<ImageInfo> &imageinfo,int *Nimages);
 PosType partition_images_kist(Point *point,Kist<Point> * imagekist,TreeHndl i_tree);
+PosType partition_images_flat(Point *point,Kist<Point> *imagekist,FlatKist<Point> &stack,TreeHndl i_tree);
 
 #endif
@@ -11,7 +11,6 @@
 #include "lens.h"
 #include "point.h"
 #include "Tree.h"
-#include <mutex>
 #include <utilities_slsim.h>
 
 class LensHaloBaseNSIE;
@@ -38,6 +37,21 @@ struct Grid{
   double ClearSurfaceBrightnesses();
   unsigned long getNumberOfPoints() const;
   
+  /** \brief Keep the rays after they have gone through the planes in front of the main halos.
+   *
+   * ReInitializeGrid(), ReShoot() and the refinements are then faster when only the main halos have
+   * changed since the rays were last shot, see Lens::rayshooterInternal(unsigned long,Point *,StaticPlaneCache &).
+   */
+  void useStaticPlaneCache(bool on){use_static_cache = on; if(!on) static_cache.clear();}
+  const StaticPlaneCache & getStaticPlaneCache() const {return static_cache;}
+  
+  /// number of image and source points allocated by this grid that have not been freed
+  size_t getNpointsAllocated() const {return point_pool.getNpoints();}
+  /// bytes of memory currently held for the points of this grid
+  size_t getPointBytes() const {return point_pool.getBytes();}
+  /// largest number of bytes held for the points of this grid at any one time
+  size_t getPointBytesHighWater() const {return point_pool.getHighWaterBytes();}
+  
   
   /// tree on image plane
   TreeHndl i_tree;
@@ -81,6 +95,8 @@ struct Grid{
 private:
   void xygridpoints(Point *points,double range,const double *center,long Ngrid
                     ,short remove_center);
+  void xygridpoints(Point *points,double range,const double *center,long Ngrid
+                    ,short remove_center,unsigned long id) const;
   
   /// one dimensional size of initial grid
   const int Ngrid_init;
@@ -100,9 +116,19 @@ private:
   
   unsigned long pointID;
   PosType axisratio;
-  void writePixelMapUniform_(const PointList &list,PixelMap *map,LensingVariable val);
   
-  static std::mutex grid_mutex;
+  /// the new image points made in RefineLeaves() before the ones off the grid are taken out, reused between calls
+  std::vector<Point> refine_scratch;
+  /// all the image and source points of the grid are allocated from here, it must outlive the trees
+  PointPool point_pool;
+  
+  bool use_static_cache;
+  StaticPlaneCache static_cache;
+  void shoot(LensHndl lens,unsigned long Npoints,Point *points){
+    if(use_static_cache) lens->rayshooterInternal(Npoints,points,static_cache);
+    else lens->rayshooterInternal(Npoints,points);
+  }
+  void writePixelMapUniform_(const PointList &list,PixelMap *map,LensingVariable val);
 };
 
 typedef struct Grid* GridHndl;
@@ -14,25 +14,47 @@
 #include "point.h"
 #include "Tree.h"
 #include "source.h"
-#include <mutex>
 
 /** \ingroup ImageFinding
  * \brief A simplified version of the Grid structure for making non-adaptive maps of the lensing quantities (kappa, gamma, etc...)
  *
  *  GripMap is faster and uses less memory than Grid.  It does not construct the tree structures for the points 
  *  and thus cannot be used for adaptive mapping or image finding.
+ *
+ *  For large grids Lens::setFMMShooting() makes the field planes use a dual tree method on all the rays at once.
+ *  GridMapStorage::compact keeps only flat arrays of the ray positions and lensing quantities instead of
+ *  two Points per ray, so about three times as many rays fit in memory.
  */
 
 //class PixelMap;
 
+/** \brief How a GridMap keeps its rays.
+ *
+ *  points  - an image and a source Point for every ray, needed for GridMap::operator[]
+ *  compact - flat arrays of only the positions and lensing quantities, about a third of the memory
+ */
+enum class GridMapStorage {points,compact};
+
 struct GridMap{
   
-	GridMap(LensHndl lens,unsigned long N1d,const double center[2],double range);
-  GridMap(LensHndl lens ,unsigned long Nx ,const PosType center[2] ,PosType rangeX ,PosType rangeY);
+	GridMap(LensHndl lens,unsigned long N1d,const double center[2],double range
+          ,GridMapStorage storage = GridMapStorage::points);
+  GridMap(LensHndl lens ,unsigned long Nx ,const PosType center[2] ,PosType rangeX ,PosType rangeY
+          ,GridMapStorage storage = GridMapStorage::points);
 	~GridMap();
   
   /// reshoot the rays for example when the source plane has been changed
   void ReInitializeGrid(LensHndl lens);
+  /** \brief Keep the rays after they have gone through the planes in front of the main halos so that
+   * ReInitializeGrid() is faster when only the main halos have changed,
+   * see Lens::rayshooterInternal(unsigned long,Point *,StaticPlaneCache &).  At most max_rays rays are kept.
+   */
+  void useStaticPlaneCache(bool on,size_t max_rays = 10000000){
+    use_static_cache = on;
+    static_cache.setMaxRays(max_rays);
+    if(!on) static_cache.clear();
+  }
+  const StaticPlaneCache & getStaticPlaneCache() const {return static_cache;}
 	double RefreshSurfaceBrightnesses(SourceHndl source);
   void ClearSurfaceBrightnesses();
 	size_t getNumberOfPoints() const {return Ngrid_init*Ngrid_init2;}
@@ -51,6 +73,15 @@ struct GridMap{
   void writePixelMapUniform(PixelMap &map,LensingVariable lensvar);
   void writeFitsUniform(const PosType center[],size_t Nx,size_t Ny,LensingVariable lensvar,std::string filename);
   
+  /// shoot the grid to several source redshifts at once with Lens::rayshooterMultiSource(), the grid's own source plane is not changed
+  void ShootSourcePlanes(LensHndl lens,const std::vector<PosType> &zsources);
+  /// number of source planes from the last ShootSourcePlanes()
+  size_t getNumberOfSourcePlanes() const {return source_z.size();}
+  /// redshift of a source plane from the last ShootSourcePlanes()
+  PosType getSourcePlaneRedshift(size_t source) const {return source_z.at(source);}
+  /// make pixel map of lensing quantities for one of the source planes from ShootSourcePlanes()
+  PixelMap writePixelMapUniform(LensingVariable lensvar,size_t source);
+  
   /// returns a PixelMap with the flux in pixels at a resolution of res times the original resolution
   PixelMap getPixelMap(int res);
   /// update a PixelMap with the flux in pixels at a resolution of res times the original resolution.
@@ -63,7 +94,11 @@ struct GridMap{
   
   Point_2d getCenter(){return center;}
   
-  Point * operator[](size_t i){return i_points + i;};
+  /// the image point of ray i, only available with GridMapStorage::points
+  Point * operator[](size_t i){
+    if(compact) throw std::runtime_error("GridMap::operator[] is not available with GridMapStorage::compact");
+    return i_points + i;
+  };
   
 private:
   void xygridpoints(Point *points,double range,const double *center,long Ngrid
@@ -77,12 +112,41 @@ private:
   PosType axisratio;
   PosType x_range;
   void writePixelMapUniform_(Point* points,size_t size,PixelMap *map,LensingVariable val);
+  void writeSourcePixelMap_(size_t source,size_t start,size_t size,PixelMap *map,LensingVariable val);
+  void writeCompactPixelMap_(size_t start,size_t size,PixelMap *map,LensingVariable val);
+  
+  /// position of ray i on the image plane
+  const PosType * image_position(size_t i) const {return compact ? &image_x[2*i] : i_points[i].x;}
+  /// surface brightness of ray i
+  float surface_brightness(size_t i) const {return compact ? ray_sb[i] : i_points[i].surface_brightness;}
+  void ShootCompact(LensHndl lens);
   
   Point *i_points;
   Point *s_points;
   Point_2d center;
   
-  static std::mutex grid_mutex;
+  bool compact;
+  /// number of rays shot at once in compact storage
+  static const size_t compact_block_size = 65536;
+  
+  // compact storage, two entries per ray for positions and three for gamma
+  std::vector<PosType> image_x;
+  std::vector<PosType> source_x;
+  std::vector<KappaType> ray_kappa;
+  std::vector<KappaType> ray_gamma;
+  std::vector<KappaType> ray_invmag;
+  std::vector<double> ray_dt;
+  std::vector<float> ray_sb;
+  
+  std::vector<PosType> source_z;
+  std::vector<std::vector<RayState> > source_rays;
+  
+  bool use_static_cache;
+  StaticPlaneCache static_cache;
+  void shoot(LensHndl lens,unsigned long Npoints,Point *points){
+    if(use_static_cache) lens->rayshooterInternal(Npoints,points,static_cache);
+    else lens->rayshooterInternal(Npoints,points);
+  }
 };
 
 #endif /* defined(__GLAMER__gridmap__) */
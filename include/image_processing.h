@@ -18,6 +18,9 @@
 
 // forward declaration
 struct Grid;
+namespace Utilities{
+  class FFTKernel;
+}
 
 /** \ingroup Image
  * \brief Takes image structure and pixelizes the flux into regular pixel grid which then
@@ -110,6 +113,11 @@ public:
   void printFITS(std::string filename,std::vector<std::tuple<std::string,double,std::string>> &extra_header_info, bool verbose) const;
 
 	void smooth(double sigma);
+  void convolve(const std::valarray<double> &kernel,std::size_t Nkx,std::size_t Nky);
+  void convolve_separable(const std::valarray<double> &kx,const std::valarray<double> &ky);
+#ifdef ENABLE_FFTW
+  void convolve(const Utilities::FFTKernel &kernel);
+#endif
 
 	inline double getValue(std::size_t i) const { return map[i]; }
 	inline double & operator[](std::size_t i) { return map[i]; };
@@ -342,6 +350,7 @@ public:
 	std::valarray<double> getPSF(){return map_psf;}
   void setPSF(std::string psf_file, float os = 1.);
 	PixelMap Convert (PixelMap &map, bool psf, bool noise,long *seed, unitType unit = counts_x_sec);
+	std::vector<PixelMap> Convert (std::vector<PixelMap> &maps, bool psf, bool noise,long *seed, unitType unit = counts_x_sec);
 	PixelMap Convert_back (PixelMap &map);
     void setExpTime(float time){exp_time = time;}
 
@@ -359,6 +368,10 @@ private:
 	double pix_size; // pixel size (in rad)
 	bool telescope; // was the observation created from a default telescope?
 
+	struct PSFCache;
+	// the transformed psf for each map shape, remade when the psf changes
+	std::shared_ptr<PSFCache> psf_cache;
+
 	PixelMap AddNoise(PixelMap &pmap,long *seed);
 	PixelMap PhotonToCounts(PixelMap &pmap);
 	PixelMap ApplyPSF(PixelMap &pmap);
@@ -376,6 +389,47 @@ namespace Utilities{
   void LoadFitsImages(std::string dir,std::vector<std::string> filespecs,std::vector<std::string> file_non_specs                                  ,std::vector<PixelMap> & images,std::vector<std::string> & names,int maxN,double resolution = -1,bool verbose = false);
     void ReadFileNames(std::string dir,const std::string filespec,std::vector<std::string> & filenames
                        ,bool verbose = false);
+  /// smallest size >= n with no prime factors larger than 7, which FFTW transforms quickly
+  size_t FFTSize(size_t n);
+#ifdef ENABLE_FFTW
+  /// FFTW's planner is not thread safe so all plans in the library are made holding this
+  std::mutex &FFTWPlannerMutex();
+  
+  /** \brief A kernel transformed once for maps of one size so that it can be applied to many of them
+   * with PixelMap::convolve(const FFTKernel &).
+   *
+   * The padding and FFTW plans are the same as for the convolutions through FFTs in PixelMap::convolve().
+   * The kernel of Nkx x Nky pixels is centered on (Nkx/2,Nky/2) and multiplied by norm.  If oversample > 1
+   * its pixels are that many times smaller than the map's.  It is then transformed on a grid that much finer
+   * covering the same area as the padded map and only the frequencies of the padded map are kept.  Maps can
+   * be convolved with the same kernel from several threads at once.
+   */
+  class FFTKernel{
+  public:
+    FFTKernel(const std::valarray<double> &kernel,std::size_t Nkx,std::size_t Nky
+              ,std::size_t Nx,std::size_t Ny,double oversample = 1,double norm = 1);
+    ~FFTKernel();
+    
+    /// size of the maps this kernel can be applied to
+    std::size_t getNx() const {return Nx;}
+    std::size_t getNy() const {return Ny;}
+    
+  private:
+    FFTKernel(const FFTKernel &);
+    FFTKernel &operator=(const FFTKernel &);
+    
+    friend class ::PixelMap;
+    void apply(std::valarray<double> &map) const;
+    
+    std::size_t Nx,Ny,Px,Py;
+    /// transform of the kernel including the FFT normalization
+    fftw_complex *fkernel;
+    
+    /// transforms of padded maps that are not in use
+    mutable std::mutex mutex;
+    mutable std::vector<fftw_complex *> workspaces;
+  };
+#endif
 }
 
 /** \brief Warning: Not tested yet. Class for doing adaptive smoothing using multiply resolution grids.
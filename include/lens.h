@@ -14,9 +14,98 @@
 #include "geometry.h"
 
 #include <map>
+#include <unordered_map>
 
 GLAMER_TEST_USES(LensTest)
 
+/** \brief The lensing quantities of a ray on one source plane, see Lens::rayshooterMultiSource().
+ *
+ *  They have the same meaning as those of a Point and its image after Lens::rayshooterInternal().
+ */
+struct RayState{
+  /// angular position on the source plane
+  PosType x[2];
+  KappaType kappa;
+  KappaType gamma[3];
+  KappaType invmag;
+  /// time delay in years
+  double dt;
+};
+
+class Lens;
+
+/** \brief Holds the state of rays after they have gone through the planes in front of the main halos,
+ * see Lens::rayshooterInternal(unsigned long,Point *,StaticPlaneCache &).
+ *
+ * The field planes in front of the first main plane do not change when the main halos are
+ * replaced or changed so the rays only need to be shot through them once.  The rays are
+ * identified by their positions on the image plane.  The cache is cleared automatically if the
+ * field planes, the plane distances or the source plane in front of the main halos change.
+ *
+ * Each ray takes about 150 bytes.  At most max_rays rays are held, 10^7 by default which is about
+ * 1.5 GB.  Once it is full the rays that are already in it are still used but new ones are shot
+ * through all the planes without being added.  Nothing is evicted because the rays are usually
+ * the same ones every time, those of a grid for example.
+ */
+class StaticPlaneCache{
+public:
+  StaticPlaneCache(size_t my_max_rays = 10000000):max_rays(my_max_rays),lens(NULL),Nstatic(0),Nhits(0),Nmisses(0){};
+  
+  /// removes all the rays
+  void clear(){rays.clear(); planes.clear(); Nstatic = 0; Nhits = Nmisses = 0;}
+  /// number of rays held
+  size_t size() const {return rays.size();}
+  /// maximum number of rays held, if it is lowered below size() no more rays are added
+  size_t getMaxRays() const {return max_rays;}
+  void setMaxRays(size_t n){max_rays = n;}
+  /// number of planes that the rays are held after, 0 if there is nothing to cache
+  int getNstatic() const {return Nstatic;}
+  /// number of rays that were taken from the cache since the last clear()
+  size_t getNhits() const {return Nhits;}
+  /// number of rays that were shot through the static planes since the last clear(), including the ones not added because it was full
+  size_t getNmisses() const {return Nmisses;}
+  
+  /// the variables of the ray shooter after plane Nstatic-1
+  struct State{
+    PosType x[2];             // comoving position on plane Nstatic
+    PosType SumPrevAlphas[2];
+    PosType SumPrevAGs[4];
+    KappaType A[4];           // 1-kappa and gamma
+    double dt;
+    /// false until the ray has been shot through the static planes
+    bool ready;
+  };
+  
+private:
+  friend class Lens;
+  
+  struct Key{
+    PosType x[2];
+    bool operator==(const Key &k) const {return x[0] == k.x[0] && x[1] == k.x[1];}
+  };
+  struct KeyHash{
+    size_t operator()(const Key &k) const {
+      std::hash<PosType> h;
+      return h(k.x[0]) ^ (h(k.x[1]) + 0x9e3779b97f4a7c15ULL + (h(k.x[0]) << 6) + (h(k.x[0]) >> 2));
+    }
+  };
+  
+  std::unordered_map<Key,State,KeyHash> rays;
+  size_t max_rays;
+  
+  // what the states were made with
+  const Lens *lens;
+  size_t field_version;
+  int Nstatic;
+  std::vector<const LensPlane *> planes;
+  std::vector<PosType> Dl,dDl,redshifts;
+  PosType charge;
+  bool deflection_off;
+  
+  size_t Nhits;
+  size_t Nmisses;
+};
+
 /**
  * \brief A class to represents a lens with multiple planes.
  *
@@ -46,6 +135,7 @@ GLAMER_TEST_USES(LensTest)
  *   	0 or none, 1 or NSIE
  *
  *   field_input_sim_file -- filename of the Millennium simulation data to be read in and used to populate the light cone with field halos
+ *   field_input_simulation_cache -- if true the columns of the input halo catalog are cached in a binary file next to it (file name + ".bin") which is used instead of the text file while the text file is unchanged; default is true
  *
  *   if field_input_sim_file is  _not_ set, then the field halos are generated from a mass function and the following are used:
  *   field_mass_func_type -- type of the halo mass function
@@ -53,10 +143,15 @@ GLAMER_TEST_USES(LensTest)
  *   mass_func_PL_slope -- slope of the mass function in the power law case; default is -1/6
  *   field_min_mass -- minimum mass for the generated field halos
  *   field_buffer -- a constant physical size buffer, padding every lens plane to increase its surface
+ *   field_theta_force -- opening angle of the tree used for the field halos; default is 0.1
+ *   field_expansion_order -- order of the multipole expansion of the tree cells, 2 (quadrupole) to 16, larger orders allow a larger field_theta_force at the same accuracy; default is 2
+ *   field_snapshot_file -- if the file exists the field halos, plane distances and mass function tables are read from it instead of being generated, otherwise they are generated and written to it.  A snapshot made with a different seed is rejected.  See Lens::save(); default is none
  *
  *   zsource -- source redshift
  *   flag_switch_deflection_off -- false: deflection is on, but kappa and gamma may be calculated, true: deflection is off; default is false
  *   flag_switch_lensing_off -- false: lensing is on, true: lensing is off (no alpha, kappa or gamma); default is false
+ *   plane_major_shooting -- true: rays are shot in batches that go through each plane before moving to the next one, see Lens::setPlaneMajorShooting(); default is false
+ *   fmm_shooting -- true: all the rays are pushed through each plane together and the field planes use a dual tree method, needs field_expansion_order >= 3, see Lens::setFMMShooting(); default is false
  *
  *   # Cosmology - Any cosmological parameters that are not set will have default values
  *
@@ -100,6 +195,24 @@ public:
    */
 	void resetFieldHalos(bool verbose = false);
 
+  /** \brief Write the field of this lens to a binary snapshot that Lens::load() can rebuild it from.
+   *
+   * The snapshot holds the cosmology, the field plane redshifts and distances, the mass function
+   * tables and the construction parameters, positions and ids of the field halos.  It can only be
+   * made for field halos drawn from the mass function, not ones read from a simulation catalog.
+   * The random seed before and after the field halos were drawn is also stored.
+   * The main halos and substructures are not saved.
+   */
+  void save(const std::string &filename) const;
+  /** \brief Replace the field halos and field planes with the ones in a snapshot written by Lens::save().
+   *
+   * The halo trees are rebuilt from the saved halos, which gives the same rays as the lens that was
+   * saved.  The main halos are kept.  The cosmology and source redshift must be the same as when the
+   * snapshot was written.  The seed is set to its value after the saved field halos were drawn.  See
+   * also the field_snapshot_file parameter.
+   */
+  void load(const std::string &filename,bool verbose = false);
+
 	/// print the main parameters of the lens
 	void printMultiLens();
 
@@ -184,7 +297,10 @@ public:
   
   
 	
-	void rayshooterInternal(unsigned long Npoints, Point *i_points, bool RSIverbose = false);
+	void rayshooterInternal(unsigned long Npoints, Point *i_points, bool RSIverbose = false) const;
+	void rayshooterInternal(unsigned long Npoints, Point *i_points, StaticPlaneCache &cache) const;
+  void rayshooterMultiSource(unsigned long Npoints,Point *i_points,const std::vector<PosType> &zsources
+                             ,std::vector<std::vector<RayState> > &rays,bool nearest = false);
   void info_rayshooter(Point *i_point
                       ,std::vector<Point_2d> & ang_positions
                       ,std::vector<KappaType> & kappa_on_planes
@@ -233,6 +349,23 @@ public:
   // get the field_Off value :
   bool getfieldOff() {return flag_switch_field_off ;}
   
+  /** \brief Switch between shooting each ray through all the planes in turn (default) and
+   * pushing batches of rays through one plane at a time.
+   *
+   * The second keeps each plane's tree in cache for many rays which is faster when there are
+   * many planes.  The results are the same.
+   */
+  void setPlaneMajorShooting(bool on) { flag_plane_major = on ; }
+  
+  /** \brief Push all the rays of a call to rayshooterInternal() through each plane together.
+   *
+   * The field planes then calculate the force with TreeQuad::force2D_fmm() which scales as N + M instead
+   * of N log M for N rays and M halos.  This is for shooting large regular grids, like a GridMap.  The results
+   * differ from the default only by the truncation of the local expansions, about 1e-7 relative.  The dual tree
+   * method needs field_expansion_order >= 3, at the default quadrupole order the field planes use the packet walk.
+   */
+  void setFMMShooting(bool on) { flag_fmm = on ; }
+  
 protected:
   /// field of view in square degrees
   PosType fieldofview;
@@ -254,6 +387,9 @@ private:
 	void assignParams(InputParams& params,bool verbose = false);
   void defaultParams(PosType zsource,bool verbose = true);
 	
+	/// finds the plane that a source at redshift z replaces and the distances to it, used by ResetSourcePlane()
+	int FindSourcePlane(PosType z,bool nearest,PosType &zs,PosType &Ds,PosType &dDs);
+	
 	/// turns source plane on and off
 	bool toggle_source_plane;
 	/// the distance from the source to the next plane
@@ -341,6 +477,10 @@ private: /* force calculation */
 	/// if >= 1, deflection in the rayshooting is switched off
 	bool flag_switch_deflection_off;
 	bool flag_switch_lensing_off;
+	/// if true, rays are shot plane by plane in batches
+	bool flag_plane_major;
+	/// if true, all the rays are shot plane by plane together using LensPlane::force_grid()
+	bool flag_fmm;
 	
 	/// the lensing planes
 	std::vector<LensPlane *> lensing_planes;
@@ -352,6 +492,11 @@ private: /* force calculation */
 	std::vector<PosType> plane_redshifts;
 	/// charge for the tree force solver (4*pi*G)
 	PosType charge;
+	/// incremented every time the field planes are remade, used to invalidate a StaticPlaneCache
+	size_t field_planes_version;
+	/// number of planes in front of the first main plane
+	int NStaticPlanes() const;
+	void rayshooterInternal_(unsigned long Npoints, Point *i_points, bool RSIverbose, StaticPlaneCache *cache) const;
 	
 private: /* field */
 	/// if true, the background is switched off and only the main lens is present
@@ -359,6 +504,32 @@ private: /* field */
 	
   /// vector of all field halos
   std::vector<LensHalo*> field_halos;
+  
+  /// parameters a field halo drawn from the mass function was constructed with, used by save() and load()
+  struct FieldHaloRecord{
+    LensHaloType type;
+    PosType mass;
+    PosType Rsize;
+    PosType zlens;
+    /// concentration (NFW, PseudoNFW), scale radius (Hernquist, Jaffe) or velocity dispersion (NSIE)
+    PosType param;
+    /// slope (PowerLaw, PseudoNFW)
+    PosType beta;
+    PosType fratio;
+    PosType pa;
+  };
+  /// records of the field halos made in createFieldHalos()
+  std::map<const LensHalo*,FieldHaloRecord> field_halo_records;
+  /// construct a field halo from its record, NULL if the type is not supported
+  LensHalo *makeFieldHalo(const FieldHaloRecord &record) const;
+  /// read a snapshot written by save(), returns false if the file cannot be opened
+  bool readFieldSnapshot(const std::string &filename,bool check_params,bool verbose);
+  /// snapshot file the field is read from, or written to after it is created
+  std::string field_snapshot_file;
+  /// true if the field was read from field_snapshot_file
+  bool field_snapshot_loaded;
+  /// value of *seed before and after the field halos were drawn in createFieldHalos(), kept in the snapshot
+  long field_seed_start,field_seed_end;
 	/// original number of field planes
   std::size_t field_Nplanes_original;
   /// current number of field planes which may include substructure plane
@@ -407,6 +578,10 @@ private: /* field */
 	PosType mass_func_PL_slope;
 	/// min mass for the halo model
 	PosType field_min_mass;
+	/// opening angle of the field plane trees
+	PosType field_theta_force;
+	/// order of the multipole expansion in the field plane trees
+	int field_expansion_order;
 	/// internal halo profile type; needs to be 0 or PowerLaw, 1 or NFW, 2 or PseudoNFW, 3 or NSIE, 4 or PointMass
 	LensHaloType field_int_prof_type;
 	/// power law or pseudo NFW internal profile slope
@@ -427,6 +602,7 @@ private: /* field */
 	
 	std::string field_input_sim_file;
   HaloCatFormats field_input_sim_format;
+  bool field_input_sim_cache;
   
 	bool sim_input_flag;
 	//std::string input_gal_file;
@@ -464,6 +640,10 @@ private: /* input */
   /// zero padding for FFTs with pixelized density maps
   int pixel_map_zeropad;
   bool pixel_map_zeromean;
+  /// single precision FFTs for pixelized density maps
+  bool pixel_map_fft_float;
+  /// limit in MB on the FFT memory for each pixelized density map, 0 for none
+  size_t pixel_map_fft_memory;
 	void readPixelizedDensity();
   
   /// the center of the lens in spherical coordinates
@@ -16,6 +16,58 @@
 //#include "quadTree.h"
 
 class TreeQuad;
+struct PlaneForceBatch;
+
+/**
+ * \brief A table of the radial functions alpha_h(x), kappa_h(x), gamma_h(x) and phi_h(x) of a
+ * spherical halo profile.
+ *
+ * The table only holds the shape of the profile as a function of x = r/rscale so that one table can be
+ * shared by all halos of a type.  Each halo supplies its own scale and offset for every function, which
+ * are computed once when its parameters are set, so that for example alpha_h(x) = scale[0]*T_alpha(x) + offset[0].
+ *
+ * The functions are interpolated with cubic Hermite polynomials on a uniform grid with the derivatives
+ * taken from finite differences of the nodes.  All four are found in one lookup with no division and
+ * no branches.  The profiles have a logarithmic singularity at x=0 so LensHalo::force_halo_sym() does not use
+ * the table below xmin().
+ */
+class LensHaloProfileTable{
+public:
+  LensHaloProfileTable(const PosType *alpha,const PosType *kappa,const PosType *gamma,const PosType *phi
+                       ,long N,PosType dx,long stride = 1);
+  
+  /// the smallest x at which the table should be used
+  PosType xmin() const {return dx;}
+  
+  /// alpha_h(x), kappa_h(x), gamma_h(x) and phi_h(x) for one halo
+  inline void eval(PosType x,const PosType *scale,const PosType *offset
+                   ,PosType &alpha,KappaType &kappa,KappaType &gamma,KappaType &phi) const{
+    PosType u = x*inv_dx;
+    long j = (long)u;
+    j = (j < jmax) ? j : jmax;
+    PosType t = u - j;
+    
+    PosType h01 = t*t*(3 - 2*t);
+    PosType h00 = 1 - h01;
+    PosType h10 = t*(1 - t)*(1 - t);
+    PosType h11 = t*t*(t - 1);
+    
+    const PosType *c0 = &table[8*j];
+    const PosType *c1 = c0 + 8;
+    
+    alpha = scale[0]*(h00*c0[0] + h10*c0[1] + h01*c1[0] + h11*c1[1]) + offset[0];
+    kappa = scale[1]*(h00*c0[2] + h10*c0[3] + h01*c1[2] + h11*c1[3]) + offset[1];
+    gamma = scale[2]*(h00*c0[4] + h10*c0[5] + h01*c1[4] + h11*c1[5]) + offset[2];
+    phi   = scale[3]*(h00*c0[6] + h10*c0[7] + h01*c1[6] + h11*c1[7]) + offset[3];
+  }
+  
+private:
+  /// for each node the four functions and their derivatives times dx, interleaved
+  std::vector<PosType> table;
+  PosType dx;
+  PosType inv_dx;
+  long jmax;
+};
 
 /**
  * \brief A base class for all types of lensing halos.
@@ -132,6 +184,8 @@ public:
 	
 	/// calculate the lensing properties -- deflection, convergence, and shear
 	virtual void force_halo(PosType *alpha,KappaType *kappa,KappaType *gamma,KappaType *phi,PosType const *xcm,bool subtract_point=false,PosType screening=1.0);
+  /// add the contribution of the halo at x_halo to a batch of rays the way LensPlaneSingular::force_batch() does
+  virtual void force_halo_batch(PlaneForceBatch &batch,PosType const *x_halo);
   
 	/// force tree calculation for stars
 	void force_stars(PosType *alpha,KappaType *kappa,KappaType *gamma,PosType const *xcm);
@@ -218,6 +272,20 @@ protected:
   PosType norm_int(PosType r_max);
 
   void force_halo_sym(PosType *alpha,KappaType *kappa,KappaType *gamma,KappaType *phi,PosType const *xcm,bool subtract_point=false,PosType screening = 1.0);
+  
+  /// table used by force_halo_sym() in place of alpha_h(), kappa_h(), gamma_h() and phi_h(), null if there is none
+  const LensHaloProfileTable *profile_table;
+  /// this halo's constants for profile_table
+  PosType profile_scale[4],profile_offset[4];
+  /// set the table and constants that force_halo_sym() uses
+  void setProfileTable(const LensHaloProfileTable *table,const PosType scale[4],const PosType offset[4]){
+    profile_table = table;
+    for(int i = 0 ; i < 4 ; ++i){
+      profile_scale[i] = scale[i];
+      profile_offset[i] = offset[i];
+    }
+  }
+  
   void force_halo_asym(PosType *alpha,KappaType *kappa,KappaType *gamma,KappaType *phi,PosType const *xcm,bool subtract_point=false,PosType screening = 1.0);
   
   
@@ -714,10 +782,10 @@ public:
 	void initFromFile(float my_mass, long *seed, float vmax, float r_halfmass);
 	void initFromMassFunc(float my_mass, float my_Rsize, float my_rscale, PosType my_slope, long *seed);
   /// set Rsize, xmax and gmax
-  void set_RsizeXmax(float my_Rsize){LensHalo::setRsize(my_Rsize); xmax = LensHalo::getRsize()/rscale; gmax = InterpolateFromTable(gtable,xmax);};
+  void set_RsizeXmax(float my_Rsize){LensHalo::setRsize(my_Rsize); xmax = LensHalo::getRsize()/rscale; gmax = InterpolateFromTable(gtable,xmax); set_profile_table();};
   /// set scale radius
   /// set rscale, xmax and gmax
-	void set_rscaleXmax(float my_rscale){rscale=my_rscale; xmax = LensHalo::getRsize()/rscale; gmax = InterpolateFromTable(gtable,xmax);};
+	void set_rscaleXmax(float my_rscale){rscale=my_rscale; xmax = LensHalo::getRsize()/rscale; gmax = InterpolateFromTable(gtable,xmax); set_profile_table();};
   
 protected:
 	/// table size
@@ -729,8 +797,12 @@ protected:
   
 	/// tables for lensing properties specific functions
 	static PosType *ftable,*gtable,*g2table,*htable,*xtable,*xgtable,***modtable; // modtable was used for Ansatz IV and worked well
+	/// the same functions combined for force_halo_sym()
+	static LensHaloProfileTable *radial_table;
   /// make the specific tables
 	void make_tables();
+	/// set this halo's constants for radial_table, must follow any change in gmax
+	void set_profile_table();
 	/// interpolates from the specific tables
 	PosType InterpolateFromTable(PosType *table, PosType y) const;
   PosType InterpolateModes(int whichmod, PosType q, PosType b);
@@ -1035,7 +1107,7 @@ public:
 	//void initFromFile(float my_mass, long *seed, float vmax, float r_halfmass);
   
 	/// set scale radius
-  void set_rscale(float my_rscale){rscale=my_rscale; xmax = LensHalo::getRsize()/rscale; gmax = InterpolateFromTable(gtable,xmax);};
+  void set_rscale(float my_rscale){rscale=my_rscale; xmax = LensHalo::getRsize()/rscale; gmax = InterpolateFromTable(gtable,xmax); set_profile_table();};
   // friend struct Ialpha_func;
   
 protected:
@@ -1048,8 +1120,12 @@ protected:
   
 	/// tables for lensing properties specific functions
 	static PosType *ftable,*gtable,*g2table,*htable,*xtable,*xgtable;
+	/// the same functions combined for force_halo_sym()
+	static LensHaloProfileTable *radial_table;
 	/// make the specific tables
 	void make_tables();
+	/// set this halo's constants for radial_table, must follow any change in gmax
+	void set_profile_table();
 	/// interpolates from the specific tables
 	PosType InterpolateFromTable(PosType *table, PosType y) const;
   
@@ -1098,7 +1174,7 @@ public:
 	virtual ~LensHaloJaffe();
   
 	/// set scale radius
-  void set_rscale(float my_rscale){rscale=my_rscale; xmax = LensHalo::getRsize()/rscale; gmax = InterpolateFromTable(gtable,xmax);};
+  void set_rscale(float my_rscale){rscale=my_rscale; xmax = LensHalo::getRsize()/rscale; gmax = InterpolateFromTable(gtable,xmax); set_profile_table();};
   
   PosType ffunction(PosType x) const;
 	PosType gfunction(PosType x) const;
@@ -1119,8 +1195,12 @@ protected:
   
 	/// tables for lensing properties specific functions
 	static PosType *ftable,*gtable,*g2table,*htable,*xtable,*xgtable;
+	/// the same functions combined for force_halo_sym()
+	static LensHaloProfileTable *radial_table;
 	/// make the specific tables
 	void make_tables();
+	/// set this halo's constants for radial_table, must follow any change in gmax
+	void set_profile_table();
 	/// interpolates from the specific tables
 	PosType InterpolateFromTable(PosType *table, PosType y) const;
   
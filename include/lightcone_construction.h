@@ -22,6 +22,10 @@
 using std::cout;
 using std::endl;
 #include <string>
+#include <array>
+#include <limits>
+#include <memory>
+#include <thread>
 #include "H5Cpp.h"
 using namespace H5;
 
@@ -75,6 +79,84 @@ namespace LightCones{
                               ,float angular_resolution
                               ,bool verbose = false);
   
+  /** \brief The points of a simulation box binned into a coarse grid of cells.
+   *
+   * This is used by LightCone::select() to accept or reject whole cells against a
+   * light cone instead of testing every point.  It can be made once for a box and
+   * then used for any number of cones.  The cell bounds are those of the points in
+   * them so points slightly outside of the box are handled correctly.
+   */
+  template <typename T>
+  class BoxGrid{
+  public:
+    BoxGrid(T* begin,T* end
+            ,double Length   /// length of the simulation box
+            ,int Ncells = 0  /// number of cells on a side, if 0 it is chosen from the number of points
+            );
+    
+    T* begin;
+    T* end;
+    double Length;
+    int Ncells;
+    
+    /// indexes of the points in cell order
+    std::vector<size_t> index;
+    /// points in cell i are index[cell_start[i]] ... index[cell_start[i+1]-1]
+    std::vector<size_t> cell_start;
+    /// bounds of the points in each cell, 6 numbers for each cell
+    std::vector<double> cell_bounds;
+    /// bounds of all the points
+    double bounds[6];
+  };
+  
+  template <typename T>
+  BoxGrid<T>::BoxGrid(T* my_begin,T* my_end,double my_Length,int my_Ncells)
+  :begin(my_begin),end(my_end),Length(my_Length),Ncells(my_Ncells)
+  {
+    size_t N = end - begin;
+    if(Ncells < 1) Ncells = std::max(1,std::min(64,(int)cbrt(N/32.)));
+    size_t Ntotal = (size_t)Ncells*Ncells*Ncells;
+    
+    std::vector<size_t> cell(N);
+    cell_start.assign(Ntotal + 1,0);
+    cell_bounds.resize(6*Ntotal);
+    for(size_t i=0;i<Ntotal;++i){
+      for(int j=0;j<3;++j){
+        cell_bounds[6*i + 2*j] = std::numeric_limits<double>::max();
+        cell_bounds[6*i + 2*j + 1] = -std::numeric_limits<double>::max();
+      }
+    }
+    for(int j=0;j<3;++j){
+      bounds[2*j] = std::numeric_limits<double>::max();
+      bounds[2*j + 1] = -std::numeric_limits<double>::max();
+    }
+    
+    // counting sort into cells
+    for(size_t i=0;i<N;++i){
+      size_t c = 0;
+      for(int j=0;j<3;++j){
+        double x = begin[i].x[j];
+        long k = (long)floor(x*Ncells/Length);
+        k = std::max(0L,std::min((long)Ncells - 1,k));
+        c = c*Ncells + k;
+      }
+      cell[i] = c;
+      ++cell_start[c+1];
+      for(int j=0;j<3;++j){
+        double x = begin[i].x[j];
+        cell_bounds[6*c + 2*j] = std::min(cell_bounds[6*c + 2*j],x);
+        cell_bounds[6*c + 2*j + 1] = std::max(cell_bounds[6*c + 2*j + 1],x);
+        bounds[2*j] = std::min(bounds[2*j],x);
+        bounds[2*j + 1] = std::max(bounds[2*j + 1],x);
+      }
+    }
+    for(size_t i=0;i<Ntotal;++i) cell_start[i+1] += cell_start[i];
+    
+    index.resize(N);
+    std::vector<size_t> next(cell_start.begin(),cell_start.end() - 1);
+    for(size_t i=0;i<N;++i) index[next[cell[i]]++] = i;
+  }
+  
   /*** \brief Class for constructing light cones form simulation boxes.
    *
    *
@@ -95,12 +177,56 @@ namespace LightCones{
                 ,Utilities::LockableContainer<std::vector<T> > &incone
                 ,bool periodic_boundaries = true);
     
+    /// same as above but with the box already binned so it can be reused for other cones
+    template <typename T>
+    void select(Point_3d xo,Point_3d v,double rlow,double rhigh
+                ,const BoxGrid<T> &grid
+                ,Utilities::LockableContainer<std::vector<T> > &incone
+                ,bool periodic_boundaries = true);
+    
   private:
     
     double r_theta; // angular radius of light cone (radians)
     double sin_theta_sqrt;
-
+    
+    /// returns 0 if the box is outside of the cone and shell, 2 if it is entirely inside and 1 otherwise
+    int test_box(const double lo[3],const double hi[3],const double v[3],double rlow2,double rhigh2) const;
   };
+  
+  inline int LightCone::test_box(const double lo[3],const double hi[3],const double v[3]
+                                 ,double rlow2,double rhigh2) const{
+    
+    // nearest and farthest distances from the observer
+    double min2 = 0,max2 = 0,c[3],d2 = 0,R2 = 0;
+    for(int i=0;i<3;++i){
+      double near = (lo[i] > 0) ? lo[i] : ( (hi[i] < 0) ? hi[i] : 0 );
+      min2 += near*near;
+      max2 += std::max(lo[i]*lo[i],hi[i]*hi[i]);
+      c[i] = (lo[i] + hi[i])/2;
+      d2 += c[i]*c[i];
+      R2 += (hi[i] - lo[i])*(hi[i] - lo[i])/4;
+    }
+    if(min2 >= rhigh2 || max2 <= rlow2) return 0;
+    
+    // a sphere around the box, the opening angle is the one used for the points in select()
+    if(d2 > R2 && sin_theta_sqrt < 1){
+      double d = sqrt(d2);
+      double cosang = (c[0]*v[0] + c[1]*v[1] + c[2]*v[2])/d;
+      cosang = std::max(-1.0,std::min(1.0,cosang));
+      if(acos(cosang) - asin(sqrt(R2)/d) > asin(sqrt(sin_theta_sqrt))) return 0;
+    }
+    
+    // the cone is convex if it is narrower than a half space so the box is inside if its corners are
+    if(min2 <= rlow2 || max2 >= rhigh2 || sin_theta_sqrt >= 1) return 1;
+    for(int k=0;k<8;++k){
+      double x[3] = { (k & 1) ? hi[0] : lo[0], (k & 2) ? hi[1] : lo[1], (k & 4) ? hi[2] : lo[2] };
+      double xp = x[0]*v[0] + x[1]*v[1] + x[2]*v[2];
+      double r2 = x[0]*x[0] + x[1]*x[1] + x[2]*x[2];
+      if(xp <= 0 || r2*sin_theta_sqrt <= r2 - xp*xp) return 1;
+    }
+    return 2;
+  }
+  
   /// select the halos from the box that are within the light cone
   template <typename T>
   void LightCone::select(Point_3d xo,Point_3d v,double Length,double rlow,double rhigh
@@ -111,28 +237,39 @@ namespace LightCones{
     
     if(begin == end) return;
     
-    Point_3d dx,x;
-    double r2,xp;
-    Point_3d n;
+    BoxGrid<T> grid(begin,end,Length);
+    select(xo,v,rlow,rhigh,grid,incone,periodic_boundaries);
+  }
+  
+  template <typename T>
+  void LightCone::select(Point_3d xo,Point_3d v,double rlow,double rhigh
+                         ,const BoxGrid<T> &grid
+                         ,Utilities::LockableContainer<std::vector<T> > &incone
+                         ,bool periodic_boundaries){
+    
+    if(grid.begin == grid.end) return;
+    
+    const double Length = grid.Length;
     double rhigh2 = rhigh*rhigh;
     double rlow2 = rlow*rlow;
     T b;
     
-    v /= v.length();
+    double vlength = sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+    double vu[3] = {v[0]/vlength,v[1]/vlength,v[2]/vlength};
     
     // standard coordinates so cone is always centered on the x-axis
-    Point_3d y_axis,z_axis;
+    double y_axis[3],z_axis[3];
     
-    y_axis[0] = -v[1];
-    y_axis[1] =  v[0];
+    double ylength = sqrt(vu[0]*vu[0] + vu[1]*vu[1]);
+    y_axis[0] = -vu[1]/ylength;
+    y_axis[1] =  vu[0]/ylength;
     y_axis[2] =  0;
     
-    y_axis /= y_axis.length();
-    z_axis = v.cross(y_axis);
-    
-    //std::cout << v*y_axis << " " << v*z_axis << " " << y_axis*z_axis << std::endl;
+    z_axis[0] = vu[1]*y_axis[2] - vu[2]*y_axis[1];
+    z_axis[1] = vu[2]*y_axis[0] - vu[0]*y_axis[2];
+    z_axis[2] = vu[0]*y_axis[1] - vu[1]*y_axis[0];
     
-    // we can do better than this !!!!
+    // the periodic images of the box that reach the shell
     int n0[2] = {(int)((rhigh + xo[0])/Length),(int)((xo[0] - rhigh)/Length) - 1 };
     int n1[2] = {(int)((rhigh + xo[1])/Length),(int)((xo[1] - rhigh)/Length) - 1 };
     int n2[2] = {(int)((rhigh + xo[2])/Length),(int)((xo[2] - rhigh)/Length) - 1 };
@@ -141,45 +278,68 @@ namespace LightCones{
       n1[0] = n1[1] = 0;
       n2[0] = n2[1] = 0;
     }
-    for(auto a = begin ; a != end ; ++a){
-      dx[0] = (*a).x[0] - xo[0];
-      dx[1] = (*a).x[1] - xo[1];
-      dx[2] = (*a).x[2] - xo[2];
-      
-      int count = 0;
-      
-      for(n[0] = n0[1]; n[0] <= n0[0] ; ++n[0]){
-        for(n[1] = n1[1]; n[1] <= n1[0] ; ++n[1]){
-          for(n[2] = n2[1]; n[2] <= n2[0] ; ++n[2]){
-            
-            x = dx + n*Length;
-            xp = x*v;
-            if(xp > 0){
-              r2 = x.length_sqr();
-              
-              if(r2 > rlow2 && r2 < rhigh2){
-                if( r2*sin_theta_sqrt > r2 - xp*xp){
-                  //std::cout << n << " | " << xo << " | "
-                  //          << v << " |  " << x << std::endl;
-                  
-                  b = *a;
-                  //b.x = x;
-                  // rotate to standard reference frame
-                  b.x[0] = xp;
-                  b.x[1] = y_axis*x;
-                  b.x[2] = z_axis*x;
-                  
-                  //std::cout << "b = " << b.x << std::endl;
-                  
-                  incone.push_back(b);
-                  ++count;
-                }
-              }
-            }
+    
+    // keep only the images that intersect the cone and shell
+    std::vector<std::array<double,3> > replicas;
+    std::array<double,3> shift;
+    for(int i=n0[1]; i <= n0[0] ; ++i){
+      for(int j=n1[1]; j <= n1[0] ; ++j){
+        for(int k=n2[1]; k <= n2[0] ; ++k){
+          shift[0] = i*Length;
+          shift[1] = j*Length;
+          shift[2] = k*Length;
+          double lo[3],hi[3];
+          for(int l=0;l<3;++l){
+            lo[l] = grid.bounds[2*l] - xo[l] + shift[l];
+            hi[l] = grid.bounds[2*l + 1] - xo[l] + shift[l];
           }
+          if(test_box(lo,hi,vu,rlow2,rhigh2) > 0) replicas.push_back(shift);
         }
       }
-      if(count > 1) std::cout << " Warning: Same halo appears " << count << " times in light-cone." << std::endl;
+    }
+    
+    std::vector<unsigned char> count(grid.end - grid.begin,0);
+    size_t Ncells = grid.cell_start.size() - 1;
+    
+    for(auto &n : replicas){
+      for(size_t c=0 ; c < Ncells ; ++c){
+        if(grid.cell_start[c] == grid.cell_start[c+1]) continue;
+        
+        double lo[3],hi[3];
+        for(int l=0;l<3;++l){
+          lo[l] = grid.cell_bounds[6*c + 2*l] - xo[l] + n[l];
+          hi[l] = grid.cell_bounds[6*c + 2*l + 1] - xo[l] + n[l];
+        }
+        int inside = test_box(lo,hi,vu,rlow2,rhigh2);
+        if(inside == 0) continue;
+        
+        for(size_t m = grid.cell_start[c] ; m < grid.cell_start[c+1] ; ++m){
+          T &a = grid.begin[grid.index[m]];
+          double x[3];
+          for(int l=0;l<3;++l) x[l] = (a.x[l] - xo[l]) + n[l];
+          double xp = x[0]*vu[0] + x[1]*vu[1] + x[2]*vu[2];
+          
+          if(inside == 1){
+            if(xp <= 0) continue;
+            double r2 = x[0]*x[0] + x[1]*x[1] + x[2]*x[2];
+            if(r2 <= rlow2 || r2 >= rhigh2) continue;
+            if(r2*sin_theta_sqrt <= r2 - xp*xp) continue;
+          }
+          
+          b = a;
+          // rotate to standard reference frame
+          b.x[0] = xp;
+          b.x[1] = y_axis[0]*x[0] + y_axis[1]*x[1] + y_axis[2]*x[2];
+          b.x[2] = z_axis[0]*x[0] + z_axis[1]*x[1] + z_axis[2]*x[2];
+          
+          incone.push_back(b);
+          if(count[grid.index[m]] < 255) ++count[grid.index[m]];
+        }
+      }
+    }
+    
+    for(auto c : count){
+      if(c > 1) std::cout << " Warning: Same halo appears " << (int)c << " times in light-cone." << std::endl;
     }
   }
   
@@ -223,6 +383,26 @@ namespace LightCones{
                        ,double BoxLength
                        ,bool periodic_boundaries = true
                        );
+    
+    /** \brief Select the points in [begin,end) that are in each of the cones.
+     
+     The box is binned into a BoxGrid once and used for all the cones so the
+     readers can do all the cones in one pass through a block of the box.
+     */
+    template <typename T>
+    void select(T* begin,T* end
+                ,double Length   /// length of the simulation box
+                ,double rlow,double rhigh
+                ,std::vector<Utilities::LockableContainer<std::vector<T> > > &incones  /// one container for each cone
+                ,bool periodic_boundaries = true
+                ){
+      assert(incones.size() == cones.size());
+      if(begin == end) return;
+      
+      BoxGrid<T> grid(begin,end,Length);
+      for(int i=0;i<cones.size();++i)
+        cones[i].select(xos[i],vs[i],rlow,rhigh,grid,incones[i],periodic_boundaries);
+    }
 
     
     
@@ -442,6 +622,7 @@ namespace LightCones{
   // added by Marcos Pellejero & Antonio Dorta***********
   /*Modified by Marcos and Antonio 4th July 2017*/
 
+  /// The returned block belongs to this object and is overwritten by the next call.
   double *common_scan_blockH5(H5std_string filename, H5std_string dataset_name, hsize_t n_rows, hsize_t n_cols, hsize_t offset_rows, hsize_t *read_rows)
   {
     const int RANK = 2;
@@ -456,14 +637,22 @@ namespace LightCones{
 	 */
 	Exception::dontPrint();
 	/*                                                                                                                                                  
-	 * Open the file and the dataset.                                                                                                                   
+	 * Open the file and the dataset.  They stay open until a different
+	 * file or dataset is asked for so that the blocks are not paying for it.
 	 */
-	H5File file( filename, H5F_ACC_RDONLY );
-	DataSet dataset = file.openDataSet(dataset_name);
+	bool opened = false;
+	if(!h5file || filename != h5filename || dataset_name != h5dataset_name){
+	  h5file.reset();
+	  h5file.reset(new H5File( filename, H5F_ACC_RDONLY ));
+	  h5dataset = h5file->openDataSet(dataset_name);
+	  h5filename = filename;
+	  h5dataset_name = dataset_name;
+	  opened = true;
+	}
 	/*                                                                                                                                                  
 	 * Get filespace for rank and dimension                                                                                                             
 	 */
-	DataSpace filespace = dataset.getSpace();
+	DataSpace filespace = h5dataset.getSpace();
 	/*                                                                                                                                                  
 	 * Get number of dimensions in the file dataspace                                                                                                   
 	 */
@@ -475,7 +664,7 @@ namespace LightCones{
         hsize_t count_rows;
         hsize_t offset[RANK];
 	rank = filespace.getSimpleExtentDims( dims );
-	cout << "dataset rank = " << rank << ", dimensions "
+	if(opened) cout << "dataset rank = " << rank << ", dimensions "
 	     << (hsize_t)(dims[0]) << " x "
 	     << (hsize_t)(dims[1]) << endl;
 	/*                                                                                                                                                  
@@ -489,9 +678,9 @@ namespace LightCones{
 	  return data_out;
 	}
 	
-        if (offset_rows > file_rows) {
-	  // Reading out of data                                                                                                                                  
-	  cout << "ERROR!!! File has " << file_rows << " rows and you wanted to read till row " << offset_rows + n_rows << "\n";
+        if (offset_rows >= file_rows) {
+	  // Reading out of data, the last block ended exactly at the end of the file if they are equal
+	  if(offset_rows > file_rows) cout << "ERROR!!! File has " << file_rows << " rows and you wanted to read till row " << offset_rows + n_rows << "\n";
 	  return data_out;
 	}
 	else if ((offset_rows == 0) && (file_rows >= n_rows)) {
@@ -516,19 +705,15 @@ namespace LightCones{
 	 */
 	
 	
-	// Allocate only the required memory
-	data_out = new double [count_rows*file_cols]; 
-        if (data_out == NULL) {
-          cout << "NOT ENOUGH MEMORY!!!\n";
-      	  *read_rows = 0;
-	  return NULL;
-        }
+	// reuse the buffer from the last block
+	h5buffer.resize(count_rows*file_cols);
+	data_out = h5buffer.data();
   
 	
 	// READ DATA!!! (we are going to read count_rows x file_cols)
 	if (readALL) {
 	  DataSpace memspace(RANK, dims);
-	  dataset.read(data_out, PredType::NATIVE_DOUBLE, memspace, filespace);
+	  h5dataset.read(data_out, PredType::NATIVE_DOUBLE, memspace, filespace);
 	}
 	else {
 	  hsize_t count[RANK];
@@ -538,7 +723,7 @@ namespace LightCones{
 	  offset[1] = 0;
 	  DataSpace memspace(RANK, count);
 	  filespace.selectHyperslab(H5S_SELECT_SET, count, offset);
-	  dataset.read(data_out, PredType::NATIVE_DOUBLE, memspace, filespace);
+	  h5dataset.read(data_out, PredType::NATIVE_DOUBLE, memspace, filespace);
 	}
 	*read_rows = count_rows;
 	
@@ -547,6 +732,7 @@ namespace LightCones{
     catch( FileIException error )
       {
 	error.printError();
+	h5file.reset();
 	*read_rows = 0;
 	return NULL;
       }
@@ -554,6 +740,7 @@ namespace LightCones{
     catch( DataSetIException error )
       {
 	error.printError();
+	h5file.reset();
 	*read_rows = 0;
 	return NULL;
       }
@@ -561,6 +748,7 @@ namespace LightCones{
     catch( DataSpaceIException error )
       {
 	error.printError();
+	h5file.reset();
 	*read_rows = 0;
 	return NULL;
       }
@@ -602,7 +790,6 @@ namespace LightCones{
         }
       }
       points.resize(j); 
-      delete data;
 
       for(auto &h: points){
 	h.r_max /= 1.0e3;
@@ -611,7 +798,12 @@ namespace LightCones{
       return j;
     }
 
-       
+  private:
+    std::unique_ptr<H5File> h5file;
+    DataSet h5dataset;
+    H5std_string h5filename;
+    H5std_string h5dataset_name;
+    std::vector<double> h5buffer;
   };
   //CHANGED ********************************************************* MARCOS
   
@@ -771,6 +963,8 @@ namespace LightCones{
     
     const int blocksize = 1000000;
     T unit;
+    // the block being projected while unit reads the next one
+    decltype(unit.points) points;
     
     // loop through files
     for(int i_file=0 ; i_file < snap_filenames.size() ; ++i_file){
@@ -842,34 +1036,52 @@ namespace LightCones{
       size_t Nlines = 0,Nblocks=0;
       size_t Nbatch = 1;
       bool H5eof = false;
-      while(!feof(pFile) && !H5eof) {  // loop through blocks
-        
+      
+      // reads the next block into unit.points
+      auto read_block = [&](){
         Nbatch = unit.scan_block(blocksize,pFile,snap_filenames[i_file],Nlines,&H5eof);
         cout << "READ " << Nbatch << " "<< H5eof  << "!!\n";
-	//long Nbatch = unit.scan_blockH5(blocksize,snap_filenames[i_file]);
+        Nlines += blocksize;
+      };
+      
+      // The blocks are double buffered.  While block k is projected by the worker
+      // threads the next block is read or parsed by another thread.
+      bool more = !feof(pFile) && !H5eof;
+      if(more) read_block();
+      while(more) {  // loop through blocks
         
-        if(Nbatch > 0){  // multi-thread the sorting into cones and projection onto planes
+        size_t Nbatch_current = Nbatch;
+        points.swap(unit.points);
+        
+        std::thread reader;
+        more = !feof(pFile) && !H5eof;
+        if(more) reader = std::thread(read_block);
+        
+        if(Nbatch_current > 0){  // multi-thread the sorting into cones and projection onto planes
           int nthreads = Utilities::GetNThreads();
           int chunk_size;
           do{
-            chunk_size =  unit.points.size()/nthreads;
+            chunk_size =  points.size()/nthreads;
             if(chunk_size == 0) nthreads /= 2;
-          }while(chunk_size == 0);
-          if(nthreads == 0) nthreads = 1;
+          }while(chunk_size == 0 && nthreads > 0);
+          if(nthreads == 0){
+            nthreads = 1;
+            chunk_size = points.size();
+          }
           
-          int remainder =  unit.points.size()%chunk_size;
+          int remainder =  points.size()%chunk_size;
           
-          assert(nthreads*chunk_size + remainder == unit.points.size() );
+          assert(nthreads*chunk_size + remainder == points.size() );
           
           std::vector<std::thread> thr(nthreads);
           for(int ii =0; ii< nthreads ; ++ii){
             
             //std::cout << ii*chunk_size << " " << n << std::endl;
             
-            thr[ii] = std::thread(&unit.fastplanes_parallel
-                                  ,unit.points.data() + ii*chunk_size
-                                  ,unit.points.data() + (ii+1)*chunk_size + (ii==nthreads-1)*remainder
-                                  ,cosmo,std::ref(boxes)
+            thr[ii] = std::thread(&T::fastplanes_parallel
+                                  ,points.data() + ii*chunk_size
+                                  ,points.data() + (ii+1)*chunk_size + (ii==nthreads-1)*remainder
+                                  ,std::cref(cosmo),std::ref(boxes)
                                   ,std::ref(observers),std::ref(rotationQs)
                                   ,std::ref(dsources),std::ref(map_pack[ii])
                                   ,dmin,dmax,BoxLength);
@@ -877,7 +1089,8 @@ namespace LightCones{
           for(int ii = 0; ii < nthreads ;++ii){ if(thr[ii].joinable() ) thr[ii].join();}
         }
         
-        Nlines += blocksize;
+        if(reader.joinable()) reader.join();
+        
         ++Nblocks;
         std::cout << "=" << std::flush ;
         if(Nblocks%10 == 0) std::cout << " " << std::flush;
@@ -10,6 +10,30 @@
 
 #include "quadTree.h"
 
+/** \brief Structure-of-arrays buffers for the lensing quantities of a batch of rays on one plane.
+ *
+ *  Used by LensPlane::force_batch().  The positions x[] are set by the caller in physical Mpc and
+ *  the other quantities are filled in by the plane with the same meaning as in LensPlane::force().
+ */
+struct PlaneForceBatch{
+  PlaneForceBatch(size_t n = 0){resize(n);}
+  
+  void resize(size_t n){
+    x[0].resize(n); x[1].resize(n);
+    alpha[0].resize(n); alpha[1].resize(n);
+    kappa.resize(n);
+    gamma[0].resize(n); gamma[1].resize(n); gamma[2].resize(n);
+    phi.resize(n);
+  }
+  size_t size() const {return kappa.size();}
+  
+  std::vector<PosType> x[2];
+  std::vector<PosType> alpha[2];
+  std::vector<KappaType> kappa;
+  std::vector<KappaType> gamma[3];
+  std::vector<KappaType> phi;
+};
+
 /// Base class representing a plane in redshift onto which lenses are placed.
 class LensPlane{
 public:
@@ -17,6 +41,10 @@ public:
 	virtual ~LensPlane() {} 
 	
   virtual void force(PosType *alpha,KappaType *kappa,KappaType *gamma,KappaType *phi,PosType *xx) = 0;
+  /// calculates the force on all the rays in batch, by default by calling force() on each ray in turn
+  virtual void force_batch(PlaneForceBatch &batch);
+  /// same as force_batch() for a large number of rays, by default done in parallel pieces with force_batch()
+  virtual void force_grid(PlaneForceBatch &batch);
 	
 	virtual void addHalo(LensHalo* halo) = 0;
 	virtual void removeHalo(LensHalo* halo) = 0;
@@ -29,10 +57,13 @@ public:
 /// A LensPlane with a TreeQuad on it to calculate the deflection caused by field lenses
 class LensPlaneTree : public LensPlane{
 public:
-	LensPlaneTree(LensHaloHndl *my_halos,IndexType Nhalos,PosType my_sigma_background,PosType my_inv_screening_scale = 0);
+	LensPlaneTree(LensHaloHndl *my_halos,IndexType Nhalos,PosType my_sigma_background,PosType my_inv_screening_scale = 0
+                ,PosType theta_force = 0.1,int expansion_order = 2);
 	~LensPlaneTree();
 
 	void force(PosType *alpha,KappaType *kappa,KappaType *gamma,KappaType *phi,PosType *xx);
+  void force_batch(PlaneForceBatch &batch);
+  void force_grid(PlaneForceBatch &batch);
   void closestHalos(PosType *xx,std::list<LensHalo *> neighbors){
     
   };
@@ -62,6 +93,7 @@ public:
 	~LensPlaneSingular();
 
   void force(PosType *alpha,KappaType *kappa,KappaType *gamma,KappaType *phi,PosType *xx);
+  void force_batch(PlaneForceBatch &batch);
     
 	void addHalo(LensHalo* halo);
 	void removeHalo(LensHalo* halo);
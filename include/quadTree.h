@@ -9,6 +9,8 @@
 #define QUAD_TREE_H_
 
 #include "simpleTree.h"
+#include <complex>
+#include <atomic>
 
 //short const treeNBdim = 2;
 
@@ -92,6 +94,9 @@ struct QTreeNB{
   short empty();
 	void attachChildrenToCurrent(QBranchNB *branch0,QBranchNB *branch1
 			,QBranchNB *branch2,QBranchNB *branch3);
+	/// same as attachChildrenToCurrent() for any branch, can be used on different branches from different threads
+	void attachChildren(QBranchNB *parent,QBranchNB *branch0,QBranchNB *branch1
+			,QBranchNB *branch2,QBranchNB *branch3);
 
 	QBranchNB *top;
 	QBranchNB *current;
@@ -140,13 +145,47 @@ struct QTreeNB{
 
 private:
   /// number of branches in tree
-	unsigned long Nbranches;
+	std::atomic<unsigned long> Nbranches;
 	void _freeQTree(short child);
 };
 
 typedef struct QTreeNB * QTreeNBHndl;
 typedef int QTreeNBElement;
 
+/** \brief Node of a QTreeNB in the compact array used by TreeQuad for the force calculation.
+ *
+ * The nodes are in depth-first order so the first child of a node that is opened is the next node in
+ * the array and next skips over the whole subtree.  Everything that is needed to decide whether to
+ * open a node and to use its expansion fits into one 64 byte cache line.  Branches without particles
+ * are left out.
+ */
+struct QFlatNode{
+  /// center of mass
+  PosType center[2];
+  PosType mass;
+  /// quadropole moment
+  PosType quad[3];
+  /// the node is opened if the ray is closer than this squared, the larger of rcrit_angle^2 and 5.83*(box size)^2
+  PosType ropen2;
+  /// index of the next node that is not in this node's subtree
+  IndexType next;
+};
+
+/// The rest of the information about a QFlatNode which is only needed when the node is opened.
+struct QFlatInfo{
+  /// 5.83*(box size)^2, within this the big particles are added individually
+  PosType rbig2;
+  /// first particle in TreeQuad::flat_x[] and TreeQuad::flat_mass[] if this is a leaf
+  IndexType first;
+  /// number of particles if this is a leaf, 0 otherwise
+  IndexType nleaf;
+  /// first particle in TreeQuad::flat_big[] and TreeQuad::flat_big_x[]
+  IndexType first_big;
+  IndexType Nbig;
+  /// largest distance from the center of mass to a corner of the box
+  PosType rmax;
+};
+
 /**
  * \brief TreeQuad is a class for calculating the deflection, kappa and gamma by tree method.
  *
@@ -159,6 +198,10 @@ typedef int QTreeNBElement;
  * The default value of theta = 0.1 generally gives better than 1% accuracy on alpha.
  * The shear and kappa is always more accurate than the deflection.
  *
+ * By default the cells are expanded to quadrupole order.  If expansion_order > 2 complex multipole
+ * coefficients up to that order are used instead which allows for a larger opening angle theta at the
+ * same accuracy and thus fewer interactions per ray.
+ *
  */
 
 class TreeQuad {
@@ -175,6 +218,7 @@ public:
 			,PosType theta_force = 0.1
       ,bool my_periodic_buffer = false
       ,PosType my_inv_screening_scale = 0
+      ,int my_expansion_order = 2
 			);
 	TreeQuad(
 			LensHaloHndl *my_halos
@@ -184,6 +228,8 @@ public:
 			,PosType theta_force = 0.1
       ,bool my_periodic_buffer = false
       ,PosType my_inv_screening_scale = 0
+      ,int my_expansion_order = 2
+      ,PosType **halo_positions = NULL
 			);
 	virtual ~TreeQuad();
 
@@ -193,6 +239,14 @@ public:
   virtual void force2D_recur(const PosType *ray,PosType *alpha,KappaType *kappa
                              ,KappaType *gamma,KappaType *phi);
   
+  void force2D_batch(size_t N,const PosType *x0,const PosType *x1
+                     ,PosType *alpha0,PosType *alpha1,KappaType *kappa
+                     ,KappaType *gamma0,KappaType *gamma1,KappaType *gamma2,KappaType *phi);
+  
+  void force2D_fmm(size_t N,const PosType *x0,const PosType *x1
+                   ,PosType *alpha0,PosType *alpha1,KappaType *kappa
+                   ,KappaType *gamma0,KappaType *gamma1,KappaType *gamma2,KappaType *phi);
+  
   /// find all points within rmax of ray in 2D
   void neighbors(PosType ray[],PosType rmax,std::list<IndexType> &neighbors) const;
   void neighbors(PosType ray[],PosType rmax,std::vector<LensHalo *> &neighbors) const;
@@ -212,6 +266,8 @@ protected:
 	IndexType Nparticles;
 	PosType sigma_background;
 	int Nbucket;
+	/// branches with more particles than this build their children in parallel
+	static const IndexType build_task_size = 8192;
 
 	PosType force_theta;
 
@@ -231,7 +287,7 @@ protected:
   PosType original_yl;  // x-axis size of simulation used for peridic buffering.
   
 	QTreeNBHndl BuildQTreeNB(PosType **xp,IndexType Nparticles,IndexType *particles);
-	void _BuildQTreeNB(IndexType nparticles,IndexType *particles);
+	void _BuildQTreeNB(QBranchNB *cbranch,IndexType nparticles,IndexType *particles);
 
 	inline short WhichQuad(PosType *x,QBranchNB &branch);
 
@@ -241,7 +297,7 @@ protected:
 	}
 	//int cutbox(PosType *ray,PosType *p1,PosType *p2,float rmax);
 	
-	void CalcMoments();
+	void CalcMoments(QBranchNB *cbranch);
 	void rotate_coordinates(PosType **coord);
 
 	// Internal profiles for a Gaussian particle
@@ -354,10 +410,142 @@ protected:
 	 void cuttoffscale(QTreeNBHndl tree,PosType *theta);
 
 	 void walkTree_recur(QBranchNB *branch,PosType const *ray,PosType *alpha,KappaType *kappa,KappaType *gamma,KappaType *phi);
+  
+  /// maximum number of rays that walk the tree together in force2D_batch()
+  static const int packet_size = 32;
+  
+  /// positions and results for a packet of rays in structure-of-arrays form
+  struct RayPacket{
+    int n;
+    PosType x[2][packet_size];
+    PosType alpha[2][packet_size];
+    KappaType kappa[packet_size];
+    KappaType gamma[3][packet_size];
+    KappaType phi[packet_size];
+  };
+  
+  /// the loops over RayLanes run over a multiple of this many rays so that they need no scalar remainder
+  static const int lane_width = 4;
+  
+  /** \brief Some of the rays of a RayPacket copied into contiguous lanes.
+   *
+   *  The force loops run straight over the lanes without going through an index list so that the
+   *  compiler can vectorize them.  log() and exp() are done in their own loops before the arithmetic.
+   */
+  struct alignas(32) RayLanes{
+    PosType x[2][packet_size];
+    PosType rcm2[packet_size];
+    PosType log_rcm2[packet_size];
+    PosType screening[packet_size];
+    PosType alpha[2][packet_size];
+    KappaType gamma[2][packet_size];
+    KappaType phi[packet_size];
+    /// number of rays
+    int n;
+    /// n rounded up to a multiple of lane_width, the extra lanes are copies of the first ray
+    int npad;
+  };
+  
+  void gatherLanes(const RayPacket &packet,const int *index,int n,RayLanes &lanes) const;
+  void scatterLanes(const RayLanes &lanes,const int *index,RayPacket &packet) const;
+  template <bool screening_on>
+  void cellForce_lanes(IndexType node,RayLanes &lanes) const;
+  template <bool screening_on>
+  void multipoleForce_lanes(IndexType node,RayLanes &lanes) const;
+  template <bool screening_on>
+  void pointForce_lanes(PosType px,PosType py,PosType mass,RayLanes &lanes) const;
+  
+  template <bool screening_on>
+  void walkTree_packet(IndexType node,RayPacket &packet,const int *active,int Nactive);
+  template <bool screening_on>
+  void addNodeParticles_packet(IndexType node,RayPacket &packet,const int *near,int Nnear,const PosType *rcm2cell);
+  
+  void walkTree_flat(PosType const *ray,PosType *alpha,KappaType *kappa,KappaType *gamma,KappaType *phi);
+  
+  /* compact copy of the tree that is used for the force calculation */
+  void FlattenTree();
+  void _FlattenTree(QBranchNB *branch,IndexType &Nnodes,IndexType &Nbig);
+  
+  /// nodes in depth-first order, aligned to cache lines
+  QFlatNode *flat_nodes;
+  QFlatInfo *flat_info;
+  IndexType Nflat;
+  /// positions of the particles in the order of the leaves, x and y interleaved
+  PosType *flat_x;
+  /// masses of the particles in the order of the leaves
+  PosType *flat_mass;
+  /// indexes of the big particles of each node into xp[], halos[] and sizes[]
+  IndexType *flat_big;
+  /// positions of the big particles, x and y interleaved
+  PosType *flat_big_x;
    void walkTree_iter(QTreeNB::iterator &treeit, PosType const *ray,PosType *alpha,KappaType *kappa,KappaType *gamma
                        ,KappaType *phi) const;
 
   PosType phiintconst;
+  
+  /* higher order multipole expansion */
+  
+  /// order of the multipole expansion of the cells, 2 is quadrupole
+  int expansion_order;
+  /// complex multipole coefficients a_0...a_expansion_order of each node in flat_nodes[] about its center of mass
+  std::complex<PosType> *flat_multipoles;
+  void CalcMultipoles();
+  inline void multipole_force(IndexType node,PosType const *xcm,PosType rcm2,PosType screening
+                              ,PosType *alpha,KappaType *gamma,KappaType *phi) const;
+  
+  /* dual tree evaluation for many rays, see force2D_fmm() */
+  
+  /// order of the local expansions in force2D_fmm()
+  static const int fmm_order = 16;
+  /// maximum number of rays in a leaf of the tree on the rays, no more than packet_size
+  static const int fmm_leaf_size = 16;
+  
+  /// node of the tree on the rays in force2D_fmm(), in depth-first order
+  struct FMMNode{
+    PosType center[2];
+    /// largest distance from center to a ray in the node
+    PosType radius;
+    /// first ray in FMMTargets::order
+    size_t first;
+    size_t n;
+    /// index of the next node that is not in this node's subtree
+    size_t next;
+  };
+  
+  /// the rays and the tree on them
+  struct FMMTargets{
+    const PosType *x[2];
+    /// ray indexes in the order of the leaves
+    std::vector<size_t> order;
+    std::vector<FMMNode> nodes;
+    /// binomial coefficients, binomial[n*(nmax+1) + k]
+    std::vector<PosType> binomial;
+    int nmax;
+    /// shift of the rays for the periodic buffer
+    PosType shift[2];
+    
+    PosType *alpha[2];
+    KappaType *kappa;
+    KappaType *gamma[3];
+    KappaType *phi;
+  };
+  
+  /// target node with the local expansion about its center and the source nodes that still need to be resolved
+  struct FMMTask{
+    size_t node;
+    /// source nodes that might act on some of the rays through their expansion
+    std::vector<IndexType> candidates;
+    /// source nodes that are opened by all the rays so their own particles are added directly
+    std::vector<IndexType> opened;
+    std::complex<PosType> L[fmm_order+1];
+  };
+  
+  void BuildFMMTargets(FMMTargets &targets,size_t N);
+  void _BuildFMMTargets(FMMTargets &targets,size_t first,size_t n,PosType const *p1,PosType boxsize,int depth);
+  void fmm_interact(FMMTargets &targets,FMMTask &task);
+  void fmm_split(FMMTargets &targets,const FMMTask &task,std::vector<FMMTask> &children);
+  void fmm_walk(FMMTargets &targets,FMMTask &task);
+  void fmm_leaf(FMMTargets &targets,const FMMTask &task);
 
    };
 
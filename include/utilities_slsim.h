@@ -14,6 +14,13 @@
 #include <random>
 #if __cplusplus >= 201103L
 #include <typeindex>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <deque>
 #include <dirent.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -996,6 +1003,62 @@ namespace Utilities
     
   };
   
+  /**
+   * \brief Counter-based random numbers (Philox4x32-10, Salmon et al. 2011).
+   *
+   * The n-th number of a stream depends only on the seed, the stream and n.  Objects that each draw from
+   * their own substream() can therefore be made in any order and on any number of threads and the results
+   * will be the same.  seek() jumps to any point in a stream without generating the numbers before it.
+   *
+   *<pre>
+   *  Utilities::RandomNumbers_Philox ran(seed);
+   *  Utilities::ThreadPool::get().parallel_for(N,256,[&](size_t first,size_t last){
+   *    for(size_t i=first;i<last;++i){
+   *      Utilities::RandomNumbers_Philox my_ran = ran.substream(i);
+   *      x[i] = my_ran();
+   *    }
+   *  });
+   *</pre>
+   */
+  class RandomNumbers_Philox{
+  public:
+    
+    RandomNumbers_Philox(uint64_t seed,uint64_t stream = 0);
+    /// takes the seed from two ran2() draws so that successive generators made from the same NR seed differ
+    RandomNumbers_Philox(long *seed);
+    
+    /// uniform random number in (0,1)
+    PosType operator()(void);
+    /// generates a Gaussian distributed number with unit variance by polar Box-Muller transform
+    PosType gauss();
+    /// Poisson distributed number with mean xm
+    long poisson(PosType xm);
+    
+    /// independent generator for sub-stream i of this stream, starting at its beginning
+    RandomNumbers_Philox substream(uint64_t i) const;
+    
+    /// jump to the n-th number of the stream
+    void seek(uint64_t n){index = n; count = true;}
+    /// the number of uniform numbers that have been drawn from the stream
+    uint64_t tell() const {return index;}
+    
+    /// the Philox4x32-10 bijection of a counter with a key
+    static void philox(const uint32_t counter[4],const uint32_t key[2],uint32_t out[4]);
+    
+  private:
+    uint64_t seed;
+    uint64_t stream;
+    uint64_t index;
+    
+    /// output of the counter index/2, each counter gives two numbers
+    uint32_t block[4];
+    uint64_t block_counter;
+    bool block_valid;
+    
+    bool count;
+    PosType u,v,s;
+  };
+  
   /// Shuffles a vector into a random order
   template <typename T, typename R>
   void shuffle(
@@ -1119,6 +1182,77 @@ namespace Utilities
   /// returns the compiler variable N_THREADS that is maximum number of threads to be used.
   int GetNThreads();
   
+  /** \brief A persistent pool of worker threads with work-stealing over batches of indexes.
+   *
+   * The threads are created once and then reused for every call to parallel_for() so that
+   * small jobs, like the rays shot during grid refinement, do not pay for thread creation.
+   * The index range [0,N) is cut into batches which are dealt out in contiguous blocks, one
+   * block per thread.  When a thread has finished its own block it steals batches from the
+   * other blocks so that expensive regions of the range are shared out.
+   *
+   * The calling thread takes part in the work.  Several threads can call parallel_for() on the
+   * same pool at the same time in which case the workers help with all the jobs in turn.
+   *
+   *<pre>
+   * Utilities::ThreadPool::get().parallel_for(N,64,[&](size_t start,size_t end){
+   *   for(size_t i=start;i<end;++i) do_something(i);
+   * });
+   *</pre>
+   */
+  class ThreadPool{
+  public:
+    /// create a pool that will run jobs on nthreads threads including the calling thread
+    ThreadPool(int nthreads);
+    ~ThreadPool();
+    
+    /// the process-wide pool with Utilities::GetNThreads() threads
+    static ThreadPool& get();
+    
+    /// number of threads that work on a job including the calling thread
+    int size() const {return workers.size() + 1;}
+    
+    /** \brief Calls func(start,end) on consecutive sub-ranges of [0,N) of at most batch_size
+     * indexes until the whole range is done.  Returns when all calls have returned.
+     */
+    void parallel_for(size_t N,size_t batch_size,const std::function<void(size_t,size_t)> &func);
+    
+  private:
+    ThreadPool(const ThreadPool &);
+    ThreadPool& operator=(const ThreadPool &);
+    
+    struct Block{
+      std::atomic<size_t> next;
+      size_t end;
+    };
+    
+    struct Job{
+      Job(size_t N,size_t batch_size,int nblocks,const std::function<void(size_t,size_t)> &func);
+      
+      const std::function<void(size_t,size_t)> &func;
+      size_t N;
+      size_t batch_size;
+      size_t Nbatches;
+      std::unique_ptr<Block[]> blocks;
+      size_t Nblocks;
+      
+      std::atomic<int> tickets;
+      std::atomic<size_t> done;
+      std::mutex mutex;
+      std::condition_variable finished;
+      
+      /// do batches until there are none left to claim, returns false if there were none at all
+      bool work(int ticket);
+    };
+    
+    void run();
+    
+    std::vector<std::thread> workers;
+    std::deque<std::shared_ptr<Job> > jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stop;
+  };
+  
   /** \brief Read in data from an ASCII file with two columns
    */
   template <class T1,class T2>
@@ -1300,6 +1434,81 @@ namespace Utilities
     }
     std::cout << "Read " << x.size() << " lines from " << filename << std::endl;
   }
+  
+  /** \brief The numerical columns of an ASCII catalog, read once and then cached in a binary file.
+   *
+   * The text file is expected to have '#' comment lines at the top followed by one row per line
+   * with the columns separated by the separator character and/or spaces.  A line starting with '#'
+   * after the data ends the table.  The type of each column is given by a character in
+   * column_types, 'i' for an integer and 'f' for a floating point number.  Columns past
+   * column_types.size() are ignored.
+   *
+   * The first time a file is read it is parsed in parallel chunks and the columns are written
+   * contiguously to filename + ".bin" along with the size and modification time of the text file.
+   * Later reads of the same, unchanged, file memory map the binary file instead of parsing.  If the
+   * text file has changed or the cache was made with different column types it is remade.  If the
+   * cache cannot be written, because the directory is read only for example, the table is still
+   * made from the text.
+   *
+   *<pre>
+   * Utilities::CatalogTable table("halos.csv","iiff",',');
+   * for(size_t i=0;i<table.size();++i) std::cout << table.integer(i,0) << " " << table(i,2) << std::endl;
+   *</pre>
+   */
+  class CatalogTable{
+  public:
+    CatalogTable(const std::string &filename  /// ASCII catalog file
+                 ,const std::string &column_types  /// 'i' or 'f' for each column that is to be read
+                 ,char separator = ' '  /// character between columns
+                 ,bool use_cache = true  /// if false the binary cache is neither read nor made
+                 ,bool verbose = false
+                 );
+    ~CatalogTable();
+    
+    /// number of rows
+    size_t size() const {return Nrows;}
+    /// number of columns
+    int getNcolumns() const {return types.size();}
+    /// true if the table was read from the binary cache
+    bool fromCache() const {return mapped != nullptr;}
+    
+    /// value in row i of floating point column l
+    double operator()(size_t i,int l) const {return columns[l][i].f;}
+    /// value in row i of integer column l
+    long long integer(size_t i,int l) const {return columns[l][i].i;}
+    
+  private:
+    CatalogTable(const CatalogTable &);
+    CatalogTable& operator=(const CatalogTable &);
+    
+    union Cell{
+      double f;
+      long long i;
+    };
+    
+    /// the header of the binary cache
+    struct Header{
+      char magic[8];
+      unsigned long long source_size;
+      long long source_mtime;
+      unsigned long long Nrows;
+      unsigned long long Ncolumns;
+      char types[64];
+    };
+    
+    bool readCache(const std::string &cachename,const Header &expected);
+    void parse(const std::string &filename,bool verbose);
+    void writeCache(const std::string &cachename,const Header &header);
+    
+    std::string types;
+    char separator;
+    size_t Nrows;
+    std::vector<const Cell *> columns;
+    
+    std::vector<Cell> data;
+    void *mapped;
+    size_t mapped_size;
+  };
 
 }
 #endif